@@ -45,6 +45,8 @@
 #include "common/mipmap_cache.h"
 #include "common/opencl.h"
 #include "common/points.h"
+#include "common/tags.h"
+#include "common/trace.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
 #include "libs/lib.h"
@@ -97,7 +99,7 @@ const char dt_supported_extensions[] = "3fr,arw,bay,bmq,cap,cine,cr2,crw,cs1,dc2
 
 static int usage(const char *argv0)
 {
-  printf("usage: %s [-d {all,cache,camctl,control,dev,fswatch,input,lighttable,masks,memory,nan,opencl,perf,pwstorage,sql}] [IMG_1234.{RAW,..}|image_folder/]", argv0);
+  printf("usage: %s [-d {all,cache,camctl,control,dev,fswatch,input,lighttable,locks,masks,memory,nan,opencl,perf,pwstorage,sql,trace}] [IMG_1234.{RAW,..}|image_folder/]", argv0);
 #ifdef HAVE_OPENCL
   printf(" [--disable-opencl]");
 #endif
@@ -193,6 +195,47 @@ void _dt_sigsegv_handler(int param)
 }
 #endif
 
+int dt_cores_acquire(int wanted, const int interactive)
+{
+  const int total = darktable.num_openmp_threads;
+  const int background_share = MAX(1, total / 4);
+  wanted = CLAMP(wanted, 1, total);
+  int used = __sync_fetch_and_add(&darktable.num_cores_used, 0);
+  while(1)
+  {
+    const int background = __sync_fetch_and_add(&darktable.num_cores_background, 0);
+    int available = total - used;
+    if(interactive)
+      available += MAX(0, background - background_share);
+    else if(__sync_fetch_and_add(&darktable.num_interactive_running, 0) > 0)
+      available = MIN(available, background_share - background);
+    const int granted = CLAMP(available, 1, wanted);
+    const int seen = __sync_val_compare_and_swap(&darktable.num_cores_used, used, used + granted);
+    if(seen == used)
+    {
+      if(!interactive) __sync_fetch_and_add(&darktable.num_cores_background, granted);
+      return granted;
+    }
+    used = seen;
+  }
+}
+
+void dt_cores_release(int granted, const int interactive)
+{
+  if(!interactive) __sync_fetch_and_sub(&darktable.num_cores_background, granted);
+  __sync_fetch_and_sub(&darktable.num_cores_used, granted);
+}
+
+void dt_cores_interactive_begin()
+{
+  __sync_fetch_and_add(&darktable.num_interactive_running, 1);
+}
+
+void dt_cores_interactive_end()
+{
+  __sync_fetch_and_sub(&darktable.num_interactive_running, 1);
+}
+
 gboolean dt_supported_image(const gchar *filename)
 {
   gboolean supported = FALSE;
@@ -471,6 +514,7 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
 #endif
 
   darktable.num_openmp_threads = 1;
+  darktable.num_cores_used = 0;
 #ifdef _OPENMP
   darktable.num_openmp_threads = omp_get_num_procs();
 #endif
@@ -545,6 +589,8 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
         else if(!strcmp(argv[k+1], "nan"))        darktable.unmuted |= DT_DEBUG_NAN; // check for NANs when processing the pipe.
         else if(!strcmp(argv[k+1], "masks"))      darktable.unmuted |= DT_DEBUG_MASKS; // masks related stuff.
         else if(!strcmp(argv[k+1], "lua"))        darktable.unmuted |= DT_DEBUG_LUA; // lua errors are reported on console
+        else if(!strcmp(argv[k+1], "locks"))      darktable.unmuted |= DT_DEBUG_LOCKS; // lock contention statistics at exit
+        else if(!strcmp(argv[k+1], "trace"))      darktable.unmuted |= DT_DEBUG_TRACE; // record a timeline, see common/trace.h
         else return usage(argv[0]);
         k ++;
       }
@@ -695,15 +741,6 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   // Initialize the signal system
   darktable.signals = dt_control_signal_init();
 
-  // Make sure that the database and xmp files are in sync before starting the fswatch.
-  // We need conf and db to be up and running for that which is the case here.
-  // FIXME: is this also useful in non-gui mode?
-  GList *changed_xmp_files = NULL;
-  if(init_gui && dt_conf_get_bool("run_crawler_on_start"))
-  {
-    changed_xmp_files = dt_control_crawler_run();
-  }
-
   // Initialize the filesystem watcher
   darktable.fswatch=dt_fswatch_new();
 
@@ -728,6 +765,8 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   dt_pthread_mutex_init(&(darktable.db_insert), NULL);
   dt_pthread_mutex_init(&(darktable.plugin_threadsafe), NULL);
   dt_pthread_mutex_init(&(darktable.capabilities_threadsafe), NULL);
+  if(darktable.unmuted & DT_DEBUG_LOCKS) dt_pthread_profile_start();
+  dt_trace_init();
   darktable.control = (dt_control_t *)calloc(1, sizeof(dt_control_t));
   if(init_gui)
   {
@@ -772,6 +811,8 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   // image dimensions stored in here:
   darktable.image_cache = (dt_image_cache_t *)calloc(1, sizeof(dt_image_cache_t));
   dt_image_cache_init(darktable.image_cache);
+  dt_image_sidecar_queue_init();
+  dt_tag_init();
 
   darktable.mipmap_cache = (dt_mipmap_cache_t *)calloc(1, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
@@ -868,10 +909,12 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   dt_lua_init(darktable.lua_state.state,lua_command);
 #endif
 
-  // last but not least construct the popup that asks the user about images whose xmp files are newer than the db entry
-  if(init_gui && changed_xmp_files)
+  // last but not least check in the background for images whose xmp files changed behind our back. the popup
+  // asking the user what to do about them shows up once that's done.
+  // FIXME: is this also useful in non-gui mode?
+  if(init_gui && dt_conf_get_bool("run_crawler_on_start"))
   {
-    dt_control_crawler_show_image_list(changed_xmp_files);
+    dt_control_crawler_start();
   }
 
   return 0;
@@ -904,6 +947,7 @@ void dt_cleanup()
     dt_gui_gtk_cleanup(darktable.gui);
     free(darktable.gui);
   }
+  dt_image_sidecar_queue_cleanup();
   dt_image_cache_cleanup(darktable.image_cache);
   free(darktable.image_cache);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
@@ -931,6 +975,7 @@ void dt_cleanup()
   DestroyMagick();
 #endif
 
+  dt_tag_cleanup();
   dt_database_destroy(darktable.db);
 
   dt_bauhaus_cleanup();
@@ -945,6 +990,8 @@ void dt_cleanup()
 #ifdef HAVE_GEGL
   gegl_exit();
 #endif
+  dt_pthread_profile_report();
+  dt_trace_cleanup();
 }
 
 void dt_print(dt_debug_thread_t thread, const char *msg, ...)
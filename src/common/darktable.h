@@ -164,7 +164,9 @@ typedef enum dt_debug_thread_t
   DT_DEBUG_NAN        = 1<<11,
   DT_DEBUG_MASKS      = 1<<12,
   DT_DEBUG_LUA        = 1<<13,
-  DT_DEBUG_INPUT      = 1<<14
+  DT_DEBUG_INPUT      = 1<<14,
+  DT_DEBUG_TRACE      = 1<<15,
+  DT_DEBUG_LOCKS      = 1<<16
 }
 dt_debug_thread_t;
 
@@ -172,6 +174,11 @@ typedef struct darktable_t
 {
   uint32_t cpu_flags;
   int32_t num_openmp_threads;
+  // cores currently handed out by dt_cores_acquire(), how many of them went to background work, and how many
+  // interactive pipes are processing right now
+  int32_t num_cores_used;
+  int32_t num_cores_background;
+  int32_t num_interactive_running;
 
   int32_t thumbnail_width, thumbnail_height;
   int32_t unmuted;
@@ -261,6 +268,18 @@ void dt_show_times(const dt_times_t *start, const char *prefix, const char *suff
 /** \brief check if file is a supported image */
 gboolean dt_supported_image(const gchar *filename);
 
+/** take up to wanted cores from the process wide budget of num_openmp_threads cores, for the threads of a parallel
+ *  section (pixelpipe modules, raw decoding, ...). the calling thread always gets at least one, its own.
+ *  while interactive work runs (see dt_cores_interactive_begin()), background work is limited to a quarter of the
+ *  cores, and interactive work may take the cores background work holds beyond that: the background work gives
+ *  them back at its next acquire/release, i.e. at the next module boundary.
+ *  returns the number of cores granted, which have to be given back with dt_cores_release(). */
+int dt_cores_acquire(int wanted, const int interactive);
+void dt_cores_release(int granted, const int interactive);
+/** bracket interactive work, like processing the darkroom pipes. */
+void dt_cores_interactive_begin();
+void dt_cores_interactive_end();
+
 static inline int dt_get_num_threads()
 {
 #ifdef _OPENMP
@@ -35,7 +35,18 @@
 #include <errno.h>
 
 // whenever _create_schema() gets changed you HAVE to bump this version and add an update path to _upgrade_schema_step()!
-#define CURRENT_DATABASE_VERSION 6
+#define CURRENT_DATABASE_VERSION 8
+
+// max number of read-only connections handed out to threads when running in wal mode
+#define DT_DATABASE_MAX_READERS 8
+
+struct dt_database_t;
+
+typedef struct dt_database_reader_t
+{
+  sqlite3 *handle;
+  struct dt_database_t *db;
+} dt_database_reader_t;
 
 typedef struct dt_database_t
 {
@@ -47,9 +58,23 @@ typedef struct dt_database_t
 
   /* ondisk DB */
   sqlite3 *handle;
+
+  /* wal mode: pool of read-only connections, one bound to each thread asking for it */
+  gboolean use_wal;
+  dt_pthread_mutex_t readers_mutex;
+  pthread_key_t reader_key;
+  dt_database_reader_t readers[DT_DATABASE_MAX_READERS];
+  int num_readers;
+  GList *free_readers;
+
+  /* explicit transactions on the shared handle, one at a time */
+  dt_pthread_mutex_t transaction_mutex;
 } dt_database_t;
 
 
+/* hands the read-only connection of a thread back to the pool */
+static void _database_release_reader(void *data);
+
 /* migrates database from old place to new */
 static void _database_migrate_to_xdg_structure();
 
@@ -492,6 +517,50 @@ static int _upgrade_schema_step(dt_database_t *db, int version)
 
     sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
     new_version = 6;
+  }
+  else if(version == 6)
+  {
+    // 6 -> 7 remember mtime and size of the xmp file as last seen, so the crawler can tell real changes
+    sqlite3_exec(db->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if(sqlite3_exec(db->handle, "ALTER TABLE images ADD COLUMN xmp_mtime INTEGER", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_exec(db->handle, "ALTER TABLE images ADD COLUMN xmp_size INTEGER", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't add `xmp_mtime' and `xmp_size' columns to database\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    new_version = 7;
+  }
+  else if(version == 7)
+  {
+    // 7 -> 8 tagxtag is maintained by common/tags.c now. it only holds pairs that actually
+    // appear together, with id1 < id2, and gets written in batches instead of from triggers.
+    sqlite3_exec(db->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if(sqlite3_exec(db->handle, "DROP TRIGGER IF EXISTS insert_tag", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_exec(db->handle, "DROP TRIGGER IF EXISTS attach_tag", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_exec(db->handle, "DROP TRIGGER IF EXISTS detach_tag", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't drop tagxtag triggers\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    if(sqlite3_exec(db->handle, "DELETE FROM tagxtag WHERE count <= 0 OR id1 = id2", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_exec(db->handle,
+                       "INSERT OR REPLACE INTO tagxtag SELECT a.id2, a.id1, a.count + "
+                       "IFNULL((SELECT b.count FROM tagxtag b WHERE b.id1 = a.id2 AND b.id2 = a.id1), 0) "
+                       "FROM tagxtag a WHERE a.id1 > a.id2", NULL, NULL, NULL) != SQLITE_OK
+       || sqlite3_exec(db->handle, "DELETE FROM tagxtag WHERE id1 > id2", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't clean up tagxtag\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    new_version = 8;
   }// maybe in the future, see commented out code elsewhere
 //   else if(version == XXX)
 //   {
@@ -554,7 +623,8 @@ static void _create_schema(dt_database_t *db)
                         "raw_auto_bright_threshold REAL, raw_black INTEGER, raw_maximum INTEGER, "
                         "caption VARCHAR, description VARCHAR, license VARCHAR, sha1sum CHAR(40), "
                         "orientation INTEGER, histogram BLOB, lightmap BLOB, longitude REAL, "
-                        "latitude REAL, color_matrix BLOB, colorspace INTEGER, version INTEGER, max_version INTEGER, write_timestamp INTEGER)", NULL, NULL, NULL);
+                        "latitude REAL, color_matrix BLOB, colorspace INTEGER, version INTEGER, max_version INTEGER, write_timestamp INTEGER, "
+                        "xmp_mtime INTEGER, xmp_size INTEGER)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE INDEX images_group_id_index ON images (group_id)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(db->handle,
@@ -589,13 +659,6 @@ static void _create_schema(dt_database_t *db)
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TABLE tagxtag (id1 INTEGER, id2 INTEGER, count INTEGER, "
                         "PRIMARY KEY (id1, id2))", NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER insert_tag AFTER INSERT ON tags"
-                        " BEGIN"
-                        "   INSERT INTO tagxtag SELECT id, new.id, 0 FROM TAGS;"
-                        "   UPDATE tagxtag SET count = 1000000 WHERE id1=new.id AND id2=new.id;"
-                        " END",
-                        NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TRIGGER delete_tag BEFORE DELETE on tags"
                         " BEGIN"
@@ -603,24 +666,6 @@ static void _create_schema(dt_database_t *db)
                         "   DELETE FROM tagged_images WHERE tagid=old.id;"
                         " END",
                         NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER attach_tag AFTER INSERT ON tagged_images"
-                        " BEGIN"
-                        "   UPDATE tagxtag"
-                        "     SET count = count + 1"
-                        "     WHERE (id1=new.tagid AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid=new.imgid))"
-                        "        OR (id2=new.tagid AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid=new.imgid));"
-                        " END",
-                        NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER detach_tag BEFORE DELETE ON tagged_images"
-                        " BEGIN"
-                        "   UPDATE tagxtag"
-                        "     SET count = count - 1"
-                        "     WHERE (id1=old.tagid AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid=old.imgid))"
-                        "        OR (id2=old.tagid AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid=old.imgid));"
-                        " END",
-                        NULL, NULL, NULL);
   ////////////////////////////// styles
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TABLE styles (id INTEGER, name VARCHAR, description VARCHAR)", NULL, NULL, NULL);
@@ -789,8 +834,29 @@ lock_again:
   sqlite3_exec(db->handle, "attach database ':memory:' as memory",NULL,NULL,NULL);
 
   sqlite3_exec(db->handle, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
-  sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
-  sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
+  // wal lets the read-only connections of worker threads read while the main handle writes.
+  // the journal mode is persistent, so switch back explicitly if the option got disabled.
+  db->use_wal = strcmp(db->dbfilename, ":memory:") && dt_conf_get_bool("database_wal_mode");
+  if(db->use_wal)
+  {
+    sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
+    if(sqlite3_exec(db->handle, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] could not switch database to wal mode, using a single connection\n");
+      db->use_wal = FALSE;
+      sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+    }
+    // don't fail right away when a checkpoint is running
+    sqlite3_busy_timeout(db->handle, 1000);
+  }
+  else
+  {
+    sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+    sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
+  }
+  dt_pthread_mutex_init(&db->readers_mutex, NULL);
+  dt_pthread_mutex_init(&db->transaction_mutex, NULL);
+  pthread_key_create(&db->reader_key, _database_release_reader);
 
   /* now that we got a functional database that is locked for us we can make sure that the schema is set up */
   // does the db contain the new 'db_info' table?
@@ -900,6 +966,16 @@ error:
 
 void dt_database_destroy(const dt_database_t *db)
 {
+  dt_database_t *d = (dt_database_t *)db;
+  if(d->handle)
+  {
+    // all threads that might still hold a reader are gone by now
+    pthread_key_delete(d->reader_key);
+    for(int k = 0; k < d->num_readers; k++) sqlite3_close(d->readers[k].handle);
+    g_list_free(d->free_readers);
+    dt_pthread_mutex_destroy(&d->readers_mutex);
+    dt_pthread_mutex_destroy(&d->transaction_mutex);
+  }
   sqlite3_close(db->handle);
   unlink(db->lockfile);
   g_free(db->lockfile);
@@ -911,6 +987,75 @@ sqlite3 *dt_database_get(const dt_database_t *db)
   return db->handle;
 }
 
+// set while the thread holds the transaction, its reads have to see what it wrote so far
+static __thread int _database_in_transaction = 0;
+
+void dt_database_start_transaction(const dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  dt_pthread_mutex_lock(&d->transaction_mutex);
+  sqlite3_exec(d->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+  _database_in_transaction = 1;
+}
+
+void dt_database_release_transaction(const dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  _database_in_transaction = 0;
+  sqlite3_exec(d->handle, "COMMIT", NULL, NULL, NULL);
+  dt_pthread_mutex_unlock(&d->transaction_mutex);
+}
+
+static void _database_release_reader(void *data)
+{
+  // called on thread exit: put the connection back into the pool
+  dt_database_reader_t *reader = (dt_database_reader_t *)data;
+  dt_database_t *db = reader->db;
+  dt_pthread_mutex_lock(&db->readers_mutex);
+  db->free_readers = g_list_prepend(db->free_readers, reader);
+  dt_pthread_mutex_unlock(&db->readers_mutex);
+}
+
+sqlite3 *dt_database_get_reader(const dt_database_t *db)
+{
+  if(!db->use_wal || _database_in_transaction) return db->handle;
+
+  dt_database_t *d = (dt_database_t *)db;
+  dt_database_reader_t *reader = (dt_database_reader_t *)pthread_getspecific(d->reader_key);
+  if(reader) return reader->handle;
+
+  dt_pthread_mutex_lock(&d->readers_mutex);
+  if(d->free_readers)
+  {
+    reader = (dt_database_reader_t *)d->free_readers->data;
+    d->free_readers = g_list_delete_link(d->free_readers, d->free_readers);
+  }
+  else if(d->num_readers < DT_DATABASE_MAX_READERS)
+  {
+    sqlite3 *handle = NULL;
+    if(sqlite3_open_v2(d->dbfilename, &handle, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) == SQLITE_OK)
+    {
+      sqlite3_busy_timeout(handle, 1000);
+      reader = d->readers + d->num_readers++;
+      reader->handle = handle;
+      reader->db = d;
+      dt_print(DT_DEBUG_SQL, "[sql] opened read-only connection %d\n", d->num_readers);
+    }
+    else
+    {
+      fprintf(stderr, "[sql] could not open read-only connection: %s\n", sqlite3_errmsg(handle));
+      sqlite3_close(handle);
+    }
+  }
+  dt_pthread_mutex_unlock(&d->readers_mutex);
+
+  // pool exhausted: share the main handle, it is serialized by sqlite anyways
+  if(!reader) return d->handle;
+
+  pthread_setspecific(d->reader_key, reader);
+  return reader->handle;
+}
+
 const gchar *dt_database_get_path(const struct dt_database_t *db)
 {
   return db->dbfilename;
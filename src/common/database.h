@@ -29,6 +29,16 @@ struct dt_database_t *dt_database_init(char *alternative);
 void dt_database_destroy(const struct dt_database_t *);
 /** get handle */
 struct sqlite3 *dt_database_get(const struct dt_database_t *);
+/** get a read-only handle bound to the calling thread. only differs from dt_database_get() in wal mode.
+ *  it doesn't see the attached memory tables, so only use it for plain selects on the library.
+ *  while the calling thread holds dt_database_start_transaction() this is the dt_database_get() handle,
+ *  so reads see the uncommitted writes of the transaction. */
+struct sqlite3 *dt_database_get_reader(const struct dt_database_t *);
+/** begins a transaction on the handle of dt_database_get(). there is only one such handle, so this waits until
+ *  any other thread's transaction got released. don't take other locks while holding it. */
+void dt_database_start_transaction(const struct dt_database_t *db);
+/** commits the transaction begun with dt_database_start_transaction() */
+void dt_database_release_transaction(const struct dt_database_t *db);
 /** test if database is new */
 gboolean dt_database_is_new(const struct dt_database_t *db);
 /** Returns database path */
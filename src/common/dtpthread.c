@@ -0,0 +1,212 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/dtpthread.h"
+#include "common/trace.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+volatile int dt_pthread_instrument = 0;
+
+#ifndef _DEBUG
+
+// only one in n uncontended locks is counted, contended ones are slow anyways and always counted.
+// has to be a power of two.
+#define DT_PTHREAD_PROFILE_SAMPLING 64
+// lock call sites, darktable has less than half of that
+#define DT_PTHREAD_PROFILE_SITES 4096
+
+typedef struct dt_pthread_profile_site_t
+{
+  const char *file;
+  const char *name;
+  const char *function;
+  int line;
+  uint64_t acquired;   // sampled
+  uint64_t contended;  // exact
+  uint64_t wait_sum;   // in ns
+  uint64_t wait_max;
+}
+dt_pthread_profile_site_t;
+
+static dt_pthread_profile_site_t _profile_sites[DT_PTHREAD_PROFILE_SITES];
+static int _profile_dropped = 0;
+static double _profile_start = 0.0;
+// random sampling, a counter would always pick the same site out of a fixed sequence of locks
+static __thread uint32_t _profile_sample = 0;
+
+// lock free: a site is claimed by swapping in its file name, then filled in. a thread racing with that might
+// claim a second slot for the same site, the report merges those again.
+static dt_pthread_profile_site_t *_profile_get_site(const char *name, const char *file, const int line,
+                                                    const char *function)
+{
+  const uint32_t hash = (uint32_t)(((uintptr_t)file >> 3) * 2654435761u) ^ (uint32_t)line * 40503u;
+  for(int k = 0; k < DT_PTHREAD_PROFILE_SITES; k++)
+  {
+    dt_pthread_profile_site_t *site = _profile_sites + ((hash + k) & (DT_PTHREAD_PROFILE_SITES - 1));
+    if(site->file == file && site->line == line) return site;
+    if(site->file == NULL && __sync_bool_compare_and_swap(&site->file, NULL, file))
+    {
+      site->name = name;
+      site->function = function;
+      site->line = line;
+      return site;
+    }
+  }
+  __sync_fetch_and_add(&_profile_dropped, 1);
+  return NULL;
+}
+
+int dt_pthread_mutex_lock_instrumented(pthread_mutex_t *mutex, const char *name, const char *file, const int line,
+                                       const char *function)
+{
+  const int profile = dt_pthread_instrument & DT_PTHREAD_INSTRUMENT_PROFILE;
+  if(!pthread_mutex_trylock(mutex))
+  {
+    if(profile)
+    {
+      // xorshift
+      uint32_t x = _profile_sample ? _profile_sample : (uint32_t)(uintptr_t)&_profile_sample | 1;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      _profile_sample = x;
+      if(x & (DT_PTHREAD_PROFILE_SAMPLING - 1)) return 0;
+
+      dt_pthread_profile_site_t *site = _profile_get_site(name, file, line, function);
+      if(site) __sync_fetch_and_add(&site->acquired, 1);
+    }
+    return 0;
+  }
+
+  const double start = dt_trace_now();
+  const int ret = pthread_mutex_lock(mutex);
+
+  if(dt_pthread_instrument & DT_PTHREAD_INSTRUMENT_TRACE) dt_trace_lock_wait(start, name, file, line, function);
+  if(profile)
+  {
+    dt_pthread_profile_site_t *site = _profile_get_site(name, file, line, function);
+    if(site)
+    {
+      const uint64_t wait = 1e9 * (dt_trace_now() - start);
+      __sync_fetch_and_add(&site->contended, 1);
+      __sync_fetch_and_add(&site->wait_sum, wait);
+      uint64_t max = site->wait_max;
+      while(wait > max)
+      {
+        const uint64_t old = __sync_val_compare_and_swap(&site->wait_max, max, wait);
+        if(old == max) break;
+        max = old;
+      }
+    }
+  }
+  return ret;
+}
+
+void dt_pthread_profile_start()
+{
+  _profile_start = dt_trace_now();
+  __sync_fetch_and_or(&dt_pthread_instrument, DT_PTHREAD_INSTRUMENT_PROFILE);
+}
+
+static int _profile_sort_by_site(const void *a, const void *b)
+{
+  const dt_pthread_profile_site_t *sa = (const dt_pthread_profile_site_t *)a;
+  const dt_pthread_profile_site_t *sb = (const dt_pthread_profile_site_t *)b;
+  if(!sa->file || !sb->file) return (sa->file == NULL) - (sb->file == NULL);
+  const int c = strcmp(sa->file, sb->file);
+  if(c) return c;
+  return sa->line - sb->line;
+}
+
+static int _profile_sort_by_wait(const void *a, const void *b)
+{
+  const dt_pthread_profile_site_t *sa = (const dt_pthread_profile_site_t *)a;
+  const dt_pthread_profile_site_t *sb = (const dt_pthread_profile_site_t *)b;
+  if(sa->wait_sum != sb->wait_sum) return sa->wait_sum < sb->wait_sum ? 1 : -1;
+  return (sa->contended < sb->contended) - (sa->contended > sb->contended);
+}
+
+void dt_pthread_profile_report()
+{
+  if(!(dt_pthread_instrument & DT_PTHREAD_INSTRUMENT_PROFILE)) return;
+  __sync_fetch_and_and(&dt_pthread_instrument, ~DT_PTHREAD_INSTRUMENT_PROFILE);
+
+  // work on a copy, threads that didn't notice the flag is gone yet might still be counting
+  dt_pthread_profile_site_t *sites
+      = (dt_pthread_profile_site_t *)malloc(sizeof(dt_pthread_profile_site_t) * DT_PTHREAD_PROFILE_SITES);
+  if(!sites) return;
+  memcpy(sites, _profile_sites, sizeof(dt_pthread_profile_site_t) * DT_PTHREAD_PROFILE_SITES);
+
+  // merge sites that got more than one slot, for example locks in inline functions of headers
+  qsort(sites, DT_PTHREAD_PROFILE_SITES, sizeof(dt_pthread_profile_site_t), _profile_sort_by_site);
+  int num_sites = 0;
+  for(int k = 0; k < DT_PTHREAD_PROFILE_SITES && sites[k].file; k++)
+  {
+    dt_pthread_profile_site_t *last = num_sites ? sites + num_sites - 1 : NULL;
+    if(last && !strcmp(last->file, sites[k].file) && last->line == sites[k].line)
+    {
+      last->acquired += sites[k].acquired;
+      last->contended += sites[k].contended;
+      last->wait_sum += sites[k].wait_sum;
+      last->wait_max = MAX(last->wait_max, sites[k].wait_max);
+    }
+    else
+      sites[num_sites++] = sites[k];
+  }
+  qsort(sites, num_sites, sizeof(dt_pthread_profile_site_t), _profile_sort_by_wait);
+
+  const double elapsed = dt_trace_now() - _profile_start;
+  printf("[locks] lock contention over %.1f s, uncontended locking sampled 1:%d, sorted by total wait\n", elapsed,
+         DT_PTHREAD_PROFILE_SAMPLING);
+  printf("[locks] %10s %9s %9s %12s %12s  %s\n", "wait ms", "max ms", "contended", "locked (est)", "contended %",
+         "lock @ site");
+  for(int k = 0; k < num_sites; k++)
+  {
+    const dt_pthread_profile_site_t *s = sites + k;
+    const uint64_t locked = s->acquired * DT_PTHREAD_PROFILE_SAMPLING + s->contended;
+    const char *base = strrchr(s->file, '/');
+    printf("[locks] %10.3f %9.3f %9" PRIu64 " %12" PRIu64 " %11.1f%%  %s @ %s (%s:%d)\n", 1e-6 * s->wait_sum,
+           1e-6 * s->wait_max, s->contended, locked, locked ? 100.0 * s->contended / locked : 0.0, s->name,
+           s->function, base ? base + 1 : s->file, s->line);
+  }
+  if(_profile_dropped) printf("[locks] %d lock operations of sites that didn't fit the table were not counted\n",
+                              _profile_dropped);
+  free(sites);
+}
+
+#else
+
+// the debug build has its own per mutex statistics, see dtpthread.h
+void dt_pthread_profile_start()
+{
+}
+
+void dt_pthread_profile_report()
+{
+}
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
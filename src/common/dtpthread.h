@@ -26,6 +26,27 @@
 #include <string.h>
 #include <glib.h>
 
+#ifndef DT_UNIT_TEST
+// in release builds locks can be instrumented at runtime: waits for contended locks go to the timeline trace
+// (common/trace.h) and -d locks collects per call site statistics. when neither is on, all that's added to
+// dt_pthread_mutex_lock() is one flag check.
+#define DT_PTHREAD_INSTRUMENT_TRACE   1
+#define DT_PTHREAD_INSTRUMENT_PROFILE 2
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+extern volatile int dt_pthread_instrument;
+/** start collecting lock statistics, with -d locks. */
+void dt_pthread_profile_start();
+/** print lock statistics, sorted by total wait time, and stop collecting. */
+void dt_pthread_profile_report();
+#ifdef __cplusplus
+}
+#endif
+#endif
+
 #ifdef _DEBUG
 
 // copied from darktable.h so we don't need to include the header
@@ -180,16 +201,46 @@ dt_pthread_cond_wait(pthread_cond_t *cond, dt_pthread_mutex_t *mutex)
   return pthread_cond_wait(cond, &(mutex->mutex));
 }
 
+static inline int
+dt_pthread_cond_timedwait(pthread_cond_t *cond, dt_pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+  return pthread_cond_timedwait(cond, &(mutex->mutex), abstime);
+}
+
 #undef TOPN
 #else
 
 #define dt_pthread_mutex_t pthread_mutex_t
 #define dt_pthread_mutex_destroy pthread_mutex_destroy
 #define dt_pthread_mutex_init pthread_mutex_init
-#define dt_pthread_mutex_lock pthread_mutex_lock
 #define dt_pthread_mutex_trylock pthread_mutex_trylock
 #define dt_pthread_mutex_unlock pthread_mutex_unlock
 #define dt_pthread_cond_wait pthread_cond_wait
+#define dt_pthread_cond_timedwait pthread_cond_timedwait
+
+#ifndef DT_UNIT_TEST
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+int dt_pthread_mutex_lock_instrumented(pthread_mutex_t *mutex, const char *name, const char *file, const int line,
+                                       const char *function);
+#ifdef __cplusplus
+}
+#endif
+
+#define dt_pthread_mutex_lock(A) dt_pthread_mutex_lock_with_caller(A, #A, __FILE__, __LINE__, __FUNCTION__)
+static inline int
+dt_pthread_mutex_lock_with_caller(pthread_mutex_t *mutex, const char *name, const char *file, const int line,
+                                  const char *function)
+{
+  if(!dt_pthread_instrument) return pthread_mutex_lock(mutex);
+  return dt_pthread_mutex_lock_instrumented(mutex, name, file, line, function);
+}
+#else
+#define dt_pthread_mutex_lock pthread_mutex_lock
+#endif
 
 #endif
 #endif
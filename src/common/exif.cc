@@ -46,6 +46,7 @@
 extern "C"
 {
 #include "common/exif.h"
+#include "common/exif_tiff.h"
 #include "common/darktable.h"
 #include "common/colorlabels.h"
 #include "common/imageio_jpeg.h"
@@ -850,6 +851,14 @@ int dt_exif_read(dt_image_t *img, const char* path)
   struct tm result;
   strftime(img->exif_datetime_taken, 20, "%Y:%m:%d %H:%M:%S", localtime_r(&statbuf.st_mtime, &result));
 
+  // most raws are plain tiff containers. walking them ourselves is a lot cheaper than having exiv2
+  // parse every ifd and maker note. it refuses anything it can't handle completely.
+  if(dt_conf_get_bool("import_fast_exif") && !dt_exif_tiff_read(img, path))
+  {
+    dt_exif_apply_global_overwrites(img);
+    return 0;
+  }
+
   try
   {
     Exiv2::Image::AutoPtr image;
@@ -1403,59 +1412,27 @@ static void _exif_import_tags(dt_image_t *img,Exiv2::XmpData::iterator &pos)
   // tags in array
   const int cnt = pos->count();
 
-  sqlite3_stmt *stmt_sel_id, *stmt_ins_tags, *stmt_ins_tagged;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "select id from tags where name = ?1",
-                              -1, &stmt_sel_id, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "insert into tags (id, name) values (null, ?1)",
-                              -1, &stmt_ins_tags, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "insert into tagged_images (tagid, imgid) values (?1, ?2)",
-                              -1, &stmt_ins_tagged, NULL);
   for (int i=0; i<cnt; i++)
   {
     char tagbuf[1024];
     std::string pos_str = pos->toString(i);
     g_strlcpy(tagbuf, pos_str.c_str(), sizeof(tagbuf));
-    int tagid = -1;
     char *tag = tagbuf;
     while(tag)
     {
       char *next_tag = strstr(tag, ",");
       if(next_tag) *(next_tag++) = 0;
-      // check if tag is available, get its id:
-      for (int k=0; k<2; k++)
-      {
-        DT_DEBUG_SQLITE3_BIND_TEXT(stmt_sel_id, 1, tag, -1, SQLITE_TRANSIENT);
-        if(sqlite3_step(stmt_sel_id) == SQLITE_ROW)
-          tagid = sqlite3_column_int(stmt_sel_id, 0);
-        sqlite3_reset(stmt_sel_id);
-        sqlite3_clear_bindings(stmt_sel_id);
-
-        if (tagid > 0)
-          break;
-
+      // check if tag is available, create it otherwise
+      guint tagid = 0;
+      if(!dt_tag_exists(tag, NULL))
         fprintf(stderr,"[xmp_import] creating tag: %s\n", tag);
-        // create this tag (increment id, leave icon empty), retry.
-        DT_DEBUG_SQLITE3_BIND_TEXT(stmt_ins_tags, 1, tag, -1, SQLITE_TRANSIENT);
-        sqlite3_step(stmt_ins_tags);
-        sqlite3_reset(stmt_ins_tags);
-        sqlite3_clear_bindings(stmt_ins_tags);
-      }
-      // associate image and tag.
-      DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_tagged, 1, tagid);
-      DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_tagged, 2, img->id);
-      sqlite3_step(stmt_ins_tagged);
-      sqlite3_reset(stmt_ins_tagged);
-      sqlite3_clear_bindings(stmt_ins_tagged);
+      // associate image and tag. this goes through the tag api to keep the tag relations up to date.
+      if(dt_tag_new(tag, &tagid) && tagid > 0)
+        dt_tag_attach(tagid, img->id);
 
       tag = next_tag;
     }
   }
-  sqlite3_finalize(stmt_sel_id);
-  sqlite3_finalize(stmt_ins_tags);
-  sqlite3_finalize(stmt_ins_tagged);
 }
 
 // need a write lock on *img (non-const) to write stars (and soon color labels).
@@ -1484,11 +1461,7 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
     sqlite3_finalize(stmt);
 
     // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "delete from tagged_images where imgid = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    dt_tag_detach_all(img->id);
 #endif
 
     if(!history_only)
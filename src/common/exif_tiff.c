@@ -0,0 +1,543 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/exif_tiff.h"
+#include "common/darktable.h"
+#include "common/metadata.h"
+#include "control/conf.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// all ifds of the raw formats we care about live at the start of the file,
+// so read that in one go and only seek for the odd value stored further down.
+#define DT_EXIF_TIFF_HEAD_SIZE 65536
+// stop following ifd chains after that many entries, protects against loops in broken files
+#define DT_EXIF_TIFF_MAX_IFDS 32
+
+typedef enum dt_exif_tiff_ifd_t
+{
+  DT_EXIF_TIFF_IFD_IMAGE = 0, // ifd0 and its chain
+  DT_EXIF_TIFF_IFD_SUB   = 1, // sub ifds (full resolution raw data in dng/nef/...)
+  DT_EXIF_TIFF_IFD_EXIF  = 2,
+  DT_EXIF_TIFF_IFD_GPS   = 3
+}
+dt_exif_tiff_ifd_t;
+
+typedef struct dt_exif_tiff_t
+{
+  int fd;
+  int big_endian;
+  size_t head_len;
+  uint8_t head[DT_EXIF_TIFF_HEAD_SIZE];
+  int num_ifds;
+  uint32_t visited[DT_EXIF_TIFF_MAX_IFDS];
+
+  // what we found:
+  int need_exiv2;
+  char maker[64], model[64], lens[128], datetime[20], datetime_image[20];
+  char *artist, *copyright;
+  float exposure, aperture, iso, iso_alt, focal_length, focus_distance;
+  int orientation;
+  int has_rating, rating, has_rating_percent, rating_percent;
+  int width, height, pixel_x, pixel_y, full_width, full_height;
+  char lat_ref, lon_ref;
+  double lat[3], lon[3];
+  int has_lat, has_lon;
+  float cm[2][9];
+  int has_cm[2], illuminant[2];
+}
+dt_exif_tiff_t;
+
+static int _read(dt_exif_tiff_t *t, const uint32_t offset, const uint32_t len, uint8_t *dst)
+{
+  if((size_t)offset + len <= t->head_len)
+  {
+    memcpy(dst, t->head + offset, len);
+    return 0;
+  }
+  if(pread(t->fd, dst, len, offset) != (ssize_t)len) return 1;
+  return 0;
+}
+
+static inline uint16_t _get16(const dt_exif_tiff_t *t, const uint8_t *b)
+{
+  return t->big_endian ? (b[0] << 8) | b[1] : (b[1] << 8) | b[0];
+}
+
+static inline uint32_t _get32(const dt_exif_tiff_t *t, const uint8_t *b)
+{
+  return t->big_endian ? ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]
+         : ((uint32_t)b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+}
+
+static int _type_size(const uint16_t type)
+{
+  switch(type)
+  {
+    case 1: // byte
+    case 2: // ascii
+    case 6: // sbyte
+    case 7: // undefined
+      return 1;
+    case 3: // short
+    case 8: // sshort
+      return 2;
+    case 4: // long
+    case 9: // slong
+    case 11: // float
+    case 13: // ifd
+      return 4;
+    case 5: // rational
+    case 10: // srational
+    case 12: // double
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+typedef struct dt_exif_tiff_entry_t
+{
+  uint16_t tag, type;
+  uint32_t count;
+  uint8_t *data; // points either to inline storage or to an allocated buffer
+  uint8_t inline_data[4];
+}
+dt_exif_tiff_entry_t;
+
+// reads the payload of an entry. values larger than 4 bytes are fetched from the file.
+static int _entry_load(dt_exif_tiff_t *t, const uint8_t *raw, dt_exif_tiff_entry_t *e)
+{
+  e->tag = _get16(t, raw);
+  e->type = _get16(t, raw + 2);
+  e->count = _get32(t, raw + 4);
+  e->data = NULL;
+  const int ts = _type_size(e->type);
+  if(!ts || e->count == 0 || e->count > (1u << 20)) return 1;
+  const uint32_t len = ts * e->count;
+  if(len <= 4)
+  {
+    memcpy(e->inline_data, raw + 8, 4);
+    e->data = e->inline_data;
+    return 0;
+  }
+  e->data = (uint8_t *)g_malloc(len);
+  if(_read(t, _get32(t, raw + 8), len, e->data))
+  {
+    g_free(e->data);
+    e->data = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+static void _entry_free(dt_exif_tiff_entry_t *e)
+{
+  if(e->data != e->inline_data) g_free(e->data);
+  e->data = NULL;
+}
+
+static double _entry_value(const dt_exif_tiff_t *t, const dt_exif_tiff_entry_t *e, const uint32_t i)
+{
+  if(i >= e->count) return 0.0;
+  const uint8_t *b = e->data + i * _type_size(e->type);
+  switch(e->type)
+  {
+    case 1:
+    case 7:
+      return b[0];
+    case 6:
+      return (int8_t)b[0];
+    case 3:
+      return _get16(t, b);
+    case 8:
+      return (int16_t)_get16(t, b);
+    case 4:
+      return _get32(t, b);
+    case 9:
+      return (int32_t)_get32(t, b);
+    case 5:
+    {
+      const uint32_t den = _get32(t, b + 4);
+      return den ? _get32(t, b) / (double)den : 0.0;
+    }
+    case 10:
+    {
+      const int32_t den = (int32_t)_get32(t, b + 4);
+      return den ? (int32_t)_get32(t, b) / (double)den : 0.0;
+    }
+    case 11:
+    {
+      union { uint32_t i; float f; } u;
+      u.i = _get32(t, b);
+      return u.f;
+    }
+    default:
+      return 0.0;
+  }
+}
+
+// copies an ascii entry, stripping trailing blanks. non utf-8 strings are left to exiv2.
+static void _entry_string(dt_exif_tiff_t *t, const dt_exif_tiff_entry_t *e, char *dst, const size_t dst_len)
+{
+  if(e->type != 2 && e->type != 7) return;
+  const size_t len = MIN(e->count, dst_len - 1);
+  memcpy(dst, e->data, len);
+  dst[len] = '\0';
+  for(size_t n = strlen(dst); n > 0 && (dst[n - 1] == ' ' || dst[n - 1] == '\n'); n--) dst[n - 1] = '\0';
+  if(!g_utf8_validate(dst, -1, NULL))
+  {
+    dst[0] = '\0';
+    t->need_exiv2 = 1;
+  }
+}
+
+static void _parse_ifd(dt_exif_tiff_t *t, uint32_t offset, const dt_exif_tiff_ifd_t kind);
+
+static void _parse_entry(dt_exif_tiff_t *t, const dt_exif_tiff_entry_t *e, const dt_exif_tiff_ifd_t kind,
+                         uint32_t *subfile_type)
+{
+  if(kind == DT_EXIF_TIFF_IFD_GPS)
+  {
+    switch(e->tag)
+    {
+      case 0x0001: // GPSLatitudeRef
+        if(e->type == 2) t->lat_ref = e->data[0];
+        break;
+      case 0x0002: // GPSLatitude
+        if(e->type == 5 && e->count == 3)
+        {
+          for(int k = 0; k < 3; k++) t->lat[k] = _entry_value(t, e, k);
+          t->has_lat = 1;
+        }
+        break;
+      case 0x0003: // GPSLongitudeRef
+        if(e->type == 2) t->lon_ref = e->data[0];
+        break;
+      case 0x0004: // GPSLongitude
+        if(e->type == 5 && e->count == 3)
+        {
+          for(int k = 0; k < 3; k++) t->lon[k] = _entry_value(t, e, k);
+          t->has_lon = 1;
+        }
+        break;
+    }
+    return;
+  }
+
+  switch(e->tag)
+  {
+    case 0x00FE: // NewSubfileType
+      *subfile_type = (uint32_t)_entry_value(t, e, 0);
+      break;
+    case 0x0100: // ImageWidth
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->width) t->width = _entry_value(t, e, 0);
+      if(*subfile_type == 0) t->full_width = MAX(t->full_width, (int)_entry_value(t, e, 0));
+      break;
+    case 0x0101: // ImageLength
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->height) t->height = _entry_value(t, e, 0);
+      if(*subfile_type == 0) t->full_height = MAX(t->full_height, (int)_entry_value(t, e, 0));
+      break;
+    case 0x010F: // Make
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->maker[0]) _entry_string(t, e, t->maker, sizeof(t->maker));
+      break;
+    case 0x0110: // Model
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->model[0]) _entry_string(t, e, t->model, sizeof(t->model));
+      break;
+    case 0x0112: // Orientation
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && t->orientation < 0) t->orientation = _entry_value(t, e, 0);
+      break;
+    case 0x013B: // Artist
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->artist)
+      {
+        char buf[512] = { 0 };
+        _entry_string(t, e, buf, sizeof(buf));
+        if(buf[0]) t->artist = g_strdup(buf);
+      }
+      break;
+    case 0x8298: // Copyright
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->copyright)
+      {
+        char buf[512] = { 0 };
+        _entry_string(t, e, buf, sizeof(buf));
+        if(buf[0]) t->copyright = g_strdup(buf);
+      }
+      break;
+    case 0x4746: // Rating
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE)
+      {
+        t->rating = (int16_t)_entry_value(t, e, 0);
+        t->has_rating = 1;
+      }
+      break;
+    case 0x4749: // RatingPercent
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE)
+      {
+        t->rating_percent = _entry_value(t, e, 0);
+        t->has_rating_percent = 1;
+      }
+      break;
+    case 0x02BC: // XMLPacket
+    case 0x83BB: // IPTC-NAA
+      // xmp and iptc trump exif, that needs the real thing.
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE) t->need_exiv2 = 1;
+      break;
+    case 0x014A: // SubIFDs
+      if(e->type == 4 || e->type == 13)
+        for(uint32_t k = 0; k < e->count && k < 8; k++)
+          _parse_ifd(t, _get32(t, e->data + 4 * k), DT_EXIF_TIFF_IFD_SUB);
+      break;
+    case 0x8769: // ExifIFDPointer
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE) _parse_ifd(t, (uint32_t)_entry_value(t, e, 0), DT_EXIF_TIFF_IFD_EXIF);
+      break;
+    case 0x8825: // GPSInfoIFDPointer
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE) _parse_ifd(t, (uint32_t)_entry_value(t, e, 0), DT_EXIF_TIFF_IFD_GPS);
+      break;
+    case 0x829A: // ExposureTime
+      if(!t->exposure) t->exposure = _entry_value(t, e, 0);
+      break;
+    case 0x829D: // FNumber
+      if(!t->aperture) t->aperture = _entry_value(t, e, 0);
+      break;
+    case 0x8827: // ISOSpeedRatings, nikon happens to store a pair for lo and hi modes
+      if(!t->iso) t->iso = _entry_value(t, e, e->count > 1 ? 1 : 0);
+      break;
+    case 0x8832: // RecommendedExposureIndex
+    case 0x8833: // ISOSpeed
+      if(!t->iso_alt) t->iso_alt = _entry_value(t, e, 0);
+      break;
+    case 0x9003: // DateTimeOriginal
+      if(kind == DT_EXIF_TIFF_IFD_IMAGE && !t->datetime_image[0])
+        _entry_string(t, e, t->datetime_image, sizeof(t->datetime_image));
+      else if(kind == DT_EXIF_TIFF_IFD_EXIF && !t->datetime[0])
+        _entry_string(t, e, t->datetime, sizeof(t->datetime));
+      break;
+    case 0x9206: // SubjectDistance
+      if(!t->focus_distance) t->focus_distance = _entry_value(t, e, 0);
+      break;
+    case 0x920A: // FocalLength
+      if(!t->focal_length) t->focal_length = _entry_value(t, e, 0);
+      break;
+    case 0x927C: // MakerNote, exiv2 decodes lens names, focus distances, rotation, ... from it
+      t->need_exiv2 = 1;
+      break;
+    case 0x9286: // UserComment, skip the 8 byte charset header and see if there's anything in it
+      for(uint32_t k = 8; k < e->count; k++)
+        if(e->data[k] != ' ' && e->data[k] != '\0')
+        {
+          t->need_exiv2 = 1;
+          break;
+        }
+      break;
+    case 0xA002: // PixelXDimension
+      if(kind == DT_EXIF_TIFF_IFD_EXIF) t->pixel_x = _entry_value(t, e, 0);
+      break;
+    case 0xA003: // PixelYDimension
+      if(kind == DT_EXIF_TIFF_IFD_EXIF) t->pixel_y = _entry_value(t, e, 0);
+      break;
+    case 0xA434: // LensModel
+      if(!t->lens[0]) _entry_string(t, e, t->lens, sizeof(t->lens));
+      break;
+    case 0xC621: // ColorMatrix1
+    case 0xC622: // ColorMatrix2
+      if(e->count == 9)
+      {
+        const int m = e->tag - 0xC621;
+        for(int k = 0; k < 9; k++) t->cm[m][k] = _entry_value(t, e, k);
+        t->has_cm[m] = 1;
+      }
+      break;
+    case 0xC65A: // CalibrationIlluminant1
+    case 0xC65B: // CalibrationIlluminant2
+      t->illuminant[e->tag - 0xC65A] = (_entry_value(t, e, 0) == 21) ? 1 : 0;
+      break;
+  }
+}
+
+static void _parse_ifd(dt_exif_tiff_t *t, uint32_t offset, const dt_exif_tiff_ifd_t kind)
+{
+  while(offset && !t->need_exiv2)
+  {
+    // refuse loops and overly long chains
+    if(t->num_ifds >= DT_EXIF_TIFF_MAX_IFDS) return;
+    for(int k = 0; k < t->num_ifds; k++)
+      if(t->visited[k] == offset) return;
+    t->visited[t->num_ifds++] = offset;
+
+    uint8_t buf[12];
+    if(_read(t, offset, 2, buf)) return;
+    const uint16_t entries = _get16(t, buf);
+    if(entries == 0 || entries > 1024) return;
+
+    uint8_t *dir = (uint8_t *)g_malloc(12 * entries + 4);
+    if(_read(t, offset + 2, 12 * entries + 4, dir))
+    {
+      g_free(dir);
+      return;
+    }
+
+    uint32_t subfile_type = (kind == DT_EXIF_TIFF_IFD_IMAGE || kind == DT_EXIF_TIFF_IFD_SUB) ? 0 : 1;
+    for(int k = 0; k < entries; k++)
+    {
+      dt_exif_tiff_entry_t e;
+      if(_entry_load(t, dir + 12 * k, &e)) continue;
+      _parse_entry(t, &e, kind, &subfile_type);
+      _entry_free(&e);
+    }
+
+    // only ifd0 continues into a chain we're interested in
+    offset = (kind == DT_EXIF_TIFF_IFD_IMAGE) ? _get32(t, dir + 12 * entries) : 0;
+    g_free(dir);
+  }
+}
+
+static gboolean _gps_to_number(const double *v, const char ref, double *result)
+{
+  if(!(ref == 'N' || ref == 'S' || ref == 'E' || ref == 'W')) return FALSE;
+  double res = v[0] + v[1] / 60.0 + v[2] / 3600.0;
+  if(ref == 'S' || ref == 'W') res = -res;
+  *result = res;
+  return TRUE;
+}
+
+int dt_exif_tiff_read(dt_image_t *img, const char *path)
+{
+  // ldr files want the exif color space, and friends. leave them to exiv2.
+  if(dt_image_is_ldr(img)) return 1;
+
+  const int fd = g_open(path, O_RDONLY | O_BINARY, 0);
+  if(fd == -1) return 1;
+
+  dt_exif_tiff_t *t = (dt_exif_tiff_t *)g_malloc0(sizeof(dt_exif_tiff_t));
+  t->fd = fd;
+  t->orientation = -1;
+  t->illuminant[0] = t->illuminant[1] = -1;
+
+  int res = 1;
+  const ssize_t len = read(fd, t->head, sizeof(t->head));
+  if(len < 16) goto end;
+  t->head_len = len;
+
+  // plain tiff headers only (cr2, nef, arw, pef, dng, ...) and olympus' variant of it.
+  // everything else (rw2, raf, mrw, crw, x3f, ...) goes through exiv2.
+  if(t->head[0] == 'I' && t->head[1] == 'I')
+    t->big_endian = 0;
+  else if(t->head[0] == 'M' && t->head[1] == 'M')
+    t->big_endian = 1;
+  else
+    goto end;
+  const uint16_t magic = _get16(t, t->head + 2);
+  if(magic != 42 && magic != 0x4f52 && magic != 0x5352) goto end;
+
+  _parse_ifd(t, _get32(t, t->head + 4), DT_EXIF_TIFF_IFD_IMAGE);
+  if(t->need_exiv2) goto end;
+
+  // bail out if anything the database stores is missing
+  if(!t->maker[0] || !t->model[0] || !t->exposure || !t->aperture || !t->focal_length) goto end;
+  if(!t->iso && !t->iso_alt) goto end;
+
+  // all good, write it to the image
+  g_strlcpy(img->exif_maker, t->maker, sizeof(img->exif_maker));
+  g_strlcpy(img->exif_model, t->model, sizeof(img->exif_model));
+  if(t->lens[0]) g_strlcpy(img->exif_lens, t->lens, sizeof(img->exif_lens));
+  img->exif_exposure = t->exposure;
+  img->exif_aperture = t->aperture;
+  // iso values above 65535 don't fit into ISOSpeedRatings
+  img->exif_iso = (t->iso && (t->iso < 65535.0f || !t->iso_alt)) ? t->iso : t->iso_alt;
+  img->exif_focal_length = t->focal_length;
+  if(t->focus_distance > 0.0f) img->exif_focus_distance = t->focus_distance;
+
+  if(t->datetime_image[0])
+    g_strlcpy(img->exif_datetime_taken, t->datetime_image, sizeof(img->exif_datetime_taken));
+  else if(t->datetime[0])
+    g_strlcpy(img->exif_datetime_taken, t->datetime, sizeof(img->exif_datetime_taken));
+
+  if(t->orientation >= 0) img->orientation = dt_image_orientation_to_flip_bits(t->orientation);
+
+  double coord;
+  if(t->has_lat && _gps_to_number(t->lat, t->lat_ref, &coord)) img->latitude = coord;
+  if(t->has_lon && _gps_to_number(t->lon, t->lon_ref, &coord)) img->longitude = coord;
+
+  if(t->artist) dt_metadata_set(img->id, "Xmp.dc.creator", t->artist);
+  if(t->copyright) dt_metadata_set(img->id, "Xmp.dc.rights", t->copyright);
+
+  if(t->has_rating || t->has_rating_percent)
+  {
+    int stars = t->has_rating ? t->rating : t->rating_percent * 5. / 100;
+    if(stars == 0)
+      stars = dt_conf_get_int("ui_last/import_initial_rating");
+    else if(stars == -1)
+      stars = 6;
+    img->flags = (img->flags & ~0x7) | (0x7 & stars);
+  }
+
+  // use the d65 (type == 21) matrix if we found it, otherwise use whatever we got
+  for(int pass = 1; pass >= 0; pass--)
+  {
+    int m = -1;
+    if(t->illuminant[0] == pass && t->has_cm[0])
+      m = 0;
+    else if(t->illuminant[1] == pass && t->has_cm[1])
+      m = 1;
+    if(m < 0) continue;
+    for(int k = 0; k < 9; k++) img->d65_color_matrix[k] = t->cm[m][k];
+    break;
+  }
+
+  // same as exiv2's pixelWidth()/pixelHeight(), the raw loader will fix it up later anyway
+  if(t->pixel_x && t->pixel_y)
+  {
+    img->width = t->pixel_x;
+    img->height = t->pixel_y;
+  }
+  else if(t->full_width && t->full_height)
+  {
+    img->width = t->full_width;
+    img->height = t->full_height;
+  }
+  else
+  {
+    img->width = t->width;
+    img->height = t->height;
+  }
+
+  img->exif_inited = 1;
+  res = 0;
+
+end:
+  close(fd);
+  g_free(t->artist);
+  g_free(t->copyright);
+  g_free(t);
+  return res;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
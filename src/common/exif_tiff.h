@@ -0,0 +1,46 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_EXIF_TIFF_H
+#define DT_EXIF_TIFF_H
+
+#include "common/image.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /** minimal tiff walker used to quickly get the exif fields stored in the database
+   *  from tiff based raw files, without going through exiv2.
+   *  only IFD0, its sub ifds, the exif ifd and the gps ifd are looked at. files with a maker note
+   *  always go through exiv2, which decodes lens names and focus distances from it, so in practice
+   *  this covers dng files and raws with stripped maker notes.
+   *  returns 0 on success. if anything is missing or would need the full tag set
+   *  (maker notes, embedded xmp/iptc, ...) non-zero is returned and img is left
+   *  untouched, so the caller can fall back to exiv2. */
+  int dt_exif_tiff_read(dt_image_t *img, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -23,6 +23,7 @@
 #include "control/progress.h"
 #include "common/film.h"
 #include "common/dtpthread.h"
+#include "common/tags.h"
 #include "common/collection.h"
 #include "common/image_cache.h"
 #include "common/debug.h"
@@ -533,10 +534,10 @@ void dt_film_remove(const int id)
   }
 
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "delete from tagged_images where imgid in "
-                              "(select id from images where film_id = ?1)", -1, &stmt, NULL);
+                              "SELECT id FROM images WHERE film_id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
-  sqlite3_step(stmt);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    dt_tag_detach_all(sqlite3_column_int(stmt, 0));
   sqlite3_finalize(stmt);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "delete from history where imgid in "
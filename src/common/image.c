@@ -37,6 +37,7 @@
 #include <strings.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/stat.h>
 #ifndef __WIN32__
   #include <glob.h>
 #endif
@@ -340,6 +341,15 @@ void dt_image_flip(const int32_t imgid, const int32_t cw)
   dt_image_set_flip(imgid, orientation);
 }
 
+/* attach all tags of src to dest, through the tag api so the tag relations get counted */
+static void _image_copy_tags(const int32_t dest, const int32_t src)
+{
+  GList *tags = NULL;
+  dt_tag_get_attached(src, &tags);
+  for(GList *iter = tags; iter; iter = g_list_next(iter))
+    dt_tag_attach(((dt_tag_t *)iter->data)->id, dest);
+  dt_tag_free_result(&tags);
+}
 
 int32_t dt_image_duplicate(const int32_t imgid)
 {
@@ -418,13 +428,7 @@ int32_t dt_image_duplicate_with_version(const int32_t imgid, const int32_t newve
     DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "insert into tagged_images (imgid, tagid) select ?1, tagid from "
-                                "tagged_images where imgid = ?2", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, newid);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    _image_copy_tags(newid, imgid);
 
     // set version of new entry and max_version of all involved duplicates (with same film_id and filename)
     int32_t version = (newversion != -1) ? newversion : max_version + 1;
@@ -484,11 +488,10 @@ void dt_image_remove(const int32_t imgid)
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "delete from tagged_images where imgid = ?1", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  dt_tag_detach_all(imgid);
+  // it's gone from the db, so nothing can queue it again. drop what's pending and wait for a write in
+  // progress, so the caller can safely delete the xmp.
+  dt_image_forget_sidecar_file(imgid);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "delete from history where imgid = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
@@ -1119,13 +1122,7 @@ int32_t dt_image_copy(const int32_t imgid, const int32_t filmid)
         DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
         sqlite3_step(stmt);
         sqlite3_finalize(stmt);
-        DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                    "insert into tagged_images (imgid, tagid) select ?1, tagid from "
-                                    "tagged_images where imgid = ?2", -1, &stmt, NULL);
-        DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, newid);
-        DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+        _image_copy_tags(newid, imgid);
 
         // get max_version of image duplicates in destination filmroll
         int32_t max_version = -1;
@@ -1323,36 +1320,220 @@ int dt_image_local_copy_reset(const int32_t imgid)
 // xmp stuff
 // *******************************************************
 
-void dt_image_write_sidecar_file(int imgid)
+static void _image_write_sidecar_file(const int imgid)
 {
   // TODO: compute hash and don't write if not needed!
   // write .xmp file
   if(imgid > 0 && dt_conf_get_bool("write_sidecar_files"))
   {
+    // the image might have been removed while its write was pending, don't bring its xmp back
+    sqlite3_stmt *stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT id FROM images WHERE id = ?1", -1, &stmt,
+                                NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+    const gboolean exists = (sqlite3_step(stmt) == SQLITE_ROW);
+    sqlite3_finalize(stmt);
+    if(!exists) return;
+
     gboolean from_cache = TRUE;
-    char filename[PATH_MAX];
+    char filename[PATH_MAX] = { 0 };
     dt_image_full_path(imgid, filename, sizeof(filename), &from_cache);
+    if(!*filename) return;
     dt_image_path_append_version(imgid, filename, sizeof(filename));
     g_strlcat(filename, ".xmp", sizeof(filename));
     if(!dt_exif_xmp_write(imgid, filename))
     {
       // put the timestamp into db. this can't be done in exif.cc since that code gets called
-      // for the copy exporter, too
-      sqlite3_stmt *stmt;
-      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "UPDATE images SET write_timestamp = STRFTIME('%s', 'now') WHERE id = ?1", -1, &stmt, NULL);
+      // for the copy exporter, too. also remember what the file looks like now, so the crawler
+      // can tell if someone else touched it.
+      struct stat statbuf;
+      if(stat(filename, &statbuf) == -1) memset(&statbuf, 0, sizeof(statbuf));
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "UPDATE images SET write_timestamp = STRFTIME('%s', 'now'), "
+                                  "xmp_mtime = ?2, xmp_size = ?3 WHERE id = ?1", -1, &stmt, NULL);
       DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+      sqlite3_bind_int64(stmt, 2, statbuf.st_mtime);
+      sqlite3_bind_int64(stmt, 3, statbuf.st_size);
       sqlite3_step(stmt);
       sqlite3_finalize(stmt);
     }
   }
 }
 
+/*
+ * sidecar write queue. rewriting the whole xmp through exiv2 is slow (even more so over the network)
+ * and happens after nearly every edit, often on the gui thread. so writes are collected per image
+ * and done by a background thread once the image hasn't been touched for xmp_write_delay ms.
+ */
+typedef struct dt_image_sidecar_queue_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond, done;
+  pthread_t thread;
+  GHashTable *pending; // imgid -> monotonic time (us) when it's due
+  int writing;         // imgid the background thread is writing right now, 0 if none
+  int running;
+}
+dt_image_sidecar_queue_t;
+
+static dt_image_sidecar_queue_t _sidecar_queue;
+
+static void *_image_sidecar_queue_work(void *ptr)
+{
+  dt_image_sidecar_queue_t *q = (dt_image_sidecar_queue_t *)ptr;
+  dt_pthread_mutex_lock(&q->mutex);
+  while(q->running)
+  {
+    const gint64 now = g_get_monotonic_time();
+    gint64 next = G_MAXINT64;
+    int imgid = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, q->pending);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+      const gint64 due = *(gint64 *)value;
+      if(due <= now)
+      {
+        imgid = GPOINTER_TO_INT(key);
+        g_hash_table_iter_remove(&iter);
+        break;
+      }
+      next = MIN(next, due);
+    }
+
+    if(imgid > 0)
+    {
+      q->writing = imgid;
+      dt_pthread_mutex_unlock(&q->mutex);
+      dt_print(DT_DEBUG_CONTROL, "[sidecar_queue] writing xmp for image %d\n", imgid);
+      _image_write_sidecar_file(imgid);
+      dt_pthread_mutex_lock(&q->mutex);
+      q->writing = 0;
+      pthread_cond_broadcast(&q->done);
+    }
+    else if(next == G_MAXINT64)
+    {
+      dt_pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    else
+    {
+      // the condition uses the realtime clock, convert our monotonic deadline
+      const gint64 wakeup = g_get_real_time() + (next - now);
+      struct timespec ts;
+      ts.tv_sec = wakeup / G_USEC_PER_SEC;
+      ts.tv_nsec = (wakeup % G_USEC_PER_SEC) * 1000;
+      dt_pthread_cond_timedwait(&q->cond, &q->mutex, &ts);
+    }
+  }
+  dt_pthread_mutex_unlock(&q->mutex);
+  return NULL;
+}
+
+void dt_image_sidecar_queue_init(void)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  dt_pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  pthread_cond_init(&q->done, NULL);
+  q->pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  q->writing = 0;
+  q->running = 1;
+  pthread_create(&q->thread, NULL, _image_sidecar_queue_work, q);
+}
+
+void dt_image_sidecar_queue_cleanup(void)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  if(!q->pending) return;
+  dt_pthread_mutex_lock(&q->mutex);
+  q->running = 0;
+  pthread_cond_broadcast(&q->cond);
+  dt_pthread_mutex_unlock(&q->mutex);
+  pthread_join(q->thread, NULL);
+
+  // nothing may get lost on shutdown
+  dt_image_flush_sidecar_files(-1);
+
+  g_hash_table_destroy(q->pending);
+  q->pending = NULL;
+  pthread_cond_destroy(&q->done);
+  pthread_cond_destroy(&q->cond);
+  dt_pthread_mutex_destroy(&q->mutex);
+}
+
+void dt_image_write_sidecar_file(int imgid)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  if(q->pending)
+  {
+    // whatever was pending is covered by this write. wait in case the background thread is on it.
+    dt_pthread_mutex_lock(&q->mutex);
+    g_hash_table_remove(q->pending, GINT_TO_POINTER(imgid));
+    while(q->writing == imgid) dt_pthread_cond_wait(&q->done, &q->mutex);
+    dt_pthread_mutex_unlock(&q->mutex);
+  }
+  _image_write_sidecar_file(imgid);
+}
+
+void dt_image_queue_sidecar_file(int imgid)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  const int delay = dt_conf_get_int("xmp_write_delay");
+  if(imgid <= 0 || !dt_conf_get_bool("write_sidecar_files")) return;
+  if(delay <= 0 || !q->pending || !q->running)
+  {
+    dt_image_write_sidecar_file(imgid);
+    return;
+  }
+
+  // (re)arm the timer for this image, so a burst of edits ends up in one write
+  gint64 *due = (gint64 *)g_malloc(sizeof(gint64));
+  *due = g_get_monotonic_time() + (gint64)delay * 1000;
+  dt_pthread_mutex_lock(&q->mutex);
+  g_hash_table_replace(q->pending, GINT_TO_POINTER(imgid), due);
+  pthread_cond_broadcast(&q->cond);
+  dt_pthread_mutex_unlock(&q->mutex);
+}
+
+void dt_image_forget_sidecar_file(int imgid)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  if(!q->pending) return;
+  dt_pthread_mutex_lock(&q->mutex);
+  g_hash_table_remove(q->pending, GINT_TO_POINTER(imgid));
+  while(q->writing == imgid) dt_pthread_cond_wait(&q->done, &q->mutex);
+  dt_pthread_mutex_unlock(&q->mutex);
+}
+
+void dt_image_flush_sidecar_files(int imgid)
+{
+  dt_image_sidecar_queue_t *q = &_sidecar_queue;
+  if(!q->pending) return;
+
+  GList *ids = NULL;
+  dt_pthread_mutex_lock(&q->mutex);
+  if(imgid > 0)
+  {
+    if(g_hash_table_remove(q->pending, GINT_TO_POINTER(imgid))) ids = g_list_prepend(ids, GINT_TO_POINTER(imgid));
+    while(q->writing == imgid) dt_pthread_cond_wait(&q->done, &q->mutex);
+  }
+  else
+  {
+    ids = g_hash_table_get_keys(q->pending);
+    g_hash_table_remove_all(q->pending);
+    while(q->writing) dt_pthread_cond_wait(&q->done, &q->mutex);
+  }
+  dt_pthread_mutex_unlock(&q->mutex);
+
+  for(GList *iter = ids; iter; iter = g_list_next(iter)) _image_write_sidecar_file(GPOINTER_TO_INT(iter->data));
+  g_list_free(ids);
+}
 
 void dt_image_synch_xmp(const int selected)
 {
   if(selected > 0)
   {
-    dt_image_write_sidecar_file(selected);
+    dt_image_queue_sidecar_file(selected);
   }
   else if(dt_conf_get_bool("write_sidecar_files"))
   {
@@ -1362,7 +1543,7 @@ void dt_image_synch_xmp(const int selected)
     while(sqlite3_step(stmt) == SQLITE_ROW)
     {
       const int imgid = sqlite3_column_int(stmt, 0);
-      dt_image_write_sidecar_file(imgid);
+      dt_image_queue_sidecar_file(imgid);
     }
     sqlite3_finalize(stmt);
   }
@@ -1383,7 +1564,7 @@ void dt_image_synch_all_xmp(const gchar *pathname)
     while(sqlite3_step(stmt) == SQLITE_ROW)
     {
       const int imgid = sqlite3_column_int(stmt, 0);
-      dt_image_write_sidecar_file(imgid);
+      dt_image_queue_sidecar_file(imgid);
     }
     sqlite3_finalize(stmt);
     g_free(imgfname);
@@ -270,7 +270,17 @@ gboolean dt_image_safe_remove(const int32_t imgid);
 /* try to sync .xmp for all local copies */
 void dt_image_local_copy_synch(void);
 // xmp functions:
+/** write the sidecar of imgid right away, dropping a pending queued write. */
 void dt_image_write_sidecar_file(int imgid);
+/** queue a sidecar write. writes are coalesced per image and done by a background thread after xmp_write_delay ms. */
+void dt_image_queue_sidecar_file(int imgid);
+/** drop the queued sidecar write of imgid without writing it, and wait for one in progress. */
+void dt_image_forget_sidecar_file(int imgid);
+/** write queued sidecars now, for imgid or all of them if imgid is -1. */
+void dt_image_flush_sidecar_files(int imgid);
+void dt_image_sidecar_queue_init(void);
+/** flushes everything that is still pending. */
+void dt_image_sidecar_queue_cleanup(void);
 void dt_image_synch_xmp(const int selected);
 void dt_image_synch_all_xmp(const gchar *pathname);
 
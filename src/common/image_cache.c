@@ -38,7 +38,7 @@ dt_image_cache_allocate(void *data, const uint32_t key, int32_t *cost, void **bu
   // load stuff from db and store in cache:
   char *str;
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
                               "SELECT id, group_id, film_id, width, height, filename, maker, model, lens, exposure, "
                               "aperture, iso, focal_length, datetime_taken, flags, crop, orientation, focus_distance, "
                               "raw_parameters, longitude, latitude, color_matrix, colorspace, version, raw_black, raw_maximum FROM images WHERE id = ?1",
@@ -272,7 +272,7 @@ dt_image_cache_write_release(
   {
     // rest about sidecars:
     // also synch dttags file:
-    dt_image_write_sidecar_file(img->id);
+    dt_image_queue_sidecar_file(img->id);
   }
   dt_cache_write_release(&cache->cache, img->id);
 }
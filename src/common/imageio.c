@@ -630,7 +630,8 @@ int dt_imageio_export_with_flags(
   dt_times_t start;
   dt_get_times(&start);
   dt_dev_pixelpipe_t pipe;
-  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export(&pipe, wd, ht, format->levels(format_params));
+  // the buffers of an export pipe are allocated once we know the memory needed for this image is available
+  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export_deferred(&pipe, wd, ht, format->levels(format_params));
   if(!res)
   {
     dt_control_log(_("failed to allocate memory for %s, please lower the threads used for export or buy more memory."), thumbnail_export ? C_("noun", "thumbnail export") : C_("noun", "export"));
@@ -759,6 +760,27 @@ int dt_imageio_export_with_flags(
   int processed_height = scale*pipe.processed_height + .5f;
   const int bpp = format->bpp(format_params);
 
+  // admission control: wait until this export fits into the memory shared by all running exports,
+  // so that small images go in parallel and big ones don't run out of memory
+  size_t reserved = 0;
+  if(!thumbnail_export)
+  {
+    reserved = dt_dev_pixelpipe_estimate_memory(&pipe, &dev, processed_width, processed_height, scale);
+    // high quality output gets downscaled into a separate buffer
+    if(high_quality_processing) reserved += (size_t)4 * sizeof(float) * processed_width * processed_height;
+    dt_print(DT_DEBUG_MEMORY, "[export] image %d needs about %zu MB\n", imgid, reserved >> 20);
+    dt_imageio_export_memory_reserve(reserved);
+    if(!dt_dev_pixelpipe_alloc_cache(&pipe))
+    {
+      dt_control_log(_("failed to allocate memory for %s, please lower the threads used for export or buy more memory."), C_("noun", "export"));
+      dt_imageio_export_memory_release(reserved);
+      dt_dev_pixelpipe_cleanup(&pipe);
+      dt_dev_cleanup(&dev);
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+      return 1;
+    }
+  }
+
   // downsampling done last, if high quality processing was requested:
   uint8_t *outbuf = pipe.backbuf;
   uint8_t *moutbuf = NULL; // keep track of alloc'ed memory
@@ -887,6 +909,7 @@ int dt_imageio_export_with_flags(
   dt_dev_cleanup(&dev);
   dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
   dt_free_align(moutbuf);
+  if(!thumbnail_export) dt_imageio_export_memory_release(reserved);
   /* now write xmp into that container, if possible */
   if(copy_metadata && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP)) {
     dt_exif_xmp_attach(imgid, filename);
@@ -910,7 +933,8 @@ dt_imageio_retval_t
 dt_imageio_open(
   dt_image_t  *img,               // non-const * means you hold a write lock!
   const char  *filename,          // full path
-  dt_mipmap_cache_allocator_t a)  // allocate via dt_mipmap_cache_alloc
+  dt_mipmap_cache_allocator_t a,  // allocate via dt_mipmap_cache_alloc
+  const int    interactive)       // decoding gets its cores before background work
 {
   /* first of all, check if file exists, don't bother to test loading if not exists */
   if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR))
@@ -928,7 +952,7 @@ dt_imageio_open(
 
 #ifdef HAVE_RAWSPEED
   if(ret != DT_IMAGEIO_OK && ret != DT_IMAGEIO_CACHE_FULL)
-    ret = dt_imageio_open_rawspeed(img, filename, a);
+    ret = dt_imageio_open_rawspeed(img, filename, a, interactive);
 #endif
 
   if(ret != DT_IMAGEIO_OK && ret != DT_IMAGEIO_CACHE_FULL)
@@ -48,8 +48,9 @@ dt_imageio_retval_t dt_imageio_open_hdr(dt_image_t *img, const char *filename, d
 dt_imageio_retval_t dt_imageio_open_raw(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
 // opens file using imagemagick
 dt_imageio_retval_t dt_imageio_open_ldr(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
-// try both, first libraw.
-dt_imageio_retval_t dt_imageio_open(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
+// try both, first libraw. interactive is set when someone waits for the image in the darkroom.
+dt_imageio_retval_t dt_imageio_open(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a,
+                                    const int interactive);
 
 struct dt_imageio_module_format_t;
 struct dt_imageio_module_data_t;
@@ -291,6 +291,20 @@ dt_imageio_init (dt_imageio_t *iio)
 
   dt_imageio_load_modules_format (iio);
   dt_imageio_load_modules_storage(iio);
+
+  dt_pthread_mutex_init(&iio->export_memory_mutex, NULL);
+  pthread_cond_init(&iio->export_memory_cond, NULL);
+  iio->export_memory_used = 0;
+  iio->exports_running = 0;
+  // default to half of the physical memory, the rest is for the caches, the gui and everything else
+  const int budget = dt_conf_get_int("export_memory_budget");
+  if(budget > 0)
+    iio->export_memory_budget = (size_t)budget << 20;
+  else if(budget == 0)
+    iio->export_memory_budget = dt_get_total_memory() * 1024 / 2;
+  else
+    iio->export_memory_budget = 0;
+  dt_print(DT_DEBUG_MEMORY, "[imageio_init] export memory budget %zu MB\n", iio->export_memory_budget >> 20);
 }
 
 void
@@ -313,6 +327,32 @@ dt_imageio_cleanup (dt_imageio_t *iio)
     free(module);
     iio->plugins_storage = g_list_delete_link(iio->plugins_storage, iio->plugins_storage);
   }
+  dt_pthread_mutex_destroy(&iio->export_memory_mutex);
+  pthread_cond_destroy(&iio->export_memory_cond);
+}
+
+void dt_imageio_export_memory_reserve(size_t size)
+{
+  dt_imageio_t *iio = darktable.imageio;
+  dt_pthread_mutex_lock(&iio->export_memory_mutex);
+  while(iio->export_memory_budget > 0 && iio->exports_running > 0
+        && iio->export_memory_used + size > iio->export_memory_budget)
+    dt_pthread_cond_wait(&iio->export_memory_cond, &iio->export_memory_mutex);
+  iio->export_memory_used += size;
+  iio->exports_running++;
+  dt_print(DT_DEBUG_MEMORY, "[export] reserved %zu MB, %d exports using %zu MB of %zu MB\n", size >> 20,
+           iio->exports_running, iio->export_memory_used >> 20, iio->export_memory_budget >> 20);
+  dt_pthread_mutex_unlock(&iio->export_memory_mutex);
+}
+
+void dt_imageio_export_memory_release(size_t size)
+{
+  dt_imageio_t *iio = darktable.imageio;
+  dt_pthread_mutex_lock(&iio->export_memory_mutex);
+  iio->export_memory_used -= size;
+  iio->exports_running--;
+  pthread_cond_broadcast(&iio->export_memory_cond);
+  dt_pthread_mutex_unlock(&iio->export_memory_mutex);
 }
 
 dt_imageio_module_format_t *dt_imageio_get_format()
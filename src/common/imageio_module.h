@@ -172,6 +172,13 @@ typedef struct dt_imageio_t
 {
   GList *plugins_format;
   GList *plugins_storage;
+
+  /* memory budget shared by all running exports, in bytes. 0 means unlimited. */
+  dt_pthread_mutex_t export_memory_mutex;
+  pthread_cond_t export_memory_cond;
+  size_t export_memory_budget;
+  size_t export_memory_used;
+  int exports_running;
 }
 dt_imageio_t;
 
@@ -180,6 +187,12 @@ void dt_imageio_init   (dt_imageio_t *iio);
 /* cleanup */
 void dt_imageio_cleanup(dt_imageio_t *iio);
 
+/* block until an export needing this much memory fits into the export memory budget. an export is always
+ * let through when no other one is running, however big it is. */
+void dt_imageio_export_memory_reserve(size_t size);
+/* give back memory reserved with dt_imageio_export_memory_reserve(). */
+void dt_imageio_export_memory_release(size_t size);
+
 /* get selected imageio plugin for export */
 dt_imageio_module_format_t *dt_imageio_get_format();
 
@@ -39,10 +39,14 @@ extern "C"
 #include "common/file_location.h"
 }
 
+// cores granted to the decoder running in this thread
+static __thread int rawspeed_cores = 0;
+
 // define this function, it is only declared in rawspeed:
 int
 rawspeed_get_number_of_processor_cores()
 {
+  if(rawspeed_cores > 0) return rawspeed_cores;
 #ifdef _OPENMP
   return omp_get_num_procs();
 #else
@@ -50,6 +54,24 @@ rawspeed_get_number_of_processor_cores()
 #endif
 }
 
+// the threads rawspeed starts for decoding come out of the process wide core budget.
+// keep one of these around for as long as rawspeed does the work.
+class dt_rawspeed_cores_t
+{
+public:
+  dt_rawspeed_cores_t(const int interactive) : interactive(interactive)
+  {
+    rawspeed_cores = dt_cores_acquire(darktable.num_openmp_threads, interactive);
+  }
+  ~dt_rawspeed_cores_t()
+  {
+    dt_cores_release(rawspeed_cores, interactive);
+    rawspeed_cores = 0;
+  }
+private:
+  const int interactive;
+};
+
 using namespace RawSpeed;
 
 dt_imageio_retval_t dt_imageio_open_rawspeed_sraw(dt_image_t *img, RawImage r, dt_mipmap_cache_allocator_t a);
@@ -79,7 +101,8 @@ dt_imageio_retval_t
 dt_imageio_open_rawspeed(
   dt_image_t  *img,
   const char  *filename,
-  dt_mipmap_cache_allocator_t a)
+  dt_mipmap_cache_allocator_t a,
+  const int    interactive)
 {
   if(!img->exif_inited)
     (void) dt_exif_read(img, filename);
@@ -138,8 +161,11 @@ dt_imageio_open_rawspeed(
 
     d->failOnUnknown = true;
     d->checkSupport(meta);
-    d->decodeRaw();
-    d->decodeMetaData(meta);
+    {
+      dt_rawspeed_cores_t cores(interactive);
+      d->decodeRaw();
+      d->decodeMetaData(meta);
+    }
     RawImage r = d->mRaw;
 
     /* free auto pointers on spot */
@@ -155,7 +181,11 @@ dt_imageio_open_rawspeed(
 
     // only scale colors for sizeof(uint16_t) per pixel, not sizeof(float)
     // if(r->getDataType() != TYPE_FLOAT32) scale_black_white((uint16_t *)r->getData(), r->blackLevel, r->whitePoint, r->dim.x, r->dim.y, r->pitch/r->getBpp());
-    if(r->getDataType() != TYPE_FLOAT32) r->scaleBlackWhite();
+    if(r->getDataType() != TYPE_FLOAT32)
+    {
+      dt_rawspeed_cores_t cores(interactive);
+      r->scaleBlackWhite();
+    }
     img->bpp = r->getBpp();
     img->filters = r->cfa.getDcrawFilter();
     if(img->filters)
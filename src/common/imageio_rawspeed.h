@@ -26,7 +26,8 @@ extern "C"
 #include "common/image.h"
 #include "common/mipmap_cache.h"
 
-  dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
+  dt_imageio_retval_t dt_imageio_open_rawspeed(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a,
+                                               const int interactive);
 
 #ifdef __cplusplus
 }
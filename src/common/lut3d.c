@@ -0,0 +1,306 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/lut3d.h"
+#include "common/darktable.h"
+
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+
+// number of random colors the table is compared to the transform with
+#define LUT3D_TEST_SAMPLES (1<<14)
+
+static inline int
+_lut3d_inside(const dt_lut3d_t *lut, const float *const in)
+{
+  // written this way round so nan ends up outside
+  return in[0] >= lut->min[0] && in[0] <= lut->max[0] && in[1] >= lut->min[1] && in[1] <= lut->max[1]
+         && in[2] >= lut->min[2] && in[2] <= lut->max[2];
+}
+
+// node coordinate t in [0,1] of an axis to the input value the node stands for
+static inline float
+_lut3d_node_value(const dt_lut3d_t *lut, const int c, float t)
+{
+  if(lut->shaper) t *= t;
+  return lut->min[c] + t * (lut->max[c] - lut->min[c]);
+}
+
+// tetrahedral interpolation of the table at a pixel inside of the domain
+static inline __m128
+_lut3d_lookup(const dt_lut3d_t *lut, const __m128 min, const __m128 scale, const float *const in)
+{
+  const int size = lut->size;
+  __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in), min), scale);
+  t = _mm_max_ps(t, _mm_setzero_ps());
+  if(lut->shaper) t = _mm_sqrt_ps(t);
+  float f[4] __attribute__((aligned(16)));
+  _mm_store_ps(f, _mm_mul_ps(t, _mm_set1_ps(size - 1)));
+  int i[3];
+  for(int c = 0; c < 3; c++)
+  {
+    // the node below, the last cell also takes the upper boundary of the domain
+    i[c] = MIN((int)f[c], size - 2);
+    f[c] -= i[c];
+  }
+
+  const size_t dx = 4, dy = (size_t)4 * size, dz = (size_t)4 * size * size;
+  const float *c0 = lut->table + dx * i[0] + dy * i[1] + dz * i[2];
+  size_t o1, o2;
+  float w0, w1, w2;
+  if(f[0] >= f[1])
+  {
+    if(f[1] >= f[2])
+    {
+      o1 = dx;
+      o2 = dx + dy;
+      w0 = f[0];
+      w1 = f[1];
+      w2 = f[2];
+    }
+    else if(f[0] >= f[2])
+    {
+      o1 = dx;
+      o2 = dx + dz;
+      w0 = f[0];
+      w1 = f[2];
+      w2 = f[1];
+    }
+    else
+    {
+      o1 = dz;
+      o2 = dz + dx;
+      w0 = f[2];
+      w1 = f[0];
+      w2 = f[1];
+    }
+  }
+  else
+  {
+    if(f[2] >= f[1])
+    {
+      o1 = dz;
+      o2 = dz + dy;
+      w0 = f[2];
+      w1 = f[1];
+      w2 = f[0];
+    }
+    else if(f[2] >= f[0])
+    {
+      o1 = dy;
+      o2 = dy + dz;
+      w0 = f[1];
+      w1 = f[2];
+      w2 = f[0];
+    }
+    else
+    {
+      o1 = dy;
+      o2 = dy + dx;
+      w0 = f[1];
+      w1 = f[0];
+      w2 = f[2];
+    }
+  }
+  const __m128 v0 = _mm_load_ps(c0), v1 = _mm_load_ps(c0 + o1), v2 = _mm_load_ps(c0 + o2),
+               v3 = _mm_load_ps(c0 + dx + dy + dz);
+  return _mm_add_ps(_mm_add_ps(v0, _mm_mul_ps(_mm_set1_ps(w0), _mm_sub_ps(v1, v0))),
+                    _mm_add_ps(_mm_mul_ps(_mm_set1_ps(w1), _mm_sub_ps(v2, v1)),
+                               _mm_mul_ps(_mm_set1_ps(w2), _mm_sub_ps(v3, v2))));
+}
+
+static void
+_lut3d_scale(const dt_lut3d_t *lut, __m128 *min, __m128 *scale)
+{
+  *min = _mm_set_ps(0.0f, lut->min[2], lut->min[1], lut->min[0]);
+  *scale = _mm_set_ps(0.0f, 1.0f / (lut->max[2] - lut->min[2]), 1.0f / (lut->max[1] - lut->min[1]),
+                      1.0f / (lut->max[0] - lut->min[0]));
+}
+
+// fills the table with size^3 nodes
+static int
+_lut3d_bake(dt_lut3d_t *lut, cmsHTRANSFORM xform, const int size)
+{
+  const size_t plane = (size_t)size * size;
+  float *in = dt_alloc_align(16, sizeof(float) * 4 * plane * size);
+  lut->table = dt_alloc_align(16, sizeof(float) * 4 * plane * size);
+  if(!in || !lut->table)
+  {
+    dt_free_align(in);
+    dt_lut3d_cleanup(lut);
+    return 1;
+  }
+  lut->size = size;
+  memset(lut->table, 0, sizeof(float) * 4 * plane * size);
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(in, lut, xform) schedule(static)
+#endif
+  for(int k = 0; k < size; k++)
+  {
+    float *node = in + 4 * plane * k;
+    for(int j = 0; j < size; j++)
+      for(int i = 0; i < size; i++, node += 4)
+      {
+        node[0] = _lut3d_node_value(lut, 0, i / (float)(size - 1));
+        node[1] = _lut3d_node_value(lut, 1, j / (float)(size - 1));
+        node[2] = _lut3d_node_value(lut, 2, k / (float)(size - 1));
+        node[3] = 0.0f;
+      }
+    cmsDoTransform(xform, in + 4 * plane * k, lut->table + 4 * plane * k, plane);
+  }
+  dt_free_align(in);
+  return 0;
+}
+
+// largest distance of the first three channels of the table to the transform, at random colors in the domain.
+// with measure, both go through it first and the distance is taken there.
+static float
+_lut3d_error(const dt_lut3d_t *lut, cmsHTRANSFORM xform, cmsHTRANSFORM measure)
+{
+  // input, output of the transform and of the table, and both of these after measure
+  float *in = dt_alloc_align(16, sizeof(float) * 4 * 5 * LUT3D_TEST_SAMPLES);
+  if(!in) return INFINITY;
+  float *out = in + 4 * LUT3D_TEST_SAMPLES, *approx = out + 4 * LUT3D_TEST_SAMPLES;
+  float *out_m = approx + 4 * LUT3D_TEST_SAMPLES, *approx_m = out_m + 4 * LUT3D_TEST_SAMPLES;
+  // the same colors every time
+  uint32_t state = 0x12345678u;
+  for(int s = 0; s < LUT3D_TEST_SAMPLES; s++)
+  {
+    for(int c = 0; c < 3; c++)
+    {
+      state = state * 1664525u + 1013904223u;
+      in[4 * s + c] = _lut3d_node_value(lut, c, (state >> 8) * (1.0f / (1 << 24)));
+    }
+    in[4 * s + 3] = 0.0f;
+  }
+  const int nthreads = dt_get_num_threads();
+  const int chunk = (LUT3D_TEST_SAMPLES + nthreads - 1) / nthreads;
+  float error[nthreads];
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(in, out, approx, out_m, approx_m, lut, xform, measure, error) \
+    schedule(static)
+#endif
+  for(int t = 0; t < nthreads; t++)
+  {
+    const int start = t * chunk, end = MIN(start + chunk, LUT3D_TEST_SAMPLES);
+    error[t] = 0.0f;
+    if(start >= end) continue;
+    cmsDoTransform(xform, in + 4 * start, out + 4 * start, end - start);
+    __m128 min, scale;
+    _lut3d_scale(lut, &min, &scale);
+    for(int s = start; s < end; s++) _mm_store_ps(approx + 4 * s, _lut3d_lookup(lut, min, scale, in + 4 * s));
+    const float *ref = out, *test = approx;
+    if(measure)
+    {
+      cmsDoTransform(measure, out + 4 * start, out_m + 4 * start, end - start);
+      cmsDoTransform(measure, approx + 4 * start, approx_m + 4 * start, end - start);
+      ref = out_m;
+      test = approx_m;
+    }
+    for(int s = start; s < end; s++)
+    {
+      float v[4] __attribute__((aligned(16)));
+      _mm_store_ps(v, _mm_sub_ps(_mm_load_ps(test + 4 * s), _mm_load_ps(ref + 4 * s)));
+      const float e = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+      // written this way round so nan counts as too large
+      if(!(e <= error[t])) error[t] = isnan(e) ? INFINITY : e;
+    }
+  }
+  dt_free_align(in);
+  float max_error = 0.0f;
+  for(int t = 0; t < nthreads; t++) max_error = MAX(max_error, error[t]);
+  return max_error;
+}
+
+int
+dt_lut3d_init(dt_lut3d_t *lut, cmsHTRANSFORM xform, const float min[3], const float max[3], const int shaper,
+              const float max_error, cmsHTRANSFORM measure)
+{
+  static const int sizes[] = { 33, 65 };
+  memset(lut, 0, sizeof(dt_lut3d_t));
+  if(!xform) return 1;
+  for(int k = 0; k < 3; k++)
+  {
+    lut->min[k] = min[k];
+    lut->max[k] = max[k];
+  }
+  lut->shaper = shaper;
+
+  for(int k = 0; k < (int)(sizeof(sizes) / sizeof(sizes[0])); k++)
+  {
+    if(_lut3d_bake(lut, xform, sizes[k])) return 1;
+    lut->max_error = _lut3d_error(lut, xform, measure);
+    dt_print(DT_DEBUG_PERF, "[lut3d] %d^3 nodes, max error %g (%g allowed)\n", lut->size, lut->max_error,
+             max_error);
+    if(lut->max_error <= max_error) return 0;
+    dt_lut3d_cleanup(lut);
+  }
+  return 1;
+}
+
+void
+dt_lut3d_cleanup(dt_lut3d_t *lut)
+{
+  dt_free_align(lut->table);
+  lut->table = NULL;
+  lut->size = 0;
+}
+
+void
+dt_lut3d_apply(const dt_lut3d_t *lut, cmsHTRANSFORM xform, const float *const in, float *const out,
+               const int width)
+{
+  if(!lut->size)
+  {
+    cmsDoTransform(xform, in, out, width);
+    return;
+  }
+
+  __m128 min, scale;
+  _lut3d_scale(lut, &min, &scale);
+  int outside = 0;
+  for(int i = 0; i < width; i++)
+  {
+    if(_lut3d_inside(lut, in + 4 * i))
+      _mm_store_ps(out + 4 * i, _lut3d_lookup(lut, min, scale, in + 4 * i));
+    else
+      outside++;
+  }
+  if(!outside) return;
+
+  // everything the table does not cover goes through the transform, in one go
+  float *tmp = dt_alloc_align(16, sizeof(float) * 4 * 2 * outside);
+  if(!tmp)
+  {
+    cmsDoTransform(xform, in, out, width);
+    return;
+  }
+  float *tmp_out = tmp + 4 * outside;
+  for(int i = 0, k = 0; i < width; i++)
+    if(!_lut3d_inside(lut, in + 4 * i)) memcpy(tmp + 4 * k++, in + 4 * i, sizeof(float) * 4);
+  cmsDoTransform(xform, tmp, tmp_out, outside);
+  for(int i = 0, k = 0; i < width; i++)
+    if(!_lut3d_inside(lut, in + 4 * i)) memcpy(out + 4 * i, tmp_out + 4 * k++, sizeof(float) * 4);
+  dt_free_align(tmp);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
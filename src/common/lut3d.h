@@ -0,0 +1,58 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_LUT3D_H
+#define DT_COMMON_LUT3D_H
+
+#include <lcms2.h>
+
+/**
+ * a littlecms transform between two 4 channel float formats, baked into a 3d lookup table
+ * and applied with tetrahedral interpolation. pixels outside of the domain of the table
+ * still go through the transform.
+ */
+typedef struct dt_lut3d_t
+{
+  int size;          // nodes per axis, 0 if there is no table
+  int shaper;        // nodes are spaced evenly in sqrt((x-min)/(max-min)) instead of x, for linear input
+  float min[3], max[3];
+  float max_error;   // largest difference to the transform found when the table was built
+  float *table;      // size^3 nodes of 4 floats, first channel varying fastest
+}
+dt_lut3d_t;
+
+/** bakes xform into lut over [min, max] for the first three channels, with 33 nodes per axis, or 65 if that is
+ * not accurate enough. returns 0 on success, and 1 if the largest euclidean distance of the first three output
+ * channels to xform stays above max_error, in which case lut is left empty. if measure is not NULL, the outputs
+ * of both are passed through it before taking the distance, so a linear rgb table can be checked in Lab. */
+int dt_lut3d_init(dt_lut3d_t *lut, cmsHTRANSFORM xform, const float min[3], const float max[3], const int shaper,
+                  const float max_error, cmsHTRANSFORM measure);
+
+/** frees the table, the lut is empty afterwards. */
+void dt_lut3d_cleanup(dt_lut3d_t *lut);
+
+/** transforms width pixels of 4 floats, like cmsDoTransform(xform, in, out, width) would. in and out have to
+ * be 16 byte aligned. */
+void dt_lut3d_apply(const dt_lut3d_t *lut, cmsHTRANSFORM xform, const float *const in, float *const out,
+                    const int width);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -24,6 +24,7 @@
 #include "common/imageio_module.h"
 #include "common/imageio_jpeg.h"
 #include "common/mipmap_cache.h"
+#include "common/trace.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "libraw/libraw.h"
@@ -742,7 +743,9 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   }
 
   // full buffer needs dynamic alloc:
-  const int full_entries = MAX(2, parallel); // even with one thread you want two buffers. one for dr one for thumbs.
+  // even with one thread you want two buffers. one for dr one for thumbs.
+  // export loads images ahead of processing them, so there has to be room for those, too.
+  const int full_entries = MAX(2, parallel) + CLAMP(dt_conf_get_int("export_decode_threads"), 1, 4);
   int32_t max_mem_bufs = nearest_power_of_two(full_entries);
 
   // for this buffer, because it can be very busy during import, we want the minimum
@@ -878,7 +881,7 @@ dt_mipmap_cache_read_get(
     if(mip > DT_MIPMAP_FULL || (int)mip < DT_MIPMAP_0) return; // remove the (int) once we no longer have to support gcc < 4.8 :/
     dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, dt_image_load_job_create(imgid, mip));
   }
-  else if(flags == DT_MIPMAP_BLOCKING)
+  else if(flags == DT_MIPMAP_BLOCKING || flags == DT_MIPMAP_BLOCKING_INTERACTIVE)
   {
     // simple case: blocking get
     struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)dt_cache_read_get(&cache->mip[mip].cache, key);
@@ -901,6 +904,7 @@ dt_mipmap_cache_read_get(
       if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
       {
         __sync_fetch_and_add (&(cache->mip[mip].stats_fetches), 1);
+        const double trace_start = dt_trace_begin();
         // fprintf(stderr, "[mipmap cache get] now initializing buffer for img %u mip %d!\n", imgid, mip);
         // we're write locked here, as requested by the alloc callback.
         // now fill it with data:
@@ -921,7 +925,8 @@ dt_mipmap_cache_read_get(
 
           dt_mipmap_cache_allocator_t a = (dt_mipmap_cache_allocator_t)&dsc;
           struct dt_mipmap_buffer_dsc* prvdsc = dsc;
-          dt_imageio_retval_t ret = dt_imageio_open(&buffered_image, filename, a);
+          dt_imageio_retval_t ret
+              = dt_imageio_open(&buffered_image, filename, a, flags == DT_MIPMAP_BLOCKING_INTERACTIVE);
           if(dsc != prvdsc)
           {
             // fprintf(stderr, "[mipmap cache] realloc %p\n", data);
@@ -980,6 +985,7 @@ dt_mipmap_cache_read_get(
             _init_8((uint8_t *)(dsc+1), &dsc->width, &dsc->height, imgid, mip);
           }
         }
+        dt_trace_end(DT_TRACE_MIPMAP, trace_start, "image %u mip %d", imgid, (int)mip);
         dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
         // drop the write lock
         dt_cache_write_release(&cache->mip[mip].cache, key);
@@ -55,7 +55,10 @@ typedef enum dt_mipmap_get_flags_t
   DT_MIPMAP_BLOCKING = 2,
   // don't actually acquire the lock if it is not
   // in cache (i.e. would have to be loaded first)
-  DT_MIPMAP_TESTLOCK = 3
+  DT_MIPMAP_TESTLOCK = 3,
+  // like blocking, for the image someone is waiting for in
+  // the darkroom: decoding it gets cores before background work.
+  DT_MIPMAP_BLOCKING_INTERACTIVE = 4
 }
 dt_mipmap_get_flags_t;
 
@@ -69,6 +69,7 @@ void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
   cl->async_pixelpipe = dt_conf_get_bool("opencl_async_pixelpipe");
   cl->synch_cache = dt_conf_get_bool("opencl_synch_cache");
   cl->micro_nap = dt_conf_get_int("opencl_micro_nap");
+  cl->interactive_wait = MAX(0, dt_conf_get_int("opencl_interactive_wait"));
   cl->dlocl = NULL;
   cl->dev_priority_image = NULL;
   cl->dev_priority_preview = NULL;
@@ -109,6 +110,7 @@ void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_synch_cache: %d\n", dt_conf_get_bool("opencl_synch_cache"));
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_number_event_handles: %d\n", dt_conf_get_int("opencl_number_event_handles"));
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_micro_nap: %d\n", dt_conf_get_int("opencl_micro_nap"));
+  dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_interactive_wait: %d\n", dt_conf_get_int("opencl_interactive_wait"));
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_use_pinned_memory: %d\n", dt_conf_get_bool("opencl_use_pinned_memory"));
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] opencl_use_cpu_devices: %d\n", dt_conf_get_bool("opencl_use_cpu_devices"));
 
@@ -203,6 +205,7 @@ void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
     cl->dev[dev].totalsuccess = 0;
     cl->dev[dev].totallost = 0;
     cl->dev[dev].summary=CL_COMPLETE;
+    cl->dev[dev].interactive_waiting = 0;
     cl->dev[dev].used_global_mem = 0;
     cl->dev[dev].nvidia_sm_20 = 0;
     cl->dev[dev].vendor = "";
@@ -781,6 +784,7 @@ int dt_opencl_lock_device(const int pipetype)
   if(!cl->inited) return -1;
 
   const int *priority;
+  const int interactive = pipetype == DT_DEV_PIXELPIPE_FULL || pipetype == DT_DEV_PIXELPIPE_PREVIEW;
 
   switch(pipetype)
   {
@@ -802,10 +806,28 @@ int dt_opencl_lock_device(const int pipetype)
 
   if(priority)
   {
-    while(*priority != -1)
+    for(const int *p = priority; *p != -1; p++)
     {
-      if(!dt_pthread_mutex_trylock(&cl->dev[*priority].lock)) return *priority;
-      priority++;
+      // a device an interactive pipe is waiting for goes to that pipe as soon as the current user lets go of it
+      if(!interactive && cl->dev[*p].interactive_waiting) continue;
+      if(!dt_pthread_mutex_trylock(&cl->dev[*p].lock)) return *p;
+    }
+
+    // all busy. the darkroom would rather wait a bit for its gpu, which typically becomes free at the end of
+    // a thumbnail or export pipe, than to run the whole pipe on the cpu.
+    if(interactive && *priority != -1 && cl->interactive_wait > 0)
+    {
+      const int dev = *priority;
+      const double start = dt_get_wtime();
+      __sync_fetch_and_add(&cl->dev[dev].interactive_waiting, 1);
+      int locked = 0;
+      while(!(locked = !dt_pthread_mutex_trylock(&cl->dev[dev].lock))
+            && dt_get_wtime() - start < 1e-3 * cl->interactive_wait)
+        g_usleep(1000);
+      __sync_fetch_and_sub(&cl->dev[dev].interactive_waiting, 1);
+      if(locked) return dev;
+      dt_print(DT_DEBUG_OPENCL, "[opencl_lock_device] device %d still busy after %d ms, using cpu\n", dev,
+               cl->interactive_wait);
     }
   }
   else
@@ -92,6 +92,8 @@ typedef struct dt_opencl_device_t
   const char *name;
   const char *cname;
   cl_int summary;
+  // number of interactive pipes waiting for this device, background pipes keep off it meanwhile
+  int interactive_waiting;
 }
 dt_opencl_device_t;
 
@@ -110,6 +112,7 @@ typedef struct dt_opencl_t
   int number_event_handles;
   int synch_cache;
   int micro_nap;
+  int interactive_wait;
   int enabled;
   int stopped;
   int num_devs;
@@ -144,7 +147,9 @@ int dt_opencl_finish(const int devid);
 /** enqueues a synchronization point. */
 int dt_opencl_enqueue_barrier(const int devid);
 
-/** locks a device for your thread's exclusive use */
+/** locks a device for your thread's exclusive use. interactive pipes (full and preview) wait up to
+ *  opencl_interactive_wait milliseconds for their preferred device if all are busy, background pipes never wait
+ *  and leave devices alone that an interactive pipe is waiting for. returns -1 to process on the cpu. */
 int dt_opencl_lock_device(const int pipetype);
 
 /** done with your command queue. */
@@ -18,32 +18,347 @@
 */
 
 #include "common/darktable.h"
+#include "common/database.h"
 #include "common/tags.h"
 #include "common/debug.h"
 #include "control/conf.h"
 #include "control/control.h"
 
-gboolean dt_tag_new(const char *name,guint *tagid)
+#include <string.h>
+
+/*
+ * in-memory index of all tags, kept in sync by the functions in this file:
+ *
+ * * every tag gets its casefolded name indexed once per hierarchy level
+ *   ("places|europe|paris", "europe|paris" and "paris"), in one sorted
+ *   array. prefix searches are a binary search plus a linear walk.
+ * * for every tag we count how many images carry it together with each
+ *   other tag. this used to be done by sqlite triggers on tagged_images
+ *   which made every attach touch the whole tagxtag table. the counts
+ *   that changed get written to tagxtag in batches instead.
+ *
+ * the index is loaded on first use. everything is protected by the mutex,
+ * which is also held while touching tagged_images through this file.
+ * the pending counts are written from a timer as well, and at shutdown.
+ */
+
+// write tagxtag when that many pairs changed, or when the oldest change is that old
+#define DT_TAG_INDEX_FLUSH_PAIRS 512
+#define DT_TAG_INDEX_FLUSH_SECONDS 30
+
+typedef struct dt_tag_index_entry_t
+{
+  guint id;
+  gchar *name;
+  gchar *folded;       // casefolded name, the prefix keys point into it
+  GHashTable *related; // other tag id -> number of images having both
+}
+dt_tag_index_entry_t;
+
+typedef struct dt_tag_index_key_t
+{
+  const gchar *key;
+  dt_tag_index_entry_t *entry;
+}
+dt_tag_index_key_t;
+
+typedef struct dt_tag_index_pair_t
+{
+  guint id1, id2;
+}
+dt_tag_index_pair_t;
+
+typedef struct dt_tag_index_t
+{
+  dt_pthread_mutex_t mutex;
+  gboolean loaded;
+  GHashTable *by_id;   // tag id -> entry
+  GHashTable *by_name; // tag name -> entry
+  GArray *keys;        // dt_tag_index_key_t, sorted by key
+  gboolean keys_dirty;
+  GArray *dirty_pairs; // dt_tag_index_pair_t with id1 < id2, not yet in tagxtag
+  gint64 first_dirty;
+  guint flush_timeout;
+}
+dt_tag_index_t;
+
+static dt_tag_index_t _tag_index;
+
+static void _tag_index_entry_free(gpointer data)
+{
+  dt_tag_index_entry_t *entry = (dt_tag_index_entry_t *)data;
+  g_hash_table_destroy(entry->related);
+  g_free(entry->name);
+  g_free(entry->folded);
+  g_free(entry);
+}
+
+static dt_tag_index_entry_t *_tag_index_add(guint id, const gchar *name)
+{
+  dt_tag_index_entry_t *entry = (dt_tag_index_entry_t *)g_malloc(sizeof(dt_tag_index_entry_t));
+  entry->id = id;
+  entry->name = g_strdup(name);
+  entry->folded = g_utf8_casefold(name, -1);
+  entry->related = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_insert(_tag_index.by_id, GUINT_TO_POINTER(id), entry);
+  g_hash_table_insert(_tag_index.by_name, entry->name, entry);
+  _tag_index.keys_dirty = TRUE;
+  return entry;
+}
+
+static void _tag_index_remove(guint id)
+{
+  dt_tag_index_entry_t *entry = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(id));
+  if(!entry) return;
+
+  // the delete_tag trigger took care of tagxtag, just forget about the pairs here
+  GHashTableIter it;
+  gpointer other;
+  g_hash_table_iter_init(&it, entry->related);
+  while(g_hash_table_iter_next(&it, &other, NULL))
+  {
+    dt_tag_index_entry_t *o = g_hash_table_lookup(_tag_index.by_id, other);
+    if(o) g_hash_table_remove(o->related, GUINT_TO_POINTER(id));
+  }
+  g_hash_table_remove(_tag_index.by_name, entry->name);
+  g_hash_table_remove(_tag_index.by_id, GUINT_TO_POINTER(id));
+  _tag_index.keys_dirty = TRUE;
+}
+
+static gint _tag_index_key_cmp(gconstpointer a, gconstpointer b)
+{
+  return strcmp(((const dt_tag_index_key_t *)a)->key, ((const dt_tag_index_key_t *)b)->key);
+}
+
+static void _tag_index_build_keys()
+{
+  g_array_set_size(_tag_index.keys, 0);
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init(&it, _tag_index.by_id);
+  while(g_hash_table_iter_next(&it, NULL, &value))
+  {
+    dt_tag_index_entry_t *entry = (dt_tag_index_entry_t *)value;
+    // internal tags are never suggested
+    if(g_str_has_prefix(entry->name, "darktable|")) continue;
+    const gchar *level = entry->folded;
+    while(level)
+    {
+      dt_tag_index_key_t key = { level, entry };
+      g_array_append_val(_tag_index.keys, key);
+      level = strchr(level, '|');
+      if(level) level++;
+    }
+  }
+  g_array_sort(_tag_index.keys, _tag_index_key_cmp);
+  _tag_index.keys_dirty = FALSE;
+}
+
+static void _tag_index_load()
 {
-  int rt;
   sqlite3_stmt *stmt;
 
-  if (!name || name[0] == '\0')
-    return FALSE; // no tagid name.
+  _tag_index.by_id = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _tag_index_entry_free);
+  _tag_index.by_name = g_hash_table_new(g_str_hash, g_str_equal);
+  _tag_index.keys = g_array_new(FALSE, FALSE, sizeof(dt_tag_index_key_t));
+  _tag_index.dirty_pairs = g_array_new(FALSE, FALSE, sizeof(dt_tag_index_pair_t));
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT id, name FROM tags", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    if(name) _tag_index_add(sqlite3_column_int(stmt, 0), name);
+  }
+  sqlite3_finalize(stmt);
 
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT id FROM tags WHERE name = ?1", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, name, -1, SQLITE_TRANSIENT);
-  rt = sqlite3_step(stmt);
-  if(rt == SQLITE_ROW)
+                              "SELECT id1, id2, count FROM tagxtag WHERE count > 0 AND id1 != id2",
+                              -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
   {
-    // tagid already exists.
-    if( tagid != NULL)
-      *tagid=sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
-    return  TRUE;
+    const guint id1 = sqlite3_column_int(stmt, 0);
+    const guint id2 = sqlite3_column_int(stmt, 1);
+    const int count = sqlite3_column_int(stmt, 2);
+    dt_tag_index_entry_t *e1 = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(id1));
+    dt_tag_index_entry_t *e2 = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(id2));
+    if(!e1 || !e2) continue;
+    g_hash_table_insert(e1->related, GUINT_TO_POINTER(id2), GINT_TO_POINTER(count));
+    g_hash_table_insert(e2->related, GUINT_TO_POINTER(id1), GINT_TO_POINTER(count));
+  }
+  sqlite3_finalize(stmt);
+
+  _tag_index_build_keys();
+  _tag_index.loaded = TRUE;
+
+  dt_print(DT_DEBUG_SQL, "[tags] indexed %d tags\n", g_hash_table_size(_tag_index.by_id));
+}
+
+static void _tag_index_lock()
+{
+  dt_pthread_mutex_lock(&_tag_index.mutex);
+  if(!_tag_index.loaded) _tag_index_load();
+}
+
+static void _tag_index_flush(gboolean force)
+{
+  if(_tag_index.dirty_pairs->len == 0) return;
+  if(!force && _tag_index.dirty_pairs->len < DT_TAG_INDEX_FLUSH_PAIRS
+     && g_get_monotonic_time() - _tag_index.first_dirty < DT_TAG_INDEX_FLUSH_SECONDS * G_USEC_PER_SEC)
+    return;
+
+  sqlite3_stmt *replace_stmt, *delete_stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "INSERT OR REPLACE INTO tagxtag (id1, id2, count) VALUES (?1, ?2, ?3)",
+                              -1, &replace_stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "DELETE FROM tagxtag WHERE id1 = ?1 AND id2 = ?2", -1, &delete_stmt, NULL);
+
+  dt_database_start_transaction(darktable.db);
+  for(guint k = 0; k < _tag_index.dirty_pairs->len; k++)
+  {
+    const dt_tag_index_pair_t *pair = &g_array_index(_tag_index.dirty_pairs, dt_tag_index_pair_t, k);
+    dt_tag_index_entry_t *e1 = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(pair->id1));
+    // removed in the meantime?
+    if(!e1 || !g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(pair->id2))) continue;
+    const int count = GPOINTER_TO_INT(g_hash_table_lookup(e1->related, GUINT_TO_POINTER(pair->id2)));
+    sqlite3_stmt *stmt = count > 0 ? replace_stmt : delete_stmt;
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, pair->id1);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, pair->id2);
+    if(count > 0) DT_DEBUG_SQLITE3_BIND_INT(stmt, 3, count);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
   }
+  dt_database_release_transaction(darktable.db);
+  sqlite3_finalize(replace_stmt);
+  sqlite3_finalize(delete_stmt);
+
+  dt_print(DT_DEBUG_SQL, "[tags] wrote %d changed tag pairs\n", _tag_index.dirty_pairs->len);
+  g_array_set_size(_tag_index.dirty_pairs, 0);
+}
+
+static void _tag_index_count_pair(guint id1, guint id2, int delta)
+{
+  dt_tag_index_entry_t *e1 = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(id1));
+  dt_tag_index_entry_t *e2 = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(id2));
+  if(!e1 || !e2 || id1 == id2) return;
+
+  const int count = GPOINTER_TO_INT(g_hash_table_lookup(e1->related, GUINT_TO_POINTER(id2))) + delta;
+  if(count > 0)
+  {
+    g_hash_table_insert(e1->related, GUINT_TO_POINTER(id2), GINT_TO_POINTER(count));
+    g_hash_table_insert(e2->related, GUINT_TO_POINTER(id1), GINT_TO_POINTER(count));
+  }
+  else
+  {
+    g_hash_table_remove(e1->related, GUINT_TO_POINTER(id2));
+    g_hash_table_remove(e2->related, GUINT_TO_POINTER(id1));
+  }
+
+  if(_tag_index.dirty_pairs->len == 0) _tag_index.first_dirty = g_get_monotonic_time();
+  dt_tag_index_pair_t pair = { MIN(id1, id2), MAX(id1, id2) };
+  g_array_append_val(_tag_index.dirty_pairs, pair);
+}
+
+/* count tagid together with all other tags currently attached to imgid */
+static void _tag_index_count_image(guint tagid, gint imgid, int delta)
+{
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT tagid FROM tagged_images WHERE imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    _tag_index_count_pair(tagid, sqlite3_column_int(stmt, 0), delta);
+  sqlite3_finalize(stmt);
+}
+
+static gboolean _tag_is_attached(guint tagid, gint imgid)
+{
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT 1 FROM tagged_images WHERE imgid = ?1 AND tagid = ?2", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, tagid);
+  const gboolean attached = (sqlite3_step(stmt) == SQLITE_ROW);
   sqlite3_finalize(stmt);
+  return attached;
+}
+
+static void _tag_attach_image(guint tagid, gint imgid)
+{
+  // attaching a tag twice doesn't make it any more related to the others
+  if(_tag_is_attached(tagid, imgid)) return;
+
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "INSERT INTO tagged_images (imgid, tagid) VALUES (?1, ?2)",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, tagid);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  _tag_index_count_image(tagid, imgid, 1);
+}
+
+static void _tag_detach_image(guint tagid, gint imgid)
+{
+  if(!_tag_is_attached(tagid, imgid)) return;
+
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "DELETE FROM tagged_images WHERE tagid = ?1 AND imgid = ?2",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  _tag_index_count_image(tagid, imgid, -1);
+}
+
+/* attach and detach only write tagxtag once enough changed, this takes care of the rest */
+static gboolean _tag_index_flush_timeout(gpointer user_data)
+{
+  // don't wait for a bulk attach in the gui thread, there is another chance in a bit
+  if(dt_pthread_mutex_trylock(&_tag_index.mutex)) return TRUE;
+  if(_tag_index.loaded) _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+  return TRUE;
+}
+
+void dt_tag_init()
+{
+  memset(&_tag_index, 0, sizeof(_tag_index));
+  dt_pthread_mutex_init(&_tag_index.mutex, NULL);
+  // twice as often as the age limit, so nothing waits much longer than that
+  _tag_index.flush_timeout = g_timeout_add_seconds(DT_TAG_INDEX_FLUSH_SECONDS / 2, _tag_index_flush_timeout, NULL);
+}
+
+void dt_tag_cleanup()
+{
+  if(_tag_index.flush_timeout) g_source_remove(_tag_index.flush_timeout);
+  dt_pthread_mutex_lock(&_tag_index.mutex);
+  if(_tag_index.loaded)
+  {
+    _tag_index_flush(TRUE);
+    g_hash_table_destroy(_tag_index.by_name);
+    g_hash_table_destroy(_tag_index.by_id);
+    g_array_free(_tag_index.keys, TRUE);
+    g_array_free(_tag_index.dirty_pairs, TRUE);
+    _tag_index.loaded = FALSE;
+  }
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+  dt_pthread_mutex_destroy(&_tag_index.mutex);
+}
+
+/* the id of the tag called name, which gets created if needed. the caller has to hold the index lock. */
+static guint _tag_new(const char *name)
+{
+  sqlite3_stmt *stmt;
+
+  dt_tag_index_entry_t *entry = g_hash_table_lookup(_tag_index.by_name, name);
+  if(entry) return entry->id; // tagid already exists.
 
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "INSERT INTO tags (id, name) VALUES (null, ?1)", -1, &stmt, NULL);
@@ -51,16 +366,29 @@ gboolean dt_tag_new(const char *name,guint *tagid)
   sqlite3_step(stmt);
   sqlite3_finalize(stmt);
 
+  guint id = 0;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT id FROM tags WHERE name = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, name, -1, SQLITE_TRANSIENT);
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    id = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  if(id > 0) _tag_index_add(id, name);
+  return id;
+}
+
+gboolean dt_tag_new(const char *name,guint *tagid)
+{
+  if (!name || name[0] == '\0')
+    return FALSE; // no tagid name.
+
+  _tag_index_lock();
+  const guint id = _tag_new(name);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+
   if (tagid != NULL)
-  {
-    *tagid = 0;
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "SELECT id FROM tags WHERE name = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, name, -1, SQLITE_TRANSIENT);
-    if (sqlite3_step(stmt) == SQLITE_ROW)
-      *tagid = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-  }
+    *tagid = id;
 
   return TRUE;
 }
@@ -96,6 +424,10 @@ guint dt_tag_remove(const guint tagid, gboolean final)
     sqlite3_step(stmt);
     sqlite3_finalize(stmt);
 
+    _tag_index_lock();
+    _tag_index_remove(tagid);
+    dt_pthread_mutex_unlock(&_tag_index.mutex);
+
     /* raise signal of tags change to refresh keywords module */
     dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
   }
@@ -105,16 +437,12 @@ guint dt_tag_remove(const guint tagid, gboolean final)
 
 gchar *dt_tag_get_name(const guint tagid)
 {
-  int rt;
   char *name=NULL;
-  sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT name FROM tags WHERE id= ?1", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1,tagid);
-  rt = sqlite3_step(stmt);
-  if( rt== SQLITE_ROW )
-    name=g_strdup((const char *)sqlite3_column_text(stmt, 0));
-  sqlite3_finalize(stmt);
+  _tag_index_lock();
+  dt_tag_index_entry_t *entry = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(tagid));
+  if(entry)
+    name = g_strdup(entry->name);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 
   return name;
 }
@@ -142,67 +470,84 @@ void dt_tag_reorganize(const gchar *source, const gchar *dest)
 
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
 
+  // names changed behind the index' back, reread them
+  sqlite3_stmt *stmt;
+  _tag_index_lock();
+  g_hash_table_remove_all(_tag_index.by_name);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT id, name FROM tags", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    dt_tag_index_entry_t *entry = g_hash_table_lookup(_tag_index.by_id, GUINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    if(!entry || !name) continue;
+    g_free(entry->name);
+    g_free(entry->folded);
+    entry->name = g_strdup(name);
+    entry->folded = g_utf8_casefold(name, -1);
+    g_hash_table_insert(_tag_index.by_name, entry->name, entry);
+  }
+  sqlite3_finalize(stmt);
+  _tag_index.keys_dirty = TRUE;
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+
   /* raise signal of tags change to refresh keywords module */
   //dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
 }
 
 gboolean dt_tag_exists(const char *name,guint *tagid)
 {
-  int rt;
-  sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT id FROM tags WHERE name = ?1", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 1, name, -1, SQLITE_TRANSIENT);
-  rt = sqlite3_step(stmt);
+  _tag_index_lock();
+  dt_tag_index_entry_t *entry = name ? g_hash_table_lookup(_tag_index.by_name, name) : NULL;
+  const guint id = entry ? entry->id : -1;
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+
+  if( tagid != NULL)
+    *tagid = id;
+  return entry != NULL;
+}
 
-  if(rt == SQLITE_ROW)
+/* attach or detach a tag to imgid, or the selected images when imgid < 1. the caller has to hold the index lock. */
+static void _tag_attach(guint tagid, gint imgid, gboolean attach)
+{
+  if(imgid > 0)
   {
-    if( tagid != NULL)
-      *tagid = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
-    return  TRUE;
+    if(attach) _tag_attach_image(tagid, imgid);
+    else _tag_detach_image(tagid, imgid);
+    return;
   }
 
-  *tagid = -1;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT imgid FROM selected_images", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    if(attach) _tag_attach_image(tagid, sqlite3_column_int(stmt, 0));
+    else _tag_detach_image(tagid, sqlite3_column_int(stmt, 0));
+  }
   sqlite3_finalize(stmt);
-  return FALSE;
 }
 
-//FIXME: shall we increment count in tagxtag if the image was already tagged?
 void dt_tag_attach(guint tagid,gint imgid)
 {
-  sqlite3_stmt *stmt;
-  if(imgid > 0)
-  {
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO tagged_images (imgid, tagid) VALUES (?1, ?2)",
-                                -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-  }
-  else
-  {
-    // insert into tagged_images if not there already.
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "INSERT OR REPLACE INTO tagged_images SELECT imgid, ?1 "
-                                "FROM selected_images", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-  }
+  _tag_index_lock();
+  // one transaction for all of the selected images
+  if(imgid < 1) dt_database_start_transaction(darktable.db);
+  _tag_attach(tagid, imgid, TRUE);
+  if(imgid < 1) dt_database_release_transaction(darktable.db);
+  _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 }
 
 void dt_tag_attach_list(GList *tags,gint imgid)
 {
-  GList *child=NULL;
-  if( (child=g_list_first(tags))!=NULL )
-    do
-    {
-      dt_tag_attach(GPOINTER_TO_INT(child->data), imgid);
-    }
-    while( (child=g_list_next(child)) !=NULL);
+  if(!tags) return;
+  _tag_index_lock();
+  dt_database_start_transaction(darktable.db);
+  for(GList *child = g_list_first(tags); child; child = g_list_next(child))
+    _tag_attach(GPOINTER_TO_INT(child->data), imgid, TRUE);
+  dt_database_release_transaction(darktable.db);
+  _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 }
 
 void dt_tag_attach_string_list(const gchar *tags, gint imgid)
@@ -210,6 +555,8 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid)
   gchar **tokens = g_strsplit(tags, ",", 0);
   if(tokens)
   {
+    _tag_index_lock();
+    dt_database_start_transaction(darktable.db);
     gchar **entry = tokens;
     while(*entry)
     {
@@ -221,50 +568,76 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid)
       if(*e)
       {
         // add the tag to the image
-        guint tagid = 0;
-        dt_tag_new(e,&tagid);
-        dt_tag_attach(tagid, imgid);
+        const guint tagid = _tag_new(e);
+        if(tagid > 0) _tag_attach(tagid, imgid, TRUE);
       }
       entry++;
     }
+    dt_database_release_transaction(darktable.db);
+    _tag_index_flush(FALSE);
+    dt_pthread_mutex_unlock(&_tag_index.mutex);
   }
   g_strfreev(tokens);
 }
 
 void dt_tag_detach(guint tagid,gint imgid)
 {
+  _tag_index_lock();
+  // one transaction for all of the selected images
+  if(imgid < 1) dt_database_start_transaction(darktable.db);
+  _tag_attach(tagid, imgid, FALSE);
+  if(imgid < 1) dt_database_release_transaction(darktable.db);
+  _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
+}
+
+void dt_tag_detach_all(gint imgid)
+{
+  GList *tags = NULL;
   sqlite3_stmt *stmt;
-  if(imgid > 0)
-  {
-    // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "DELETE FROM tagged_images WHERE tagid = ?1 AND imgid = ?2",
-                                -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-  }
-  else
-  {
-    // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "delete from tagged_images where tagid = ?1 and imgid in "
-                                "(select imgid from selected_images)", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-  }
+  _tag_index_lock();
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT tagid FROM tagged_images WHERE imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    tags = g_list_prepend(tags, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  sqlite3_finalize(stmt);
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "DELETE FROM tagged_images WHERE imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  for(GList *t1 = tags; t1; t1 = g_list_next(t1))
+    for(GList *t2 = g_list_next(t1); t2; t2 = g_list_next(t2))
+      _tag_index_count_pair(GPOINTER_TO_INT(t1->data), GPOINTER_TO_INT(t2->data), -1);
+  g_list_free(tags);
+
+  _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 }
 
 void dt_tag_detach_by_string(const char *name, gint imgid)
 {
   char query[2048]= {0};
+  sqlite3_stmt *stmt;
   g_snprintf(query, sizeof(query),
-             "DELETE FROM tagged_images WHERE tagid IN (SELECT id FROM "
-             "tags WHERE name LIKE '%s') AND imgid = %d;", name, imgid);
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query,
-                        NULL, NULL, NULL);
+             "SELECT tagid FROM tagged_images WHERE tagid IN (SELECT id FROM "
+             "tags WHERE name LIKE '%s') AND imgid = %d", name, imgid);
+  _tag_index_lock();
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+  GList *tags = NULL;
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    tags = g_list_prepend(tags, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  sqlite3_finalize(stmt);
+  dt_database_start_transaction(darktable.db);
+  for(GList *t = tags; t; t = g_list_next(t))
+    _tag_detach_image(GPOINTER_TO_INT(t->data), imgid);
+  dt_database_release_transaction(darktable.db);
+  g_list_free(tags);
+  _tag_index_flush(FALSE);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 }
 
 
@@ -383,109 +756,145 @@ gchar *dt_tag_get_hierarchical(gint imgid, const gchar *separator)
 }
 
 /*
- * dt_tag_get_suggestions() takes a string (keyword) and searches the
- * tagxtags table for possibly-related tags. The list we construct at
- * the end of the function is made up as follows:
- *
- * * Tags which appear as tagxtag.id2, where (keyword's name = tagxtag.id1)
- *   are listed first, ordered by count of times seen already.
- * * Tags which appear as tagxtag.id1, where (keyword's name = tagxtag.id2)
- *   are listed second, ordered as before.
- *
- * We do not suggest tags which have not yet been matched up in tagxtag,
- * because it is up to the user to add new tags to the list and thereby
- * make the association.
+ * dt_tag_get_suggestions() takes a string (keyword) and looks up all
+ * tags having a hierarchy level starting with it in the in-memory
+ * index. The list we construct is made up as follows:
  *
- * Expressing these as separate queries avoids making the sqlite3 engine
- * do a large number of operations and thus makes the user experience
- * snappy.
+ * * The matching tags themselves are listed first.
+ * * Tags which were attached to the same images as any of the matching
+ *   tags follow, ordered by count of times seen together.
  *
- * SELECT T.id FROM tags T WHERE T.name LIKE '?1';  --> into temp table
- * SELECT TXT.id2 FROM tagxtag TXT WHERE TXT.id1 IN (temp table)
- *   AND TXT.count > 0 ORDER BY TXT.count DESC;
- * SELECT TXT.id1 FROM tagxtag TXT WHERE TXT.id2 IN (temp table)
- *   AND TXT.count > 0 ORDER BY TXT.count DESC;
- *
- * SELECT DISTINCT(T.name) FROM tags T JOIN memoryquery MQ on MQ.id = T.id;
+ * We do not suggest tags which have never been seen together with a
+ * matching one, because it is up to the user to add new tags to the
+ * list and thereby make the association.
  *
+ * Nothing here touches the database, so it is fine to call this on
+ * every keystroke.
  */
-uint32_t dt_tag_get_suggestions(const gchar *keyword, GList **result)
+typedef struct dt_tag_suggestion_t
 {
-  sqlite3_stmt *stmt;
-  char query[1024];
-  /*
-   * Earlier versions of this function used a large collation of selects
-   * and joins, resulting in multi-*second* timings for sqlite3_exec().
-   *
-   * Breaking the query into several smaller ones allows the sqlite3
-   * execution engine to work more effectively, which is very important
-   * for interactive response since we call this function several times
-   * in quick succession (on every keystroke).
-   */
+  dt_tag_index_entry_t *entry;
+  gint64 score;
+}
+dt_tag_suggestion_t;
+
+static gint _tag_suggestion_cmp(gconstpointer a, gconstpointer b)
+{
+  const dt_tag_suggestion_t *sa = (const dt_tag_suggestion_t *)a;
+  const dt_tag_suggestion_t *sb = (const dt_tag_suggestion_t *)b;
+  if(sa->score != sb->score) return sa->score > sb->score ? -1 : 1;
+  return g_strcmp0(sa->entry->name, sb->entry->name);
+}
 
+uint32_t dt_tag_get_suggestions(const gchar *keyword, GList **result)
+{
   /* Quick sanity check - is keyword empty? If so .. return 0 */
   if (keyword == 0)
     return 0;
 
-  /* SELECT T.id FROM tags T WHERE T.name LIKE '%%%s%%';  --> into temp table */
-  memset(query, 0, sizeof(query));
-  snprintf(query, sizeof(query),
-           "INSERT INTO memory.tagq (id) SELECT id FROM tags T WHERE "
-           "T.name LIKE '%%%s%%' ", keyword);
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query,
-                        NULL, NULL, NULL);
-
-  /*
-   * SELECT TXT.id2 FROM tagxtag TXT WHERE TXT.id1 IN (temp table)
-   *   AND TXT.count > 0 ORDER BY TXT.count DESC;
-   */
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
-                        "INSERT INTO memory.taglist (id, count) "
-                        "SELECT DISTINCT(TXT.id2), TXT.count FROM tagxtag TXT "
-                        "WHERE TXT.count > 0 "
-                        " AND TXT.id1 IN (SELECT id FROM memory.tagq) "
-                        "ORDER BY TXT.count DESC",
-                        NULL, NULL, NULL);
-
-  /*
-   * SELECT TXT.id1 FROM tagxtag TXT WHERE TXT.id2 IN (temp table)
-   *   AND TXT.count > 0 ORDER BY TXT.count DESC;
-   */
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
-                        "INSERT OR REPLACE INTO memory.taglist (id, count) "
-                        "SELECT DISTINCT(TXT.id1), TXT.count FROM tagxtag TXT "
-                        "WHERE TXT.count > 0 "
-                        " AND TXT.id2 IN (SELECT id FROM memory.tagq) "
-                        "ORDER BY TXT.count DESC",
-                        NULL, NULL, NULL);
-
-  /* Now put all the bits together */
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                              "SELECT T.name, T.id FROM tags T "
-                              "JOIN memory.taglist MT ON MT.id = T.id "
-                              "WHERE T.id IN (SELECT DISTINCT(MT.id) FROM memory.taglist MT) "
-                              "  AND T.name NOT LIKE 'darktable|%%' "
-                              "ORDER BY MT.count DESC",
-                              -1, &stmt, NULL);
+  // matches count more than anything seen together with them
+  const gint64 match_score = 1000000;
+
+  gchar *folded = g_utf8_casefold(keyword, -1);
+  GHashTable *scores = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+  _tag_index_lock();
+  if(_tag_index.keys_dirty) _tag_index_build_keys();
+
+  // lower bound of the keyword in the sorted keys
+  const dt_tag_index_key_t *keys = (const dt_tag_index_key_t *)_tag_index.keys->data;
+  guint lo = 0, hi = _tag_index.keys->len;
+  while(lo < hi)
+  {
+    const guint mid = (lo + hi) / 2;
+    if(strcmp(keys[mid].key, folded) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  for(guint k = lo; k < _tag_index.keys->len && g_str_has_prefix(keys[k].key, folded); k++)
+  {
+    dt_tag_index_entry_t *entry = keys[k].entry;
+    dt_tag_suggestion_t *s = g_hash_table_lookup(scores, entry);
+    if(!s)
+    {
+      s = g_malloc0(sizeof(dt_tag_suggestion_t));
+      s->entry = entry;
+      g_hash_table_insert(scores, entry, s);
+    }
+    else if(s->score >= match_score) continue; // matched on more than one level
+    s->score += match_score;
+
+    GHashTableIter it;
+    gpointer other, count;
+    g_hash_table_iter_init(&it, entry->related);
+    while(g_hash_table_iter_next(&it, &other, &count))
+    {
+      dt_tag_index_entry_t *o = g_hash_table_lookup(_tag_index.by_id, other);
+      if(!o || g_str_has_prefix(o->name, "darktable|")) continue;
+      dt_tag_suggestion_t *so = g_hash_table_lookup(scores, o);
+      if(!so)
+      {
+        so = g_malloc0(sizeof(dt_tag_suggestion_t));
+        so->entry = o;
+        g_hash_table_insert(scores, o, so);
+      }
+      so->score += GPOINTER_TO_INT(count);
+    }
+  }
 
   /* ... and create the result list to send upwards */
+  GList *suggestions = g_list_sort(g_hash_table_get_values(scores), _tag_suggestion_cmp);
   uint32_t count=0;
-  dt_tag_t *t;
-  while(sqlite3_step(stmt) == SQLITE_ROW)
+  for(GList *iter = suggestions; iter; iter = g_list_next(iter))
   {
-    t = g_malloc(sizeof(dt_tag_t));
-    t->tag = g_strdup((char *)sqlite3_column_text(stmt, 0));
-    t->id = sqlite3_column_int(stmt, 1);
-    *result = g_list_append((*result),t);
+    const dt_tag_suggestion_t *s = (const dt_tag_suggestion_t *)iter->data;
+    dt_tag_t *t = g_malloc(sizeof(dt_tag_t));
+    t->tag = g_strdup(s->entry->name);
+    t->id = s->entry->id;
+    *result = g_list_prepend((*result),t);
     count++;
   }
+  *result = g_list_reverse(*result);
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 
-  sqlite3_finalize(stmt);
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
-                        "DELETE from memory.taglist", NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
-                        "DELETE from memory.tagq", NULL, NULL, NULL);
+  g_list_free(suggestions);
+  g_hash_table_destroy(scores);
+  g_free(folded);
+
+  return count;
+}
+
+static gint _tag_entry_cmp(gconstpointer a, gconstpointer b)
+{
+  const dt_tag_index_entry_t *ea = *(const dt_tag_index_entry_t **)a;
+  const dt_tag_index_entry_t *eb = *(const dt_tag_index_entry_t **)b;
+  const int cmp = strcmp(ea->folded, eb->folded);
+  return cmp ? cmp : strcmp(ea->name, eb->name);
+}
+
+uint32_t dt_tag_get_all(GList **result)
+{
+  _tag_index_lock();
+  GPtrArray *entries = g_ptr_array_sized_new(g_hash_table_size(_tag_index.by_id));
+  GHashTableIter it;
+  gpointer value;
+  g_hash_table_iter_init(&it, _tag_index.by_id);
+  while(g_hash_table_iter_next(&it, NULL, &value)) g_ptr_array_add(entries, value);
+  g_ptr_array_sort(entries, _tag_entry_cmp);
+
+  // prepending backwards keeps the order without walking the list
+  for(gint k = entries->len - 1; k >= 0; k--)
+  {
+    const dt_tag_index_entry_t *entry = (const dt_tag_index_entry_t *)g_ptr_array_index(entries, k);
+    dt_tag_t *t = g_malloc(sizeof(dt_tag_t));
+    t->tag = g_strdup(entry->name);
+    t->id = entry->id;
+    *result = g_list_prepend(*result, t);
+  }
+  dt_pthread_mutex_unlock(&_tag_index.mutex);
 
+  const uint32_t count = entries->len;
+  g_ptr_array_free(entries, TRUE);
   return count;
 }
 
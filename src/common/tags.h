@@ -28,6 +28,12 @@ typedef struct dt_tag_t
 }
 dt_tag_t;
 
+/** sets up the in-memory tag index, it gets filled on first use. */
+void dt_tag_init();
+
+/** writes pending tag relations to the db and frees the tag index. */
+void dt_tag_cleanup();
+
 /** creates a new tag, returns tagid \param[in] name the tag name. \param[in] tagid a pointer to tagid of new tag, this can be NULL \return false if failed to create a tag and indicates that tagid is invalid to use. \note If tag already exists the existing tag id is returned. */
 gboolean dt_tag_new(const char *name,guint *tagid);
 
@@ -55,6 +61,9 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid);
 /** detach tag from images. \param[in] tagid if of tag to deattach. \param[in] imgid the image id to attach tag from, if < 0 selected images are used. */
 void dt_tag_detach(guint tagid,gint imgid);
 
+/** detach all tags from an image. use this instead of deleting from tagged_images, so the tag relations stay in sync. */
+void dt_tag_detach_all(gint imgid);
+
 /** detach tags from images that matches name, it is valid to use % to match tag */
 void dt_tag_detach_by_string(const char *name, gint imgid);
 
@@ -70,6 +79,8 @@ gchar *dt_tag_get_hierarchical(gint imgid, const gchar *separator);
 /** retrieves a list of suggested tags matching keyword. \param[in] keyword the keyword to search \param[out] result a pointer to list populated with result. \return the count \note the limit of result is decided by conf value "xxx" */
 uint32_t dt_tag_get_suggestions(const gchar *keyword, GList **result);
 
+/** retrieves all tags from the in-memory index, sorted case insensitively by name. \param[out] result a list of dt_tag_t. \return the count */
+uint32_t dt_tag_get_all(GList **result);
 /** retrieves a list of recent tags used. \param[out] result a pointer to list populated with result. \return the count \note the limit of result is decided by conf value "xxx" */
 uint32_t dt_tag_get_recent_used(GList **result);
 
@@ -0,0 +1,237 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/trace.h"
+#include "common/darktable.h"
+#include "common/dtpthread.h"
+#include "common/file_location.h"
+#include "control/control.h"
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// per thread, the oldest events get overwritten once it's full. 64 bytes each.
+#define DT_TRACE_BUFFER_SIZE (1<<15)
+
+typedef struct dt_trace_event_t
+{
+  double start, end;
+  int32_t category;
+  char name[44];
+}
+dt_trace_event_t;
+
+typedef struct dt_trace_buffer_t
+{
+  int32_t tid;
+  char thread_name[64];
+  // only ever written by the owning thread
+  uint32_t head;
+  dt_trace_event_t events[DT_TRACE_BUFFER_SIZE];
+}
+dt_trace_buffer_t;
+
+volatile int dt_trace_active = 0;
+
+static const char *_trace_category_names[DT_TRACE_NUM] = { "job", "pipe", "opencl", "mipmap", "lock" };
+
+// not a dt_pthread_mutex_t, those are traced themselves
+static pthread_mutex_t _trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GList *_trace_buffers = NULL;
+static int32_t _trace_next_tid = 0;
+static double _trace_start_time = 0.0;
+static __thread dt_trace_buffer_t *_trace_buffer = NULL;
+
+double dt_trace_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static dt_trace_buffer_t *_trace_get_buffer()
+{
+  if(_trace_buffer) return _trace_buffer;
+  dt_trace_buffer_t *b = (dt_trace_buffer_t *)calloc(1, sizeof(dt_trace_buffer_t));
+  if(!b) return NULL;
+  pthread_mutex_lock(&_trace_mutex);
+  b->tid = _trace_next_tid++;
+  snprintf(b->thread_name, sizeof(b->thread_name), "thread %d", b->tid);
+  _trace_buffers = g_list_append(_trace_buffers, b);
+  pthread_mutex_unlock(&_trace_mutex);
+  _trace_buffer = b;
+  return b;
+}
+
+void dt_trace_set_thread_name(const char *name, ...)
+{
+  dt_trace_buffer_t *b = _trace_get_buffer();
+  if(!b) return;
+  va_list ap;
+  va_start(ap, name);
+  vsnprintf(b->thread_name, sizeof(b->thread_name), name, ap);
+  va_end(ap);
+}
+
+static void _trace_record(dt_trace_category_t category, double start, double end, const char *name, va_list ap)
+{
+  if(!dt_trace_active) return;
+  dt_trace_buffer_t *b = _trace_get_buffer();
+  if(!b) return;
+  dt_trace_event_t *ev = b->events + (b->head & (DT_TRACE_BUFFER_SIZE - 1));
+  ev->start = start;
+  ev->end = end;
+  ev->category = category;
+  vsnprintf(ev->name, sizeof(ev->name), name, ap);
+  b->head++;
+}
+
+void dt_trace_span(dt_trace_category_t category, double start, const char *name, ...)
+{
+  va_list ap;
+  va_start(ap, name);
+  _trace_record(category, start, dt_trace_now(), name, ap);
+  va_end(ap);
+}
+
+void dt_trace_lock_wait(double start, const char *name, const char *file, const int line, const char *function)
+{
+  const char *base = strrchr(file, '/');
+  dt_trace_span(DT_TRACE_LOCK, start, "%s in %s (%s:%d)", name, function, base ? base + 1 : file, line);
+}
+
+static void _trace_write_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for(; *s; s++)
+  {
+    if(*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+    else fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+void dt_trace_start()
+{
+  pthread_mutex_lock(&_trace_mutex);
+  for(GList *l = _trace_buffers; l; l = g_list_next(l)) ((dt_trace_buffer_t *)l->data)->head = 0;
+  _trace_start_time = dt_trace_now();
+  pthread_mutex_unlock(&_trace_mutex);
+  dt_trace_active = 1;
+  __sync_fetch_and_or(&dt_pthread_instrument, DT_PTHREAD_INSTRUMENT_TRACE);
+}
+
+int dt_trace_stop(const char *filename)
+{
+  if(!dt_trace_active) return 1;
+  __sync_fetch_and_and(&dt_pthread_instrument, ~DT_PTHREAD_INSTRUMENT_TRACE);
+  dt_trace_active = 0;
+
+  char path[PATH_MAX] = { 0 };
+  if(filename)
+    g_strlcpy(path, filename, sizeof(path));
+  else
+  {
+    char cachedir[PATH_MAX] = { 0 }, stamp[64];
+    const time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+    snprintf(path, sizeof(path), "%s/trace-%s.json", cachedir, stamp);
+  }
+
+  FILE *f = fopen(path, "wb");
+  if(!f)
+  {
+    fprintf(stderr, "[trace] could not write `%s'\n", path);
+    return 1;
+  }
+
+  // threads that were in the middle of recording an event when we stopped might still finish it. that only
+  // ever touches the newest slot, the time stamps of which we don't trust anyways.
+  pthread_mutex_lock(&_trace_mutex);
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  int first = 1;
+  size_t events = 0;
+  for(GList *l = _trace_buffers; l; l = g_list_next(l))
+  {
+    const dt_trace_buffer_t *b = (const dt_trace_buffer_t *)l->data;
+    const uint32_t head = b->head;
+    const uint32_t n = MIN(head, DT_TRACE_BUFFER_SIZE);
+    if(n == 0) continue;
+    fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n",
+            b->tid);
+    _trace_write_string(f, b->thread_name);
+    fprintf(f, "}}");
+    first = 0;
+    for(uint32_t k = head - n; k != head; k++)
+    {
+      const dt_trace_event_t *ev = b->events + (k & (DT_TRACE_BUFFER_SIZE - 1));
+      if(ev->start < _trace_start_time) continue;
+      fprintf(f, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"cat\":\"%s\",\"ts\":%.1f,\"dur\":%.1f,\"name\":", b->tid,
+              _trace_category_names[ev->category], 1e6 * (ev->start - _trace_start_time),
+              1e6 * MAX(0.0, ev->end - ev->start));
+      _trace_write_string(f, ev->name);
+      fputc('}', f);
+      events++;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  pthread_mutex_unlock(&_trace_mutex);
+  fclose(f);
+
+  dt_print(DT_DEBUG_PERF, "[trace] wrote %zu events to `%s'\n", events, path);
+  return 0;
+}
+
+void dt_trace_toggle()
+{
+  if(!dt_trace_active)
+  {
+    dt_trace_start();
+    dt_control_log(_("recording timeline trace"));
+  }
+  else if(dt_trace_stop(NULL))
+    dt_control_log(_("could not write timeline trace"));
+  else
+    dt_control_log(_("timeline trace written to the cache directory"));
+}
+
+void dt_trace_init()
+{
+  dt_trace_set_thread_name("gui");
+  if(darktable.unmuted & DT_DEBUG_TRACE) dt_trace_start();
+}
+
+void dt_trace_cleanup()
+{
+  if(dt_trace_active) dt_trace_stop(NULL);
+  pthread_mutex_lock(&_trace_mutex);
+  g_list_free_full(_trace_buffers, free);
+  _trace_buffers = NULL;
+  pthread_mutex_unlock(&_trace_mutex);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,94 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_TRACE_H
+#define DT_TRACE_H
+
+/** timeline of what all threads did: jobs, pixelpipe modules, mipmap loads and lock waits.
+ *  every thread records into its own ring buffer, so recording only costs a clock read and a few stores,
+ *  and nothing at all while the trace is off. when stopped, everything recorded so far is written as
+ *  chrome trace event json, to be looked at in chrome://tracing or ui.perfetto.dev.
+ *  start with -d trace, toggle at runtime with the global "toggle timeline trace" shortcut. */
+
+typedef enum dt_trace_category_t
+{
+  DT_TRACE_JOB = 0,
+  DT_TRACE_PIPE,
+  DT_TRACE_OPENCL,
+  DT_TRACE_MIPMAP,
+  DT_TRACE_LOCK,
+  DT_TRACE_NUM
+} dt_trace_category_t;
+
+#ifndef DT_UNIT_TEST
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** non-zero while recording. */
+extern volatile int dt_trace_active;
+
+void dt_trace_init();
+/** writes the trace if still recording. */
+void dt_trace_cleanup();
+/** start recording, dropping what has been recorded before. */
+void dt_trace_start();
+/** stop recording and write the trace to filename, or to a time stamped file in the cache dir if NULL.
+ *  returns non-zero on failure. */
+int dt_trace_stop(const char *filename);
+/** start or stop, telling the user where the trace went. */
+void dt_trace_toggle();
+
+/** monotonic time in seconds. */
+double dt_trace_now();
+/** name the calling thread in the trace. */
+void dt_trace_set_thread_name(const char *name, ...) __attribute__((format(printf, 1, 2)));
+/** record a span from start till now, name is printf style. */
+void dt_trace_span(dt_trace_category_t category, double start, const char *name, ...) __attribute__((format(printf, 3, 4)));
+/** record a wait for a contended mutex, used by common/dtpthread.c. */
+void dt_trace_lock_wait(double start, const char *name, const char *file, const int line, const char *function);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** returns the start time for dt_trace_end(), or 0 if not recording. */
+static inline double dt_trace_begin()
+{
+  return dt_trace_active ? dt_trace_now() : 0.0;
+}
+
+/** record the span started by dt_trace_begin(), if it was. */
+#define dt_trace_end(category, start, ...) \
+  do { if((start) > 0.0) dt_trace_span(category, start, __VA_ARGS__); } while(0)
+
+#else
+
+// the stand alone tests don't link the tracer
+#define dt_trace_begin() 0.0
+#define dt_trace_end(category, start, ...) do { (void)(start); } while(0)
+#define dt_trace_set_thread_name(...)
+
+#endif
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -213,8 +213,15 @@ typedef struct dt_control_t
   int32_t num_threads;
   pthread_t *thread,kick_on_workers_thread;
 
-  GList *queues[DT_JOB_QUEUE_MAX];
-  size_t queue_length[DT_JOB_QUEUE_MAX];
+  // per worker job queues, see jobs.c
+  struct dt_control_worker_t *workers;
+  uint32_t next_worker;
+  // queued system foreground jobs, to find duplicates. protected by queue_mutex
+  GHashTable *fg_jobs;
+  size_t fg_length;
+  uint64_t fg_seq;
+  // links between dependent jobs, see dt_control_job_add_dependency()
+  dt_pthread_mutex_t deps_mutex;
 
   dt_job_t *job_res[DT_CTL_WORKER_RESERVED];
   uint8_t new_res[DT_CTL_WORKER_RESERVED];
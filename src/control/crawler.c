@@ -21,6 +21,7 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <sqlite3.h>
+#include <sys/stat.h>
 
 #include "crawler.h"
 #include "common/darktable.h"
@@ -28,6 +29,8 @@
 #include "common/history.h"
 #include "common/image.h"
 #include "control/conf.h"
+#include "control/control.h"
+#include "control/jobs.h"
 #include "gui/gtk.h"
 
 
@@ -51,125 +54,207 @@ typedef struct dt_control_crawler_result_t
   char *image_path, *xmp_path;
 } dt_control_crawler_result_t;
 
+// one image as seen by the crawler. filled from the db, then the file system part is done in parallel
+typedef struct dt_control_crawler_entry_t
+{
+  int id, version, flags, new_flags;
+  time_t timestamp;
+  gboolean has_seen, has_xmp;
+  sqlite3_int64 seen_mtime, seen_size;
+  sqlite3_int64 mtime, size;
+  gchar *image_path;
+  gchar xmp_path[PATH_MAX];
+} dt_control_crawler_entry_t;
+
+// stat the xmp and look for .txt/.wav files. only touches the entry, so it's safe to run in parallel
+static void _crawler_check_files(dt_control_crawler_entry_t *e, const gboolean look_for_xmp)
+{
+  e->new_flags = e->flags;
+  e->has_xmp = FALSE;
+
+  // no need to look for xmp files if none get written anyway.
+  if(look_for_xmp)
+  {
+    // construct the xmp filename for this image
+    g_strlcpy(e->xmp_path, e->image_path, sizeof(e->xmp_path));
+    dt_image_path_append_version_no_db(e->version, e->xmp_path, sizeof(e->xmp_path));
+    if(g_strlcat(e->xmp_path, ".xmp", sizeof(e->xmp_path)) < sizeof(e->xmp_path))
+    {
+      struct stat statbuf;
+      if(stat(e->xmp_path, &statbuf) == 0) // TODO: shall we report missing ones?
+      {
+        e->has_xmp = TRUE;
+        e->mtime = statbuf.st_mtime;
+        e->size = statbuf.st_size;
+      }
+    }
+  }
+
+  // check if the image has associated files (.txt, .wav)
+  const char *c = e->image_path + strlen(e->image_path);
+  while((c > e->image_path) && (*c != '.')) c--;
+  const size_t len = c - e->image_path + 1;
+
+  char *extra_path = g_strndup(e->image_path, len + 3);
+
+  extra_path[len]   = 't';
+  extra_path[len+1] = 'x';
+  extra_path[len+2] = 't';
+  gboolean has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+
+  if(!has_txt)
+  {
+    extra_path[len]   = 'T';
+    extra_path[len+1] = 'X';
+    extra_path[len+2] = 'T';
+    has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+  }
+
+  extra_path[len]   = 'w';
+  extra_path[len+1] = 'a';
+  extra_path[len+2] = 'v';
+  gboolean has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+
+  if(!has_wav)
+  {
+    extra_path[len]   = 'W';
+    extra_path[len+1] = 'A';
+    extra_path[len+2] = 'V';
+    has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+  }
+
+  // TODO: decide if we want to remove the flag for images that lost their extra file. currently we do (the else cases)
+  if(has_txt) e->new_flags |= DT_IMAGE_HAS_TXT;
+  else        e->new_flags &= ~DT_IMAGE_HAS_TXT;
+  if(has_wav) e->new_flags |= DT_IMAGE_HAS_WAV;
+  else        e->new_flags &= ~DT_IMAGE_HAS_WAV;
+
+  g_free(extra_path);
+}
 
 GList * dt_control_crawler_run()
 {
-  sqlite3_stmt *stmt, *inner_stmt;
+  sqlite3_stmt *stmt, *flags_stmt, *seen_stmt;
   GList *result = NULL;
   gboolean look_for_xmp = dt_conf_get_bool("write_sidecar_files");
 
-  sqlite3_prepare_v2(dt_database_get(darktable.db),
-                     "SELECT images.id, write_timestamp, version, folder || '/' || filename, flags "
+  // fetch everything up front, ordered by directory so the parallel stat()s below hit the file system in a
+  // friendly order.
+  GArray *entries = g_array_new(FALSE, TRUE, sizeof(dt_control_crawler_entry_t));
+  sqlite3_prepare_v2(dt_database_get_reader(darktable.db),
+                     "SELECT images.id, write_timestamp, version, folder || '/' || filename, flags, xmp_mtime, xmp_size "
                      "FROM images, film_rolls WHERE images.film_id = film_rolls.id "
-                     "ORDER BY film_rolls.id, filename", -1, &stmt, NULL);
-  sqlite3_prepare_v2(dt_database_get(darktable.db), "UPDATE images SET flags = ?1 WHERE id = ?2", -1, &inner_stmt, NULL);
+                     "ORDER BY folder, filename", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    dt_control_crawler_entry_t e = { 0 };
+    e.id = sqlite3_column_int(stmt, 0);
+    e.timestamp = sqlite3_column_int(stmt, 1);
+    e.version = sqlite3_column_int(stmt, 2);
+    e.image_path = g_strdup((const gchar *)sqlite3_column_text(stmt, 3));
+    e.flags = sqlite3_column_int(stmt, 4);
+    e.has_seen = sqlite3_column_type(stmt, 5) != SQLITE_NULL && sqlite3_column_type(stmt, 6) != SQLITE_NULL;
+    e.seen_mtime = sqlite3_column_int64(stmt, 5);
+    e.seen_size = sqlite3_column_int64(stmt, 6);
+    g_array_append_val(entries, e);
+  }
+  sqlite3_finalize(stmt);
 
-  // let's wrap this into a transaction, it might make it a little faster.
-  sqlite3_exec(dt_database_get(darktable.db), "BEGIN TRANSACTION", NULL, NULL, NULL);
+  dt_control_crawler_entry_t *e = (dt_control_crawler_entry_t *)entries->data;
+  int num_entries = entries->len;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(dynamic, 32) shared(e, look_for_xmp, num_entries)
+#endif
+  for(int k = 0; k < num_entries; k++) _crawler_check_files(e + k, look_for_xmp);
 
-  while(sqlite3_step(stmt) == SQLITE_ROW)
+  sqlite3_prepare_v2(dt_database_get(darktable.db), "UPDATE images SET flags = ?1 WHERE id = ?2", -1, &flags_stmt, NULL);
+  sqlite3_prepare_v2(dt_database_get(darktable.db), "UPDATE images SET xmp_mtime = ?1, xmp_size = ?2 WHERE id = ?3", -1,
+                     &seen_stmt, NULL);
+
+  // let's wrap this into a transaction, it might make it a little faster. we are not alone on this handle any
+  // longer, so take turns with the other transactions.
+  dt_database_start_transaction(darktable.db);
+
+  for(int k = 0; k < num_entries; k++)
   {
-    const int id = sqlite3_column_int(stmt, 0);
-    const time_t timestamp = sqlite3_column_int(stmt, 1);
-    const int version = sqlite3_column_int(stmt, 2);
-    gchar* image_path = (gchar*)sqlite3_column_text(stmt, 3);
-    int flags = sqlite3_column_int(stmt, 4);
-
-    // no need to look for xmp files if none get written anyway.
-    if(look_for_xmp)
+    if(e[k].has_xmp)
     {
-      // construct the xmp filename for this image
-      gchar xmp_path[PATH_MAX];
-      g_strlcpy(xmp_path, image_path, sizeof(xmp_path));
-      dt_image_path_append_version_no_db(version, xmp_path, sizeof(xmp_path));
-      size_t len = strlen(xmp_path);
-      if(len + 4 >= PATH_MAX) continue;
-      xmp_path[len++] = '.';
-      xmp_path[len++] = 'x';
-      xmp_path[len++] = 'm';
-      xmp_path[len++] = 'p';
-      xmp_path[len] = '\0';
-
-      struct stat statbuf;
-      if(stat(xmp_path, &statbuf) == -1) continue; // TODO: shall we report these?
+      gboolean changed;
+      if(e[k].has_seen)
+      {
+        // we know what the file looked like when we last wrote or read it, anything else is a real change
+        changed = (e[k].mtime != e[k].seen_mtime || e[k].size != e[k].seen_size);
+      }
+      else
+      {
+        // first time we see this one, all we have is the timestamp of our last write
+        // FIXME: allow for a few seconds difference?
+        changed = (e[k].timestamp < e[k].mtime);
+        // older timestamps are the case for all images after the db upgrade. better not report these, but
+        // take them as reference for the next run.
+        if(!changed)
+        {
+          sqlite3_bind_int64(seen_stmt, 1, e[k].mtime);
+          sqlite3_bind_int64(seen_stmt, 2, e[k].size);
+          sqlite3_bind_int(seen_stmt, 3, e[k].id);
+          sqlite3_step(seen_stmt);
+          sqlite3_reset(seen_stmt);
+          sqlite3_clear_bindings(seen_stmt);
+        }
+      }
 
-      // step 1: check if the xmp is newer than our db entry
-      // FIXME: allow for a few seconds difference?
-      if(timestamp < statbuf.st_mtime)
+      if(changed)
       {
         dt_control_crawler_result_t *item = (dt_control_crawler_result_t*)malloc(sizeof(dt_control_crawler_result_t));
-        item->id = id;
-        item->timestamp_xmp = statbuf.st_mtime;
-        item->timestamp_db  = timestamp;
-        item->image_path = g_strdup(image_path);
-        item->xmp_path = g_strdup(xmp_path);
+        item->id = e[k].id;
+        item->timestamp_xmp = e[k].mtime;
+        item->timestamp_db  = e[k].timestamp;
+        item->image_path = g_strdup(e[k].image_path);
+        item->xmp_path = g_strdup(e[k].xmp_path);
 
         result = g_list_append(result, item);
-        dt_print(DT_DEBUG_CONTROL, "[crawler] `%s' (id: %d) is a newer xmp file.\n", xmp_path, id);
+        dt_print(DT_DEBUG_CONTROL, "[crawler] `%s' (id: %d) is a newer xmp file.\n", e[k].xmp_path, e[k].id);
       }
-      // older timestamps are the case for all images after the db upgrade. better not report these
-//       else if(timestamp > statbuf.st_mtime)
-//         printf("`%s' (%d) has an older xmp file.\n", image_path, id);
     }
 
-    // step 2: check if the image has associated files (.txt, .wav)
-    size_t len = strlen(image_path);
-    char *c = image_path + len;
-    while((c > image_path) && (*c != '.')) *c-- = '\0';
-    len = c - image_path + 1;
-
-    char *extra_path = g_strndup(image_path, len + 3);
-
-    extra_path[len]   = 't';
-    extra_path[len+1] = 'x';
-    extra_path[len+2] = 't';
-    gboolean has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
-
-    if(!has_txt)
+    if(e[k].flags != e[k].new_flags)
     {
-      extra_path[len]   = 'T';
-      extra_path[len+1] = 'X';
-      extra_path[len+2] = 'T';
-      has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+      sqlite3_bind_int(flags_stmt, 1, e[k].new_flags);
+      sqlite3_bind_int(flags_stmt, 2, e[k].id);
+      sqlite3_step(flags_stmt);
+      sqlite3_reset(flags_stmt);
+      sqlite3_clear_bindings(flags_stmt);
     }
 
-    extra_path[len]   = 'w';
-    extra_path[len+1] = 'a';
-    extra_path[len+2] = 'v';
-    gboolean has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+    g_free(e[k].image_path);
+  }
 
-    if(!has_wav)
-    {
-      extra_path[len]   = 'W';
-      extra_path[len+1] = 'A';
-      extra_path[len+2] = 'V';
-      has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
-    }
+  dt_database_release_transaction(darktable.db);
 
-    // TODO: decide if we want to remove the flag for images that lost their extra file. currently we do (the else cases)
-    int new_flags = flags;
-    if(has_txt) new_flags |= DT_IMAGE_HAS_TXT;
-    else        new_flags &= ~DT_IMAGE_HAS_TXT;
-    if(has_wav) new_flags |= DT_IMAGE_HAS_WAV;
-    else        new_flags &= ~DT_IMAGE_HAS_WAV;
-    if(flags != new_flags)
-    {
-      sqlite3_bind_int(inner_stmt, 1, new_flags);
-      sqlite3_bind_int(inner_stmt, 2, id);
-      sqlite3_step(inner_stmt);
-      sqlite3_reset(inner_stmt);
-      sqlite3_clear_bindings(inner_stmt);
-    }
+  sqlite3_finalize(flags_stmt);
+  sqlite3_finalize(seen_stmt);
+  g_array_free(entries, TRUE);
 
-    g_free(extra_path);
-  }
+  return result;
+}
 
-  sqlite3_exec(dt_database_get(darktable.db), "COMMIT", NULL, NULL, NULL);
+static gboolean _crawler_show_image_list_idle(gpointer user_data)
+{
+  dt_control_crawler_show_image_list((GList *)user_data);
+  return FALSE;
+}
 
-  sqlite3_finalize(stmt);
-  sqlite3_finalize(inner_stmt);
+static int32_t _crawler_job_run(dt_job_t *job)
+{
+  GList *images = dt_control_crawler_run();
+  // the popup has to be created from the gui thread
+  if(images) g_idle_add(_crawler_show_image_list_idle, images);
+  return 0;
+}
 
-  return result;
+void dt_control_crawler_start()
+{
+  dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, dt_control_job_create(&_crawler_job_run, "crawl xmp files"));
 }
 
 
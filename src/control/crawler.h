@@ -21,19 +21,18 @@
 
 #include <glib.h>
 
-/** this isn't a background job on purpose. it has to be really fast so it shouldn't
- *  require locking from image cache or anything like that.
- *  should we find out that we want to have a background job that crawls over all images
- *  we can maybe refactor this, but for now it's good the way it is.
- */
-
 // this function iterates over ALL images from the database and checks whether
-// - the XMP file on disk is newer than the timestamp from db
+// - the XMP file on disk changed since we last wrote or saw it (mtime/size are kept in the db),
+//   or, if we never saw it, is newer than the timestamp from db
 // - there is a .txt or .wav file associated with the image and mark so in the db
 //   or if such a file no longer exists
-// it returns the list of images with a (supposedly) updated xmp file to let the user decide
+// the file system checks are done in parallel, in directory order.
+// it returns the list of images with an updated xmp file to let the user decide
 GList * dt_control_crawler_run();
 
+// run the crawler as a background job and pop up the list of changed images once it's done.
+void dt_control_crawler_start();
+
 // show a popup with the images, let the user decide what to do and free the list afterwards
 void dt_control_crawler_show_image_list(GList *images);
 
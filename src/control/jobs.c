@@ -20,11 +20,33 @@
 */
 
 #include "control/jobs.h"
+#include "common/trace.h"
+#ifndef DT_UNIT_TEST
 #include "control/control.h"
+#endif
 
 #define DT_CONTROL_FG_PRIORITY 4
 #define DT_CONTROL_MAX_JOBS 30
 
+/* every worker thread owns one set of queues. jobs added from a worker thread go to its own
+   queues, jobs from anywhere else are spread round robin, so adding and picking jobs on
+   different workers doesn't contend on a global lock and only the worker that got a job is woken.
+   picking uses the priority/aging rules of _control_worker_pop(). to keep these global, every
+   worker publishes the rank of the job it would hand out next, and a worker takes the best ranked
+   job of all of them. that's its own one unless someone else has more urgent work waiting, so a
+   foreground job never waits behind the background jobs of other workers.
+*/
+typedef struct dt_control_worker_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int sleeping, woken;
+  GQueue queues[DT_JOB_QUEUE_MAX];
+  // see _control_worker_update_rank(). only written with mutex held, read without it
+  int rank;
+}
+dt_control_worker_t;
+
 /* the queue can have scheduled jobs but all
     the workers are sleeping, so this kicks the workers
     on timed interval.
@@ -39,6 +61,7 @@ typedef struct _dt_job_t
 {
   dt_job_execute_callback execute;
   void *params;
+  dt_job_destroy_callback params_destroy;
   int32_t result;
 
   dt_pthread_mutex_t state_mutex;
@@ -50,24 +73,62 @@ typedef struct _dt_job_t
 
   dt_job_state_change_callback state_changed_cb;
 
+  // where the job is queued, protected by the mutex of that worker
+  int worker;
+  GList *link;
+  // age of system foreground jobs, to push out the oldest one when there are too many
+  uint64_t seq;
+
+  // the dependency graph, protected by control->deps_mutex. the links are only ever set up before any of the
+  // jobs involved got added, afterwards they are only taken down again.
+  GList *dependencies;  // unfinished jobs we are waiting for
+  GList *dependents;    // jobs waiting for us
+  int parked_queue;     // where to go once the dependencies are done, -1 as long as we weren't added
+  int cancelled;        // one of the jobs we wait for went away without finishing
+
+  // the group we are in, and how many dt_control_job_group_cancel() calls are holding on to us. both are
+  // protected by the mutex of the group. a job disposed while pinned is freed by the last of these calls.
+  struct dt_job_group_t *group;
+  GList *group_link;
+  int pins;
+
   char description[DT_CONTROL_DESCRIPTION_LEN];
 }
 _dt_job_t;
 
+struct dt_job_group_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  GQueue jobs;  // the members that aren't disposed yet
+  int failed;   // members that got disposed without finishing
+};
+
 /** check if two jobs are to be considered equal. a simple memcmp won't work since the mutexes probably won't match
     we don't want to compare result, priority or state since these will change during the course of processing.
-    TODO: somehow compare params. maybe we have to pass the sizeof(params) when setting the params to do a memcmp, or maybe even
-          allow to pass a comparator for that.
+    params aren't compared either, jobs doing different things have to say so in their description.
  */
-static inline int dt_control_job_equal(_dt_job_t * j1, _dt_job_t * j2)
+static inline int dt_control_job_equal(const _dt_job_t * j1, const _dt_job_t * j2)
 {
   return (j1->execute == j2->execute              &&
      j1->state_changed_cb == j2->state_changed_cb &&
      j1->queue == j2->queue                       &&
-     g_strcmp0(j1->description, j2->description)
+     !g_strcmp0(j1->description, j2->description)
     );
 }
 
+/* hash table callbacks to find duplicate system foreground jobs, using the same notion of equality */
+static guint _control_job_hash(gconstpointer key)
+{
+  const _dt_job_t *job = (const _dt_job_t *)key;
+  return g_str_hash(job->description) ^ GPOINTER_TO_UINT(job->execute);
+}
+
+static gboolean _control_job_hash_equal(gconstpointer a, gconstpointer b)
+{
+  return dt_control_job_equal((const _dt_job_t *)a, (const _dt_job_t *)b);
+}
+
 static void dt_control_job_set_state(_dt_job_t *job, dt_job_state_t state)
 {
   if(!job) return;
@@ -88,10 +149,11 @@ dt_job_state_t dt_control_job_get_state(_dt_job_t *job)
   return state;
 }
 
-void dt_control_job_set_params(_dt_job_t *job, void * params)
+void dt_control_job_set_params(_dt_job_t *job, void * params, dt_job_destroy_callback callback)
 {
   if(!job || dt_control_job_get_state(job) != DT_JOB_STATE_INITIALIZED) return;
   job->params = params;
+  job->params_destroy = callback;
 }
 
 void * dt_control_job_get_params(const _dt_job_t *job)
@@ -112,20 +174,148 @@ dt_job_t * dt_control_job_create(dt_job_execute_callback execute, const char *ms
 
   job->execute = execute;
   job->state = DT_JOB_STATE_INITIALIZED;
+  job->parked_queue = -1;
   dt_pthread_mutex_init(&job->state_mutex, NULL);
   dt_pthread_mutex_init(&job->wait_mutex, NULL);
   return job;
 }
 
-void dt_control_job_dispose(_dt_job_t *job)
+static void _control_job_collect_dependents(_dt_job_t *job, GList **found)
+{
+  for(GList *iter = job->dependents; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *dependent = (_dt_job_t *)iter->data;
+    // its dependents got taken care of when it got cancelled
+    if(dependent->cancelled) continue;
+    dependent->cancelled = 1;
+    *found = g_list_prepend(*found, dependent);
+    _control_job_collect_dependents(dependent, found);
+  }
+}
+
+/* flag everything depending on job as cancelled, recursively. the caller has to hold deps_mutex. the state
+   callbacks must not run under that lock, so the parked ones are taken out of the graph and returned, the
+   caller hands them to _control_job_dispose_cancelled() once deps_mutex is released. jobs that weren't added
+   yet only get flagged, dt_control_add_job() gets rid of them. */
+static GList *_control_job_cancel_dependents(_dt_job_t *job)
+{
+  GList *found = NULL, *parked = NULL;
+  _control_job_collect_dependents(job, &found);
+  for(GList *iter = found; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *dependent = (_dt_job_t *)iter->data;
+    if(dependent->parked_queue < 0) continue;
+    for(GList *diter = dependent->dependencies; diter; diter = g_list_next(diter))
+    {
+      _dt_job_t *dependency = (_dt_job_t *)diter->data;
+      dependency->dependents = g_list_remove(dependency->dependents, dependent);
+    }
+    g_list_free(dependent->dependencies);
+    dependent->dependencies = NULL;
+    dependent->parked_queue = -1;
+    parked = g_list_prepend(parked, dependent);
+  }
+  g_list_free(found);
+  return parked;
+}
+
+static void _control_job_dispose_cancelled(GList *jobs)
+{
+  // nothing else can reach these any longer. cancel all of them before disposing any, that would resolve
+  // the graph below them again
+  for(GList *iter = jobs; iter; iter = g_list_next(iter))
+    dt_control_job_set_state((_dt_job_t *)iter->data, DT_JOB_STATE_CANCELLED);
+  for(GList *iter = jobs; iter; iter = g_list_next(iter)) dt_control_job_dispose((_dt_job_t *)iter->data);
+  g_list_free(jobs);
+}
+
+/* job is about to go away. let the jobs waiting for it go on, or cancel them if it didn't finish. */
+static void _control_job_resolve(_dt_job_t *job)
+{
+  // no locking for the common case, the links can only go away while the job is alive but never appear
+  if(!job->dependencies && !job->dependents) return;
+
+  dt_control_t *control = darktable.control;
+  const gboolean finished = dt_control_job_get_state(job) == DT_JOB_STATE_FINISHED;
+  GList *ready = NULL, *cancelled = NULL;
+
+  dt_pthread_mutex_lock(&control->deps_mutex);
+  // we might go before the jobs we wait for, when getting cancelled or at shutdown
+  for(GList *iter = job->dependencies; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *dependency = (_dt_job_t *)iter->data;
+    dependency->dependents = g_list_remove(dependency->dependents, job);
+  }
+  g_list_free(job->dependencies);
+  job->dependencies = NULL;
+
+  if(!finished) cancelled = _control_job_cancel_dependents(job);
+  for(GList *iter = job->dependents; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *dependent = (_dt_job_t *)iter->data;
+    dependent->dependencies = g_list_remove(dependent->dependencies, job);
+    // dependents that weren't added yet are taken care of in dt_control_add_job()
+    if(!dependent->dependencies && dependent->parked_queue >= 0) ready = g_list_prepend(ready, dependent);
+  }
+  g_list_free(job->dependents);
+  job->dependents = NULL;
+  dt_pthread_mutex_unlock(&control->deps_mutex);
+
+  _control_job_dispose_cancelled(cancelled);
+
+  // these aren't reachable from the graph any longer, so they are ours now
+  ready = g_list_reverse(ready);
+  for(GList *iter = ready; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *dependent = (_dt_job_t *)iter->data;
+    const dt_job_queue_t queue_id = dependent->parked_queue;
+    dependent->parked_queue = -1;
+    if(dt_control_job_get_state(dependent) == DT_JOB_STATE_CANCELLED)
+      dt_control_job_dispose(dependent);
+    else
+      dt_control_add_job(control, queue_id, dependent);
+  }
+  g_list_free(ready);
+}
+
+/* take the disposed job out of its group. returns TRUE if dt_control_job_group_cancel() still holds on to it,
+   freeing it is up to that then. */
+static gboolean _control_job_leave_group(_dt_job_t *job, const gboolean finished)
+{
+  dt_job_group_t *group = job->group;
+  if(!group) return FALSE;
+  dt_pthread_mutex_lock(&group->mutex);
+  g_queue_delete_link(&group->jobs, job->group_link);
+  job->group = NULL;
+  job->group_link = NULL;
+  if(!finished) group->failed++;
+  const gboolean pinned = job->pins > 0;
+  // once this is broadcast the group may go away
+  if(g_queue_is_empty(&group->jobs)) pthread_cond_broadcast(&group->cond);
+  dt_pthread_mutex_unlock(&group->mutex);
+  return pinned;
+}
+
+static void _control_job_free(_dt_job_t *job)
 {
-  if(!job) return;
-  dt_control_job_set_state(job, DT_JOB_STATE_DISPOSED);
   dt_pthread_mutex_destroy(&job->state_mutex);
   dt_pthread_mutex_destroy(&job->wait_mutex);
   free(job);
 }
 
+void dt_control_job_dispose(_dt_job_t *job)
+{
+  if(!job) return;
+  const gboolean finished = dt_control_job_get_state(job) == DT_JOB_STATE_FINISHED;
+  _control_job_resolve(job);
+  dt_control_job_set_state(job, DT_JOB_STATE_DISPOSED);
+  // the state callbacks may still look at them
+  if(job->params_destroy) job->params_destroy(job->params);
+  job->params = NULL;
+  if(_control_job_leave_group(job, finished)) return;
+  _control_job_free(job);
+}
+
 void dt_control_job_set_state_callback(_dt_job_t *job, dt_job_state_change_callback cb)
 {
   // once the job got added to the queue it may not be changed from the outside
@@ -140,9 +330,136 @@ static void dt_control_job_print(_dt_job_t *job)
   dt_print(DT_DEBUG_CONTROL, "%s | queue: %d | priority: %d", job->description, job->queue, job->priority);
 }
 
+static void _control_job_cancel_graph(_dt_job_t *job)
+{
+  if(!job->dependents) return;
+  dt_pthread_mutex_lock(&darktable.control->deps_mutex);
+  GList *cancelled = _control_job_cancel_dependents(job);
+  dt_pthread_mutex_unlock(&darktable.control->deps_mutex);
+  _control_job_dispose_cancelled(cancelled);
+}
+
 void dt_control_job_cancel(_dt_job_t *job)
 {
+  if(!job) return;
   dt_control_job_set_state(job, DT_JOB_STATE_CANCELLED);
+  _control_job_cancel_graph(job);
+}
+
+/* does job (indirectly) wait for other? the caller has to hold deps_mutex. */
+static gboolean _control_job_depends_on(const _dt_job_t *job, const _dt_job_t *other)
+{
+  for(const GList *iter = job->dependencies; iter; iter = g_list_next(iter))
+  {
+    const _dt_job_t *dependency = (const _dt_job_t *)iter->data;
+    if(dependency == other || _control_job_depends_on(dependency, other)) return TRUE;
+  }
+  return FALSE;
+}
+
+int dt_control_job_add_dependency(_dt_job_t *job, _dt_job_t *dependency)
+{
+  if(!job || !dependency || job == dependency) return 1;
+  if(dt_control_job_get_state(job) != DT_JOB_STATE_INITIALIZED
+     || dt_control_job_get_state(dependency) != DT_JOB_STATE_INITIALIZED)
+    return 1;
+
+  int res = 0;
+  dt_pthread_mutex_lock(&darktable.control->deps_mutex);
+  if(_control_job_depends_on(dependency, job))
+    res = 1;
+  else if(!g_list_find(job->dependencies, dependency))
+  {
+    job->dependencies = g_list_prepend(job->dependencies, dependency);
+    dependency->dependents = g_list_prepend(dependency->dependents, job);
+  }
+  dt_pthread_mutex_unlock(&darktable.control->deps_mutex);
+  return res;
+}
+
+dt_job_group_t *dt_control_job_group_create()
+{
+  dt_job_group_t *group = (dt_job_group_t *)calloc(1, sizeof(dt_job_group_t));
+  if(!group) return NULL;
+  dt_pthread_mutex_init(&group->mutex, NULL);
+  pthread_cond_init(&group->cond, NULL);
+  g_queue_init(&group->jobs);
+  return group;
+}
+
+int dt_control_job_group_add(dt_job_group_t *group, _dt_job_t *job)
+{
+  if(!group || !job || job->group || dt_control_job_get_state(job) != DT_JOB_STATE_INITIALIZED) return 1;
+  dt_pthread_mutex_lock(&group->mutex);
+  g_queue_push_tail(&group->jobs, job);
+  job->group_link = g_queue_peek_tail_link(&group->jobs);
+  job->group = group;
+  dt_pthread_mutex_unlock(&group->mutex);
+  return 0;
+}
+
+void dt_control_job_group_cancel(dt_job_group_t *group)
+{
+  if(!group) return;
+  // cancelling disposes the parked dependents, and these leave the group on the way. so we can't hold the
+  // mutex while doing it, pin the members instead. that keeps them from getting freed in the meantime.
+  dt_pthread_mutex_lock(&group->mutex);
+  GList *members = NULL;
+  for(GList *iter = group->jobs.head; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *job = (_dt_job_t *)iter->data;
+    job->pins++;
+    members = g_list_prepend(members, job);
+  }
+  dt_pthread_mutex_unlock(&group->mutex);
+  members = g_list_reverse(members);
+
+  for(GList *iter = members; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *job = (_dt_job_t *)iter->data;
+    // check and change the state in one go, a member might get disposed by someone else any time
+    dt_pthread_mutex_lock(&job->state_mutex);
+    const gboolean active = job->state == DT_JOB_STATE_INITIALIZED || job->state == DT_JOB_STATE_QUEUED
+                            || job->state == DT_JOB_STATE_RUNNING;
+    if(active)
+    {
+      job->state = DT_JOB_STATE_CANCELLED;
+      if(job->state_changed_cb) job->state_changed_cb(job, DT_JOB_STATE_CANCELLED);
+    }
+    dt_pthread_mutex_unlock(&job->state_mutex);
+    if(active) _control_job_cancel_graph(job);
+  }
+
+  // the members that got disposed meanwhile already left the group, we were the last ones looking at them
+  GList *orphans = NULL;
+  dt_pthread_mutex_lock(&group->mutex);
+  for(GList *iter = members; iter; iter = g_list_next(iter))
+  {
+    _dt_job_t *job = (_dt_job_t *)iter->data;
+    if(--job->pins == 0 && !job->group) orphans = g_list_prepend(orphans, job);
+  }
+  dt_pthread_mutex_unlock(&group->mutex);
+  g_list_free(members);
+  g_list_free_full(orphans, (GDestroyNotify)_control_job_free);
+}
+
+int dt_control_job_group_wait(dt_job_group_t *group)
+{
+  if(!group) return 0;
+  dt_pthread_mutex_lock(&group->mutex);
+  while(!g_queue_is_empty(&group->jobs)) dt_pthread_cond_wait(&group->cond, &group->mutex);
+  const int failed = group->failed;
+  dt_pthread_mutex_unlock(&group->mutex);
+  return failed;
+}
+
+void dt_control_job_group_destroy(dt_job_group_t *group)
+{
+  if(!group) return;
+  dt_control_job_group_wait(group);
+  dt_pthread_mutex_destroy(&group->mutex);
+  pthread_cond_destroy(&group->cond);
+  free(group);
 }
 
 void dt_control_job_wait(_dt_job_t *job)
@@ -185,7 +502,9 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
     dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
     /* execute job */
+    const double trace_start = dt_trace_begin();
     job->result = job->execute(job);
+    dt_trace_end(DT_TRACE_JOB, trace_start, "%s", job->description);
 
     dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
     dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ", res, dt_get_wtime());
@@ -197,7 +516,32 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
   return 0;
 }
 
-static _dt_job_t* dt_control_schedule_job(dt_control_t *control)
+/* publish what _control_worker_pop() would pick: its priority, and among the same priority the queue order.
+   -1 if there's nothing. the caller has to hold w->mutex. */
+static void _control_worker_update_rank(dt_control_worker_t *w)
+{
+  int rank = -1;
+  for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+  {
+    const _dt_job_t *job = (const _dt_job_t*)g_queue_peek_head(&w->queues[i]);
+    if(job) rank = MAX(rank, job->priority * DT_JOB_QUEUE_MAX + DT_JOB_QUEUE_MAX - 1 - i);
+  }
+  __sync_lock_test_and_set(&w->rank, rank);
+}
+
+/* the jobs of this worker lost a round against someone else's. the caller has to hold w->mutex. */
+static void _control_worker_age(dt_control_worker_t *w)
+{
+  for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+  {
+    _dt_job_t *job = (_dt_job_t*)g_queue_peek_head(&w->queues[i]);
+    if(job) job->priority++;
+  }
+  _control_worker_update_rank(w);
+}
+
+/* take the next job from the queues of one worker. the caller has to hold w->mutex. */
+static _dt_job_t *_control_worker_pop(dt_control_worker_t *w)
 {
   /*
    * job scheduling works like this:
@@ -210,17 +554,14 @@ static _dt_job_t* dt_control_schedule_job(dt_control_t *control)
    * - the jobs that didn't get picked this round get their priority incremented
    */
 
-  dt_pthread_mutex_lock(&control->queue_mutex);
-
   // find the job
   _dt_job_t *job = NULL;
   int winner_queue = DT_JOB_QUEUE_MAX;
   int max_priority = -1;
   for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
   {
-    if(control->queues[i] == NULL) continue;
-    _dt_job_t *_job = (_dt_job_t*)control->queues[i]->data;
-    if(_job->priority > max_priority)
+    _dt_job_t *_job = (_dt_job_t*)g_queue_peek_head(&w->queues[i]);
+    if(_job && _job->priority > max_priority)
     {
       max_priority = _job->priority;
       job = _job;
@@ -228,35 +569,103 @@ static _dt_job_t* dt_control_schedule_job(dt_control_t *control)
     }
   }
 
-  if(!job)
-  {
-    dt_pthread_mutex_unlock(&control->queue_mutex);
-    return NULL;
-  }
+  if(!job) return NULL;
 
-  // the order of the queues in control->queues matches our priority, and we only update job when the priority is strictly bigger
+  // the order of the queues matches our priority, and we only update job when the priority is strictly bigger
   // invariant -> job is the one we are looking for
 
   // remove the to be scheduled job from its queue
-  GList **queue = &control->queues[winner_queue];
-  *queue = g_list_delete_link(*queue, *queue);
-  control->queue_length[winner_queue]--;
+  g_queue_pop_head(&w->queues[winner_queue]);
+  job->link = NULL;
 
   // increment the priorities of the others
   for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
   {
-    if(i == winner_queue || control->queues[i] == NULL) continue;
-    ((_dt_job_t*)control->queues[i]->data)->priority++;
+    if(i == winner_queue || g_queue_is_empty(&w->queues[i])) continue;
+    ((_dt_job_t*)g_queue_peek_head(&w->queues[i]))->priority++;
   }
+  _control_worker_update_rank(w);
+
+  return job;
+}
 
+/* a system foreground job left the queues, forget about it */
+static void _control_job_unregister(dt_control_t *control, _dt_job_t *job)
+{
+  if(job->queue != DT_JOB_QUEUE_SYSTEM_FG) return;
+  dt_pthread_mutex_lock(&control->queue_mutex);
+  // a duplicate might have replaced us while we weren't queued any longer
+  if(g_hash_table_lookup(control->fg_jobs, job) == job)
+    g_hash_table_remove(control->fg_jobs, job);
+  control->fg_length--;
   dt_pthread_mutex_unlock(&control->queue_mutex);
+}
 
-  return job;
+static _dt_job_t* dt_control_schedule_job(dt_control_t *control, int32_t worker)
+{
+  // the best ranked job of all workers, our own one on a tie. the ranks may change while we look, that only
+  // costs us the perfect choice.
+  const int n = control->num_threads;
+  int best = worker, best_rank = __sync_fetch_and_add(&control->workers[worker].rank, 0);
+  for(int k = 1; k < n; k++)
+  {
+    const int other = (worker + k) % n;
+    const int rank = __sync_fetch_and_add(&control->workers[other].rank, 0);
+    if(rank > best_rank)
+    {
+      best_rank = rank;
+      best = other;
+    }
+  }
+
+  // when that one is gone already go through all of them, our own queues first
+  for(int k = -1; k < n; k++)
+  {
+    const int victim = k < 0 ? best : (worker + k) % n;
+    dt_control_worker_t *w = &control->workers[victim];
+    dt_pthread_mutex_lock(&w->mutex);
+    _dt_job_t *job = _control_worker_pop(w);
+    dt_pthread_mutex_unlock(&w->mutex);
+    if(!job) continue;
+
+    _control_job_unregister(control, job);
+    if(victim != worker)
+    {
+      dt_control_worker_t *own = &control->workers[worker];
+      dt_pthread_mutex_lock(&own->mutex);
+      _control_worker_age(own);
+      dt_pthread_mutex_unlock(&own->mutex);
+    }
+    return job;
+  }
+  return NULL;
+}
+
+static void _control_worker_wake(dt_control_worker_t *w)
+{
+  dt_pthread_mutex_lock(&w->mutex);
+  w->woken = 1;
+  pthread_cond_signal(&w->cond);
+  dt_pthread_mutex_unlock(&w->mutex);
+}
+
+/* sleep until someone hands us work (or the kicker comes by). returns right away if we were woken in the meantime. */
+static void _control_worker_sleep(dt_control_t *control, dt_control_worker_t *w)
+{
+  dt_pthread_mutex_lock(&w->mutex);
+  if(!w->woken && dt_control_running())
+  {
+    w->sleeping = 1;
+    dt_pthread_cond_wait(&w->cond, &w->mutex);
+    w->sleeping = 0;
+  }
+  w->woken = 0;
+  dt_pthread_mutex_unlock(&w->mutex);
 }
 
 static int32_t dt_control_run_job(dt_control_t *control)
 {
-  _dt_job_t *job = dt_control_schedule_job(control);
+  _dt_job_t *job = dt_control_schedule_job(control, dt_control_get_threadid());
 
   if(!job)
     return -1;
@@ -273,7 +682,9 @@ static int32_t dt_control_run_job(dt_control_t *control)
     dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
     /* execute job */
+    const double trace_start = dt_trace_begin();
     job->result = job->execute(job);
+    dt_trace_end(DT_TRACE_JOB, trace_start, "%s", job->description);
 
     dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
 
@@ -325,6 +736,47 @@ int32_t dt_control_add_job_res(dt_control_t *control, _dt_job_t *job, int32_t re
   return 0;
 }
 
+/* push the oldest system foreground jobs out of the queues. the caller has to hold control->queue_mutex. */
+static void _control_trim_system_fg(dt_control_t *control)
+{
+  while(control->fg_length > DT_CONTROL_MAX_JOBS)
+  {
+    // the oldest job sits at the bottom of one of the stacks
+    int oldest = -1;
+    uint64_t oldest_seq = UINT64_MAX;
+    for(int k = 0; k < control->num_threads; k++)
+    {
+      dt_control_worker_t *w = &control->workers[k];
+      dt_pthread_mutex_lock(&w->mutex);
+      _dt_job_t *last = (_dt_job_t*)g_queue_peek_tail(&w->queues[DT_JOB_QUEUE_SYSTEM_FG]);
+      if(last && last->seq < oldest_seq)
+      {
+        oldest_seq = last->seq;
+        oldest = k;
+      }
+      dt_pthread_mutex_unlock(&w->mutex);
+    }
+    if(oldest < 0) return; // all of them are just being picked up
+
+    dt_control_worker_t *w = &control->workers[oldest];
+    dt_pthread_mutex_lock(&w->mutex);
+    _dt_job_t *last = (_dt_job_t*)g_queue_pop_tail(&w->queues[DT_JOB_QUEUE_SYSTEM_FG]);
+    if(last) last->link = NULL;
+    _control_worker_update_rank(w);
+    dt_pthread_mutex_unlock(&w->mutex);
+    if(!last) continue;
+
+    g_hash_table_remove(control->fg_jobs, last);
+    control->fg_length--;
+    dt_control_job_set_state(last, DT_JOB_STATE_DISCARDED);
+    dt_control_job_dispose(last);
+  }
+}
+
+static __thread int threadid = -1;
+// only set in the normal worker threads, the reserved ones have their own numbering in threadid
+static __thread int worker_threadid = -1;
+
 int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t *job)
 {
   if(((unsigned int)queue_id) >= DT_JOB_QUEUE_MAX || !job)
@@ -333,78 +785,148 @@ int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t
     return 1;
   }
 
-  job->queue = queue_id;
+  // something we depend on got cancelled before we were added
+  if(dt_control_job_get_state(job) == DT_JOB_STATE_CANCELLED)
+  {
+    dt_control_job_dispose(job);
+    return 1;
+  }
 
-  dt_pthread_mutex_lock(&control->queue_mutex);
+  if(job->dependencies || job->cancelled)
+  {
+    dt_pthread_mutex_lock(&control->deps_mutex);
+    if(job->cancelled)
+    {
+      // one of our dependencies went away without finishing
+      dt_pthread_mutex_unlock(&control->deps_mutex);
+      dt_control_job_set_state(job, DT_JOB_STATE_CANCELLED);
+      dt_control_job_dispose(job);
+      return 1;
+    }
+    if(job->dependencies)
+    {
+      // park the job until the last dependency is done, _control_job_resolve() adds it then
+      dt_print(DT_DEBUG_CONTROL, "[add_job] waiting for %d jobs | ", g_list_length(job->dependencies));
+      dt_control_job_print(job);
+      dt_print(DT_DEBUG_CONTROL, "\n");
+      job->parked_queue = queue_id;
+      dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
+      dt_pthread_mutex_unlock(&control->deps_mutex);
+      return 0;
+    }
+    dt_pthread_mutex_unlock(&control->deps_mutex);
+  }
 
-  GList **queue = &control->queues[queue_id];
-  size_t length = control->queue_length[queue_id];
+  job->queue = queue_id;
+  if(queue_id == DT_JOB_QUEUE_USER_BG || queue_id == DT_JOB_QUEUE_SYSTEM_BG)
+    job->priority = 0;
+  else
+    job->priority = DT_CONTROL_FG_PRIORITY;
+
+  // jobs spawned by a worker stay there, the others get spread over all workers
+  int worker = worker_threadid;
+  if(worker < 0)
+    worker = (int)(__sync_fetch_and_add(&control->next_worker, 1) % (uint32_t)control->num_threads);
+  dt_control_worker_t *w = &control->workers[worker];
 
-  dt_print(DT_DEBUG_CONTROL, "[add_job] %ld | ", length);
+  dt_print(DT_DEBUG_CONTROL, "[add_job] %d | ", worker);
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
   if(queue_id == DT_JOB_QUEUE_SYSTEM_FG)
   {
     // this is a stack with limited size and bubble up and all that stuff
-    job->priority = DT_CONTROL_FG_PRIORITY;
-
-    // if the job is already in the queue -> move it to the top
-    for(GList *iter = *queue; iter; iter = g_list_next(iter))
+    dt_pthread_mutex_lock(&control->queue_mutex);
+
+    // if the job is already in the queue -> move it to the top. jobs that are part of a graph or group are
+    // never merged, discarding them would cancel everything depending on them.
+    _dt_job_t *other_job = NULL;
+    if(!job->dependents && !job->group) other_job = (_dt_job_t*)g_hash_table_lookup(control->fg_jobs, job);
+    gboolean moved = FALSE;
+    if(other_job)
     {
-      _dt_job_t* other_job = (_dt_job_t*)iter->data;
-      if(dt_control_job_equal(job, other_job))
+      dt_control_worker_t *ow = &control->workers[other_job->worker];
+      dt_pthread_mutex_lock(&ow->mutex);
+      if(other_job->link)
       {
-        dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue: ");
-        dt_control_job_print(job);
-        dt_print(DT_DEBUG_CONTROL, "\n");
-
-        *queue = g_list_delete_link(*queue, iter);
-        length--;
-        dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
-        dt_control_job_dispose(job);
-        job = other_job;
-        break; // there can't be any further copy in the list
+        g_queue_delete_link(&ow->queues[DT_JOB_QUEUE_SYSTEM_FG], other_job->link);
+        other_job->link = NULL;
+        moved = TRUE;
+        _control_worker_update_rank(ow);
       }
+      dt_pthread_mutex_unlock(&ow->mutex);
     }
+    if(moved)
+    {
+      dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue: ");
+      dt_control_job_print(job);
+      dt_print(DT_DEBUG_CONTROL, "\n");
 
-    // now we can add the new job to the list
-    *queue = g_list_prepend(*queue, job);
-    length++;
-
-    // and take care of the maximal queue size
-    if(length > DT_CONTROL_MAX_JOBS)
+      dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
+      dt_control_job_dispose(job);
+      job = other_job;
+    }
+    else
     {
-      GList *last = g_list_last(*queue);
-      dt_control_job_set_state((_dt_job_t*)last->data, DT_JOB_STATE_DISCARDED);
-      *queue = g_list_delete_link(*queue, last);
-      length--;
+      // new job, or the old copy is already running
+      dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
+      control->fg_length++;
     }
+    job->seq = control->fg_seq++;
+    g_hash_table_replace(control->fg_jobs, job, job);
 
-    control->queue_length[queue_id] = length;
+    // now we can add the new job to the stack
+    dt_pthread_mutex_lock(&w->mutex);
+    g_queue_push_head(&w->queues[queue_id], job);
+    job->link = g_queue_peek_head_link(&w->queues[queue_id]);
+    job->worker = worker;
+    _control_worker_update_rank(w);
+    dt_pthread_mutex_unlock(&w->mutex);
+
+    // and take care of the maximal queue size
+    _control_trim_system_fg(control);
+
+    dt_pthread_mutex_unlock(&control->queue_mutex);
   }
   else
   {
     // the rest are FIFOs
-    if(queue_id == DT_JOB_QUEUE_USER_BG || queue_id == DT_JOB_QUEUE_SYSTEM_BG)
-      job->priority = 0;
-    else
-      job->priority = DT_CONTROL_FG_PRIORITY;
-    *queue = g_list_append(*queue, job);
-    control->queue_length[queue_id]++;
+    dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
+    dt_pthread_mutex_lock(&w->mutex);
+    g_queue_push_tail(&w->queues[queue_id], job);
+    job->link = g_queue_peek_tail_link(&w->queues[queue_id]);
+    job->worker = worker;
+    _control_worker_update_rank(w);
+    dt_pthread_mutex_unlock(&w->mutex);
   }
-  dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
-  dt_pthread_mutex_unlock(&control->queue_mutex);
 
-  // notify workers
-  dt_pthread_mutex_lock(&control->cond_mutex);
-  pthread_cond_broadcast(&control->cond);
-  dt_pthread_mutex_unlock(&control->cond_mutex);
+  // notify the worker owning the job. when it's busy, get an idle one to steal it.
+  if(!w->sleeping)
+  {
+    for(int k = 1; k < control->num_threads; k++)
+    {
+      dt_control_worker_t *idle = &control->workers[(worker + k) % control->num_threads];
+      if(idle->sleeping)
+      {
+        _control_worker_wake(idle);
+        break;
+      }
+    }
+  }
+  _control_worker_wake(w);
 
   return 0;
 }
 
-static __thread int threadid = -1;
+int dt_control_add_continuation(dt_control_t *control, _dt_job_t *job, dt_job_queue_t queue_id, _dt_job_t *next)
+{
+  if(dt_control_job_add_dependency(next, job))
+  {
+    dt_control_job_dispose(next);
+    return 1;
+  }
+  return dt_control_add_job(control, queue_id, next);
+}
 
 int32_t dt_control_get_threadid()
 {
@@ -428,6 +950,7 @@ static void *dt_control_work_res(void *ptr)
   threadid = params->threadid;
   free(params);
   int32_t threadid = dt_control_get_threadid_res();
+  dt_trace_set_thread_name("reserved worker %d", threadid);
   while(dt_control_running())
   {
     // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
@@ -445,16 +968,25 @@ static void *dt_control_work_res(void *ptr)
   return NULL;
 }
 
+static void _control_kick_workers(dt_control_t *control)
+{
+  dt_pthread_mutex_lock(&control->cond_mutex);
+  pthread_cond_broadcast(&control->cond);
+  dt_pthread_mutex_unlock(&control->cond_mutex);
+  for(int k = 0; k < control->num_threads; k++)
+    _control_worker_wake(&control->workers[k]);
+}
+
 static void * dt_control_worker_kicker(void *ptr)
 {
   dt_control_t *control = (dt_control_t *)ptr;
   while(dt_control_running())
   {
     sleep(2);
-    dt_pthread_mutex_lock(&control->cond_mutex);
-    pthread_cond_broadcast(&control->cond);
-    dt_pthread_mutex_unlock(&control->cond_mutex);
+    _control_kick_workers(control);
   }
+  // make sure nobody sleeps through the shutdown
+  _control_kick_workers(control);
   return NULL;
 }
 
@@ -465,18 +997,17 @@ static void *dt_control_work(void *ptr)
 #endif
   worker_thread_parameters_t *params = (worker_thread_parameters_t*)ptr;
   dt_control_t *control = params->self;
-  threadid = params->threadid;
+  threadid = worker_threadid = params->threadid;
   free(params);
-  // int32_t threadid = dt_control_get_threadid();
+  dt_trace_set_thread_name("worker %d", threadid);
+  dt_control_worker_t *w = &control->workers[threadid];
   while(dt_control_running())
   {
     // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
     if(dt_control_run_job(control) < 0)
     {
       // wait for a new job.
-      dt_pthread_mutex_lock(&control->cond_mutex);
-      dt_pthread_cond_wait(&control->cond, &control->cond_mutex);
-      dt_pthread_mutex_unlock(&control->cond_mutex);
+      _control_worker_sleep(control, w);
     }
   }
   return NULL;
@@ -488,6 +1019,20 @@ void dt_control_jobs_init(dt_control_t *control)
   // start threads
   control->num_threads = CLAMP(dt_conf_get_int ("worker_threads"), 1, 8);
   control->thread = (pthread_t *)calloc(control->num_threads, sizeof(pthread_t));
+  control->workers = (dt_control_worker_t *)calloc(control->num_threads, sizeof(dt_control_worker_t));
+  for(int k=0; k<control->num_threads; k++)
+  {
+    dt_control_worker_t *w = &control->workers[k];
+    dt_pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    for(int i = 0; i < DT_JOB_QUEUE_MAX; i++) g_queue_init(&w->queues[i]);
+    w->rank = -1;
+  }
+  control->fg_jobs = g_hash_table_new(_control_job_hash, _control_job_hash_equal);
+  control->fg_length = 0;
+  control->fg_seq = 0;
+  control->next_worker = 0;
+  dt_pthread_mutex_init(&control->deps_mutex, NULL);
   dt_pthread_mutex_lock(&control->run_mutex);
   control->running = 1;
   dt_pthread_mutex_unlock(&control->run_mutex);
@@ -513,6 +1058,37 @@ void dt_control_jobs_init(dt_control_t *control)
   }
 }
 
+void dt_control_jobs_cleanup(dt_control_t *control)
+{
+  // all workers are gone, throw away what's left in the queues
+  for(int k=0; k<control->num_threads; k++)
+  {
+    dt_control_worker_t *w = &control->workers[k];
+    for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+    {
+      _dt_job_t *job;
+      while((job = (_dt_job_t*)g_queue_pop_head(&w->queues[i])))
+      {
+        dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
+        dt_control_job_dispose(job);
+      }
+    }
+    dt_pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+  }
+  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
+  {
+    dt_control_job_dispose(control->job_res[k]);
+    control->job_res[k] = NULL;
+  }
+  g_hash_table_destroy(control->fg_jobs);
+  dt_pthread_mutex_destroy(&control->deps_mutex);
+  free(control->workers);
+  control->workers = NULL;
+  free(control->thread);
+  control->thread = NULL;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -54,6 +54,7 @@ typedef struct _dt_job_t dt_job_t;
 
 typedef int32_t (*dt_job_execute_callback)(dt_job_t*);
 typedef void (*dt_job_state_change_callback)(dt_job_t*, dt_job_state_t state);
+typedef void (*dt_job_destroy_callback)(void *data);
 
 /** create a new initialized job */
 dt_job_t *dt_control_job_create(dt_job_execute_callback execute, const char *msg, ...);
@@ -66,18 +67,51 @@ void dt_control_job_cancel(dt_job_t *job);
 dt_job_state_t dt_control_job_get_state(dt_job_t *job);
 /** wait for a job to finish execution. */
 void dt_control_job_wait(dt_job_t *job);
-/** accessors for internal fields */
-void dt_control_job_set_params(dt_job_t *job, void * params);
+/** accessors for internal fields. if callback isn't NULL the job owns params and hands them to it when it gets
+ *  disposed, whether it ran or not. a job dropped as a duplicate when adding it never runs, so params that are
+ *  freed by the job itself leak in that case. */
+void dt_control_job_set_params(dt_job_t *job, void * params, dt_job_destroy_callback callback);
 void * dt_control_job_get_params(const dt_job_t *job);
 
+/** let job only start after dependency finished. both jobs have to be freshly created, i.e. not added
+ *  to a queue yet, so build the whole graph first and then add all of its jobs with dt_control_add_job().
+ *  a job waiting for others sits in the queued state until the last of them finished, so jobs without
+ *  dependencies between each other still run in parallel. when a job gets cancelled or discarded all jobs
+ *  depending on it (directly or not) are cancelled, too, and get disposed without running.
+ *  dependencies are only honoured by dt_control_add_job(), not by dt_control_add_job_res().
+ *  returns non-zero if the dependency couldn't be added, for example because it would form a cycle. */
+int dt_control_job_add_dependency(dt_job_t *job, dt_job_t *dependency);
+
+struct dt_job_group_t;
+typedef struct dt_job_group_t dt_job_group_t;
+
+/** a group of jobs that can be waited for or cancelled together. */
+dt_job_group_t *dt_control_job_group_create();
+/** add a freshly created job to the group, a job can only be in one group. returns non-zero on failure. */
+int dt_control_job_group_add(dt_job_group_t *group, dt_job_t *job);
+/** cancel all jobs of the group that didn't finish yet, and everything depending on them. */
+void dt_control_job_group_cancel(dt_job_group_t *group);
+/** block until all jobs of the group got disposed. returns the number of them that didn't finish, i.e. that got
+ *  cancelled or discarded. don't call this from a job, a worker waiting for other jobs can stall the queues.
+ *  to continue with something once the whole group is done, make that a job depending on all of them instead. */
+int dt_control_job_group_wait(dt_job_group_t *group);
+/** wait for the group and free it. */
+void dt_control_job_group_destroy(dt_job_group_t *group);
+
 struct dt_control_t;
 void dt_control_jobs_init(struct dt_control_t *control);
+/** free the job queues. all workers have to be shut down already. */
+void dt_control_jobs_cleanup(struct dt_control_t *control);
 
 int dt_control_add_job(struct dt_control_t *control, dt_job_queue_t queue_id, dt_job_t *job);
 int32_t dt_control_add_job_res(struct dt_control_t *s, dt_job_t *job, int32_t res);
+/** continuation: add next to queue_id, to run once job finished. job has to be added separately, afterwards.
+ *  same as dt_control_job_add_dependency(next, job) followed by dt_control_add_job(control, queue_id, next). */
+int dt_control_add_continuation(struct dt_control_t *control, dt_job_t *job, dt_job_queue_t queue_id, dt_job_t *next);
 
 int32_t dt_control_get_threadid();
 
+#ifndef DT_UNIT_TEST
 #ifdef HAVE_GPHOTO2
 #include "control/jobs/camera_jobs.h"
 #endif
@@ -85,6 +119,7 @@ int32_t dt_control_get_threadid();
 #include "control/jobs/develop_jobs.h"
 #include "control/jobs/film_jobs.h"
 #include "control/jobs/image_jobs.h"
+#endif
 
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -276,7 +276,7 @@ dt_job_t * dt_camera_capture_job_create(const char *jobcode, uint32_t delay, uin
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
 
   params->shared.session = dt_import_session_new();
   dt_import_session_set_name(params->shared.session, jobcode);
@@ -295,9 +295,14 @@ static int32_t dt_camera_get_previews_job_run(dt_job_t *job)
   dt_camctl_register_listener(darktable.camctl, params->listener);
   dt_camctl_get_previews(darktable.camctl, params->flags, params->camera);
   dt_camctl_unregister_listener(darktable.camctl, params->listener);
+  return 0;
+}
+
+static void dt_camera_get_previews_job_cleanup(void *p)
+{
+  dt_camera_get_previews_t *params = p;
   g_free(params->listener);
   free(params);
-  return 0;
 }
 
 dt_job_t * dt_camera_get_previews_job_create(dt_camera_t *camera, dt_camctl_listener_t *listener, uint32_t flags, void *data)
@@ -310,7 +315,7 @@ dt_job_t * dt_camera_get_previews_job_create(dt_camera_t *camera, dt_camctl_list
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, dt_camera_get_previews_job_cleanup);
 
   params->listener=g_malloc(sizeof(dt_camctl_listener_t));
   memcpy(params->listener, listener, sizeof(dt_camctl_listener_t));
@@ -389,7 +394,7 @@ dt_job_t * dt_camera_import_job_create(const char *jobcode, GList *images, struc
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
 
   /* intitialize import session for camera import job */
   params->shared.session = dt_import_session_new();
@@ -146,7 +146,7 @@ static dt_job_t * dt_control_generic_images_job_create(dt_job_execute_callback e
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
   dt_control_image_enumerator_job_selected_init(params);
   params->flag = flag;
   params->data = data;
@@ -159,7 +159,8 @@ static int32_t dt_control_write_sidecar_files_job_run(dt_job_t *job)
   dt_control_image_enumerator_t *params = dt_control_job_get_params(job);
   GList *t = params->index;
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "UPDATE images SET write_timestamp = STRFTIME('%s', 'now') WHERE id = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "UPDATE images SET write_timestamp = STRFTIME('%s', 'now'), "
+                              "xmp_mtime = ?2, xmp_size = ?3 WHERE id = ?1", -1, &stmt, NULL);
   while(t)
   {
     gboolean from_cache = FALSE;
@@ -172,8 +173,12 @@ static int32_t dt_control_write_sidecar_files_job_run(dt_job_t *job)
     if(!dt_exif_xmp_write(imgid, dtfilename))
     {
       // put the timestamp into db. this can't be done in exif.cc since that code gets called
-      // for the copy exporter, too
+      // for the copy exporter, too. the crawler wants to know what the file looks like now.
+      struct stat statbuf;
+      if(stat(dtfilename, &statbuf) == -1) memset(&statbuf, 0, sizeof(statbuf));
       DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+      sqlite3_bind_int64(stmt, 2, statbuf.st_mtime);
+      sqlite3_bind_int64(stmt, 3, statbuf.st_size);
       sqlite3_step(stmt);
       sqlite3_reset(stmt);
       sqlite3_clear_bindings(stmt);
@@ -828,9 +833,89 @@ static int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   return 0;
 }
 
+/* export runs as a pipeline. loader threads decode the raw files into the full mipmap cache, in order, and hand
+   them over to the processing threads, which run the pixelpipe and encode and store the result. from being
+   loaded until it is stored every image takes a slot, so no more than the threads of both stages can use
+   are kept in memory. */
+typedef struct dt_control_export_image_t
+{
+  int32_t imgid;
+  guint num;
+  dt_mipmap_buffer_t buf;
+}
+dt_control_export_image_t;
+
+typedef struct dt_control_export_pipe_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  dt_job_t *job;
+  GList *todo;    // images that weren't loaded yet
+  guint num;      // how many got taken from todo so far
+  GQueue loaded;  // waiting to be processed
+  int free_slots; // how many more images may be loaded right now
+  int loaders;    // loader threads still running
+}
+dt_control_export_pipe_t;
+
+static void *_control_export_load_images(void *data)
+{
+  dt_control_export_pipe_t *pipe = (dt_control_export_pipe_t *)data;
+  dt_pthread_mutex_lock(&pipe->mutex);
+  while(1)
+  {
+    while(pipe->free_slots == 0 && dt_control_job_get_state(pipe->job) != DT_JOB_STATE_CANCELLED)
+      dt_pthread_cond_wait(&pipe->cond, &pipe->mutex);
+    if(!pipe->todo || dt_control_job_get_state(pipe->job) == DT_JOB_STATE_CANCELLED) break;
+
+    dt_control_export_image_t *image = (dt_control_export_image_t *)calloc(1, sizeof(dt_control_export_image_t));
+    image->imgid = GPOINTER_TO_INT(pipe->todo->data);
+    image->num = ++pipe->num;
+    image->buf.size = DT_MIPMAP_NONE;
+    pipe->todo = g_list_delete_link(pipe->todo, pipe->todo);
+    pipe->free_slots--;
+    dt_pthread_mutex_unlock(&pipe->mutex);
+
+    // check if image still exists:
+    char imgfilename[PATH_MAX];
+    const dt_image_t *img = dt_image_cache_read_get(darktable.image_cache, image->imgid);
+    if(img)
+    {
+      gboolean from_cache = TRUE;
+      dt_image_full_path(img->id, imgfilename, sizeof(imgfilename), &from_cache);
+      if(!g_file_test(imgfilename, G_FILE_TEST_IS_REGULAR))
+      {
+        dt_control_log(_("image `%s' is currently unavailable"), img->filename);
+        fprintf(stderr, "image `%s' is currently unavailable", imgfilename);
+        // dt_image_remove(imgid);
+      }
+      else
+      {
+        // decode now. the buffer stays read locked in the cache until the image got exported, so the
+        // processing threads never have to wait for the raw loader.
+        dt_mipmap_cache_read_get(darktable.mipmap_cache, &image->buf, image->imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+        if(!image->buf.buf)
+        {
+          dt_control_log(_("image `%s' is not available!"), img->filename);
+          dt_mipmap_cache_read_release(darktable.mipmap_cache, &image->buf);
+          image->buf.size = DT_MIPMAP_NONE;
+        }
+      }
+      dt_image_cache_read_release(darktable.image_cache, img);
+    }
+
+    dt_pthread_mutex_lock(&pipe->mutex);
+    g_queue_push_tail(&pipe->loaded, image);
+    pthread_cond_broadcast(&pipe->cond);
+  }
+  pipe->loaders--;
+  pthread_cond_broadcast(&pipe->cond);
+  dt_pthread_mutex_unlock(&pipe->mutex);
+  return NULL;
+}
+
 static int32_t dt_control_export_job_run(dt_job_t *job)
 {
-  int imgid = -1;
   dt_control_image_enumerator_t *params = (dt_control_image_enumerator_t *)dt_control_job_get_params(job);
   dt_control_export_t *settings = (dt_control_export_t*)params->data;
   GList *t = params->index;
@@ -878,10 +963,31 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   // GCC won't accept that this variable is used in a macro, considers
   // it set but not used, which makes for instance Fedora break.
   const __attribute__((__unused__)) int num_threads = MAX(1, MIN(full_entries, 8));
+#else
+  const int num_threads = 1;
+#endif
+  // the mipmap cache has room for this many more full buffers
+  const int num_loaders = CLAMP(dt_conf_get_int("export_decode_threads"), 1, 4);
+
+  dt_control_export_pipe_t pipe;
+  dt_pthread_mutex_init(&pipe.mutex, NULL);
+  pthread_cond_init(&pipe.cond, NULL);
+  pipe.job = job;
+  pipe.todo = t;
+  pipe.num = 0;
+  g_queue_init(&pipe.loaded);
+  // every processing thread works on one image and every loader keeps one ready for it
+  pipe.free_slots = num_threads + num_loaders;
+  pipe.loaders = num_loaders;
+  pthread_t loaders[4];
+  for(int k = 0; k < num_loaders; k++)
+    pthread_create(&loaders[k], NULL, _control_export_load_images, &pipe);
+
+#ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__NetBSD__) && !defined(__WIN32__)
-  #pragma omp parallel default(none) private(imgid) shared(control, fraction, w, h, stderr, mformat, mstorage, t, sdata, job, progress, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel default(none) shared(control, fraction, w, h, mformat, mstorage, pipe, sdata, job, progress, darktable, settings) num_threads(num_threads) if(num_threads > 1)
 #else
-  #pragma omp parallel private(imgid) shared(control, fraction, w, h, mformat, mstorage, t, sdata, job, progress, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel shared(control, fraction, w, h, mformat, mstorage, pipe, sdata, job, progress, darktable, settings) num_threads(num_threads) if(num_threads > 1)
 #endif
   {
 #endif
@@ -892,53 +998,44 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
     fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
     g_strlcpy(fdata->style, settings->style, sizeof(fdata->style));
-    guint num = 0;
+#ifdef _OPENMP
+    // let the modules use the cores the other exports don't need, the pixelpipe takes them from the core budget
+    omp_set_nested(1);
+#endif
     // Invariant: the tagid for 'darktable|changed' will not change while this function runs. Is this a sensible assumption?
     guint tagid = 0,
           etagid = 0;
     dt_tag_new("darktable|changed",&tagid);
     dt_tag_new("darktable|exported",&etagid);
 
-    while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
+    while(1)
     {
-#ifdef _OPENMP
-      #pragma omp critical
-#endif
+      dt_pthread_mutex_lock(&pipe.mutex);
+      while(g_queue_is_empty(&pipe.loaded) && pipe.loaders > 0)
+        dt_pthread_cond_wait(&pipe.cond, &pipe.mutex);
+      dt_control_export_image_t *image = (dt_control_export_image_t *)g_queue_pop_head(&pipe.loaded);
+      dt_pthread_mutex_unlock(&pipe.mutex);
+      // everything is loaded and taken
+      if(!image) break;
+
+      // once cancelled the loaders stop, the rest of the images are just released
+      if(dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
       {
-        if(!t)
-          imgid = 0;
-        else
-        {
-          imgid = GPOINTER_TO_INT(t->data);
-          t = g_list_delete_link(t, t);
-          num = total - g_list_length(t);
-        }
-      }
-      // remove 'changed' tag from image
-      dt_tag_detach(tagid, imgid);
-      // make sure the 'exported' tag is set on the image
-      dt_tag_attach(etagid, imgid);
-      // check if image still exists:
-      char imgfilename[PATH_MAX];
-      const dt_image_t *image = dt_image_cache_read_get(darktable.image_cache, (int32_t)imgid);
-      if(image)
-      {
-        gboolean from_cache = TRUE;
-        dt_image_full_path(image->id, imgfilename, sizeof(imgfilename), &from_cache);
-        if(!g_file_test(imgfilename, G_FILE_TEST_IS_REGULAR))
-        {
-          dt_control_log(_("image `%s' is currently unavailable"), image->filename);
-          fprintf(stderr, "image `%s' is currently unavailable", imgfilename);
-          // dt_image_remove(imgid);
-          dt_image_cache_read_release(darktable.image_cache, image);
-        }
-        else
-        {
-          dt_image_cache_read_release(darktable.image_cache, image);
-          if(mstorage->store(mstorage,sdata, imgid, mformat, fdata, num, total, settings->high_quality) != 0)
-            dt_control_job_cancel(job);
-        }
+        // remove 'changed' tag from image
+        dt_tag_detach(tagid, image->imgid);
+        // make sure the 'exported' tag is set on the image
+        dt_tag_attach(etagid, image->imgid);
+        if(image->buf.buf
+           && mstorage->store(mstorage, sdata, image->imgid, mformat, fdata, image->num, total, settings->high_quality) != 0)
+          dt_control_job_cancel(job);
       }
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &image->buf);
+      free(image);
+
+      dt_pthread_mutex_lock(&pipe.mutex);
+      pipe.free_slots++;
+      pthread_cond_broadcast(&pipe.cond);
+      dt_pthread_mutex_unlock(&pipe.mutex);
 #ifdef _OPENMP
       #pragma omp critical
 #endif
@@ -962,6 +1059,11 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
 #ifdef _OPENMP
   }
 #endif
+  for(int k = 0; k < num_loaders; k++)
+    pthread_join(loaders[k], NULL);
+  g_list_free(pipe.todo);
+  dt_pthread_mutex_destroy(&pipe.mutex);
+  pthread_cond_destroy(&pipe.cond);
   g_free(params->data);
   free(params);
   return 0;
@@ -977,7 +1079,7 @@ static dt_job_t * dt_control_gpx_apply_job_create(const gchar *filename, int32_t
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
   if (filmid != -1)
     dt_control_image_enumerator_job_film_init(params, filmid);
   else
@@ -1202,7 +1304,7 @@ void dt_control_export(GList *imgid_list, int max_width, int max_height, int for
     dt_control_job_dispose(job);
     return;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
   params->index = imgid_list;
   dt_control_export_t *data = (dt_control_export_t*)malloc(sizeof(dt_control_export_t));
   data->max_width = max_width;
@@ -1294,7 +1396,7 @@ static dt_job_t * dt_control_time_offset_job_create(const long int offset, int i
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
   if (imgid != -1)
     params->index = g_list_append(params->index, GINT_TO_POINTER(imgid));
   else
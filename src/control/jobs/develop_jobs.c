@@ -30,7 +30,7 @@ dt_job_t * dt_dev_process_preview_job_create(dt_develop_t *dev)
 {
   dt_job_t *job = dt_control_job_create(&dt_dev_process_preview_job_run, "develop process preview");
   if(!job) return NULL;
-  dt_control_job_set_params(job, dev);
+  dt_control_job_set_params(job, dev, NULL);
   return job;
 }
 
@@ -45,7 +45,7 @@ dt_job_t * dt_dev_process_image_job_create(dt_develop_t *dev)
 {
   dt_job_t *job = dt_control_job_create(&dt_dev_process_image_job_run, "develop process image");
   if(!job) return NULL;
-  dt_control_job_set_params(job, dev);
+  dt_control_job_set_params(job, dev, NULL);
   return job;
 }
 
@@ -44,7 +44,6 @@ static int32_t dt_image_load_job_run(dt_job_t *job)
   // drop read lock, as this is only speculative async loading.
   if(buf.buf)
     dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
-  free(params);
   return 0;
 }
 
@@ -58,7 +57,7 @@ dt_job_t * dt_image_load_job_create(int32_t id, dt_mipmap_size_t mip)
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, free);
   params->imgid = id;
   params->mip = mip;
   return job;
@@ -107,7 +106,7 @@ dt_job_t * dt_image_import_job_create(uint32_t filmid, const char *filename)
     dt_control_job_dispose(job);
     return NULL;
   }
-  dt_control_job_set_params(job, params);
+  dt_control_job_set_params(job, params, NULL);
   params->filename = g_strdup(filename);
   params->film_id = filmid;
   return job;
@@ -1784,6 +1784,16 @@ int dt_iop_breakpoint(struct dt_develop_t *dev, struct dt_dev_pixelpipe_t *pipe)
   return 0;
 }
 
+int dt_iop_cancelled(const dt_dev_pixelpipe_iop_t *piece)
+{
+  const dt_dev_pixelpipe_t *pipe = piece->pipe;
+  const dt_develop_t *dev = piece->module->dev;
+  if(pipe->shutdown) return 1;
+  if(pipe != dev->preview_pipe && pipe->changed == DT_DEV_PIPE_ZOOMED) return 1;
+  if((pipe->changed != DT_DEV_PIPE_UNCHANGED && pipe->changed != DT_DEV_PIPE_ZOOMED) || dev->gui_leaving) return 1;
+  return 0;
+}
+
 void dt_iop_nap(int32_t usec)
 {
   if(usec <= 0) return;
@@ -464,6 +464,10 @@ void dt_iop_cleanup_histogram(gpointer data, gpointer user_data);
 
 /** let plugins have breakpoints: */
 int dt_iop_breakpoint(struct dt_develop_t *dev, struct dt_dev_pixelpipe_t *pipe);
+/** cheap enough to poll per tile or block of rows in long running process() implementations: returns non-zero
+ *  if the pipe doesn't need the output any more (params changed, zoomed, shut down). the module may then return
+ *  right away, leaving its output incomplete, the pipe throws it away and starts over. */
+int dt_iop_cancelled(const struct dt_dev_pixelpipe_iop_t *piece);
 
 /** allow plugins to relinquish CPU and go to sleep for some time */
 void dt_iop_nap(int32_t usec);
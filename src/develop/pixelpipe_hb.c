@@ -22,6 +22,7 @@
 #include "gui/gtk.h"
 #include "control/control.h"
 #include "control/signal.h"
+#include "control/conf.h"
 #include "common/opencl.h"
 #include "common/imageio.h"
 #include "libs/lib.h"
@@ -29,6 +30,7 @@
 #include "iop/colorout.h"
 #include "common/colorspaces.h"
 #include "common/histogram.h"
+#include "common/trace.h"
 
 #include <assert.h>
 #include <string.h>
@@ -55,6 +57,18 @@ dt_pixelpipe_flow_t;
 // this is to ensure compatibility with pixelpipe_gegl.c, which does not need to build the other module:
 #include "develop/pixelpipe_cache.c"
 
+// how long pipe runs waited for an opencl device and how long they took, per pipe type. reported with -d perf.
+typedef struct dt_dev_pixelpipe_latency_t
+{
+  int runs;
+  double wait_sum, wait_max, run_sum;
+}
+dt_dev_pixelpipe_latency_t;
+
+static dt_dev_pixelpipe_latency_t _pipe_latency[4];
+// not a dt_pthread_mutex_t, only there for the statistics
+static pthread_mutex_t _pipe_latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static char *_pipe_type_to_str(int pipe_type)
 {
   char *r;
@@ -87,6 +101,24 @@ int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_
   return res;
 }
 
+int dt_dev_pixelpipe_init_export_deferred(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
+{
+  // no cache lines yet, these come with dt_dev_pixelpipe_alloc_cache()
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 0);
+  pipe->type = DT_DEV_PIXELPIPE_EXPORT;
+  pipe->levels = levels;
+  return res;
+}
+
+int dt_dev_pixelpipe_alloc_cache(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  if(dt_dev_pixelpipe_cache_init(&(pipe->cache), 2, pipe->backbuf_size)) return 1;
+  // leave an empty cache behind so that dt_dev_pixelpipe_cleanup() still works
+  dt_dev_pixelpipe_cache_init(&(pipe->cache), 0, 0);
+  return 0;
+}
+
 int dt_dev_pixelpipe_init_thumbnail(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height)
 {
   int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
@@ -300,6 +332,41 @@ void dt_dev_pixelpipe_remove_node(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, i
 {
 }
 
+/* run a module on the cpu. its openmp threads come from the process wide core budget, so that concurrent pipes
+   (darkroom, thumbnails, exports) together don't start more threads than there are cores.
+   returns non-zero if the pipe got cancelled meanwhile. the module might have stopped half way then, so the
+   output is dropped from the cache and the caller has to bail out. */
+static int
+_pixelpipe_process_on_cpu(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, void *input, void *output,
+                          const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp, const int tiling)
+{
+  // the darkroom pipes get their cores first, thumbnails and exports make do with what's left
+  const int interactive = piece->pipe->type & (DT_DEV_PIXELPIPE_FULL | DT_DEV_PIXELPIPE_PREVIEW);
+  const int cores = dt_cores_acquire(darktable.num_openmp_threads, interactive);
+#ifdef _OPENMP
+  const int max_threads = omp_get_max_threads();
+  omp_set_num_threads(cores);
+#endif
+  const double trace_start = dt_trace_begin();
+  if(tiling)
+    module->process_tiling(module, piece, input, output, roi_in, roi_out, in_bpp);
+  else
+    module->process(module, piece, input, output, roi_in, roi_out);
+  dt_trace_end(DT_TRACE_PIPE, trace_start, "%s [%s]%s", module->op, _pipe_type_to_str(piece->pipe->type),
+               tiling ? " tiled" : "");
+#ifdef _OPENMP
+  omp_set_num_threads(max_threads);
+#endif
+  dt_cores_release(cores, interactive);
+
+  if(dt_iop_cancelled(piece))
+  {
+    dt_dev_pixelpipe_cache_invalidate(&(piece->pipe->cache), output);
+    return 1;
+  }
+  return 0;
+}
+
 static int
 get_output_bpp(dt_iop_module_t *module, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece, dt_develop_t *dev)
 {
@@ -1012,7 +1079,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
           /* now call process_cl of module; module should emit meaningful messages in case of error */
           if (success_opencl) {
+            const double trace_start = dt_trace_begin();
             success_opencl = module->process_cl(module, piece, cl_mem_input, *cl_mem_output, &roi_in, roi_out);
+            dt_trace_end(DT_TRACE_OPENCL, trace_start, "%s [%s]", module->op, _pipe_type_to_str(pipe->type));
             pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_GPU);
             pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
           }
@@ -1130,13 +1199,17 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
           /* now call process_tiling_cl of module; module should emit meaningful messages in case of error */
           if (success_opencl) {
+            const double trace_start = dt_trace_begin();
             success_opencl = module->process_tiling_cl(module, piece, input, *output, &roi_in, roi_out, in_bpp);
+            dt_trace_end(DT_TRACE_OPENCL, trace_start, "%s [%s] tiled", module->op, _pipe_type_to_str(pipe->type));
             pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
             pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_CPU);
           }
 
-          if(pipe->shutdown)
+          /* tiling skips the remaining tiles once cancelled, don't fall back to the cpu for those */
+          if(pipe->shutdown || dt_iop_cancelled(piece))
           {
+            dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
             dt_pthread_mutex_unlock(&pipe->busy_mutex);
             return 1;
           }
@@ -1309,19 +1382,20 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
           }
 
           /* process module on cpu. use tiling if needed and possible. */
+          int cancelled;
           if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
               !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
                                                 MAX(in_bpp, bpp), tiling.factor, tiling.overhead)) {
-            module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
+            cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, TRUE);
             pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
             pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
           } else {
-            module->process(module, piece, input, *output, &roi_in, roi_out);
+            cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, FALSE);
             pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
             pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
           }
 
-          if(pipe->shutdown)
+          if(pipe->shutdown || cancelled)
           {
             dt_pthread_mutex_unlock(&pipe->busy_mutex);
             return 1;
@@ -1420,19 +1494,20 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         }
 
         /* process module on cpu. use tiling if needed and possible. */
+        int cancelled;
         if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
             !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
                                               MAX(in_bpp, bpp), tiling.factor, tiling.overhead)) {
-          module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
+          cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, TRUE);
           pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
           pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
         } else {
-          module->process(module, piece, input, *output, &roi_in, roi_out);
+          cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, FALSE);
           pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
           pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
         }
 
-        if(pipe->shutdown)
+        if(pipe->shutdown || cancelled)
         {
           dt_pthread_mutex_unlock(&pipe->busy_mutex);
           return 1;
@@ -1501,19 +1576,20 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
 
       /* process module on cpu. use tiling if needed and possible. */
+      int cancelled;
       if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
           !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
                                             MAX(in_bpp, bpp), tiling.factor, tiling.overhead)) {
-        module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
+        cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, TRUE);
         pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
         pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
       } else {
-        module->process(module, piece, input, *output, &roi_in, roi_out);
+        cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, FALSE);
         pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
         pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
       }
 
-      if(pipe->shutdown)
+      if(pipe->shutdown || cancelled)
       {
         dt_pthread_mutex_unlock(&pipe->busy_mutex);
         return 1;
@@ -1568,19 +1644,20 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     }
 
     /* process module on cpu. use tiling if needed and possible. */
+    int cancelled;
     if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
         !dt_tiling_piece_fits_host_memory(MAX(roi_in.width, roi_out->width), MAX(roi_in.height, roi_out->height),
                                           MAX(in_bpp, bpp), tiling.factor, tiling.overhead)) {
-      module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
+      cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, TRUE);
       pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
       pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
     } else {
-      module->process(module, piece, input, *output, &roi_in, roi_out);
+      cancelled = _pixelpipe_process_on_cpu(module, piece, input, *output, &roi_in, roi_out, in_bpp, FALSE);
       pixelpipe_flow |=  (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
       pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
     }
 
-    if(pipe->shutdown)
+    if(pipe->shutdown || cancelled)
     {
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
       return 1;
@@ -2184,8 +2261,16 @@ dt_dev_pixelpipe_process_rec_and_backcopy(dt_dev_pixelpipe_t *pipe, dt_develop_t
 int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x, int y, int width, int height, float scale)
 {
   pipe->processing = 1;
+  // the darkroom pipes take priority over thumbnails and exports, for cores and opencl devices
+  const int interactive = pipe->type & (DT_DEV_PIXELPIPE_FULL | DT_DEV_PIXELPIPE_PREVIEW);
+  if(interactive) dt_cores_interactive_begin();
+  const double wait_start = dt_get_wtime(), trace_wait = dt_trace_begin();
   pipe->opencl_enabled = dt_opencl_update_enabled(); // update enabled flag from preferences
   pipe->devid = (pipe->opencl_enabled) ? dt_opencl_lock_device(pipe->type) : -1;  // try to get/lock opencl resource
+  const int locked_devid = pipe->devid;
+  const double run_start = dt_get_wtime();
+  if(run_start - wait_start > 1e-3)
+    dt_trace_end(DT_TRACE_OPENCL, trace_wait, "%s pipe waiting for device", _pipe_type_to_str(pipe->type));
 
   dt_print(DT_DEBUG_OPENCL, "[pixelpipe_process] [%s] using device %d\n", _pipe_type_to_str(pipe->type), pipe->devid);
 
@@ -2228,7 +2313,10 @@ restart:
   int out_bpp;
 
   // run pixelpipe recursively and get error status
+  const double trace_start = dt_trace_begin();
   int err = dt_dev_pixelpipe_process_rec_and_backcopy(pipe, dev, &buf, &cl_mem_out, &out_bpp, &roi, modules, pieces, pos);
+  dt_trace_end(DT_TRACE_PIPE, trace_start, "%s pipe %dx%d%s", _pipe_type_to_str(pipe->type), width, height,
+               err ? " aborted" : "");
 
   // get status summary of opencl queue by checking the eventlist
   int oclerr = (pipe->devid >= 0) ? (dt_opencl_events_flush(pipe->devid, 1) != 0) : 0;
@@ -2267,6 +2355,25 @@ restart:
     dt_opencl_unlock_device(pipe->devid);
     pipe->devid = -1;
   }
+  if(interactive) dt_cores_interactive_end();
+
+  if(darktable.unmuted & DT_DEBUG_PERF)
+  {
+    const double end = dt_get_wtime();
+    const int type = CLAMP(ffs(pipe->type) - 1, 0, 3);
+    pthread_mutex_lock(&_pipe_latency_mutex);
+    dt_dev_pixelpipe_latency_t *l = _pipe_latency + type;
+    l->runs++;
+    l->wait_sum += run_start - wait_start;
+    l->wait_max = MAX(l->wait_max, run_start - wait_start);
+    l->run_sum += end - run_start;
+    dt_print(DT_DEBUG_PERF, "[pixelpipe_process] [%s] waited %.3f secs for device %d, ran %.3f secs%s | "
+                            "%d runs, waited %.3f avg %.3f max, ran %.3f avg\n",
+             _pipe_type_to_str(pipe->type), run_start - wait_start, locked_devid, end - run_start,
+             err ? " (aborted)" : "", l->runs, l->wait_sum / l->runs, l->wait_max, l->run_sum / l->runs);
+    pthread_mutex_unlock(&_pipe_latency_mutex);
+  }
+
   // ... and in case of other errors ...
   if (err)
   {
@@ -2328,6 +2435,89 @@ void dt_dev_pixelpipe_get_dimensions(dt_dev_pixelpipe_t *pipe, struct dt_develop
   dt_pthread_mutex_unlock(&pipe->busy_mutex);
 }
 
+size_t dt_dev_pixelpipe_estimate_memory(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int width, int height, float scale)
+{
+  const int count = g_list_length(pipe->nodes);
+  dt_iop_roi_t *rois = (dt_iop_roi_t *)malloc(sizeof(dt_iop_roi_t) * 2 * count);
+  int *active = (int *)calloc(count, sizeof(int));
+  if(!rois || !active)
+  {
+    free(rois);
+    free(active);
+    return 0;
+  }
+
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  // walk the pipe backwards to get the same regions of interest as dt_dev_pixelpipe_process_rec()
+  dt_iop_roi_t roi_out = (dt_iop_roi_t)
+  {
+    0, 0, width, height, scale
+  };
+  GList *modules = g_list_last(dev->iop);
+  GList *pieces  = g_list_last(pipe->nodes);
+  for(int k = count - 1; k >= 0 && modules && pieces; k--)
+  {
+    dt_iop_module_t *module = (dt_iop_module_t *)modules->data;
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)pieces->data;
+    if(piece->enabled && !(dev->gui_module && dev->gui_module->operation_tags_filter() & module->operation_tags()))
+    {
+      dt_iop_roi_t roi_in = roi_out;
+      module->modify_roi_in(module, piece, &roi_out, &roi_in);
+      rois[2*k] = roi_in;
+      rois[2*k+1] = roi_out;
+      active[k] = 1;
+      roi_out = roi_in;
+    }
+    modules = g_list_previous(modules);
+    pieces  = g_list_previous(pieces);
+  }
+
+  // and forward again for the pixel formats. input and output of every module live in the cache lines, which
+  // grow to the largest buffer. on top of that comes what the worst module needs for itself.
+  int in_bpp = get_output_bpp(NULL, pipe, NULL, dev);
+  const size_t input = (size_t)pipe->iwidth * pipe->iheight * in_bpp;
+  size_t line = pipe->backbuf_size;
+  size_t peak = 0;
+  modules = dev->iop;
+  pieces  = pipe->nodes;
+  for(int k = 0; k < count && modules && pieces; k++)
+  {
+    dt_iop_module_t *module = (dt_iop_module_t *)modules->data;
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)pieces->data;
+    modules = g_list_next(modules);
+    pieces  = g_list_next(pieces);
+    if(!active[k]) continue;
+
+    const dt_iop_roi_t *roi_in = rois + 2*k, *roi_o = rois + 2*k + 1;
+    const int bpp = get_output_bpp(module, pipe, piece, dev);
+    dt_develop_tiling_t tiling = { 0 };
+    dt_develop_tiling_t tiling_blendop = { 0 };
+    module->tiling_callback(module, piece, roi_in, roi_o, &tiling);
+    tiling_callback_blendop(module, piece, roi_in, roi_o, &tiling_blendop);
+    tiling.factor = fmax(tiling.factor, tiling_blendop.factor);
+    tiling.overhead = fmax(tiling.overhead, tiling_blendop.overhead);
+
+    const size_t wd = MAX(roi_in->width, roi_o->width);
+    const size_t ht = MAX(roi_in->height, roi_o->height);
+    const int max_bpp = MAX(in_bpp, bpp);
+    line = MAX(line, wd * ht * max_bpp);
+    // the factor includes input and output
+    size_t own = fmax(tiling.factor - 2.0f, 0.0f) * wd * ht * max_bpp + tiling.overhead;
+    // tiling keeps it within the host memory limit
+    if((module->flags() & IOP_FLAGS_ALLOW_TILING)
+       && !dt_tiling_piece_fits_host_memory(wd, ht, max_bpp, tiling.factor, tiling.overhead))
+      own = MIN(own, (size_t)dt_conf_get_int("host_memory_limit") << 20);
+    peak = MAX(peak, own);
+    in_bpp = bpp;
+  }
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  free(rois);
+  free(active);
+
+  // export and thumbnail pipes have two cache lines
+  return input + 2 * line + peak;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
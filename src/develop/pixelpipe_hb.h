@@ -135,6 +135,11 @@ int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe);
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe);
 // inits the pixelpipe with settings optimized for full-image export (no history stack cache)
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels);
+// like dt_dev_pixelpipe_init_export(), but the pixel caches are only allocated by dt_dev_pixelpipe_alloc_cache().
+// that way the nodes can be set up and the memory needed can be estimated before committing to it.
+int dt_dev_pixelpipe_init_export_deferred(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels);
+// allocates the pixel caches of a pipe set up by dt_dev_pixelpipe_init_export_deferred(). returns 0 on failure.
+int dt_dev_pixelpipe_alloc_cache(dt_dev_pixelpipe_t *pipe);
 // inits the pixelpipe with settings optimized for thumbnail export (no history stack cache)
 int dt_dev_pixelpipe_init_thumbnail(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height);
 // inits all but the pixel caches, so you can't actually process an image (just get dimensions and distortions)
@@ -147,6 +152,10 @@ void dt_dev_pixelpipe_set_input(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *d
 // returns the dimensions of the full image after processing.
 void dt_dev_pixelpipe_get_dimensions(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int width_in, int height_in, int *width, int *height);
 
+// estimates the peak memory (in bytes) processing a region of width x height at the given scale takes, using the
+// tiling requirements of all enabled modules. includes the input buffer and the cache lines of the pipe.
+size_t dt_dev_pixelpipe_estimate_memory(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int width, int height, float scale);
+
 // destroys all allocated data.
 void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe);
 
@@ -38,6 +38,7 @@
 #include "control/signal.h"
 #include "views/view.h"
 #include "common/styles.h"
+#include "common/trace.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -232,6 +233,15 @@ static gboolean fullscreen_key_accel_callback(GtkAccelGroup *accel_group,
   return TRUE;
 }
 
+static gboolean trace_key_accel_callback(GtkAccelGroup *accel_group,
+    GObject *acceleratable, guint keyval,
+    GdkModifierType modifier,
+    gpointer data)
+{
+  dt_trace_toggle();
+  return TRUE;
+}
+
 static gboolean view_switch_key_accel_callback(GtkAccelGroup *accel_group,
     GObject *acceleratable, guint keyval,
     GdkModifierType modifier,
@@ -983,6 +993,13 @@ dt_gui_gtk_init(dt_gui_gtk_t *gui, int argc, char *argv[])
     "switch view",
     g_cclosure_new(G_CALLBACK(view_switch_key_accel_callback), NULL, NULL));
 
+  // timeline trace, no default key
+  dt_accel_register_global(NC_("accel", "toggle timeline trace"), 0, 0);
+
+  dt_accel_connect_global(
+    "toggle timeline trace",
+    g_cclosure_new(G_CALLBACK(trace_key_accel_callback), NULL, NULL));
+
   darktable.gui->reset = 0;
   for(int i=0; i<3; i++) darktable.gui->bgcolor[i] = 0.1333;
 
@@ -26,9 +26,11 @@ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
  *******************************************************************/
 
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <xmmintrin.h>
 
 /*******************************************************************
  * Hash table implementation for permutohedral lattice             *
@@ -82,73 +84,109 @@ public:
     return values;
   }
 
-  /* Returns the index into the hash table for a given key.
+  // Worst case memory per vector in bytes: right after growing, the table is only a quarter
+  // full and the key and value arrays half.
+  static size_t memory_per_entry()
+  {
+    return 4*sizeof(Entry) + 2*(KD*sizeof(short) + VD*sizeof(float));
+  }
+
+  // Makes room for n more vectors, so they can be added without growing the table in between.
+  void reserve(size_t n)
+  {
+    while (filled + n >= (capacity/2)-1)
+      grow();
+  }
+
+  /* Hints that the entry for the key with the given hash will be looked up soon.
+   * Looking up a handful of keys takes about as long as one cache miss if they're
+   * prefetched first, instead of one miss after the other. */
+  void prefetch(uint64_t h) const
+  {
+    _mm_prefetch((const char *)(entries + (h & capacity_bits)), _MM_HINT_T0);
+  }
+
+  /* Returns the index of the vector with the given key and hash, or -1 if there is none.
+   * Doesn't modify the table, so any number of threads can look up at once.
+   */
+  int lookupIndex(const short *key, uint64_t h) const
+  {
+    for (h &= capacity_bits;; h = (h + 1) & capacity_bits)
+    {
+      const Entry &e = entries[h];
+      if (e.index == -1) return -1;
+      if (!memcmp(e.key, key, sizeof(short)*KD)) return e.index;
+    }
+  }
+
+  int lookupIndex(const short *key) const
+  {
+    return lookupIndex(key, hash(key));
+  }
+
+  /* Returns the index into the values array for a given key and its hash,
+   * creating the entry if it's not there yet.
    *     key: a pointer to the position vector.
    *       h: hash of the position vector.
-   *  create: a flag specifying whether an entry should be created,
-   *          should an entry with the given key not found.
    */
-  int lookupOffset(const short *key, size_t h, bool create = true)
+  int lookupOffset(const short *key, uint64_t h)
   {
-
     // Double hash table size if necessary
     if (filled >= (capacity/2)-1)
     {
       grow();
     }
 
-    // Find the entry with the given key
-    while (1)
+    // Find the entry with the given key. The entries keep a copy of their key,
+    // so probing doesn't have to go elsewhere in memory.
+    for (h &= capacity_bits;; h = (h + 1) & capacity_bits)
     {
-      Entry e = entries[h];
+      Entry &e = entries[h];
       // check if the cell is empty
-      if (e.keyIdx == -1)
+      if (e.index == -1)
       {
-        if (!create) return -1; // Return not found.
         // need to create an entry. Store the given key.
-        for (int i = 0; i < KD; i++)
-          keys[filled*KD+i] = key[i];
-        e.keyIdx = filled*KD;
-        e.valueIdx = filled*VD;
-        entries[h] = e;
-        filled++;
-        return e.valueIdx;
+        memcpy(e.key, key, sizeof(short)*KD);
+        memcpy(keys + filled*KD, key, sizeof(short)*KD);
+        e.index = filled++;
+        return e.index*VD;
       }
 
       // check if the cell has a matching key
-      bool match = true;
-      for (int i = 0; i < KD && match; i++)
-        match = keys[e.keyIdx+i] == key[i];
-      if (match)
-        return e.valueIdx;
-
-      // increment the bucket with wraparound
-      h++;
-      if (h == capacity) h = 0;
+      if (!memcmp(e.key, key, sizeof(short)*KD))
+        return e.index*VD;
     }
   }
 
-  /* Looks up the value vector associated with a given key vector.
+  int lookupOffset(const short *key)
+  {
+    return lookupOffset(key, hash(key));
+  }
+
+  /* Looks up the value vector associated with a given key vector,
+   * creating it if it doesn't exist yet.
    *        k : pointer to the key vector to be looked up.
-   *   create : true if a non-existing key should be created.
    */
-  float *lookup(const short *k, bool create = true)
+  float *lookup(const short *k)
   {
-    size_t h = hash(k) & capacity_bits;
-    int offset = lookupOffset(k, h, create);
-    if (offset < 0) return NULL;
-    else return values + offset;
+    // lookupOffset() might grow the table and move the values
+    const int offset = lookupOffset(k);
+    return values + offset;
   };
 
-  /* Hash function used in this implementation. A simple base conversion. */
-  size_t hash(const short *key)
+  /* Hash function used in this implementation. A simple base conversion,
+   * mixed so the low bits used to index the table depend on all of the key. */
+  static uint64_t hash(const short *key)
   {
-    size_t k = 0;
+    uint64_t k = 0;
     for (int i = 0; i < KD; i++)
     {
       k += key[i];
       k *= 2531011;
     }
+    k ^= k >> 29;
+    k *= 0xbf58476d1ce4e5b9ull;
+    k ^= k >> 32;
     return k;
   }
 
@@ -178,9 +216,9 @@ private:
     // Migrate the table of indices.
     for (size_t i = 0; i < oldCapacity; i++)
     {
-      if (entries[i].keyIdx == -1) continue;
-      size_t h = hash(keys + entries[i].keyIdx) & capacity_bits;
-      while (newEntries[h].keyIdx != -1)
+      if (entries[i].index == -1) continue;
+      size_t h = hash(entries[i].key) & capacity_bits;
+      while (newEntries[h].index != -1)
       {
         h++;
         if (h == capacity) h = 0;
@@ -191,12 +229,12 @@ private:
     entries = newEntries;
   }
 
-  // Private struct for the hash table entries.
+  // Private struct for the hash table entries: the key and the index of its value vector.
   struct Entry
   {
-    Entry() : keyIdx(-1), valueIdx(-1) {}
-    int keyIdx;
-    int valueIdx;
+    Entry() : index(-1) {}
+    short key[KD];
+    int index;
   };
 
   short *keys;
@@ -285,7 +323,6 @@ public:
     int greedy[D+1];
     int rank[D+1];
     float barycentric[D+2];
-    short key[D];
 
     // first rotate position into the (d+1)-dimensional hyperplane
     elevated[D] = -D*position[D-1]*scaleFactor[D-1];
@@ -298,7 +335,9 @@ public:
     // prepare to find the closest lattice points
     float scale = 1.0f/(D+1);
 
-    // greedily search for the closest zero-colored lattice point
+    // greedily search for the closest zero-colored lattice point.
+    // the comparisons in here come out either way about as often, so they're all written
+    // as selects instead of branches.
     int sum = 0;
     for (int i = 0; i <= D; i++)
     {
@@ -306,8 +345,7 @@ public:
       float up = ceilf(v)*(D+1);
       float down = floorf(v)*(D+1);
 
-      if (up - elevated[i] < elevated[i] - down) greedy[i] = up;
-      else greedy[i] = down;
+      greedy[i] = (up - elevated[i] < elevated[i] - down) ? up : down;
 
       sum += greedy[i];
     }
@@ -315,41 +353,26 @@ public:
 
     // rank differential to find the permutation between this simplex and the canonical one.
     // (See pg. 3-4 in paper.)
+    float differential[D+1];
+    for (int i = 0; i <= D; i++)
+      differential[i] = elevated[i] - greedy[i];
     memset(rank, 0, sizeof rank);
     for (int i = 0; i < D; i++)
       for (int j = i+1; j <= D; j++)
-        if (elevated[i] - greedy[i] < elevated[j] - greedy[j]) rank[i]++;
-        else rank[j]++;
-
-    if (sum > 0)
-    {
-      // sum too large - the point is off the hyperplane.
-      // need to bring down the ones with the smallest differential
-      for (int i = 0; i <= D; i++)
       {
-        if (rank[i] >= D + 1 - sum)
-        {
-          greedy[i] -= D+1;
-          rank[i] += sum - (D+1);
-        }
-        else
-          rank[i] += sum;
+        const int smaller = differential[i] < differential[j];
+        rank[i] += smaller;
+        rank[j] += 1 - smaller;
       }
-    }
-    else if (sum < 0)
+
+    // if sum is too large, the point is off the hyperplane and the ones with the smallest
+    // differential need to be brought down. if it is too small, the ones with the largest
+    // differential need to be brought up.
+    for (int i = 0; i <= D; i++)
     {
-      // sum too small - the point is off the hyperplane
-      // need to bring up the ones with largest differential
-      for (int i = 0; i <= D; i++)
-      {
-        if (rank[i] < -sum)
-        {
-          greedy[i] += D+1;
-          rank[i] += (D+1) + sum;
-        }
-        else
-          rank[i] += sum;
-      }
+      const int shift = (sum < 0 && rank[i] < -sum) - (sum > 0 && rank[i] >= D + 1 - sum);
+      greedy[i] += shift*(D+1);
+      rank[i] += sum + shift*(D+1);
     }
 
     // Compute barycentric coordinates (See pg.10 of paper.)
@@ -361,23 +384,36 @@ public:
     }
     barycentric[0] += 1.0f + barycentric[D+1];
 
-    // Splat the value into each vertex of the simplex, with barycentric weights.
+    // Compute the location of the lattice points explicitly (all but the last coordinate - it's redundant
+    // because they sum to zero), and have their entries fetched while doing the others.
+    HashTablePermutohedral<D,VD> &table = hashTables[thread_index];
+    short keys[D+1][D];
+    uint64_t hashes[D+1];
     for (int remainder = 0; remainder <= D; remainder++)
     {
-      // Compute the location of the lattice point explicitly (all but the last coordinate - it's redundant because they sum to zero)
       for (int i = 0; i < D; i++)
-        key[i] = greedy[i] + canonical[remainder*(D+1) + rank[i]];
+        keys[remainder][i] = greedy[i] + canonical[remainder*(D+1) + rank[i]];
+      hashes[remainder] = table.hash(keys[remainder]);
+      table.prefetch(hashes[remainder]);
+    }
 
+    // Splat the value into each vertex of the simplex, with barycentric weights.
+    for (int remainder = 0; remainder <= D; remainder++)
+    {
       // Retrieve pointer to the value at this vertex.
-      float * val = hashTables[thread_index].lookup(key, true);
+      const int offset = table.lookupOffset(keys[remainder], hashes[remainder]);
+      float * val = table.getValues() + offset;
 
       // Accumulate values with barycentric weight.
-      for (int i = 0; i < VD; i++)
-        val[i] += barycentric[remainder]*value[i];
+      if (VD == 4)
+        _mm_storeu_ps(val, _mm_add_ps(_mm_loadu_ps(val), _mm_mul_ps(_mm_set1_ps(barycentric[remainder]), _mm_loadu_ps(value))));
+      else
+        for (int i = 0; i < VD; i++)
+          val[i] += barycentric[remainder]*value[i];
 
       // Record this interaction to use later when slicing
       replay[replay_index*(D+1)+remainder].table = thread_index;
-      replay[replay_index*(D+1)+remainder].offset = val - hashTables[thread_index].getValues();
+      replay[replay_index*(D+1)+remainder].offset = offset;
       replay[replay_index*(D+1)+remainder].weight = barycentric[remainder];
     }
   }
@@ -388,7 +424,13 @@ public:
     if (nThreads <= 1)
       return;
 
-    /* Merge the multiple hash tables into one, creating an offset remap table. */
+    /* Merge the multiple hash tables into one, creating an offset remap table.
+     * Make room for all of them first, so the first table doesn't grow step by step. */
+    size_t total = 0;
+    for (int i = 1; i < nThreads; i++)
+      total += hashTables[i].size();
+    hashTables[0].reserve(total);
+
     int *offset_remap[nThreads];
     for (int i = 1; i < nThreads; i++)
     {
@@ -398,18 +440,26 @@ public:
       offset_remap[i] = new int[filled];
       for (int j = 0; j < filled; j++)
       {
-        float *val = hashTables[0].lookup(oldKeys+j*D, true);
-        const float *oldVal = oldVals + j*VD;
+        const int offset = hashTables[0].lookupOffset(oldKeys+(size_t)j*D);
+        float *val = hashTables[0].getValues() + offset;
+        const float *oldVal = oldVals + (size_t)j*VD;
         for (int k = 0; k < VD; k++)
           val[k] += oldVal[k];
-        offset_remap[i][j] = val - hashTables[0].getValues();
+        offset_remap[i][j] = offset;
       }
     }
 
     /* Rewrite the offsets in the replay structure from the above generated table. */
-    for (int i = 0; i < nData*(D+1); i++)
+    const size_t n = (size_t)nData*(D+1);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) shared(offset_remap)
+#endif
+    for (size_t i = 0; i < n; i++)
       if (replay[i].table > 0)
+      {
         replay[i].offset = offset_remap[replay[i].table][replay[i].offset/VD];
+        replay[i].table = 0;
+      }
 
     for (int i = 1; i < nThreads; i++)
       delete[] offset_remap[i];
@@ -422,6 +472,17 @@ public:
   void slice(float *col, size_t replay_index)
   {
     float *base = hashTables[0].getValues();
+    if (VD == 4)
+    {
+      __m128 sum = _mm_setzero_ps();
+      for (int i = 0; i <= D; i++)
+      {
+        const ReplayEntry r = replay[replay_index*(D+1)+i];
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(r.weight), _mm_loadu_ps(base + r.offset)));
+      }
+      _mm_storeu_ps(col, sum);
+      return;
+    }
     for (int j = 0; j < VD; j++) col[j] = 0;
     for (int i = 0; i <= D; i++)
     {
@@ -436,9 +497,12 @@ public:
   /* Performs a Gaussian blur along each projected axis in the hyperplane. */
   void blur()
   {
+    HashTablePermutohedral<D,VD> &table = hashTables[0];
+    const int n = table.size();
+
     // Prepare arrays
-    float *newValue = new float[VD*hashTables[0].size()];
-    float *oldValue = hashTables[0].getValues();
+    float *newValue = new float[(size_t)VD*n];
+    float *oldValue = table.getValues();
     float *hashTableBase = oldValue;
 
     float zero[VD];
@@ -448,12 +512,12 @@ public:
     for (int j = 0; j <= D; j++)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for shared(j, oldValue, newValue, hashTableBase, zero)
+      #pragma omp parallel for schedule(static) shared(j, oldValue, newValue, zero)
 #endif
       // For each vertex in the lattice,
-      for (int i = 0; i < hashTables[0].size(); i++)   // blur point i in dimension j
+      for (int i = 0; i < n; i++)   // blur point i in dimension j
       {
-        const short *key    = hashTables[0].getKeys() + i*(D); // keys to current vertex
+        const short *key = table.getKeys() + (size_t)i*D; // keys to current vertex
         short neighbor1[D+1];
         short neighbor2[D+1];
         for (int k = 0; k < D; k++)
@@ -464,18 +528,17 @@ public:
         neighbor1[j] = key[j] - D;
         neighbor2[j] = key[j] + D; // keys to the neighbors along the given axis.
 
-        float *oldVal = oldValue + i*VD;
-        float *newVal = newValue + i*VD;
-
-        float *vm1, *vp1;
-
-        vm1 = hashTables[0].lookup(neighbor1, false); // look up first neighbor
-        if (vm1) vm1 = vm1 - hashTableBase + oldValue;
-        else vm1 = zero;
+        // look up both neighbors at once. the table doesn't change anymore, so all threads can.
+        const uint64_t h1 = table.hash(neighbor1), h2 = table.hash(neighbor2);
+        table.prefetch(h1);
+        table.prefetch(h2);
+        const int i1 = table.lookupIndex(neighbor1, h1);
+        const int i2 = table.lookupIndex(neighbor2, h2);
 
-        vp1 = hashTables[0].lookup(neighbor2, false); // look up second neighbor
-        if (vp1) vp1 = vp1 - hashTableBase + oldValue;
-        else vp1 = zero;
+        const float *oldVal = oldValue + (size_t)i*VD;
+        float *newVal = newValue + (size_t)i*VD;
+        const float *vm1 = i1 >= 0 ? oldValue + (size_t)i1*VD : zero;
+        const float *vp1 = i2 >= 0 ? oldValue + (size_t)i2*VD : zero;
 
         // Mix values of the three vertices
         for (int k = 0; k < VD; k++)
@@ -490,7 +553,7 @@ public:
     // depending where we ended up, we may have to copy data
     if (oldValue != hashTableBase)
     {
-      memcpy(hashTableBase, oldValue, hashTables[0].size()*VD*sizeof(float));
+      memcpy(hashTableBase, oldValue, (size_t)n*VD*sizeof(float));
       delete[] oldValue;
     }
     else
@@ -499,6 +562,15 @@ public:
     }
   }
 
+  /* Memory in bytes that filtering nData points takes if they end up on nVertices distinct
+   * lattice points, for tiling_callback(). Every vertex may be in one of the per thread tables
+   * and in the merged one, and the blur needs one more value vector. */
+  static size_t memory_use(size_t nData, size_t nVertices)
+  {
+    const size_t blur = VD*sizeof(float);
+    return nData*(D+1)*sizeof(ReplayEntry) + nVertices*(2*HashTablePermutohedral<D,VD>::memory_per_entry() + blur);
+  }
+
 private:
 
   int nData;
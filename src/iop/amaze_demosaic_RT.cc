@@ -336,6 +336,9 @@ amaze_demosaic_RT(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, c
     for (top=winy-16; top < winy+height; top += TS-32)
       for (left=winx-16; left < winx+width; left += TS-32)
       {
+        // darktable: skip the remaining tiles if the pipe doesn't need the result any more
+        if(dt_iop_cancelled(piece)) continue;
+
         memset(nyquist, 0, sizeof(char)*TS*TSH);
         memset(rbint, 0, sizeof(float)*TS*TSH);
         //location of tile bottom edge
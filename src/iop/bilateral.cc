@@ -292,7 +292,12 @@ extern "C"
     sigma[0] = data->sigma[0] * roi_in->scale / piece->iscale;
     sigma[1] = data->sigma[1] * roi_in->scale / piece->iscale;
     const int rad = (int)(3.0*fmaxf(sigma[0],sigma[1])+1.0);
-    tiling->factor = 2 + 50;
+    // input and output, and for the larger radii the lattice. noisy input at small color sigmas
+    // gives every pixel vertices of its own, up to all of the 5+1 of its simplex.
+    const size_t pixels = (size_t)roi_in->width*roi_in->height;
+    tiling->factor = 2;
+    if(rad > 6 && pixels)
+      tiling->factor += (float)PermutohedralLattice<5,4>::memory_use(pixels, pixels*6) / (pixels*4*sizeof(float));
     tiling->overhead = 0;
     tiling->overlap = rad;
     tiling->xalign = 1;
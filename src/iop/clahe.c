@@ -23,6 +23,7 @@
 #include "develop/develop.h"
 #include "develop/imageop.h"
 #include "control/control.h"
+#include "develop/tiling.h"
 #include "dtgtk/slider.h"
 #include "dtgtk/resetlabel.h"
 #include "gui/gtk.h"
@@ -32,6 +33,7 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <xmmintrin.h>
 
 #define CLIP(x) ((x<0)?0.0:(x>1.0)?1.0:x)
 
@@ -77,163 +79,214 @@ int flags()
   return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED;
 }
 
-void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+#define BINS 256
+
+// the equalization is evaluated on a grid of pixels this fraction of the radius apart, and interpolated
+// bilinearly in between. that costs about 4/CLAHE_GRID^2 histogram updates per pixel, independent of the radius.
+#define CLAHE_GRID 2
+
+static inline int grid_spacing(const int rad)
 {
-  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
-  const int ch = piece->colors;
+  return MAX(1, rad/CLAHE_GRID);
+}
 
-  // PASS1: Get a luminance map of image...
-  float *luminance=(float *)malloc(((size_t)roi_out->width*roi_out->height)*sizeof(float));
-  //double lsmax=0.0,lsmin=1.0;
+/* the histogram bin of every pixel's luminance, i.e. the average of the clipped rgb max and min */
+static void get_bins(const float *in, uint16_t *bins, const int width, const int height, const int ch)
+{
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(0.5f*BINS), half = _mm_set1_ps(0.5f);
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid)
+  #pragma omp parallel for default(none) schedule(static) shared(in,bins)
 #endif
-  for(int j=0; j<roi_out->height; j++)
+  for(int j=0; j<height; j++)
   {
-    float *in=(float *)ivoid+(size_t)j*roi_out->width*ch;
-    float *lm=luminance+(size_t)j*roi_out->width;
-    for(int i=0; i<roi_out->width; i++)
+    const float *px = in + (size_t)j*width*ch;
+    uint16_t *b = bins + (size_t)j*width;
+    int i = 0;
+    // four pixels at a time: transpose to r, g, b vectors
+    for(; i<width-3; i+=4, px+=4*ch)
     {
-      double pmax=CLIP(fmax(in[0],fmax(in[1],in[2]))); // Max value in RGB set
-      double pmin=CLIP(fmin(in[0],fmin(in[1],in[2]))); // Min value in RGB set
-      *lm=(pmax+pmin)/2.0;        // Pixel luminocity
-      in+=ch;
-      lm++;
+      __m128 p0 = _mm_load_ps(px), p1 = _mm_load_ps(px+ch), p2 = _mm_load_ps(px+2*ch), p3 = _mm_load_ps(px+3*ch);
+      _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+      const __m128 pmax = _mm_min_ps(one, _mm_max_ps(zero, _mm_max_ps(p0, _mm_max_ps(p1, p2))));
+      const __m128 pmin = _mm_min_ps(one, _mm_max_ps(zero, _mm_min_ps(p0, _mm_min_ps(p1, p2))));
+      float v[4] __attribute__((aligned(16)));
+      _mm_store_ps(v, _mm_add_ps(_mm_mul_ps(_mm_add_ps(pmax, pmin), scale), half));
+      for(int k=0; k<4; k++) b[i+k] = (uint16_t)v[k];
+    }
+    for(; i<width; i++, px+=ch)
+    {
+      const float pmax = CLIP(fmaxf(px[0], fmaxf(px[1], px[2])));
+      const float pmin = CLIP(fminf(px[0], fminf(px[1], px[2])));
+      b[i] = ROUND_POSISTIVE((pmax + pmin)*0.5f*BINS);
     }
   }
+}
 
-
-  // Params
-  const int rad=data->radius*roi_in->scale/piece->iscale;
-
-  const int bins=256;
-  const float slope=data->slope;
-
-  // CLAHE
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid,ovoid)
-#endif
-  for(int j=0; j<roi_out->height; j++)
+/* the mapping from luminance bin to equalized luminance for the window of the given radius around (x, y):
+   the contrast limited histogram of the window, with the clipped counts spread over all bins, integrated. */
+static void get_mapping(const uint16_t *bins, const int width, const int height, const int x, const int y,
+                        const int rad, const float slope, float *map)
+{
+  int hist[BINS+1];
+  const int yMin = MAX(0, y - rad), yMax = MIN(height, y + rad + 1);
+  const int xMin = MAX(0, x - rad), xMax = MIN(width, x + rad + 1);
+  const int n = (yMax - yMin) * (xMax - xMin);
+  const int limit = ( int )( slope * n /  BINS + 0.5f );
+
+  memset(hist, 0, (BINS+1)*sizeof(int));
+  for(int yi = yMin; yi < yMax; yi++)
   {
-    int yMin = fmax( 0, j - rad );
-    int yMax = fmin( roi_in->height, j + rad + 1 );
-    int h = yMax - yMin;
-
-    int xMin0 = fmax( 0, 0-rad );
-    int xMax0 = fmin( roi_in->width - 1, rad );
-
-    int hist[bins+1];
-    int clippedhist[bins+1];
-    float dest[roi_out->width];
-
-    /* initially fill histogram */
-    memset(hist,0,(bins+1)*sizeof(int));
-    for ( int yi = yMin; yi < yMax; ++yi )
-      for ( int xi = xMin0; xi < xMax0; ++xi )
-        ++hist[ ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xi] * (float)bins) ];
-
-    // Destination row
-    memset(dest,0,roi_out->width*sizeof(float));
-    float *ld=dest;
+    const uint16_t *b = bins + (size_t)yi*width;
+    for(int xi = xMin; xi < xMax; xi++) hist[b[xi]]++;
+  }
 
-    for(int i=0; i<roi_out->width; i++)
+  /* clip histogram and redistribute clipped entries */
+  int ce = 0, ceb = 0;
+  do
+  {
+    ceb = ce;
+    ce = 0;
+    for ( int b = 0; b <= BINS; b++ )
     {
-
-      int v = ROUND_POSISTIVE(luminance[(size_t)j*roi_in->width+i] * (float)bins);
-
-      int xMin = fmax( 0, i - rad );
-      int xMax = i + rad + 1;
-      int w = fmin( roi_in->width, xMax ) - xMin;
-      int n = h * w;
-
-      int limit = ( int )( slope * n /  bins + 0.5f );
-
-      /* remove left behind values from histogram */
-      if ( xMin > 0 )
-      {
-        int xMin1 = xMin - 1;
-        for ( int yi = yMin; yi < yMax; ++yi )
-          --hist[  ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xMin1] * (float)bins) ];
-      }
-
-      /* add newly included values to histogram */
-      if ( xMax <= roi_in->width )
-      {
-        int xMax1 = xMax - 1;
-        for ( int yi = yMin; yi < yMax; ++yi )
-          ++hist[  ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xMax1] * (float)bins) ];
-      }
-
-      /* clip histogram and redistribute clipped entries */
-      memcpy(clippedhist,hist,(bins+1)*sizeof(int));
-      int ce = 0, ceb=0;
-      do
+      const int d = hist[ b ] - limit;
+      if ( d > 0 )
       {
-        ceb = ce;
-        ce = 0;
-        for ( int b = 0; b <= bins; b++ )
-        {
-          int d = clippedhist[ b ] - limit;
-          if ( d > 0 )
-          {
-            ce += d;
-            clippedhist[ b ] = limit;
-          }
-        }
-
-        int d = (ce / (float) ( bins + 1 ));
-        int m = ce % ( bins + 1 );
-        for ( int h = 0; h <= bins; h++)
-          clippedhist[ h ] += d;
-
-        if ( m != 0 )
-        {
-          int s = bins / (float)m;
-          for ( int h = 0; h <= bins; h += s )
-            ++clippedhist[ h ];
-        }
+        ce += d;
+        hist[ b ] = limit;
       }
-      while ( ce != ceb);
+    }
 
-      /* build cdf of clipped histogram */
-      int hMin = bins;
-      for ( int h = 0; h < hMin; h++ )
-        if ( clippedhist[ h ] != 0 ) hMin = h;
+    const int d = (ce / (float) ( BINS + 1 ));
+    const int m = ce % ( BINS + 1 );
+    for ( int h = 0; h <= BINS; h++)
+      hist[ h ] += d;
 
-      int cdf = 0;
-      for ( int h = hMin; h <= v; h++ )
-        cdf += clippedhist[ h ];
+    if ( m != 0 )
+    {
+      const int s = BINS / (float)m;
+      for ( int h = 0; h <= BINS; h += s )
+        ++hist[ h ];
+    }
+  }
+  while ( ce != ceb);
+
+  /* cdf of clipped histogram, normalized to what's between its first non-empty bin and the end */
+  int hMin = BINS;
+  for ( int h = 0; h < hMin; h++ )
+    if ( hist[ h ] != 0 ) hMin = h;
+  int cdfMax = 0;
+  for ( int h = hMin; h <= BINS; h++ ) cdfMax += hist[ h ];
+  const int cdfMin = hist[ hMin ];
+  const float norm = 1.0f / MAX(1, cdfMax - cdfMin);
+
+  int cdf = 0;
+  for ( int h = 0; h <= BINS; h++ )
+  {
+    if ( h >= hMin ) cdf += hist[ h ];
+    map[ h ] = ( cdf - cdfMin ) * norm;
+  }
+}
 
-      int cdfMax = cdf;
-      for ( int h = v + 1; h <= bins; h++ )
-        cdfMax += clippedhist[ h ];
+void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
+  const int ch = piece->colors;
+  const int width = roi_out->width, height = roi_out->height;
 
-      int cdfMin = clippedhist[ hMin ];
+  // Params
+  const int rad=data->radius*roi_in->scale/piece->iscale;
+  const float slope=data->slope;
 
-      *ld=( cdf - cdfMin ) / ( float )( cdfMax - cdfMin );
+  // PASS1: Get a luminance map of image...
+  uint16_t *bins = (uint16_t *)dt_alloc_align(16, (size_t)width*height*sizeof(uint16_t));
+  // CLAHE: mappings of two rows of grid points at a time
+  const int s = grid_spacing(rad);
+  const int nx = (width - 1 + s - 1)/s + 1, ny = (height - 1 + s - 1)/s + 1;
+  float *maps = (float *)dt_alloc_align(16, (size_t)2*nx*(BINS+1)*sizeof(float));
+  if(!bins || !maps)
+  {
+    dt_free_align(bins);
+    dt_free_align(maps);
+    memcpy(ovoid, ivoid, (size_t)width*height*ch*sizeof(float));
+    return;
+  }
+  get_bins((const float *)ivoid, bins, width, height, ch);
 
-      ld++;
+  float *map0 = maps, *map1 = maps + (size_t)nx*(BINS+1);
+  for(int gy=0; gy<ny; gy++)
+  {
+    if(dt_iop_cancelled(piece)) break;
+    // grid rows gy-1 and gy, the last one sits on the last pixel row
+    const int y1 = MIN(gy*s, height-1), y0 = gy > 0 ? MIN((gy-1)*s, height-1) : y1;
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) schedule(dynamic) shared(bins,map1)
+#endif
+    for(int gx=0; gx<nx; gx++)
+      get_mapping(bins, width, height, MIN(gx*s, width-1), y1, rad, slope, map1 + (size_t)gx*(BINS+1));
+    if(gy == 0)
+    {
+      // nothing to interpolate yet, unless this is the only grid row
+      float *t = map0;
+      map0 = map1;
+      map1 = t;
+      if(ny > 1) continue;
+      map1 = map0;
     }
 
-    // Apply row
-    float *in = ((float *)ivoid) + (size_t)j*roi_out->width*ch;
-    float *out = ((float *)ovoid) + (size_t)j*roi_out->width*ch;
-    for(int r=0; r<roi_out->width; r++)
+    // interpolate the pixel rows between the two grid rows, including the lower one only at the end
+    const int jMin = y0, jMax = gy == ny-1 ? height : y1;
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) schedule(static) shared(bins,map0,map1,ivoid,ovoid)
+#endif
+    for(int j=jMin; j<jMax; j++)
     {
-      float H, S, L;
-      rgb2hsl(in,&H,&S,&L);
-      //hsl2rgb(out,H,S,( L / dest[r] ) * (L-lsmin) + lsmin );
-      hsl2rgb(out,H,S,dest[r] );
-      out += ch;
-      in += ch;
-      ld++;
+      const float fy = y1 > y0 ? (j - y0)/(float)(y1 - y0) : 0.0f;
+      const uint16_t *b = bins + (size_t)j*width;
+      const float *in = ((const float *)ivoid) + (size_t)j*width*ch;
+      float *out = ((float *)ovoid) + (size_t)j*width*ch;
+      for(int i=0; i<width; i++, in+=ch, out+=ch)
+      {
+        const int gx0 = MIN(i/s, nx-1), gx1 = MIN(gx0+1, nx-1);
+        const int x0 = MIN(gx0*s, width-1), x1 = MIN(gx1*s, width-1);
+        const float fx = x1 > x0 ? (i - x0)/(float)(x1 - x0) : 0.0f;
+        const int v = b[i];
+        const float *m00 = map0 + (size_t)gx0*(BINS+1), *m01 = map0 + (size_t)gx1*(BINS+1);
+        const float *m10 = map1 + (size_t)gx0*(BINS+1), *m11 = map1 + (size_t)gx1*(BINS+1);
+        const float top = m00[v] + fx*(m01[v] - m00[v]);
+        const float bottom = m10[v] + fx*(m11[v] - m10[v]);
+
+        // Apply
+        float H, S, L;
+        rgb2hsl(in,&H,&S,&L);
+        hsl2rgb(out,H,S,top + fy*(bottom - top));
+      }
     }
 
+    float *t = map0;
+    map0 = map1;
+    map1 = t;
   }
 
   // Cleanup
-  free(luminance);
+  dt_free_align(maps);
+  dt_free_align(bins);
+}
 
+void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
+{
+  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
+  const int rad = data->radius*roi_in->scale/piece->iscale;
+  const int s = grid_spacing(rad);
+
+  tiling->factor = 2.0f + 0.125f;  // in + out + bins
+  tiling->maxbuf = 1.0f;
+  tiling->overhead = (unsigned)(2 * ((roi_in->width + s - 1)/s + 1) * (BINS+1) * sizeof(float));
+  // pixels reach their neighbouring grid points, those their whole window. tiles start on the grid.
+  tiling->overlap = rad + s;
+  tiling->xalign = s;
+  tiling->yalign = s;
+  return;
 }
 
 static void
@@ -22,10 +22,12 @@
 #include "iop/color.h"
 #include "develop/develop.h"
 #include "control/control.h"
+#include "control/conf.h"
 #include "gui/gtk.h"
 #include "bauhaus/bauhaus.h"
 #include "common/colorspaces.h"
 #include "common/colormatrices.c"
+#include "common/lut3d.h"
 #include "common/opencl.h"
 #include "common/image_cache.h"
 #ifdef HAVE_OPENJPEG
@@ -92,6 +94,10 @@ typedef struct dt_iop_colorin_data_t
   cmsHTRANSFORM *xform_cam_Lab;
   cmsHTRANSFORM *xform_cam_nrgb;
   cmsHTRANSFORM *xform_nrgb_Lab;
+  // the transforms above sampled into tables, where that is accurate enough
+  dt_lut3d_t lut3d_cam_Lab;
+  dt_lut3d_t lut3d_cam_nrgb;
+  dt_lut3d_t lut3d_nrgb_Lab;
   float lut[3][LUT_SAMPLES];
   float cmatrix[9];
   float nmatrix[9];
@@ -456,11 +462,11 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       // convert to (L,a/L,b/L) to be able to change L without changing saturation.
       if(!d->nrgb)
       {
-        cmsDoTransform(d->xform_cam_Lab, cam, out, roi_out->width);
+        dt_lut3d_apply(&d->lut3d_cam_Lab, d->xform_cam_Lab, cam, out, roi_out->width);
         dt_free_align(cam);
       } else {
         void *rgb = dt_alloc_align(16, 4*sizeof(float)*roi_out->width);
-        cmsDoTransform(d->xform_cam_nrgb, cam, rgb, roi_out->width);
+        dt_lut3d_apply(&d->lut3d_cam_nrgb, d->xform_cam_nrgb, cam, rgb, roi_out->width);
         dt_free_align(cam);
 
         float *rgbptr = (float *)rgb;
@@ -473,7 +479,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
           _mm_store_ps(rgbptr, result);
         }
 
-        cmsDoTransform(d->xform_nrgb_Lab, rgb, out, roi_out->width);
+        dt_lut3d_apply(&d->lut3d_nrgb_Lab, d->xform_nrgb_Lab, rgb, out, roi_out->width);
         dt_free_align(rgb);
       }
     }
@@ -541,6 +547,9 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_lut3d_cleanup(&d->lut3d_cam_Lab);
+  dt_lut3d_cleanup(&d->lut3d_cam_nrgb);
+  dt_lut3d_cleanup(&d->lut3d_nrgb_Lab);
 
   d->cmatrix[0] = d->nmatrix[0] = d->lmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
@@ -725,6 +734,23 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // littlecms is slow, sample its transforms into tables where they are accurate enough. camera and
+  // normalized rgb are linear, so the nodes are spaced more densely in the shadows.
+  if(dt_conf_get_bool("lcms2_use_lut3d"))
+  {
+    const float min[3] = { 0.0f, 0.0f, 0.0f }, max[3] = { 1.0f, 1.0f, 1.0f };
+    // a delta E of one
+    const float max_error = 1.0f;
+    if(d->nrgb)
+    {
+      // an error that is small in linear rgb can still be a few delta E near black, so look at it in Lab
+      if(d->xform_nrgb_Lab)
+        dt_lut3d_init(&d->lut3d_cam_nrgb, d->xform_cam_nrgb, min, max, 1, max_error, d->xform_nrgb_Lab);
+      dt_lut3d_init(&d->lut3d_nrgb_Lab, d->xform_nrgb_Lab, min, max, 1, max_error, NULL);
+    }
+    else dt_lut3d_init(&d->lut3d_cam_Lab, d->xform_cam_Lab, min, max, 1, max_error, NULL);
+  }
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -755,6 +781,9 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->xform_cam_Lab = NULL;
   d->xform_cam_nrgb = NULL;
   d->xform_nrgb_Lab = NULL;
+  memset(&d->lut3d_cam_Lab, 0, sizeof(dt_lut3d_t));
+  memset(&d->lut3d_cam_nrgb, 0, sizeof(dt_lut3d_t));
+  memset(&d->lut3d_nrgb_Lab, 0, sizeof(dt_lut3d_t));
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -780,6 +809,9 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_lut3d_cleanup(&d->lut3d_cam_Lab);
+  dt_lut3d_cleanup(&d->lut3d_cam_nrgb);
+  dt_lut3d_cleanup(&d->lut3d_nrgb_Lab);
 
   free(piece->data);
   piece->data = NULL;
@@ -40,6 +40,7 @@
 #include <strings.h>
 #include <gtk/gtk.h>
 #include <inttypes.h>
+#include <xmmintrin.h>
 
 /**
  * color transfer somewhat based on the glorious paper `color transfer between images'
@@ -57,6 +58,8 @@ DT_MODULE_INTROSPECTION(1, dt_iop_colormapping_params_t)
 
 #define HISTN (1<<11)
 #define MAXN 5
+// k-means only looks at a random subset of the pixels, at most this many
+#define KMEANS_SAMPLES (1<<16)
 
 typedef enum dt_iop_colormapping_flags_t
 {
@@ -119,6 +122,7 @@ typedef struct dt_iop_colormapping_gui_data_t
   int  width;
   int height;
   int ch;
+  uint64_t buffer_hash;
   int flowback_set;
   dt_iop_colormapping_flowback_t flowback;
   GtkWidget *acquire_source_button;
@@ -132,6 +136,12 @@ typedef struct dt_iop_colormapping_gui_data_t
   cmsHPROFILE hLab;
   cmsHTRANSFORM xform;
   dt_pthread_mutex_t lock;
+  // clusters of the last buffer k-means ran on, acquiring the same image again just copies them
+  uint64_t cluster_hash;
+  int cluster_n;
+  float cluster_mean[MAXN][2];
+  float cluster_var[MAXN][2];
+  float cluster_weight[MAXN];
 }
 dt_iop_colormapping_gui_data_t;
 
@@ -291,17 +301,54 @@ get_cluster(const float *col, const int n, float mean[n][2])
   return cluster;
 }
 
+// nearest cluster of four samples at once
+static inline void
+get_cluster4(const float *a, const float *b, const int n, float mean[n][2], int *cluster)
+{
+  const __m128 va = _mm_load_ps(a), vb = _mm_load_ps(b);
+  __m128 mdist = _mm_set1_ps(FLT_MAX), best = _mm_setzero_ps();
+  for(int k=0; k<n; k++)
+  {
+    const __m128 da = _mm_sub_ps(va, _mm_set1_ps(mean[k][0]));
+    const __m128 db = _mm_sub_ps(vb, _mm_set1_ps(mean[k][1]));
+    const __m128 dist = _mm_add_ps(_mm_mul_ps(da, da), _mm_mul_ps(db, db));
+    const __m128 closer = _mm_cmplt_ps(dist, mdist);
+    mdist = _mm_min_ps(dist, mdist);
+    best = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(k)), _mm_andnot_ps(closer, best));
+  }
+  float c[4] __attribute__((aligned(16)));
+  _mm_store_ps(c, best);
+  for(int l=0; l<4; l++) cluster[l] = c[l];
+}
+
 static void
 kmeans(const float *col, const int width, const int height, const int n, float mean_out[n][2], float var_out[n][2], float weight_out[n])
 {
-  const int nit = 40; // number of iterations
-  const int samples = width*height * 0.2; // samples: only a fraction of the buffer.
+  const int nit = 40; // max number of iterations, stops as soon as no sample changes its cluster
+  const int samples = MIN(width*height * 0.2, KMEANS_SAMPLES); // samples: only a fraction of the buffer.
 
-  float mean[n][2], var[n][2];
   int cnt[n], count;
 
   float a_min = FLT_MAX, b_min = FLT_MAX, a_max = FLT_MIN, b_max = FLT_MIN;
 
+  // pick the samples once, so the iterations can converge on them
+  float *sa = dt_alloc_align(16, sizeof(float)*(samples+4));
+  float *sb = dt_alloc_align(16, sizeof(float)*(samples+4));
+  int *cluster = dt_alloc_align(16, sizeof(int)*(samples+4));
+  const int nthreads = dt_get_num_threads();
+  // per thread sums of a, b, a^2, b^2 and count of each cluster
+  double *sums = dt_alloc_align(16, sizeof(double)*nthreads*MAXN*5);
+  if(!sa || !sb || !cluster || !sums)
+  {
+    dt_free_align(sa);
+    dt_free_align(sb);
+    dt_free_align(cluster);
+    dt_free_align(sums);
+    for(int k=0; k<n; k++)
+      mean_out[k][0] = mean_out[k][1] = var_out[k][0] = var_out[k][1] = weight_out[k] = 0.0f;
+    return;
+  }
+
   for(int s=0; s<samples; s++)
   {
     const int j = CLAMP(dt_points_get()*height, 0, height-1);
@@ -310,6 +357,10 @@ kmeans(const float *col, const int width, const int height, const int n, float m
     const float a = col[4*(width*j + i)+1];
     const float b = col[4*(width*j + i)+2];
 
+    sa[s] = a;
+    sb[s] = b;
+    cluster[s] = -1;
+
     a_min = fmin(a, a_min);
     a_max = fmax(a, a_max);
     b_min = fmin(b, b_min);
@@ -322,58 +373,50 @@ kmeans(const float *col, const int width, const int height, const int n, float m
     mean_out[k][0] = 0.9f * (a_min + (a_max - a_min) * dt_points_get());
     mean_out[k][1] = 0.9f * (b_min + (b_max - b_min) * dt_points_get());
     var_out[k][0] = var_out[k][1] = weight_out[k] = 0.0f;
-    mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
   }
   for(int it=0; it<nit; it++)
   {
-    for(int k=0; k<n; k++) cnt[k] = 0;
-    // randomly sample col positions inside roi
+    int changed = 0;
+    memset(sums, 0, sizeof(double)*nthreads*MAXN*5);
+    // for each sample: determine cluster, update new mean, update var. four at a time, summed up per thread.
 #ifdef _OPENMP
-    #pragma omp parallel for default(none) schedule(static) shared(col,var,mean,mean_out,cnt)
+    #pragma omp parallel for default(none) schedule(static) shared(sa,sb,cluster,sums,mean_out) reduction(+:changed)
 #endif
-    for(int s=0; s<samples; s++)
+    for(int s=0; s<samples; s+=4)
     {
-      const int j = CLAMP(dt_points_get()*height, 0, height-1);
-      const int i = CLAMP(dt_points_get()*width, 0, width-1);
-      // for each sample: determine cluster, update new mean, update var
-      for(int k=0; k<n; k++)
+      double *sum = sums + (size_t)dt_get_thread_num()*MAXN*5;
+      int c[4];
+      const int m = MIN(4, samples-s);
+      if(m == 4) get_cluster4(sa+s, sb+s, n, mean_out, c);
+      else for(int l=0; l<m; l++)
       {
-        const float L = col[4*(width*j+i)];
-        const float Lab[3] = {L, col[4*(width*j + i)+1], col[4*(width*j + i)+2]};
-        // determine dist to mean_out
-        const int c = get_cluster(Lab, n, mean_out);
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        cnt[c]++;
-        // update mean, var
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][0]  += Lab[1]*Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][1]  += Lab[2]*Lab[2];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][0] += Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][1] += Lab[2];
+        const float Lab[3] = {0.0f, sa[s+l], sb[s+l]};
+        c[l] = get_cluster(Lab, n, mean_out);
+      }
+      for(int l=0; l<m; l++)
+      {
+        changed += c[l] != cluster[s+l];
+        cluster[s+l] = c[l];
+        double *sk = sum + 5*c[l];
+        sk[0] += sa[s+l];
+        sk[1] += sb[s+l];
+        sk[2] += sa[s+l]*sa[s+l];
+        sk[3] += sb[s+l]*sb[s+l];
+        sk[4] += 1.0;
       }
     }
     // swap old/new means
     for(int k=0; k<n; k++)
     {
+      double sk[5] = {0.0};
+      for(int t=0; t<nthreads; t++)
+        for(int i=0; i<5; i++) sk[i] += sums[(size_t)t*MAXN*5 + 5*k + i];
+      cnt[k] = sk[4];
       if(cnt [k] == 0) continue;
-      mean_out[k][0] = mean[k][0]/cnt[k];
-      mean_out[k][1] = mean[k][1]/cnt[k];
-      var_out[k][0] = var[k][0]/cnt[k] - mean_out[k][0]*mean_out[k][0];
-      var_out[k][1] = var[k][1]/cnt[k] - mean_out[k][1]*mean_out[k][1];
-      mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
+      mean_out[k][0] = sk[0]/cnt[k];
+      mean_out[k][1] = sk[1]/cnt[k];
+      var_out[k][0] = sk[2]/cnt[k] - (sk[0]/cnt[k])*(sk[0]/cnt[k]);
+      var_out[k][1] = sk[3]/cnt[k] - (sk[1]/cnt[k])*(sk[1]/cnt[k]);
     }
 
     // determine weight of clusters
@@ -383,7 +426,14 @@ kmeans(const float *col, const int width, const int height, const int n, float m
 
     // printf("it %d  %d means:\n", it, n);
     // for(int k=0;k<n;k++) printf("mean %f %f -- var %f %f -- weight %f\n", mean_out[k][0], mean_out[k][1], var_out[k][0], var_out[k][1], weight_out[k]);
+
+    // same clusters as before give the same means again
+    if(!changed) break;
   }
+  dt_free_align(sa);
+  dt_free_align(sb);
+  dt_free_align(cluster);
+  dt_free_align(sums);
 
   for(int k=0; k<n; k++)
   {
@@ -450,6 +500,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
     g->width = width;
     g->height = height;
     g->ch = ch;
+    g->buffer_hash = dt_dev_pixelpipe_cache_hash(piece->pipe->image.id, roi_in, piece->pipe,
+                                                 g_list_index(piece->pipe->nodes, piece));
 
     if(g->buffer)
       memcpy(g->buffer, in, (size_t)width*height*ch*sizeof(float));
@@ -581,6 +633,8 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
     g->width = width;
     g->height = height;
     g->ch = ch;
+    g->buffer_hash = dt_dev_pixelpipe_cache_hash(piece->pipe->image.id, roi_in, piece->pipe,
+                                                 g_list_index(piece->pipe->nodes, piece));
 
     if(g->buffer)
       err = dt_opencl_copy_device_to_host(devid, g->buffer, dev_in, width, height, ch*sizeof(float));
@@ -956,6 +1010,20 @@ cluster_preview_expose (GtkWidget *widget, GdkEventExpose *event, dt_iop_module_
   return TRUE;
 }
 
+// k-means of the buffer with the given pipe hash, remembered for as long as the same image gets acquired again
+static void
+kmeans_cached(dt_iop_colormapping_gui_data_t *g, const uint64_t hash, const float *buffer, const int width, const int height, const int n, float mean_out[n][2], float var_out[n][2], float weight_out[n])
+{
+  if(!hash || hash != g->cluster_hash || n != g->cluster_n)
+  {
+    kmeans(buffer, width, height, n, g->cluster_mean, g->cluster_var, g->cluster_weight);
+    g->cluster_hash = hash;
+    g->cluster_n = n;
+  }
+  memcpy(mean_out, g->cluster_mean, sizeof(float)*2*n);
+  memcpy(var_out, g->cluster_var, sizeof(float)*2*n);
+  memcpy(weight_out, g->cluster_weight, sizeof(float)*n);
+}
 
 void
 gui_post_expose (struct dt_iop_module_t *self, cairo_t *cr, int32_t fwidth, int32_t fheight, int32_t pointerx, int32_t pointery)
@@ -973,6 +1041,7 @@ gui_post_expose (struct dt_iop_module_t *self, cairo_t *cr, int32_t fwidth, int3
   const int width = g->width;
   const int height = g->height;
   const int ch = g->ch;
+  const uint64_t hash = g->buffer_hash;
   float *buffer = malloc (width*height*ch*sizeof(float));
   if(!buffer)
   {
@@ -993,7 +1062,7 @@ gui_post_expose (struct dt_iop_module_t *self, cairo_t *cr, int32_t fwidth, int3
     invert_histogram(hist, p->source_ihist);
 
     // get n color clusters
-    kmeans(buffer, width, height, p->n, p->source_mean, p->source_var, p->source_weight);
+    kmeans_cached(g, hash, buffer, width, height, p->n, p->source_mean, p->source_var, p->source_weight);
 
     p->flag |= HAS_SOURCE;
     new_source_clusters = 1;
@@ -1004,7 +1073,7 @@ gui_post_expose (struct dt_iop_module_t *self, cairo_t *cr, int32_t fwidth, int3
     capture_histogram(buffer, width, height, p->target_hist);
 
     // get n color clusters
-    kmeans(buffer, width, height, p->n, p->target_mean, p->target_var, p->target_weight);
+    kmeans_cached(g, hash, buffer, width, height, p->n, p->target_mean, p->target_var, p->target_weight);
 
     p->flag |= HAS_TARGET;
   }
@@ -1051,6 +1120,9 @@ gui_init(struct dt_iop_module_t *self)
   g->hLab  = dt_colorspaces_create_lab_profile();
   g->xform = cmsCreateTransform(g->hLab, TYPE_Lab_DBL, g->hsRGB, TYPE_RGB_DBL, INTENT_PERCEPTUAL, 0);
   g->buffer = NULL;
+  g->buffer_hash = 0;
+  g->cluster_hash = 0;
+  g->cluster_n = 0;
 
   dt_pthread_mutex_init(&g->lock, NULL);
 
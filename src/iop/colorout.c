@@ -480,7 +480,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
 
       if(!gamutcheck)
       {
-        cmsDoTransform(d->xform, in, out, roi_out->width);
+        dt_lut3d_apply(&d->lut3d, d->xform, in, out, roi_out->width);
       } else {
         void *rgb = dt_alloc_align(16, 4*sizeof(float)*roi_out->width);
         cmsDoTransform(d->xform, in, rgb, roi_out->width);
@@ -583,6 +583,7 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_lut3d_cleanup(&d->lut3d);
   d->cmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -668,6 +669,16 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // littlecms is slow, sample its transform into a table if that is accurate enough. gamut check marks
+  // single colors, and high quality processing asks for littlecms itself.
+  if(d->xform && d->softproof_enabled != DT_SOFTPROOF_GAMUTCHECK && !high_quality_processing
+     && dt_conf_get_bool("lcms2_use_lut3d"))
+  {
+    const float min[3] = { 0.0f, -128.0f, -128.0f }, max[3] = { 100.0f, 128.0f, 128.0f };
+    // one 8 bit code value
+    dt_lut3d_init(&d->lut3d, d->xform, min, max, 0, 1.0f/255.0f, NULL);
+  }
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -700,6 +711,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->softproof_enabled = 0;
   d->softproof = d->output = NULL;
   d->xform = NULL;
+  memset(&d->lut3d, 0, sizeof(dt_lut3d_t));
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -714,6 +726,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_lut3d_cleanup(&d->lut3d);
 
   free(piece->data);
   piece->data = NULL;
@@ -19,6 +19,7 @@
 #define DARKTABLE_IOP_COLOROUT_H
 
 #include "iop/color.h" // common structs and defines
+#include "common/lut3d.h"
 
 typedef struct dt_iop_colorout_data_t
 {
@@ -29,6 +30,7 @@ typedef struct dt_iop_colorout_data_t
   cmsHPROFILE output;
   cmsHPROFILE Lab;
   cmsHTRANSFORM *xform;
+  dt_lut3d_t lut3d;                   // xform sampled into a table, if that is accurate enough
   float unbounded_coeffs[3][3];       // for extrapolation of shaper curves
 }
 dt_iop_colorout_data_t;
@@ -33,6 +33,7 @@
 #include <strings.h>
 #include <gtk/gtk.h>
 #include <inttypes.h>
+#include <xmmintrin.h>
 
 /**
  * color transfer somewhat based on the glorious paper `color transfer between images'
@@ -50,6 +51,8 @@ DT_MODULE_INTROSPECTION(1, dt_iop_colortransfer_params_t)
 
 #define HISTN (1<<11)
 #define MAXN 5
+// k-means only looks at a random subset of the pixels, at most this many
+#define KMEANS_SAMPLES (1<<16)
 
 typedef enum dt_iop_colortransfer_flag_t
 {
@@ -97,6 +100,11 @@ typedef struct dt_iop_colortransfer_data_t
   float mean[MAXN][2];
   float var [MAXN][2];
   int n;
+  // clusters of the last input, see kmeans_cached()
+  uint64_t cluster_hash;
+  int cluster_n;
+  float cluster_mean[MAXN][2];
+  float cluster_var[MAXN][2];
 }
 dt_iop_colortransfer_data_t;
 
@@ -234,15 +242,40 @@ get_cluster(const float *col, const int n, float mean[n][2])
   return cluster;
 }
 
+// nearest cluster of four samples at once
+static inline void
+get_cluster4(const float *a, const float *b, const int n, float mean[n][2], int *cluster)
+{
+  const __m128 va = _mm_load_ps(a), vb = _mm_load_ps(b);
+  __m128 mdist = _mm_set1_ps(FLT_MAX), best = _mm_setzero_ps();
+  for(int k=0; k<n; k++)
+  {
+    const __m128 da = _mm_sub_ps(va, _mm_set1_ps(mean[k][0]));
+    const __m128 db = _mm_sub_ps(vb, _mm_set1_ps(mean[k][1]));
+    const __m128 dist = _mm_add_ps(_mm_mul_ps(da, da), _mm_mul_ps(db, db));
+    const __m128 closer = _mm_cmplt_ps(dist, mdist);
+    mdist = _mm_min_ps(dist, mdist);
+    best = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps(k)), _mm_andnot_ps(closer, best));
+  }
+  float c[4] __attribute__((aligned(16)));
+  _mm_store_ps(c, best);
+  for(int l=0; l<4; l++) cluster[l] = c[l];
+}
+
 static void
 kmeans(const float *col, const dt_iop_roi_t *roi, const int n, float mean_out[n][2], float var_out[n][2])
 {
   // TODO: check params here:
-  const int nit = 10; // number of iterations
-  const int samples = roi->width*roi->height * 0.2; // samples: only a fraction of the buffer.
+  const int nit = 10; // max number of iterations, stops as soon as no sample changes its cluster
+  const int samples = MIN(roi->width*roi->height * 0.2, KMEANS_SAMPLES); // samples: only a fraction of the buffer.
 
-  float mean[n][2], var[n][2];
-  int cnt[n];
+  // pick the samples once, so the iterations can converge on them
+  float *sa = dt_alloc_align(16, sizeof(float)*(samples+4));
+  float *sb = dt_alloc_align(16, sizeof(float)*(samples+4));
+  int *cluster = dt_alloc_align(16, sizeof(int)*(samples+4));
+  const int nthreads = dt_get_num_threads();
+  // per thread sums of a, b, a^2, b^2 and count of each cluster
+  double *sums = dt_alloc_align(16, sizeof(double)*nthreads*MAXN*5);
 
   // init n clusters for a, b channels at random
   for(int k=0; k<n; k++)
@@ -250,61 +283,80 @@ kmeans(const float *col, const dt_iop_roi_t *roi, const int n, float mean_out[n]
     mean_out[k][0] = 20.0f-40.0f*dt_points_get();
     mean_out[k][1] = 20.0f-40.0f*dt_points_get();
     var_out[k][0] = var_out[k][1] = 0.0f;
-    mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
   }
+  if(!sa || !sb || !cluster || !sums)
+  {
+    dt_free_align(sa);
+    dt_free_align(sb);
+    dt_free_align(cluster);
+    dt_free_align(sums);
+    return;
+  }
+
+  // randomly sample col positions inside roi
+  for(int s=0; s<samples; s++)
+  {
+    const int j = dt_points_get()*roi->height, i = dt_points_get()*roi->width;
+    sa[s] = col[3*(roi->width*j + i)+1];
+    sb[s] = col[3*(roi->width*j + i)+2];
+    cluster[s] = -1;
+  }
+
   for(int it=0; it<nit; it++)
   {
-    for(int k=0; k<n; k++) cnt[k] = 0;
-    // randomly sample col positions inside roi
+    int changed = 0;
+    memset(sums, 0, sizeof(double)*nthreads*MAXN*5);
+    // for each sample: determine cluster, update new mean, update var. four at a time, summed up per thread.
 #ifdef _OPENMP
-    #pragma omp parallel for default(none) schedule(static) shared(roi,col,var,mean,mean_out,cnt)
+    #pragma omp parallel for default(none) schedule(static) shared(sa,sb,cluster,sums,mean_out) reduction(+:changed)
 #endif
-    for(int s=0; s<samples; s++)
+    for(int s=0; s<samples; s+=4)
     {
-      const int j = dt_points_get()*roi->height, i = dt_points_get()*roi->width;
-      // for each sample: determine cluster, update new mean, update var
-      for(int k=0; k<n; k++)
+      double *sum = sums + (size_t)dt_get_thread_num()*MAXN*5;
+      int c[4];
+      const int m = MIN(4, samples-s);
+      if(m == 4) get_cluster4(sa+s, sb+s, n, mean_out, c);
+      else for(int l=0; l<m; l++)
       {
-        const float L = col[3*(roi->width*j+i)];
-        const float Lab[3] = {L, col[3*(roi->width*j + i)+1], col[3*(roi->width*j + i)+2]};
-        // determine dist to mean_out
-        const int c = get_cluster(Lab, n, mean_out);
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        cnt[c]++;
-        // update mean, var
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][0]  += Lab[1]*Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        var[c][1]  += Lab[2]*Lab[2];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][0] += Lab[1];
-#ifdef _OPENMP
-        #pragma omp atomic
-#endif
-        mean[c][1] += Lab[2];
+        const float Lab[3] = {0.0f, sa[s+l], sb[s+l]};
+        c[l] = get_cluster(Lab, n, mean_out);
+      }
+      for(int l=0; l<m; l++)
+      {
+        changed += c[l] != cluster[s+l];
+        cluster[s+l] = c[l];
+        double *sk = sum + 5*c[l];
+        sk[0] += sa[s+l];
+        sk[1] += sb[s+l];
+        sk[2] += sa[s+l]*sa[s+l];
+        sk[3] += sb[s+l]*sb[s+l];
+        sk[4] += 1.0;
       }
     }
     // swap old/new means
     for(int k=0; k<n; k++)
     {
-      if(cnt [k] == 0) continue;
-      mean_out[k][0] = mean[k][0]/cnt[k];
-      mean_out[k][1] = mean[k][1]/cnt[k];
-      var_out[k][0] = var[k][0]/cnt[k] - mean_out[k][0]*mean_out[k][0];
-      var_out[k][1] = var[k][1]/cnt[k] - mean_out[k][1]*mean_out[k][1];
-      mean[k][0] = mean[k][1] = var[k][0] = var[k][1] = 0.0f;
+      double sk[5] = {0.0};
+      for(int t=0; t<nthreads; t++)
+        for(int i=0; i<5; i++) sk[i] += sums[(size_t)t*MAXN*5 + 5*k + i];
+      const int cnt = sk[4];
+      if(cnt == 0) continue;
+      mean_out[k][0] = sk[0]/cnt;
+      mean_out[k][1] = sk[1]/cnt;
+      var_out[k][0] = sk[2]/cnt - (sk[0]/cnt)*(sk[0]/cnt);
+      var_out[k][1] = sk[3]/cnt - (sk[1]/cnt)*(sk[1]/cnt);
     }
     // printf("it %d  %d means:\n", it, n);
     // for(int k=0;k<n;k++) printf("%f %f -- var %f %f\n", mean_out[k][0], mean_out[k][1], var_out[k][0], var_out[k][1]);
+
+    // same clusters as before give the same means again
+    if(!changed) break;
   }
+  dt_free_align(sa);
+  dt_free_align(sb);
+  dt_free_align(cluster);
+  dt_free_align(sums);
+
   for(int k=0; k<n; k++)
   {
     // we actually want the std deviation.
@@ -313,6 +365,22 @@ kmeans(const float *col, const dt_iop_roi_t *roi, const int n, float mean_out[n]
   }
 }
 
+// k-means of the input of the piece, kept until anything before this module changes
+static void
+kmeans_cached(dt_iop_colortransfer_data_t *data, dt_dev_pixelpipe_iop_t *piece, const float *col, const dt_iop_roi_t *roi, const int n, float mean_out[n][2], float var_out[n][2])
+{
+  const uint64_t hash = dt_dev_pixelpipe_cache_hash(piece->pipe->image.id, roi, piece->pipe,
+                                                    g_list_index(piece->pipe->nodes, piece));
+  if(hash != data->cluster_hash || n != data->cluster_n)
+  {
+    kmeans(col, roi, n, data->cluster_mean, data->cluster_var);
+    data->cluster_hash = hash;
+    data->cluster_n = n;
+  }
+  memcpy(mean_out, data->cluster_mean, sizeof(float)*2*n);
+  memcpy(var_out, data->cluster_var, sizeof(float)*2*n);
+}
+
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   // FIXME: this returns nan!!
@@ -333,7 +401,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
       invert_histogram(hist, data->hist);
 
       // get n clusters
-      kmeans(in, roi_in, data->n, data->mean, data->var);
+      kmeans_cached(data, piece, in, roi_in, data->n, data->mean, data->var);
 
       // notify gui that commit_params should let stuff flow back!
       data->flag = ACQUIRED;
@@ -364,7 +432,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
 
     // cluster input buffer
     float mean[data->n][2], var[data->n][2];
-    kmeans(in, roi_in, data->n, mean, var);
+    kmeans_cached(data, piece, in, roi_in, data->n, mean, var);
 
     // get mapping from input clusters to target clusters
     int mapio[data->n];
@@ -524,6 +592,8 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   piece->data = malloc(sizeof(dt_iop_colortransfer_data_t));
   dt_iop_colortransfer_data_t *d = (dt_iop_colortransfer_data_t *)piece->data;
   d->flag = NEUTRAL;
+  d->cluster_hash = 0;
+  d->cluster_n = 0;
   self->commit_params(self, self->default_params, pipe, piece);
 #endif
 }
@@ -579,6 +579,7 @@ void process_wavelets(
 
   for(int scale=0; scale<max_scale; scale++)
   {
+    if(dt_iop_cancelled(piece)) goto cleanup;
     const float sigma = 1.0f;
     const float varf = sqrtf(2.0f + 2.0f * 4.0f*4.0f + 6.0f*6.0f)/16.0f; // about 0.5
     const float sigma_band = powf(varf, scale) *sigma;
@@ -612,6 +613,7 @@ void process_wavelets(
   // now do everything backwards, so the result will end up in *ovoid
   for(int scale=max_scale-1; scale>=0; scale--)
   {
+    if(dt_iop_cancelled(piece)) goto cleanup;
 #if 1
     // variance stabilizing transform maps sigma to unity.
     const float sigma = 1.0f;
@@ -659,6 +661,7 @@ void process_wavelets(
 
   backtransform((float *)ovoid, width, height, aa, bb);
 
+cleanup:
   for(int k=0; k<max_scale; k++)
     dt_free_align(buf[k]);
   dt_free_align(tmp);
@@ -717,6 +720,9 @@ void process_nlmeans(
   {
     for(int ki=-K; ki<=K; ki++)
     {
+      // every shift vector is a full pass over the image, stop early if the pipe doesn't need it any more
+      if(dt_iop_cancelled(piece)) continue;
+
       // TODO: adaptive K tests here!
       // TODO: expf eval for real bilateral experience :)
 
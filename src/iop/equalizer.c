@@ -22,6 +22,7 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <xmmintrin.h>
 #include "common/darktable.h"
 #include "common/debug.h"
 #include "develop/develop.h"
@@ -30,6 +31,7 @@
 #include "gui/draw.h"
 #include "gui/gtk.h"
 #include "gui/presets.h"
+#include "develop/tiling.h"
 
 #include "iop/equalizer_eaw.h"
 
@@ -82,6 +84,9 @@ typedef struct dt_iop_equalizer_data_t
 {
   dt_draw_curve_t *curve[3];
   int num_levels;
+  // wavelet weights of all levels and the per level scratch space, kept for the next run of the pipe
+  float *buffer;
+  size_t buffer_size;
 }
 dt_iop_equalizer_data_t;
 
@@ -105,21 +110,12 @@ int flags()
 
 
 
-void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+// finest level of the wavelet transform in terms of the full image (l1), the coarsest (lm), and the number of
+// levels of the transform of this buffer. the transform works on levels 1 .. numl_cap-1.
+static int get_levels(const dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, float *l1_out, float *lm_out)
 {
-  float *in = (float *)i;
-  float *out = (float *)o;
-  const int chs = piece->colors;
   const int width = roi_in->width, height = roi_in->height;
   const float scale = roi_in->scale;
-  memcpy(out, in, (size_t)chs*sizeof(float)*width*height);
-#if 1
-  // printf("thread %d starting equalizer", (int)pthread_self());
-  // if(piece->iscale != 1.0) printf(" for preview\n");
-  // else printf("\n");
-  dt_iop_equalizer_data_t *d = (dt_iop_equalizer_data_t *)(piece->data);
-  // dt_iop_equalizer_gui_data_t *c = (dt_iop_equalizer_gui_data_t *)self->gui_data;
-
   // 1 pixel in this buffer represents 1.0/scale pixels in original image:
   const float l1 = 1.0f + dt_log2f(piece->iscale/scale);                          // finest level
   float lm = 0;
@@ -128,18 +124,55 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   // level 1 => full resolution
   int numl = 0;
   for(int k=MIN(width,height); k; k>>=1) numl++;
-  const int numl_cap = MIN(DT_IOP_EQUALIZER_MAX_LEVEL-l1+1.5, numl);
+  if(l1_out) *l1_out = l1;
+  if(lm_out) *lm_out = lm;
+  return MIN(DT_IOP_EQUALIZER_MAX_LEVEL-l1+1.5, numl);
+}
+
+// floats needed for the weights of all levels, followed by scratch space for the finest one
+static size_t get_buffer_size(const int numl_cap, const int width, const int height)
+{
+  size_t size = 0;
+  for(int k=1; k<numl_cap; k++) size += (size_t)(1 + (width>>(k-1))) * (1 + (height>>(k-1)));
+  return size + (size_t)2 * (1 + width) * (1 + height);
+}
+
+void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  float *in = (float *)i;
+  float *out = (float *)o;
+  const int chs = piece->colors;
+  const int width = roi_in->width, height = roi_in->height;
+  memcpy(out, in, (size_t)chs*sizeof(float)*width*height);
+  dt_iop_equalizer_data_t *d = (dt_iop_equalizer_data_t *)(piece->data);
+  // dt_iop_equalizer_gui_data_t *c = (dt_iop_equalizer_gui_data_t *)self->gui_data;
+
+  float l1, lm;
+  const int numl_cap = get_levels(piece, roi_in, &l1, &lm);
   // printf("level range in %d %d: %f %f, cap: %d\n", 1, d->num_levels, l1, lm, numl_cap);
 
-  // TODO: fixed alloc for data piece at capped resolution?
-  float **tmp = (float **)calloc(numl_cap, sizeof(float *));
+  // the buffers stay with the pipe, they only have to grow when the roi does.
+  const size_t buffer_size = get_buffer_size(numl_cap, width, height);
+  if(buffer_size > d->buffer_size)
+  {
+    dt_free_align(d->buffer);
+    d->buffer = (float *)dt_alloc_align(16, sizeof(float)*buffer_size);
+    d->buffer_size = d->buffer ? buffer_size : 0;
+    if(!d->buffer) return;
+  }
+  float *tmp[DT_IOP_EQUALIZER_MAX_LEVEL] = { NULL };
+  float *scratch = d->buffer;
   for(int k=1; k<numl_cap; k++)
   {
-    const int wd = (int)(1 + (width>>(k-1))), ht = (int)(1 + (height>>(k-1)));
-    tmp[k] = (float *)malloc((size_t)sizeof(float)*wd*ht);
+    tmp[k] = scratch;
+    scratch += (size_t)(1 + (width>>(k-1))) * (1 + (height>>(k-1)));
   }
 
-  for(int level=1; level<numl_cap; level++) dt_iop_equalizer_wtf(out, tmp, level, width, height);
+  for(int level=1; level<numl_cap; level++)
+  {
+    if(dt_iop_cancelled(piece)) return;
+    dt_iop_equalizer_wtf(out, tmp, scratch, level, width, height);
+  }
 
 #if 0
   // printf("transformed\n");
@@ -179,33 +212,54 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   {
     const float lv = (lm-l1)*(l-1)/(float)(numl_cap-1) + l1; // appr level in real image.
     const float band = CLAMP((1.0 - lv / d->num_levels), 0, 1.0);
-    for(int ch=0; ch<3; ch++)
-    {
-      // coefficients in range [0, 2], 1 being neutral.
-      const float coeff = 2*dt_draw_curve_calc_value(d->curve[ch==0?0:1], band);
-      const int step = 1<<l;
-#if 1 // scale coefficients
-      for(int j=0; j<height; j+=step)      for(int i=step/2; i<width; i+=step) out[(size_t)chs*width*j + chs*i + ch] *= coeff;
-      for(int j=step/2; j<height; j+=step) for(int i=0; i<width; i+=step)      out[(size_t)chs*width*j + chs*i + ch] *= coeff;
-      for(int j=step/2; j<height; j+=step) for(int i=step/2; i<width; i+=step) out[(size_t)chs*width*j + chs*i + ch] *= coeff*coeff;
-#else // soft-thresholding (shrinkage)
-#define wshrink (copysignf(fmaxf(0.0f, fabsf(out[(size_t)chs*width*j + chs*i + ch]) - (1.0-coeff)), out[(size_t)chs*width*j + chs*i + ch]))
-      for(int j=0; j<height; j+=step)      for(int i=step/2; i<width; i+=step) out[(size_t)chs*width*j + chs*i + ch] = wshrink;
-      for(int j=step/2; j<height; j+=step) for(int i=0; i<width; i+=step)      out[(size_t)chs*width*j + chs*i + ch] = wshrink;
-      for(int j=step/2; j<height; j+=step) for(int i=step/2; i<width; i+=step) out[(size_t)chs*width*j + chs*i + ch] = wshrink;
-#undef wshrink
+    // coefficients in range [0, 2], 1 being neutral. chroma shares one curve.
+    const float coeff_L = 2*dt_draw_curve_calc_value(d->curve[0], band);
+    const float coeff_c = 2*dt_draw_curve_calc_value(d->curve[1], band);
+    const __m128 coeff = _mm_set_ps(1.0f, coeff_c, coeff_c, coeff_L);
+    const __m128 coeff2 = _mm_mul_ps(coeff, coeff);
+    const int step = 1<<l;
+    // scale the detail coefficients: horizontal ones on the even rows of the level, vertical and diagonal ones
+    // on the odd rows.
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(out) schedule(static)
 #endif
+    for(int j=0; j<height; j+=step/2)
+    {
+      float *row = out + (size_t)chs*width*j;
+      if(j & (step/2))
+      {
+        for(int i=0; i<width; i+=step/2)
+          _mm_store_ps(row + chs*i, _mm_mul_ps(_mm_load_ps(row + chs*i), (i & (step/2)) ? coeff2 : coeff));
+      }
+      else
+      {
+        for(int i=step/2; i<width; i+=step)
+          _mm_store_ps(row + chs*i, _mm_mul_ps(_mm_load_ps(row + chs*i), coeff));
+      }
     }
   }
   // printf("applied\n");
-  for(int level=numl_cap-1; level>0; level--) dt_iop_equalizer_iwtf(out, tmp, level, width, height);
+  for(int level=numl_cap-1; level>0; level--)
+  {
+    if(dt_iop_cancelled(piece)) return;
+    dt_iop_equalizer_iwtf(out, tmp, scratch, level, width, height);
+  }
+}
 
-  for(int k=1; k<numl_cap; k++) free(tmp[k]);
-  free(tmp);
-  // printf("thread %d finished equalizer", (int)pthread_self());
-  // if(piece->iscale != 1.0) printf(" for preview\n");
-  // else printf("\n");
-#endif
+void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
+{
+  const int width = roi_in->width, height = roi_in->height;
+  const int numl_cap = MAX(1, get_levels(piece, roi_in, NULL, NULL));
+  const size_t buffer_size = get_buffer_size(numl_cap, width, height);
+
+  tiling->factor = 2.0f + (float)buffer_size / ((size_t)4 * width * height);  // in + out + weights
+  tiling->maxbuf = 1.0f;
+  tiling->overhead = 0;
+  // every level reaches two of its steps out, tiles have to start on the grid of the coarsest level
+  tiling->overlap = 1 << numl_cap;
+  tiling->xalign = 1 << (numl_cap - 1);
+  tiling->yalign = 1 << (numl_cap - 1);
+  return;
 }
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -239,6 +293,8 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   int l = 0;
   for(int k=(int)MIN(pipe->iwidth*pipe->iscale,pipe->iheight*pipe->iscale); k; k>>=1) l++;
   d->num_levels = MIN(DT_IOP_EQUALIZER_MAX_LEVEL, l);
+  d->buffer = NULL;
+  d->buffer_size = 0;
 #ifdef HAVE_GEGL
 #error "gegl version not implemented!"
   piece->input = piece->output = gegl_node_new_child(pipe->gegl, "operation", "gegl:dt-contrast-curve", "sampling-points", 65535, "curve", d->curve[0], NULL);
@@ -255,6 +311,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
 #endif
   dt_iop_equalizer_data_t *d = (dt_iop_equalizer_data_t *)(piece->data);
   for(int ch=0; ch<3; ch++) dt_draw_curve_destroy(d->curve[ch]);
+  dt_free_align(d->buffer);
   free(piece->data);
   piece->data = NULL;
 }
@@ -16,123 +16,161 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-// edge-avoiding wavelet:
-#define gweight(i, j, ii, jj) 1.0/(fabsf(weight_a[l][(size_t)wd*((j)>>(l-1)) + ((i)>>(l-1))] - weight_a[l][(size_t)wd*((jj)>>(l-1)) + ((ii)>>(l-1))])+1.e-5)
-// #define gweight(i, j, ii, jj) 1.0/(powf(fabsf(weight_a[l][wd*((j)>>(l-1)) + ((i)>>(l-1))] - weight_a[l][wd*((jj)>>(l-1)) + ((ii)>>(l-1))]),0.8)+1.e-5)
-// std cdf(2,2) wavelet:
-// #define gweight(i, j, ii, jj) (wd ? 1.0 : 1.0) //1.0
-#define gbuf(BUF, A, B) ((BUF)[4*((size_t)width*((B)) + ((A))) + ch])
+#include <xmmintrin.h>
 
+// edge-avoiding wavelet, a lifting scheme on the four channel buffer in place. the weights between neighbours
+// on the grid of level l only depend on the luma of the coarse pixels at the time of the forward transform,
+// which is stored in weight_a[l] (wd x ht, one entry per coarse pixel) for the inverse. from that, both
+// transforms first derive the horizontal and vertical weights of the level into scratch (2 x wd x ht floats),
+// so the lifting steps only do multiply-adds on whole pixels.
+// the column steps run along rows, which keeps memory access linear and lets the rows go to different threads.
 
-void dt_iop_equalizer_wtf(float *buf, float **weight_a, const int l, const int width, const int height)
+static inline float _eaw_weight(const float a, const float b)
 {
-  const int wd = (int)(1 + (width>>(l-1))), ht = (int)(1 + (height>>(l-1)));
-  int ch = 0;
-  // store weights for luma channel only, chroma uses same basis.
-  memset(weight_a[l], 0, (size_t)sizeof(float)*wd*ht);
-  for(int j=0; j<ht-1; j++) for(int i=0; i<wd-1; i++) weight_a[l][(size_t)j*wd+i] = gbuf(buf, i<<(l-1), j<<(l-1));
-
-  const int step = 1<<l;
-  const int st = step/2;
+  return 1.0f/(fabsf(a - b) + 1.e-5f);
+}
 
+// weight_h[cj*wd + ci] between coarse pixels (ci, cj) and (ci+1, cj), weight_v between (ci, cj) and (ci, cj+1)
+static void _eaw_level_weights(const float *const weight, float *const weight_h, float *const weight_v,
+                               const int wd, const int ht)
+{
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(weight_a,buf) private(ch) schedule(static)
+  #pragma omp parallel for default(none) schedule(static)
 #endif
-  for(int j=0; j<height; j++)
+  for(int j=0; j<ht; j++)
   {
-    // rows
-    // precompute weights:
-    float tmp[width];
-    for(int i=0; i<width-st; i+=st) tmp[i] = gweight(i, j, i+st, j);
-    // predict, get detail
-    int i = st;
-    for(; i<width-st; i+=step) for(ch=0; ch<3; ch++)
-        gbuf(buf, i, j) -= (tmp[i-st]*gbuf(buf, i-st, j) + tmp[i]*gbuf(buf, i+st, j))
-                           /(tmp[i-st] + tmp[i]);
-    if(i < width) for(ch=0; ch<3; ch++) gbuf(buf, i, j) -= gbuf(buf, i-st, j);
-    // update coarse
-    for(ch=0; ch<3; ch++) gbuf(buf, 0, j) += gbuf(buf, st, j)*0.5f;
-    for(i=step; i<width-st; i+=step) for(ch=0; ch<3; ch++)
-        gbuf(buf, i, j) += (tmp[i-st]*gbuf(buf, i-st, j) + tmp[i]*gbuf(buf, i+st, j))
-                           /(2.0*(tmp[i-st] + tmp[i]));
-    if(i < width) for(ch=0; ch<3; ch++) gbuf(buf, i, j) += gbuf(buf, i-st, j)*.5f;
+    const float *w = weight + (size_t)j*wd;
+    float *h = weight_h + (size_t)j*wd, *v = weight_v + (size_t)j*wd;
+    for(int i=0; i<wd-1; i++) h[i] = _eaw_weight(w[i], w[i+1]);
+    h[wd-1] = 1.0f;
+    if(j < ht-1) for(int i=0; i<wd; i++) v[i] = _eaw_weight(w[i], w[i+wd]);
+    else for(int i=0; i<wd; i++) v[i] = 1.0f;
   }
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(weight_a,buf) private(ch) schedule(static)
-#endif
-  for(int i=0; i<width; i++)
+}
+
+// px += sign * (wa*a + wb*b)/(norm*(wa + wb))
+static inline void _eaw_lift(float *px, const float *a, const float *b, const float wa, const float wb,
+                             const float sign, const float norm)
+{
+  const float n = sign/(norm*(wa + wb));
+  const __m128 s = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(wa*n), _mm_load_ps(a)), _mm_mul_ps(_mm_set1_ps(wb*n), _mm_load_ps(b)));
+  _mm_store_ps(px, _mm_add_ps(_mm_load_ps(px), s));
+}
+
+// px += f * a
+static inline void _eaw_lift1(float *px, const float *a, const float f)
+{
+  _mm_store_ps(px, _mm_add_ps(_mm_load_ps(px), _mm_mul_ps(_mm_set1_ps(f), _mm_load_ps(a))));
+}
+
+// one row, predict (detail) at the odd positions or update (coarse) at the even positions of the level.
+// the inverse transform runs the same steps the other way around.
+static inline void _eaw_row(float *row, const float *h, const int st, const int width, const int update,
+                            const int inverse)
+{
+  const float sign = update != inverse ? 1.0f : -1.0f;
+  const int step = 2*st;
+  int i = update ? step : st;
+  if(update) _eaw_lift1(row, row + 4*st, sign*0.5f);
+  for(; i<width-st; i+=step)
   {
-    // cols
-    // precompute weights:
-    float tmp[height];
-    for(int j=0; j<height-st; j+=st) tmp[j] = gweight(i, j, i, j+st);
-    int j = st;
-    // predict, get detail
-    for(; j<height-st; j+=step) for(ch=0; ch<3; ch++)
-        gbuf(buf, i, j) -= (tmp[j-st]*gbuf(buf, i, j-st) + tmp[j]*gbuf(buf, i, j+st))
-                           /(tmp[j-st] + tmp[j]);
-    if(j < height) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) -= gbuf(buf, i, j-st);
-    // update
-    for(ch=0; ch<3; ch++) gbuf(buf, i, 0) += gbuf(buf, i, st)*0.5;
-    for(j=step; j<height-st; j+=step) for(ch=0; ch<3; ch++)
-        gbuf(buf, i, j) += (tmp[j-st]*gbuf(buf, i, j-st) + tmp[j]*gbuf(buf, i, j+st))
-                           /(2.0*(tmp[j-st] + tmp[j]));
-    if(j < height) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) += gbuf(buf, i, j-st)*.5f;
+    const int ci = i/st;
+    _eaw_lift(row + 4*i, row + 4*(i-st), row + 4*(i+st), h[ci-1], h[ci], sign, update ? 2.0f : 1.0f);
   }
+  if(i < width) _eaw_lift1(row + 4*i, row + 4*(i-st), update ? sign*0.5f : sign);
 }
 
-void dt_iop_equalizer_iwtf(float *buf, float **weight_a, const int l, const int width, const int height)
+// row j of the column steps, from rows j-st and j+st, v the vertical weights of coarse row pairs (j/st-1, j/st)
+// and (j/st, j/st+1)
+static inline void _eaw_col(float *buf, const float *v0, const float *v1, const int l, const int j, const int st,
+                            const int width, const int height, const int update, const int inverse)
 {
-  const int step = 1<<l;
-  const int st = step/2;
-  const int wd = (int)(1 + (width>>(l-1)));
+  const float sign = update != inverse ? 1.0f : -1.0f;
+  float *row = buf + (size_t)4*width*j;
+  if(update && j == 0)
+  {
+    for(int i=0; i<width; i++) _eaw_lift1(row + 4*i, row + 4*((size_t)width*st + i), sign*0.5f);
+  }
+  else if(j >= height-st)
+  {
+    for(int i=0; i<width; i++)
+      _eaw_lift1(row + 4*i, row + 4*(i - (size_t)width*st), update ? sign*0.5f : sign);
+  }
+  else
+  {
+    const float *above = row - (size_t)4*width*st, *below = row + (size_t)4*width*st;
+    for(int i=0; i<width; i++)
+    {
+      const int ci = i>>(l-1);
+      _eaw_lift(row + 4*i, above + 4*i, below + 4*i, v0[ci], v1[ci], sign, update ? 2.0f : 1.0f);
+    }
+  }
+}
 
+static void _eaw_rows(float *buf, const float *weight_h, const int l, const int width, const int height,
+                      const int wd, const int inverse)
+{
+  const int st = 1<<(l-1);
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(weight_a,buf) schedule(static)
+  #pragma omp parallel for default(none) shared(buf) schedule(static)
 #endif
-  for(int i=0; i<width; i++)
+  for(int j=0; j<height; j++)
   {
-    //cols
-    float tmp[height];
-    int j;
-    for(j=0; j<height-st; j+=st) tmp[j] = gweight(i, j, i, j+st);
-    // update coarse
-    for(int ch=0; ch<3; ch++) gbuf(buf, i, 0) -= gbuf(buf, i, st)*0.5f;
-    for(j=step; j<height-st; j+=step) for(int ch=0; ch<3; ch++)
-        gbuf(buf, i, j) -= (tmp[j-st]*gbuf(buf, i, j-st) + tmp[j]*gbuf(buf, i, j+st))
-                           /(2.0*(tmp[j-st] + tmp[j]));
-    if(j < height) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) -= gbuf(buf, i, j-st)*.5f;
-    // predict
-    for(j=st; j<height-st; j+=step) for(int ch=0; ch<3; ch++)
-        gbuf(buf, i, j) += (tmp[j-st]*gbuf(buf, i, j-st) + tmp[j]*gbuf(buf, i, j+st))
-                           /(tmp[j-st] + tmp[j]);
-    if(j < height) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) += gbuf(buf, i, j-st);
+    float *row = buf + (size_t)4*width*j;
+    const float *h = weight_h + (size_t)wd*(j>>(l-1));
+    _eaw_row(row, h, st, width, inverse, inverse);
+    _eaw_row(row, h, st, width, !inverse, inverse);
   }
+}
+
+static void _eaw_cols(float *buf, const float *weight_v, const int l, const int width, const int height,
+                      const int wd, const int inverse)
+{
+  const int st = 1<<(l-1), step = 2*st;
+  // the first pass for every odd row (forward: predict) or even row (inverse: update), then the other
+  for(int pass=0; pass<2; pass++)
+  {
+    const int update = inverse ? !pass : pass;
+    const int first = update ? 0 : st;
+    const int rows = (height - first + step - 1)/step;
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(weight_a,buf) schedule(static)
+    #pragma omp parallel for default(none) shared(buf) schedule(static)
 #endif
-  for(int j=0; j<height; j++)
-  {
-    // rows
-    float tmp[width];
-    int i;
-    for(int i=0; i<width-st; i+=st) tmp[i] = gweight(i, j, i+st, j);
-    // update
-    for(int ch=0; ch<3; ch++) gbuf(buf, 0, j) -= gbuf(buf, st, j)*0.5f;
-    for(i=step; i<width-st; i+=step) for(int ch=0; ch<3; ch++)
-        gbuf(buf, i, j) -= (tmp[i-st]*gbuf(buf, i-st, j) + tmp[i]*gbuf(buf, i+st, j))
-                           /(2.0*(tmp[i-st] + tmp[i]));
-    if(i < width) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) -= gbuf(buf, i-st, j)*0.5f;
-    // predict
-    for(i=st; i<width-st; i+=step) for(int ch=0; ch<3; ch++)
-        gbuf(buf, i, j) += (tmp[i-st]*gbuf(buf, i-st, j) + tmp[i]*gbuf(buf, i+st, j))
-                           /(tmp[i-st] + tmp[i]);
-    if(i < width) for(int ch=0; ch<3; ch++) gbuf(buf, i, j) += gbuf(buf, i-st, j);
+    for(int k=0; k<rows; k++)
+    {
+      const int j = first + k*step, cj = j>>(l-1);
+      const float *v0 = weight_v + (size_t)wd*MAX(cj-1, 0), *v1 = weight_v + (size_t)wd*cj;
+      _eaw_col(buf, v0, v1, l, j, st, width, height, update, inverse);
+    }
   }
 }
 
-#undef gbuf
-#undef gweight
+void dt_iop_equalizer_wtf(float *buf, float **weight_a, float *scratch, const int l, const int width, const int height)
+{
+  const int wd = (int)(1 + (width>>(l-1))), ht = (int)(1 + (height>>(l-1)));
+  // store weights for luma channel only, chroma uses same basis.
+  memset(weight_a[l], 0, (size_t)sizeof(float)*wd*ht);
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(buf, weight_a) schedule(static)
+#endif
+  for(int j=0; j<ht-1; j++)
+    for(int i=0; i<wd-1; i++) weight_a[l][(size_t)j*wd+i] = buf[4*((size_t)width*(j<<(l-1)) + (i<<(l-1)))];
+
+  float *weight_h = scratch, *weight_v = scratch + (size_t)wd*ht;
+  _eaw_level_weights(weight_a[l], weight_h, weight_v, wd, ht);
+  _eaw_rows(buf, weight_h, l, width, height, wd, 0);
+  _eaw_cols(buf, weight_v, l, width, height, wd, 0);
+}
+
+void dt_iop_equalizer_iwtf(float *buf, float **weight_a, float *scratch, const int l, const int width, const int height)
+{
+  const int wd = (int)(1 + (width>>(l-1))), ht = (int)(1 + (height>>(l-1)));
+  float *weight_h = scratch, *weight_v = scratch + (size_t)wd*ht;
+  _eaw_level_weights(weight_a[l], weight_h, weight_v, wd, ht);
+  _eaw_cols(buf, weight_v, l, width, height, wd, 1);
+  _eaw_rows(buf, weight_h, l, width, height, wd, 1);
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
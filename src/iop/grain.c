@@ -33,6 +33,7 @@
 #include "gui/gtk.h"
 #include <gtk/gtk.h>
 #include <inttypes.h>
+#include <xmmintrin.h>
 
 #define GRAIN_LIGHTNESS_STRENGTH_SCALE 0.15
 // (m_pi/2)/4 = half hue colorspan
@@ -77,6 +78,11 @@ typedef struct dt_iop_grain_data_t
   _dt_iop_grain_channel_t channel;
   float scale;
   float strength;
+  // noise of the last roi the darkroom pipes processed. it doesn't depend on the input, only on the image,
+  // the roi and the coarseness, so dragging the strength slider doesn't have to synthesize it again.
+  float *noise;
+  size_t noise_size;
+  uint64_t noise_hash;
 }
 dt_iop_grain_data_t;
 
@@ -106,152 +112,94 @@ static void _simplex_noise_init()
 {
   for(int i=0; i<512; i++) perm[i] = p[i & 255];
 }
-static double dot(int g[], double x, double y, double z)
+// the noise repeats every 768 units along x and y: that's a step of 4*256 and 256 on the skewed lattice, and
+// the gradients only depend on the lattice coordinates mod 256. coordinates are brought into [0, 768) this way
+// in double precision, so the noise can be done in float even far from the origin.
+#define SIMPLEX_PERIOD 768.0
+
+static inline float _simplex_wrap(const double x)
 {
-  return g[0]*x + g[1]*y + g[2]*z;
+  return x - SIMPLEX_PERIOD * floor(x * (1.0/SIMPLEX_PERIOD));
 }
 
-#define FASTFLOOR(x) ( x>0 ? (int)(x) : (int)(x)-1 )
-
-static double _simplex_noise(double xin, double yin, double zin)
-{
-  double n0, n1, n2, n3; // Noise contributions from the four corners
-// Skew the input space to determine which simplex cell we're in
-  double F3 = 1.0/3.0;
-  double s = (xin+yin+zin)*F3; // Very nice and simple skew factor for 3D
-  int i = FASTFLOOR(xin+s);
-  int j = FASTFLOOR(yin+s);
-  int k = FASTFLOOR(zin+s);
-  double G3 = 1.0/6.0; // Very nice and simple unskew factor, too
-  double t = (i+j+k)*G3;
-  double X0 = i-t; // Unskew the cell origin back to (x,y,z) space
-  double Y0 = j-t;
-  double Z0 = k-t;
-  double x0 = xin-X0; // The x,y,z distances from the cell origin
-  double y0 = yin-Y0;
-  double z0 = zin-Z0;
-// For the 3D case, the simplex shape is a slightly irregular tetrahedron.
-// Determine which simplex we are in.
-  int i1, j1, k1; // Offsets for second corner of simplex in (i,j,k) coords
-  int i2, j2, k2; // Offsets for third corner of simplex in (i,j,k) coords
-  if(x0>=y0)
-  {
-    if(y0>=z0)
-    {
-      i1=1;  // X Y Z order
-      j1=0;
-      k1=0;
-      i2=1;
-      j2=1;
-      k2=0;
-    }
-    else if(x0>=z0)
-    {
-      i1=1;  // X Z Y order
-      j1=0;
-      k1=0;
-      i2=1;
-      j2=0;
-      k2=1;
-    }
-    else
-    {
-      i1=0;  // Z X Y order
-      j1=0;
-      k1=1;
-      i2=1;
-      j2=0;
-      k2=1;
-    }
+// contribution of one corner of the simplex, with the gradients of the four points gathered from grad3
+#define SIMPLEX_CORNER(N, X, Y, Z, GI) \
+  __m128 N; \
+  { \
+    __m128 t = _mm_sub_ps(_mm_set1_ps(0.6f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(X, X), _mm_mul_ps(Y, Y)), _mm_mul_ps(Z, Z))); \
+    t = _mm_max_ps(t, _mm_setzero_ps()); \
+    t = _mm_mul_ps(t, t); \
+    const __m128 gx = _mm_set_ps(grad3[GI[3]][0], grad3[GI[2]][0], grad3[GI[1]][0], grad3[GI[0]][0]); \
+    const __m128 gy = _mm_set_ps(grad3[GI[3]][1], grad3[GI[2]][1], grad3[GI[1]][1], grad3[GI[0]][1]); \
+    const __m128 gz = _mm_set_ps(grad3[GI[3]][2], grad3[GI[2]][2], grad3[GI[1]][2], grad3[GI[0]][2]); \
+    const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, X), _mm_mul_ps(gy, Y)), _mm_mul_ps(gz, Z)); \
+    N = _mm_mul_ps(_mm_mul_ps(t, t), dot); \
   }
-  else   // x0<y0
+
+// 3d simplex noise at four points of the plane z = zin. x, y and zin have to be positive.
+static __m128 _simplex_noise(const __m128 xin, const __m128 yin, const float zin)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 G3 = _mm_set1_ps(1.0f/6.0f); // Very nice and simple unskew factor
+  const __m128 zv = _mm_set1_ps(zin);
+  // Skew the input space to determine which simplex cell we're in. all positive, so truncation is floor.
+  const __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(xin, yin), zv), _mm_set1_ps(1.0f/3.0f));
+  const __m128i i = _mm_cvttps_epi32(_mm_add_ps(xin, s));
+  const __m128i j = _mm_cvttps_epi32(_mm_add_ps(yin, s));
+  const __m128i k = _mm_cvttps_epi32(_mm_add_ps(zv, s));
+  const __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), k)), G3);
+  // The x,y,z distances from the cell origin, unskewed back to (x,y,z) space
+  const __m128 x0 = _mm_sub_ps(xin, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+  const __m128 y0 = _mm_sub_ps(yin, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+  const __m128 z0 = _mm_sub_ps(zv, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+  // Determine which simplex we are in: offsets of the second (i1, j1, k1) and third corner (i2, j2, k2), as masks
+  const __m128 x_ge_y = _mm_cmpge_ps(x0, y0), y_ge_z = _mm_cmpge_ps(y0, z0), x_ge_z = _mm_cmpge_ps(x0, z0);
+  const __m128 i1 = _mm_and_ps(x_ge_y, x_ge_z);
+  const __m128 j1 = _mm_andnot_ps(x_ge_y, y_ge_z);
+  const __m128 k1 = _mm_andnot_ps(_mm_or_ps(x_ge_z, y_ge_z), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+  const __m128 i2 = _mm_or_ps(x_ge_y, x_ge_z);
+  const __m128 j2 = _mm_or_ps(_mm_andnot_ps(x_ge_y, _mm_castsi128_ps(_mm_set1_epi32(-1))), y_ge_z);
+  const __m128 k2 = _mm_andnot_ps(_mm_and_ps(x_ge_z, y_ge_z), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+  // Offsets for the other corners in (x,y,z) coords
+  const __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(i1, one)), G3);
+  const __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(j1, one)), G3);
+  const __m128 z1 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(k1, one)), G3);
+  const __m128 G3_2 = _mm_add_ps(G3, G3), G3_3 = _mm_sub_ps(_mm_set1_ps(0.5f), one);
+  const __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(i2, one)), G3_2);
+  const __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(j2, one)), G3_2);
+  const __m128 z2 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(k2, one)), G3_2);
+  const __m128 x3 = _mm_add_ps(x0, G3_3);
+  const __m128 y3 = _mm_add_ps(y0, G3_3);
+  const __m128 z3 = _mm_add_ps(z0, G3_3);
+
+  // Work out the hashed gradient indices of the four simplex corners, point by point
+  int32_t ii[4] __attribute__((aligned(16))), jj[4] __attribute__((aligned(16))), kk[4] __attribute__((aligned(16)));
+  _mm_store_si128((__m128i *)ii, i);
+  _mm_store_si128((__m128i *)jj, j);
+  _mm_store_si128((__m128i *)kk, k);
+  const int mi1 = _mm_movemask_ps(i1), mj1 = _mm_movemask_ps(j1), mk1 = _mm_movemask_ps(k1);
+  const int mi2 = _mm_movemask_ps(i2), mj2 = _mm_movemask_ps(j2), mk2 = _mm_movemask_ps(k2);
+  int gi0[4], gi1[4], gi2[4], gi3[4];
+  for(int l=0; l<4; l++)
   {
-    if(y0<z0)
-    {
-      i1=0;  // Z Y X order
-      j1=0;
-      k1=1;
-      i2=0;
-      j2=1;
-      k2=1;
-    }
-    else if(x0<z0)
-    {
-      i1=0;  // Y Z X order
-      j1=1;
-      k1=0;
-      i2=0;
-      j2=1;
-      k2=1;
-    }
-    else
-    {
-      i1=0;  // Y X Z order
-      j1=1;
-      k1=0;
-      i2=1;
-      j2=1;
-      k2=0;
-    }
+    const int a = ii[l] & 255, b = jj[l] & 255, c = kk[l] & 255;
+    gi0[l] = perm[a+perm[b+perm[c]]] % 12;
+    gi1[l] = perm[a+((mi1>>l)&1)+perm[b+((mj1>>l)&1)+perm[c+((mk1>>l)&1)]]] % 12;
+    gi2[l] = perm[a+((mi2>>l)&1)+perm[b+((mj2>>l)&1)+perm[c+((mk2>>l)&1)]]] % 12;
+    gi3[l] = perm[a+1+perm[b+1+perm[c+1]]] % 12;
   }
-//  A step of (1,0,0) in (i,j,k) means a step of (1-c,-c,-c) in (x,y,z),
-//  a step of (0,1,0) in (i,j,k) means a step of (-c,1-c,-c) in (x,y,z), and
-//  a step of (0,0,1) in (i,j,k) means a step of (-c,-c,1-c) in (x,y,z), where
-//  c = 1/6.
-  double   x1 = x0 - i1 + G3; // Offsets for second corner in (x,y,z) coords
-  double   y1 = y0 - j1 + G3;
-  double   z1 = z0 - k1 + G3;
-  double   x2 = x0 - i2 + 2.0*G3; // Offsets for third corner in (x,y,z) coords
-  double   y2 = y0 - j2 + 2.0*G3;
-  double   z2 = z0 - k2 + 2.0*G3;
-  double   x3 = x0 - 1.0 + 3.0*G3; // Offsets for last corner in (x,y,z) coords
-  double   y3 = y0 - 1.0 + 3.0*G3;
-  double   z3 = z0 - 1.0 + 3.0*G3;
-  // Work out the hashed gradient indices of the four simplex corners
-  int ii = i & 255;
-  int jj = j & 255;
-  int kk = k & 255;
-  int gi0 = perm[ii+perm[jj+perm[kk]]] % 12;
-  int gi1 = perm[ii+i1+perm[jj+j1+perm[kk+k1]]] % 12;
-  int gi2 = perm[ii+i2+perm[jj+j2+perm[kk+k2]]] % 12;
-  int gi3 = perm[ii+1+perm[jj+1+perm[kk+1]]] % 12;
+
   // Calculate the contribution from the four corners
-  double t0 = 0.6 - x0*x0 - y0*y0 - z0*z0;
-  if(t0<0) n0 = 0.0;
-  else
-  {
-    t0 *= t0;
-    n0 = t0 * t0 * dot(grad3[gi0], x0, y0, z0);
-  }
-  double t1 = 0.6 - x1*x1 - y1*y1 - z1*z1;
-  if(t1<0) n1 = 0.0;
-  else
-  {
-    t1 *= t1;
-    n1 = t1 * t1 * dot(grad3[gi1], x1, y1, z1);
-  }
-  double t2 = 0.6 - x2*x2 - y2*y2 - z2*z2;
-  if(t2<0) n2 = 0.0;
-  else
-  {
-    t2 *= t2;
-    n2 = t2 * t2 * dot(grad3[gi2], x2, y2, z2);
-  }
-  double t3 = 0.6 - x3*x3 - y3*y3 - z3*z3;
-  if(t3<0) n3 = 0.0;
-  else
-  {
-    t3 *= t3;
-    n3 = t3 * t3 * dot(grad3[gi3], x3, y3, z3);
-  }
+  SIMPLEX_CORNER(n0, x0, y0, z0, gi0);
+  SIMPLEX_CORNER(n1, x1, y1, z1, gi1);
+  SIMPLEX_CORNER(n2, x2, y2, z2, gi2);
+  SIMPLEX_CORNER(n3, x3, y3, z3, gi3);
   // Add contributions from each corner to get the final noise value.
   // The result is scaled to stay just inside [-1,1]
-  return 32.0*(n0 + n1 + n2 + n3);
+  return _mm_mul_ps(_mm_set1_ps(32.0f), _mm_add_ps(_mm_add_ps(n0, n1), _mm_add_ps(n2, n3)));
 }
 
-
-
-
+#undef SIMPLEX_CORNER
 
 #define PRIME_LEVELS 4
 //static uint64_t _low_primes[PRIME_LEVELS] ={ 12503,14029,15649, 11369 };
@@ -307,17 +255,21 @@ static double _perlin_2d_noise(double x,double y,uint32_t octaves,double persist
   return total;
 }*/
 
-static double _simplex_2d_noise(double x,double y,uint32_t octaves,double persistance,double z)
+// the octaves of the noise at four points. the octave loop this module always had goes through f = 1, 0, 2 and
+// a = 1, 0, 1 (persistance 1), so only the first and the third of its three octaves ever contributed.
+static inline __m128 _simplex_2d_noise(const double x[4], const double y[4], const double z)
 {
-  double f=1,a=1,total=0;
-
-  for(uint32_t o=0; o<octaves; o++)
+  float x1[4] __attribute__((aligned(16))), y1[4] __attribute__((aligned(16)));
+  float x2[4] __attribute__((aligned(16))), y2[4] __attribute__((aligned(16)));
+  for(int l=0; l<4; l++)
   {
-    total+= (_simplex_noise(x*f/z,y*f/z,o)*a);
-    f=2*o;
-    a=persistance*o;
+    x1[l] = _simplex_wrap(x[l]/z);
+    y1[l] = _simplex_wrap(y[l]/z);
+    x2[l] = _simplex_wrap(2.0*x[l]/z);
+    y2[l] = _simplex_wrap(2.0*y[l]/z);
   }
-  return total;
+  return _mm_add_ps(_simplex_noise(_mm_load_ps(x1), _mm_load_ps(y1), 0.0f),
+                    _simplex_noise(_mm_load_ps(x2), _mm_load_ps(y2), 2.0f));
 }
 
 
@@ -363,6 +315,46 @@ static unsigned int _hash_string(char *s)
   return h;
 }
 
+// rank-1 lattices (n, g) of fibonacci numbers for the supersampling of zoomed out views, point l is
+// (l/n, l*g/n mod 1). the coarser the noise is compared to the pixel, the fewer points it takes.
+static const int _grain_lattice[4][2] = {{1,0},{5,3},{13,8},{21,13}};
+
+static int _grain_lattice_size(const double filtermul, const double zoom)
+{
+  // finest octave has features of about zoom/2
+  const double r = filtermul/(0.5*zoom);
+  if(r < 0.125) return 0;
+  if(r < 0.25) return 1;
+  if(r < 0.5) return 2;
+  return 3;
+}
+
+static void _grain_noise_row(float *noise, const dt_iop_roi_t *const roi_out, const int j, const unsigned int hash,
+                             const double wd, const double zoom, const double filtermul, const int lattice)
+{
+  const int n = _grain_lattice[lattice][0], g = _grain_lattice[lattice][1];
+  // calculate x, y in a resolution independent way:
+  // wx,wy: worldspace in full image pixel coords,
+  // x, y: normalized to shorter side of image, so with pixel aspect = 1.
+  const double y = (roi_out->y + j)/roi_out->scale/wd;
+  for(int i=0; i<roi_out->width; i+=4)
+  {
+    double x[4];
+    for(int k=0; k<4; k++) x[k] = (roi_out->x + i + k)/roi_out->scale/wd + hash;
+    __m128 sum = _mm_setzero_ps();
+    for(int l=0; l<n; l++)
+    {
+      const double dx = (l/(double)n)*filtermul, dy = ((l*g) % n)/(double)n*filtermul;
+      const double xs[4] = { x[0]+dx, x[1]+dx, x[2]+dx, x[3]+dx };
+      const double ys[4] = { y+dy, y+dy, y+dy, y+dy };
+      sum = _mm_add_ps(sum, _simplex_2d_noise(xs, ys, zoom));
+    }
+    float v[4] __attribute__((aligned(16)));
+    _mm_store_ps(v, _mm_mul_ps(sum, _mm_set1_ps(1.0f/n)));
+    for(int k=0; k<4 && i+k<roi_out->width; k++) noise[i+k] = v[k];
+  }
+}
+
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   dt_iop_grain_data_t *data = (dt_iop_grain_data_t *)piece->data;
@@ -371,51 +363,57 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
 
   const int ch = piece->colors;
   // Apply grain to image
-  const double strength=(data->strength/100.0);
-  const double octaves=3;
-  // double zoom=1.0+(8*(data->scale/100.0));
+  const float strength = 100.0*(data->strength/100.0)*GRAIN_LIGHTNESS_STRENGTH_SCALE;
   const double wd = fminf(piece->buf_in.width, piece->buf_in.height);
   const double zoom=(1.0+8*data->scale/100)/800.0;
   const int filter = fabsf(roi_out->scale - 1.0f) > 0.01;
   // filter width depends on world space (i.e. reverse wd norm and roi->scale, as well as buffer input to pixelpipe iscale)
   const double filtermul = piece->iscale/(roi_out->scale*wd);
+  // if zoomed out a lot, use rank-1 lattice downsampling
+  const int lattice = filter ? _grain_lattice_size(filtermul, zoom) : 0;
+
+  // the darkroom pipes keep the noise around for the next run, the others synthesize it row by row
+  float *noise = NULL;
+  int cached = 0;
+  uint64_t key = 0;
+  if(piece->pipe->type & (DT_DEV_PIXELPIPE_FULL | DT_DEV_PIXELPIPE_PREVIEW))
+  {
+    const double k[] = { roi_out->x, roi_out->y, roi_out->width, roi_out->height, roi_out->scale,
+                         piece->iscale, wd, zoom, hash, lattice };
+    key = 14695981039346656037ull;
+    const uint8_t *b = (const uint8_t *)k;
+    for(size_t l=0; l<sizeof(k); l++) key = (key ^ b[l]) * 1099511628211ull;
+    key |= 1; // 0 is empty
+
+    const size_t size = (size_t)roi_out->width * roi_out->height;
+    if(data->noise && data->noise_hash == key) cached = 1;
+    else
+    {
+      data->noise_hash = 0;
+      if(data->noise_size < size)
+      {
+        dt_free_align(data->noise);
+        data->noise = (float *)dt_alloc_align(16, sizeof(float)*size);
+        data->noise_size = data->noise ? size : 0;
+      }
+    }
+    noise = data->noise;
+  }
+
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(roi_out, roi_in, ovoid, ivoid, data, hash)
+  #pragma omp parallel for default(none) shared(roi_out, ivoid, ovoid, noise, cached, hash)
 #endif
   for(int j=0; j<roi_out->height; j++)
   {
-    float *in  = ((float *)ivoid) + (size_t)roi_out->width * j * ch;
+    float row[noise ? 1 : roi_out->width];
+    float *n = noise ? noise + (size_t)roi_out->width * j : row;
+    if(!cached) _grain_noise_row(n, roi_out, j, hash, wd, zoom, filtermul, lattice);
+
+    const float *in  = ((float *)ivoid) + (size_t)roi_out->width * j * ch;
     float *out = ((float *)ovoid) + (size_t)roi_out->width * j * ch;
     for(int i=0; i<roi_out->width; i++)
     {
-      // calculate x, y in a resolution independent way:
-      // wx,wy: worldspace in full image pixel coords:
-      double wx = (roi_out->x + i)/roi_out->scale;
-      double wy = (roi_out->y + j)/roi_out->scale;
-      // x, y: normalized to shorter side of image, so with pixel aspect = 1.
-      // printf("scale %f\n", wd);
-      double x = wx / wd;
-      double y = wy / wd;
-      //  double noise=_perlin_2d_noise(x, y, octaves,0.25, zoom)*1.5;
-      double noise = 0.0;
-      if(filter)
-      {
-        // if zoomed out a lot, use rank-1 lattice downsampling
-        const float fib1 = 34.0, fib2 = 21.0;
-        for(int l=0; l<fib2; l++)
-        {
-          float px = l/fib2, py = l*(fib1/fib2);
-          py -= (int)py;
-          float dx = px*filtermul, dy = py*filtermul;
-          noise += (1.0/fib2) * _simplex_2d_noise(x+dx+hash, y+dy, octaves, 1.0, zoom);
-        }
-      }
-      else
-      {
-        noise = _simplex_2d_noise(x+hash, y, octaves, 1.0, zoom);
-      }
-
-      out[0] = in[0]+((100.0*(noise*(strength)))*GRAIN_LIGHTNESS_STRENGTH_SCALE);
+      out[0] = in[0] + n[i]*strength;
       out[1] = in[1];
       out[2] = in[2];
       out[3] = in[3];
@@ -424,6 +422,8 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
       in += ch;
     }
   }
+
+  if(noise && !cached) data->noise_hash = key;
 }
 
 static void
@@ -479,6 +479,8 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
   (void)gegl_node_remove_child(pipe->gegl, piece->input);
   // no free necessary, no data is alloc'ed
 #else
+  dt_iop_grain_data_t *d = (dt_iop_grain_data_t *)piece->data;
+  dt_free_align(d->noise);
   free(piece->data);
   piece->data = NULL;
 #endif
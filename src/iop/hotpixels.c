@@ -29,6 +29,7 @@
 #include "dtgtk/resetlabel.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
+#include "iop/hotpixels.h"
 #include <gtk/gtk.h>
 #include <stdlib.h>
 
@@ -100,16 +101,6 @@ output_bpp(dt_iop_module_t *module, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_i
   return sizeof(float);
 }
 
-static uint8_t
-FCxtrans(const int row, const int col,
-         const dt_iop_roi_t *const roi,
-         const uint8_t (*const xtrans)[6])
-{
-  // add +6 to as offset can be -1 or -2 and need to ensure a
-  // non-negative array index.
-  return xtrans[(row+roi->y+6) % 6][(col+roi->x+6) % 6];
-}
-
 static int
 process_xtrans(
   const void *const i, void *o,
@@ -119,24 +110,8 @@ process_xtrans(
   const float threshold, const float multiplier,
   const gboolean markfixed, const int min_neighbours)
 {
-  // for each cell of sensor array, a list of the x/y offsets of the
-  // four radially nearest pixels of the same color
   int offsets[6][6][4][2];
-  const int search[20][2]={{-1,0},{1,0},{0,-1},{0,1},{-1,-1},{-1,1},{1,-1},{1,1},{-2,0},{2,0},{0,-2},{0,2},{-2,-1},{-2,1},{2,-1},{2,1},{-1,-2},{1,-2},{-1,2},{1,2}};
-  for (int j=0; j<6; ++j)
-    for (int i=0; i<6; ++i)
-    {
-      const uint8_t c = FCxtrans(j,i,roi_in,xtrans);
-      for (int s=0, found=0; s<20 && found<4; ++s)
-      {
-        if (c == FCxtrans(j+search[s][1],i+search[s][0],roi_in,xtrans))
-        {
-          offsets[i][j][found][0] = search[s][0];
-          offsets[i][j][found][1] = search[s][1];
-          ++found;
-        }
-      }
-    }
+  dt_iop_hotpixels_xtrans_offsets(offsets, xtrans, roi_in->x, roi_in->y);
 
   int fixed = 0;
 #ifdef _OPENMP
@@ -144,46 +119,10 @@ process_xtrans(
 #endif
   for (int row=1; row<height-1; row++)
   {
-    const float *in = (float*)i + (size_t)width*row+2;
-    float *out = (float*)o + (size_t)width*row+2;
-    for (int col=1; col<width-1; col++, in++, out++)
-    {
-      float mid= *in * multiplier;
-      if (*in > threshold)
-      {
-        int count=0;
-        float maxin=0.0;
-        for (int n=0; n < 4; ++n)
-        {
-          int xx = offsets[col%6][row%6][n][0];
-          int yy = offsets[col%6][row%6][n][1];
-          if ((xx < -col) || (xx >= (width-col)) ||
-              (yy < -row) || (yy >= (height-row)))
-            break;
-          float other = *(in + xx + yy*width);
-          if (mid > other)
-          {
-            count++;
-            if (other > maxin) maxin = other;
-          }
-        }
-        // NOTE: it seems that detecting by 2 neighbors would help for extreme cases
-        if (count >= min_neighbours)
-        {
-          *out = maxin;
-          fixed++;
-          if (markfixed)
-          {
-            // cheat and mark all colors of pixels
-            // FIXME: use offsets
-            for (int i=-2; i>=-10 && i>=-col; --i)
-              out[i] = *in;
-            for (int i=2; i<=10 && i<width-col; ++i)
-              out[i] = *in;
-          }
-        }
-      }
-    }
+    const float *in = (float*)i + (size_t)width*row;
+    float *out = (float*)o + (size_t)width*row;
+    fixed += dt_iop_hotpixels_xtrans_row(in, out, row, width, height, offsets, threshold, multiplier,
+                                         min_neighbours, markfixed);
   }
 
   return fixed;
@@ -205,7 +144,6 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   const float multiplier = data->multiplier;
   const int width = roi_out->width;
   const int height = roi_out->height;
-  const int widthx2 = width*2;
   const gboolean markfixed = data->markfixed;
   const int min_neighbours = data->permissive ? 3 : 4;
 
@@ -228,42 +166,9 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
 #endif
   for (int row=2; row<roi_out->height-2; row++)
   {
-    const float *in = (float*)i + (size_t)width*row+2;
-    float *out = (float*)o + (size_t)width*row+2;
-    for (int col=2; col<width-1; col++, in++, out++)
-    {
-      float mid= *in * multiplier;
-      if (*in > threshold)
-      {
-        int count=0;
-        float maxin=0.0;
-        float other;
-#define TESTONE(OFFSET)				\
-	other=in[OFFSET];			\
-	if (mid > other)			\
-	{					\
-	  count++;				\
-	  if (other > maxin) maxin = other;	\
-	}
-        TESTONE(-2);
-        TESTONE(-widthx2);
-        TESTONE(+2);
-        TESTONE(+widthx2);
-#undef TESTONE
-        if (count >= min_neighbours)
-        {
-          *out = maxin;
-          fixed++;
-          if (markfixed)
-          {
-            for (int i=-2; i>=-10 && i>=-col; i-=2)
-              out[i] = *in;
-            for (int i=2; i<=10 && i<width-col; i+=2)
-              out[i] = *in;
-          }
-        }
-      }
-    }
+    const float *in = (float*)i + (size_t)width*row;
+    float *out = (float*)o + (size_t)width*row;
+    fixed += dt_iop_hotpixels_bayer_row(in, out, width, threshold, multiplier, min_neighbours, markfixed);
   }
 
 processed:
@@ -0,0 +1,250 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <xmmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+// the detection of iop/hotpixels.c, one row at a time, so src/tests/hotpixels.c can benchmark it.
+// a site is hot if it is above the threshold and more than the given number of its four nearest neighbours of
+// the same color are below its value times the multiplier. it's replaced by the largest of those neighbours.
+// the vector loops compare a run of consecutive sites against their neighbours without branches, only the
+// rare hot ones are fixed one by one, left to right, so marking overwrites the output just like before.
+// all of them return the number of fixed sites.
+
+static inline void _hotpixels_mark(const float *const in, float *const out, const int col, const int width,
+                                   const int step)
+{
+  for(int i=-2; i>=-10 && i>=-col; i-=step)
+    out[col+i] = in[col];
+  for(int i=2; i<=10 && i<width-col; i+=step)
+    out[col+i] = in[col];
+}
+
+static inline int _hotpixels_fix(const float *const in, float *const out, const int col, const int width,
+                                 const int mask, const float *const maxin, const int lanes, const int markfixed,
+                                 const int step)
+{
+  int fixed = 0;
+  for(int k=0; k<lanes; k++)
+  {
+    if(!(mask & (1<<k))) continue;
+    out[col+k] = maxin[k];
+    fixed++;
+    if(markfixed) _hotpixels_mark(in, out, col+k, width, step);
+  }
+  return fixed;
+}
+
+// bayer: the neighbours are two sites up, down, left and right. in and out point to the start of the row,
+// all of the rows two above and below have to be there.
+static inline int dt_iop_hotpixels_bayer_row(const float *const in, float *const out, const int width,
+                                             const float threshold, const float multiplier,
+                                             const int min_neighbours, const int markfixed)
+{
+  const int w2 = 2*width;
+  int fixed = 0;
+  int col = 2;
+#ifdef __AVX__
+  {
+    const __m256 thrs = _mm256_set1_ps(threshold), mul = _mm256_set1_ps(multiplier);
+    const __m256 one = _mm256_set1_ps(1.0f), minn = _mm256_set1_ps(min_neighbours - 0.5f);
+    for(; col+7 < width-1; col+=8)
+    {
+      const __m256 v = _mm256_loadu_ps(in+col);
+      const __m256 mid = _mm256_mul_ps(v, mul);
+      __m256 count = _mm256_setzero_ps(), maxin = _mm256_setzero_ps();
+#define TESTONE(OFFSET) \
+      { \
+        const __m256 other = _mm256_loadu_ps(in+col+(OFFSET)); \
+        const __m256 lower = _mm256_cmp_ps(mid, other, _CMP_GT_OQ); \
+        count = _mm256_add_ps(count, _mm256_and_ps(lower, one)); \
+        maxin = _mm256_max_ps(maxin, _mm256_and_ps(lower, other)); \
+      }
+      TESTONE(-2);
+      TESTONE(-w2);
+      TESTONE(+2);
+      TESTONE(+w2);
+#undef TESTONE
+      const int mask = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v, thrs, _CMP_GT_OQ),
+                                                        _mm256_cmp_ps(count, minn, _CMP_GT_OQ)));
+      if(mask)
+      {
+        float m[8] __attribute__((aligned(32)));
+        _mm256_store_ps(m, maxin);
+        fixed += _hotpixels_fix(in, out, col, width, mask, m, 8, markfixed, 2);
+      }
+    }
+  }
+#endif
+  const __m128 thrs = _mm_set1_ps(threshold), mul = _mm_set1_ps(multiplier);
+  const __m128 one = _mm_set1_ps(1.0f), minn = _mm_set1_ps(min_neighbours - 0.5f);
+  for(; col+3 < width-1; col+=4)
+  {
+    const __m128 v = _mm_loadu_ps(in+col);
+    const __m128 mid = _mm_mul_ps(v, mul);
+    __m128 count = _mm_setzero_ps(), maxin = _mm_setzero_ps();
+#define TESTONE(OFFSET) \
+    { \
+      const __m128 other = _mm_loadu_ps(in+col+(OFFSET)); \
+      const __m128 lower = _mm_cmpgt_ps(mid, other); \
+      count = _mm_add_ps(count, _mm_and_ps(lower, one)); \
+      maxin = _mm_max_ps(maxin, _mm_and_ps(lower, other)); \
+    }
+    TESTONE(-2);
+    TESTONE(-w2);
+    TESTONE(+2);
+    TESTONE(+w2);
+#undef TESTONE
+    const int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(v, thrs), _mm_cmpgt_ps(count, minn)));
+    if(mask)
+    {
+      float m[4] __attribute__((aligned(16)));
+      _mm_store_ps(m, maxin);
+      fixed += _hotpixels_fix(in, out, col, width, mask, m, 4, markfixed, 2);
+    }
+  }
+  for(; col<width-1; col++)
+  {
+    const float mid = in[col] * multiplier;
+    if(in[col] > threshold)
+    {
+      int count = 0;
+      float maxin = 0.0f;
+      const int offsets[4] = { -2, -w2, +2, +w2 };
+      for(int n=0; n<4; n++)
+      {
+        const float other = in[col+offsets[n]];
+        if(mid > other)
+        {
+          count++;
+          if(other > maxin) maxin = other;
+        }
+      }
+      if(count >= min_neighbours) fixed += _hotpixels_fix(in, out, col, width, 1, &maxin, 1, markfixed, 2);
+    }
+  }
+  return fixed;
+}
+
+// x-trans: for each cell of the sensor array (x and y of the site mod 6), a list of the x/y offsets of the
+// four radially nearest sites of the same color. xtrans is indexed [y][x] relative to the roi at x0, y0.
+static inline void dt_iop_hotpixels_xtrans_offsets(int offsets[6][6][4][2], const uint8_t (*const xtrans)[6],
+                                                   const int x0, const int y0)
+{
+  const int search[20][2]={{-1,0},{1,0},{0,-1},{0,1},{-1,-1},{-1,1},{1,-1},{1,1},{-2,0},{2,0},{0,-2},{0,2},{-2,-1},{-2,1},{2,-1},{2,1},{-1,-2},{1,-2},{-1,2},{1,2}};
+  // add +6 to as offset can be -1 or -2 and need to ensure a non-negative array index.
+#define FCXTRANS(ROW, COL) xtrans[((ROW)+y0+6) % 6][((COL)+x0+6) % 6]
+  for (int j=0; j<6; ++j)
+    for (int i=0; i<6; ++i)
+    {
+      const uint8_t c = FCXTRANS(j,i);
+      for (int s=0, found=0; s<20 && found<4; ++s)
+      {
+        if (c == FCXTRANS(j+search[s][1],i+search[s][0]))
+        {
+          offsets[i][j][found][0] = search[s][0];
+          offsets[i][j][found][1] = search[s][1];
+          ++found;
+        }
+      }
+    }
+#undef FCXTRANS
+}
+
+static inline int _hotpixels_xtrans_site(const float *const in, float *const out, const int row, const int col,
+                                         const int width, const int height, int offsets[6][6][4][2],
+                                         const float threshold, const float multiplier,
+                                         const int min_neighbours, const int markfixed)
+{
+  const float mid = in[col] * multiplier;
+  if(in[col] <= threshold) return 0;
+  int count = 0;
+  float maxin = 0.0f;
+  for(int n=0; n<4; ++n)
+  {
+    const int xx = offsets[col%6][row%6][n][0];
+    const int yy = offsets[col%6][row%6][n][1];
+    if((xx < -col) || (xx >= (width-col)) || (yy < -row) || (yy >= (height-row)))
+      break;
+    const float other = in[col + xx + yy*width];
+    if(mid > other)
+    {
+      count++;
+      if(other > maxin) maxin = other;
+    }
+  }
+  // NOTE: it seems that detecting by 2 neighbors would help for extreme cases
+  if(count < min_neighbours) return 0;
+  // cheat and mark all colors of pixels
+  // FIXME: use offsets
+  return _hotpixels_fix(in, out, col, width, 1, &maxin, 1, markfixed, 1);
+}
+
+// x-trans row, for 0 < row < height-1. the neighbours are up to two sites away, so away from the borders
+// the sites can be done four at a time, gathering their neighbours through a table of the six column phases.
+static inline int dt_iop_hotpixels_xtrans_row(const float *const in, float *const out, const int row,
+                                              const int width, const int height, int offsets[6][6][4][2],
+                                              const float threshold, const float multiplier,
+                                              const int min_neighbours, const int markfixed)
+{
+  int fixed = 0;
+  int col = 1;
+  if(row >= 2 && row < height-2)
+  {
+    fixed += _hotpixels_xtrans_site(in, out, row, col++, width, height, offsets, threshold, multiplier,
+                                    min_neighbours, markfixed);
+    // linear offsets of the neighbours by column phase, twice so lane k of phase p is at p+k
+    int lin[12][4];
+    for(int p=0; p<12; p++)
+      for(int n=0; n<4; n++) lin[p][n] = offsets[p%6][row%6][n][0] + offsets[p%6][row%6][n][1]*width;
+    const __m128 thrs = _mm_set1_ps(threshold), mul = _mm_set1_ps(multiplier);
+    const __m128 one = _mm_set1_ps(1.0f), minn = _mm_set1_ps(min_neighbours - 0.5f);
+    for(int p=col%6; col+3 < width-2; col+=4, p = p >= 2 ? p-2 : p+4)
+    {
+      const float *const s = in + col;
+      const __m128 v = _mm_loadu_ps(s);
+      const __m128 mid = _mm_mul_ps(v, mul);
+      __m128 count = _mm_setzero_ps(), maxin = _mm_setzero_ps();
+      for(int n=0; n<4; n++)
+      {
+        const __m128 other = _mm_set_ps(s[3+lin[p+3][n]], s[2+lin[p+2][n]], s[1+lin[p+1][n]], s[lin[p][n]]);
+        const __m128 lower = _mm_cmpgt_ps(mid, other);
+        count = _mm_add_ps(count, _mm_and_ps(lower, one));
+        maxin = _mm_max_ps(maxin, _mm_and_ps(lower, other));
+      }
+      const int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(v, thrs), _mm_cmpgt_ps(count, minn)));
+      if(mask)
+      {
+        float m[4] __attribute__((aligned(16)));
+        _mm_store_ps(m, maxin);
+        fixed += _hotpixels_fix(in, out, col, width, mask, m, 4, markfixed, 1);
+      }
+    }
+  }
+  for(; col<width-1; col++)
+    fixed += _hotpixels_xtrans_site(in, out, row, col, width, height, offsets, threshold, multiplier,
+                                    min_neighbours, markfixed);
+  return fixed;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
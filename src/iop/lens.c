@@ -27,6 +27,7 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <lensfun.h>
+#include <xmmintrin.h>
 #include "develop/develop.h"
 #include "develop/imageop.h"
 #include "develop/tiling.h"
@@ -44,18 +45,14 @@
 #define LF_SEARCH_SORT_AND_UNIQUIFY 2
 #endif
 
-#ifndef __GNUC_PREREQ
-// on OSX, gcc-4.6 and clang chokes if this is not here.
-#if defined __GNUC__ && defined __GNUC_MINOR__
-# define __GNUC_PREREQ(maj, min) \
-((__GNUC__ << 16) + __GNUC_MINOR__ >= ((maj) << 16) + (min))
-#else
-# define __GNUC_PREREQ(maj, min) 0
-#endif
-#endif
-
 DT_MODULE_INTROSPECTION(4, dt_iop_lensfun_params_t)
 
+// lensfun's distortion is smooth, so it is only evaluated on a grid with this spacing
+// and interpolated bilinearly in between.
+#define LENS_GRID_STEP 8
+// the grids for distort_transform() and distort_backtransform() cover the whole image, so they are coarser
+#define LENS_POINTS_GRID_STEP 16
+
 typedef enum dt_iop_lensfun_modflag_t
 {
   LENSFUN_MODFLAG_NONE        = 0,
@@ -126,6 +123,23 @@ typedef struct dt_iop_lensfun_global_data_t
 }
 dt_iop_lensfun_global_data_t;
 
+typedef struct dt_iop_lensfun_grid_t
+{
+  dt_pthread_mutex_t lock;
+  lfModifier *modifier;
+  int modflags;
+  int valid;
+  // what the grid has been computed for
+  int inverse;
+  float orig_w, orig_h;
+  int x, y, width, height, step;
+  // nx*ny nodes of 8 floats: the x and y lensfun computes for red, green and blue, and 2 for alignment
+  int nx, ny;
+  size_t size;
+  float *node;
+}
+dt_iop_lensfun_grid_t;
+
 typedef struct dt_iop_lensfun_data_t
 {
   lfLens *lens;
@@ -137,6 +151,9 @@ typedef struct dt_iop_lensfun_data_t
   float aperture;
   float distance;
   lfLensType target_geom;
+  // pixel coordinates for the last roi processed, and for points in both directions
+  dt_iop_lensfun_grid_t grid;
+  dt_iop_lensfun_grid_t points_grid[2];
 }
 dt_iop_lensfun_data_t;
 
@@ -311,6 +328,147 @@ _lens_sanitize(const char *orig_lens)
   }
 }
 
+static void
+_grid_invalidate(dt_iop_lensfun_grid_t *grid)
+{
+  if(grid->modifier) lf_modifier_destroy(grid->modifier);
+  grid->modifier = NULL;
+  grid->modflags = 0;
+  grid->valid = 0;
+}
+
+static void
+_grid_cleanup(dt_iop_lensfun_grid_t *grid)
+{
+  _grid_invalidate(grid);
+  dt_free_align(grid->node);
+  grid->node = NULL;
+  grid->size = 0;
+  dt_pthread_mutex_destroy(&grid->lock);
+}
+
+/* makes sure the grid holds the coordinates for the pixels x..x+width-1, y..y+height-1 at
+ * image size orig_w x orig_h and returns the lensfun modflags. call with grid->lock held. */
+static int
+_grid_update(const dt_iop_lensfun_data_t *d, dt_iop_lensfun_grid_t *grid, const int inverse,
+             const float orig_w, const float orig_h, const int x, const int y, const int width,
+             const int height, const int step)
+{
+  if(grid->valid && grid->inverse == inverse && grid->orig_w == orig_w && grid->orig_h == orig_h
+     && grid->x == x && grid->y == y && grid->width == width && grid->height == height && grid->step == step)
+    return grid->modflags;
+
+  _grid_invalidate(grid);
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  grid->modflags = lf_modifier_initialize(
+                     modifier, d->lens, LF_PF_F32,
+                     d->focal, d->aperture,
+                     d->distance, d->scale,
+                     d->target_geom, d->modify_flags, inverse);
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  grid->modifier = modifier;
+  grid->inverse = inverse;
+  grid->orig_w = orig_w;
+  grid->orig_h = orig_h;
+  grid->x = x;
+  grid->y = y;
+  grid->width = width;
+  grid->height = height;
+  grid->step = step;
+  // one more node than needed for the last pixel, so it can be interpolated like all others
+  grid->nx = (width-1)/step + 2;
+  grid->ny = (height-1)/step + 2;
+
+  if(grid->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+  {
+    const size_t size = (size_t)grid->nx*grid->ny*8;
+    if(size > grid->size)
+    {
+      dt_free_align(grid->node);
+      grid->node = dt_alloc_align(16, size*sizeof(float));
+      grid->size = grid->node ? size : 0;
+    }
+    if(!grid->node) return grid->modflags;
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(grid, modifier) schedule(static)
+#endif
+    for(int j = 0; j < grid->ny; j++)
+    {
+      float *node = grid->node + (size_t)8*grid->nx*j;
+      for(int i = 0; i < grid->nx; i++, node += 8)
+      {
+        lf_modifier_apply_subpixel_geometry_distortion(
+          modifier, x + i*step, y + j*step, 1, 1, node);
+        node[6] = node[7] = 0.0f;
+      }
+    }
+  }
+  grid->valid = 1;
+  return grid->modflags;
+}
+
+/* coordinates of row y (relative to the grid) the way lf_modifier_apply_subpixel_geometry_distortion()
+ * puts them, 6 floats per pixel. tmp has to hold 8*grid->nx floats. */
+static void
+_grid_row(const dt_iop_lensfun_grid_t *grid, const int y, float *tmp, float *out)
+{
+  const int step = grid->step;
+  const int j = y / step;
+  const __m128 fy = _mm_set1_ps((y - j*step) / (float)step);
+  const __m128 *n0 = (const __m128 *)(grid->node + (size_t)8*grid->nx*j);
+  const __m128 *n1 = n0 + 2*grid->nx;
+  __m128 *row = (__m128 *)tmp;
+  for(int k = 0; k < 2*grid->nx; k++)
+    row[k] = _mm_add_ps(n0[k], _mm_mul_ps(fy, _mm_sub_ps(n1[k], n0[k])));
+
+  const float inv_step = 1.0f/step;
+  for(int i = 0, x = 0; x < grid->width; i++)
+  {
+    const __m128 a0 = row[2*i], a1 = row[2*i+1];
+    const __m128 d0 = _mm_sub_ps(row[2*i+2], a0), d1 = _mm_sub_ps(row[2*i+3], a1);
+    for(int k = 0; k < step && x < grid->width; k++, x++, out += 6)
+    {
+      const __m128 fx = _mm_set1_ps(k*inv_step);
+      _mm_storeu_ps(out, _mm_add_ps(a0, _mm_mul_ps(fx, d0)));
+      _mm_storel_pi((__m64 *)(out+4), _mm_add_ps(a1, _mm_mul_ps(fx, d1)));
+    }
+  }
+}
+
+// transforms points the way distort_transform() always did, using the grid where it covers them
+static void
+_grid_points(const dt_iop_lensfun_grid_t *grid, float *points, const size_t points_count)
+{
+  const int step = grid->step;
+  const float inv_step = 1.0f/step;
+  float buf[6];
+  for(size_t i = 0; i < points_count*2; i += 2)
+  {
+    const float px = (points[i] - grid->x)*inv_step, py = (points[i+1] - grid->y)*inv_step;
+    const int cx = px, cy = py;
+    if(grid->node && px >= 0.0f && py >= 0.0f && cx < grid->nx-1 && cy < grid->ny-1)
+    {
+      const float fx = px - cx, fy = py - cy;
+      const float *n00 = grid->node + 8*((size_t)grid->nx*cy + cx);
+      const float *n01 = n00 + 8, *n10 = n00 + 8*grid->nx, *n11 = n10 + 8;
+      for(int c = 0; c < 4; c += 3)
+      {
+        const float top = n00[c] + fx*(n01[c] - n00[c]);
+        const float bot = n10[c] + fx*(n11[c] - n10[c]);
+        buf[c] = top + fy*(bot - top);
+      }
+    }
+    else
+    {
+      lf_modifier_apply_subpixel_geometry_distortion(grid->modifier, points[i], points[i+1], 1, 1, buf);
+    }
+    points[i] = buf[0];
+    points[i+1] = buf[3];
+  }
+}
+
 void
 process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * const ivoid, void *ovoid, const dt_iop_roi_t * const roi_in, const dt_iop_roi_t * const roi_out)
 {
@@ -331,36 +489,33 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  const int modflags = lf_modifier_initialize(
-                         modifier, d->lens, LF_PF_F32,
-                         d->focal, d->aperture,
-                         d->distance, d->scale,
-                         d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  dt_iop_lensfun_grid_t *grid = &d->grid;
+  dt_pthread_mutex_lock(&grid->lock);
+  const int modflags = _grid_update(d, grid, d->inverse, orig_w, orig_h,
+                                    roi_out->x, roi_out->y, roi_out->width, roi_out->height, LENS_GRID_STEP);
+  lfModifier *modifier = grid->modifier;
 
   const struct dt_interpolation * const interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
-    if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if(grid->node && (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+                                  LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE)))
     {
-      // acquire temp memory for distorted pixel coords
-      const size_t bufsize = (size_t)roi_out->width*2*3;
+      // acquire temp memory for an interpolated row of the grid and distorted pixel coords,
+      // rounded up to keep the rows of all threads aligned
+      const size_t bufsize = (size_t)8*grid->nx + ((size_t)roi_out->width*2*3 + 3)/4*4;
       void *buf = dt_alloc_align(16, bufsize*dt_get_num_threads()*sizeof(float));
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(buf, modifier, ovoid) schedule(static)
+      #pragma omp parallel for default(none) shared(buf, grid, ovoid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
-        float *bufptr = ((float *)buf) + (size_t)bufsize*dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, bufptr);
+        float *row = ((float *)buf) + (size_t)bufsize*dt_get_thread_num();
+        float *bufptr = row + (size_t)8*grid->nx;
+        _grid_row(grid, y, row, bufptr);
 
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y*roi_out->width*ch;
@@ -436,21 +591,22 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
       }
     }
 
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if (grid->node && (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+                                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE)))
     {
-      // acquire temp memory for distorted pixel coords
-      const size_t buf2size = (size_t)roi_out->width*2*3;
+      // acquire temp memory for an interpolated row of the grid and distorted pixel coords,
+      // rounded up to keep the rows of all threads aligned
+      const size_t buf2size = (size_t)8*grid->nx + ((size_t)roi_out->width*2*3 + 3)/4*4;
       void *buf2 = dt_alloc_align(16, buf2size*sizeof(float)*dt_get_num_threads());
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(buf2, buf, modifier, ovoid) schedule(static)
+      #pragma omp parallel for default(none) shared(buf2, buf, grid, ovoid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
-        float *buf2ptr = ((float *)buf2) + (size_t)buf2size*dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, buf2ptr);
+        float *row = ((float *)buf2) + (size_t)buf2size*dt_get_thread_num();
+        float *buf2ptr = row + (size_t)8*grid->nx;
+        _grid_row(grid, y, row, buf2ptr);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,buf2ptr+=6,out+=ch)
@@ -485,7 +641,7 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
     }
     dt_free_align(buf);
   }
-  lf_modifier_destroy(modifier);
+  dt_pthread_mutex_unlock(&grid->lock);
 
   if(g != NULL && self->dev->gui_attached && piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
   {
@@ -506,7 +662,8 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   cl_int err = -999;
 
   float *tmpbuf = NULL;
-  lfModifier *modifier = NULL;
+  float *rowbuf = NULL;
+  dt_iop_lensfun_grid_t *grid = NULL;
 
   const int devid = piece->pipe->devid;
   const int iwidth = roi_in->width;
@@ -569,15 +726,16 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   dev_tmpbuf = dt_opencl_alloc_device_buffer(devid, tmpbuflen);
   if(dev_tmpbuf == NULL) goto error;
 
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  grid = &d->grid;
+  dt_pthread_mutex_lock(&grid->lock);
+  int modflags = _grid_update(d, grid, d->inverse, orig_w, orig_h,
+                              roi_out->x, roi_out->y, roi_out->width, roi_out->height, LENS_GRID_STEP);
+  lfModifier *modifier = grid->modifier;
+  if(!grid->node) modflags &= ~(LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE);
 
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  // interpolated rows of the grid, one per thread
+  rowbuf = (float *)dt_alloc_align(16, (size_t)8*grid->nx*dt_get_num_threads()*sizeof(float));
+  if(rowbuf == NULL) goto error;
 
   if(d->inverse)
   {
@@ -586,13 +744,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, tmpbuf, rowbuf, grid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _grid_row(grid, y, rowbuf + (size_t)8*grid->nx*dt_get_thread_num(), pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -694,13 +851,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, tmpbuf, rowbuf, grid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _grid_row(grid, y, rowbuf + (size_t)8*grid->nx*dt_get_thread_num(), pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -732,17 +888,19 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
     g->corrections_done = (modflags & LENSFUN_MODFLAG_MASK);
   }
 
+  dt_pthread_mutex_unlock(&grid->lock);
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  if (rowbuf != NULL) dt_free_align(rowbuf);
   return TRUE;
 
 error:
+  if (grid != NULL) dt_pthread_mutex_unlock(&grid->lock);
   if (dev_tmp != NULL) dt_opencl_release_mem_object(dev_tmp);
   if (dev_tmpbuf != NULL) dt_opencl_release_mem_object(dev_tmpbuf);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  if (rowbuf != NULL) dt_free_align(rowbuf);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
 }
@@ -765,27 +923,13 @@ int distort_transform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, floa
 
   if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
 
-  const float orig_w = piece->iwidth, orig_h = piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, !d->inverse);
-  float *buf = malloc(2*3*sizeof(float));
-
-  for (size_t i=0; i<points_count*2; i+=2)
-  {
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
-    {
-      lf_modifier_apply_subpixel_geometry_distortion (modifier, points[i], points[i+1], 1, 1, buf);
-      points[i] = buf[0];
-      points[i+1] = buf[3];
-    }
-  }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  dt_iop_lensfun_grid_t *grid = &d->points_grid[1];
+  dt_pthread_mutex_lock(&grid->lock);
+  const int modflags = _grid_update(d, grid, !d->inverse, piece->iwidth, piece->iheight,
+                                    0, 0, piece->iwidth, piece->iheight, LENS_POINTS_GRID_STEP);
+  if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    _grid_points(grid, points, points_count);
+  dt_pthread_mutex_unlock(&grid->lock);
 
   return 1;
 }
@@ -794,27 +938,13 @@ int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece,
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
   if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
 
-  const float orig_w = piece->iwidth, orig_h = piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  float *buf = malloc(2*3*sizeof(float));
-
-  for (size_t i=0; i<points_count*2; i+=2)
-  {
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
-    {
-      lf_modifier_apply_subpixel_geometry_distortion (modifier, points[i], points[i+1], 1, 1, buf);
-      points[i] = buf[0];
-      points[i+1] = buf[3];
-    }
-  }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  dt_iop_lensfun_grid_t *grid = &d->points_grid[0];
+  dt_pthread_mutex_lock(&grid->lock);
+  const int modflags = _grid_update(d, grid, d->inverse, piece->iwidth, piece->iheight,
+                                    0, 0, piece->iwidth, piece->iheight, LENS_POINTS_GRID_STEP);
+  if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    _grid_points(grid, points, points_count);
+  dt_pthread_mutex_unlock(&grid->lock);
   return 1;
 }
 
@@ -833,49 +963,28 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  float xm = INFINITY, xM = - INFINITY, ym = INFINITY, yM = - INFINITY;
+  dt_iop_lensfun_grid_t *grid = &d->grid;
+  dt_pthread_mutex_lock(&grid->lock);
+  const int modflags = _grid_update(d, grid, d->inverse, orig_w, orig_h,
+                                    roi_out->x, roi_out->y, roi_out->width, roi_out->height, LENS_GRID_STEP);
 
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-
-  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
-                 LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+  if(grid->node && (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+                                LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE)))
   {
-    // acquire temp memory for distorted pixel coords
-    const size_t bufsize = (size_t)roi_in->width*2*3;
-
-#if defined(_OPENMP) && __GNUC_PREREQ(4,7)
-    void *buf = dt_alloc_align(16, bufsize*dt_get_num_threads()*sizeof(float));
-
-    #pragma omp parallel for default(none) shared(buf, modifier) reduction(min: xm, ym) reduction(max: xM, yM) schedule(static)
-#else
-    void *buf = dt_alloc_align(16, bufsize*sizeof(float));
-#endif
-    for (int y = 0; y < roi_out->height; y++)
+    // the pixel coords are interpolated from the grid, so their bounds are the bounds of the nodes.
+    // the last row and column of nodes may lie a bit outside of roi_out, which only makes roi_in larger.
+    float xm = INFINITY, xM = - INFINITY, ym = INFINITY, yM = - INFINITY;
+    const float *node = grid->node;
+    for(size_t k = 0; k < (size_t)grid->nx*grid->ny; k++, node += 8)
     {
-      float *bufptr = ((float *)buf) + (size_t)bufsize*dt_get_thread_num();
-
-      lf_modifier_apply_subpixel_geometry_distortion(
-        modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, bufptr);
-
-      // reverse transform the global coords from lf to our buffer
-      for (int x = 0; x < roi_out->width; x++)
+      for(int c=0; c<6; c+=2)
       {
-        for(int c=0; c<3; c++, bufptr+=2)
-        {
-          xm = MIN(xm, bufptr[0]);
-          xM = MAX(xM, bufptr[0]);
-          ym = MIN(ym, bufptr[1]);
-          yM = MAX(yM, bufptr[1]);
-        }
+        xm = MIN(xm, node[c]);
+        xM = MAX(xM, node[c]);
+        ym = MIN(ym, node[c+1]);
+        yM = MAX(yM, node[c+1]);
       }
     }
-    dt_free_align(buf);
 
     const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
     roi_in->x = fmaxf(0.0f, xm-interpolation->width);
@@ -883,7 +992,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     roi_in->width = fminf(orig_w-roi_in->x, xM - roi_in->x + interpolation->width);
     roi_in->height = fminf(orig_h-roi_in->y, yM - roi_in->y + interpolation->width);
   }
-  lf_modifier_destroy(modifier);
+  dt_pthread_mutex_unlock(&grid->lock);
 }
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -910,6 +1019,17 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   const lfCamera *camera = NULL;
   const lfCamera **cam = NULL;
 
+  // the coordinates depend on all of the parameters
+  dt_pthread_mutex_lock(&d->grid.lock);
+  _grid_invalidate(&d->grid);
+  dt_pthread_mutex_unlock(&d->grid.lock);
+  for(int k=0; k<2; k++)
+  {
+    dt_pthread_mutex_lock(&d->points_grid[k].lock);
+    _grid_invalidate(&d->points_grid[k]);
+    dt_pthread_mutex_unlock(&d->points_grid[k].lock);
+  }
+
   if(d->lens)
   {
     lf_lens_destroy(d->lens);
@@ -972,6 +1092,9 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
 #error "lensfun needs to be ported to GEGL!"
 #else
   piece->data = calloc(1, sizeof(dt_iop_lensfun_data_t));
+  dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_pthread_mutex_init(&d->grid.lock, NULL);
+  for(int k=0; k<2; k++) dt_pthread_mutex_init(&d->points_grid[k].lock, NULL);
   self->commit_params(self, self->default_params, pipe, piece);
 #endif
 }
@@ -982,6 +1105,8 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
 #error "lensfun needs to be ported to GEGL!"
 #else
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  _grid_cleanup(&d->grid);
+  for(int k=0; k<2; k++) _grid_cleanup(&d->points_grid[k]);
   if(d->lens)
   {
     lf_lens_destroy(d->lens);
@@ -405,6 +405,9 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   {
     for(int ki=-K; ki<=K; ki++)
     {
+      // every shift vector is a full pass over the image, stop early if the pipe doesn't need it any more
+      if(dt_iop_cancelled(piece)) continue;
+
       int inited_slide = 0;
       // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else we will add up errors)
       // do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more memory
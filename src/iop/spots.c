@@ -46,7 +46,36 @@ typedef struct dt_iop_spots_gui_data_t
 }
 dt_iop_spots_gui_data_t;
 
-typedef struct dt_iop_spots_params_t dt_iop_spots_data_t;
+// rasterized mask of a form, see _spots_mask_hash() for what it depends on
+typedef struct dt_iop_spots_mask_t
+{
+  uint64_t hash;
+  float *mask;
+  int width, height, posx, posy;
+}
+dt_iop_spots_mask_t;
+
+typedef struct dt_iop_spots_data_t
+{
+  int clone_id[64];
+  int clone_algo[64];
+  // the darkroom pipes keep the masks of the forms, by position in the group
+  dt_iop_spots_mask_t masks[64];
+}
+dt_iop_spots_data_t;
+
+// one spot, in the coordinates of the roi: the target rectangle, the offset from the source to the target, and
+// either the rasterized mask or the separable filter of a circle to blend with
+typedef struct dt_iop_spots_clone_t
+{
+  int x0, y0, x1, y1;
+  int dx, dy;
+  const float *mask;
+  int mask_width, mask_x, mask_y;
+  float *filter;
+  int filter_x, filter_y;
+}
+dt_iop_spots_clone_t;
 
 // this returns a translatable name
 const char *name()
@@ -283,25 +312,72 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
   roi_in->height = CLAMP(roib-roi_in->y, 1, piece->pipe->iheight*roi_in->scale-roi_in->y);
 }
 
+// the mask of a form depends on the form and on the distortions of the modules before this one
+static uint64_t _spots_mask_hash(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form)
+{
+  uint64_t hash = 5381;
+  const int length = dt_masks_group_get_hash_buffer_length(form);
+  char *str = malloc(length);
+  if(!str) return 0;
+  dt_masks_group_get_hash_buffer(form, str);
+  for(int i=0; i<length; i++) hash = ((hash << 5) + hash) ^ str[i];
+  free(str);
+  for(GList *pieces = piece->pipe->nodes; pieces; pieces = g_list_next(pieces))
+  {
+    dt_dev_pixelpipe_iop_t *p = (dt_dev_pixelpipe_iop_t *)pieces->data;
+    if(p->module->priority >= self->priority) break;
+    hash = ((hash << 5) + hash) ^ p->hash;
+  }
+  hash = ((hash << 5) + hash) ^ piece->buf_in.width;
+  hash = ((hash << 5) + hash) ^ piece->buf_in.height;
+  return hash ? hash : 1;
+}
+
+// the mask of the form at position pos, from the cache of the pipe if it's still good
+static const float *_spots_get_mask(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form,
+                                    const int pos, int *width, int *height, int *posx, int *posy, float **to_free)
+{
+  dt_iop_spots_data_t *d = (dt_iop_spots_data_t *)piece->data;
+  float *mask = NULL;
+  *to_free = NULL;
+  if(!(piece->pipe->type & (DT_DEV_PIXELPIPE_FULL | DT_DEV_PIXELPIPE_PREVIEW)))
+  {
+    if(!dt_masks_get_mask(self,piece,form,&mask,width,height,posx,posy)) return NULL;
+    *to_free = mask;
+    return mask;
+  }
+
+  dt_iop_spots_mask_t *m = d->masks + pos;
+  const uint64_t hash = _spots_mask_hash(self, piece, form);
+  if(!m->mask || m->hash != hash)
+  {
+    free(m->mask);
+    m->mask = NULL;
+    m->hash = 0;
+    if(!dt_masks_get_mask(self,piece,form,&mask,&m->width,&m->height,&m->posx,&m->posy)) return NULL;
+    m->mask = mask;
+    m->hash = hash;
+  }
+  *width = m->width;
+  *height = m->height;
+  *posx = m->posx;
+  *posy = m->posy;
+  return m->mask;
+}
+
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
-  dt_iop_spots_params_t *d = (dt_iop_spots_params_t *)piece->data;
+  dt_iop_spots_data_t *d = (dt_iop_spots_data_t *)piece->data;
   dt_develop_blend_params_t *bp = self->blend_params;
 
   const int ch = piece->colors;
   const float *in = (float *)i;
   float *out = (float *)o;
 
-  // we don't modify most of the image:
-#ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) shared(out,in,roi_in,roi_out)
-#endif
-  for (int k=0; k<roi_out->height; k++)
-  {
-    float *outb = out + (size_t)ch*k*roi_out->width;
-    const float *inb =  in + (size_t)ch*roi_in->width*(k+roi_out->y-roi_in->y) + ch*(roi_out->x-roi_in->x);
-    memcpy(outb, inb, sizeof(float)*roi_out->width*ch);
-  }
+  // first collect the spots touching the roi, with their masks
+  dt_iop_spots_clone_t clones[64];
+  float *to_free[64];
+  int num_clones = 0;
 
   // iterate through all forms
   dt_masks_form_t *grp = dt_masks_get_from_id(self->dev,bp->mask_id);
@@ -309,7 +385,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   if (grp && (grp->type & DT_MASKS_GROUP))
   {
     GList *forms = g_list_first(grp->points);
-    while(forms)
+    while(forms && pos < 64)
     {
       dt_masks_point_group_t *grpt = (dt_masks_point_group_t *)forms->data;
       //we get the spot
@@ -337,6 +413,9 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         pos++;
         continue;
       }
+      dt_iop_spots_clone_t *clone = clones + num_clones;
+      memset(clone, 0, sizeof(dt_iop_spots_clone_t));
+      to_free[num_clones] = NULL;
       if (d->clone_algo[pos] == 1 && (form->type & DT_MASKS_CIRCLE))
       {
         dt_masks_point_circle_t *circle = (dt_masks_point_circle_t *)g_list_nth_data(form->points,0);
@@ -346,12 +425,15 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         const int posy  = (circle->center[1] * piece->buf_in.height)*roi_in->scale - rad;
         const int posx_source = (form->source[0]*piece->buf_in.width)*roi_in->scale - rad;
         const int posy_source = (form->source[1]*piece->buf_in.height)*roi_in->scale - rad;
-        const int dx = posx-posx_source;
-        const int dy = posy-posy_source;
         fw = fh = 2*rad;
 
-        // convert from world space:
-        float filter[2*rad + 1];
+        float *filter = malloc(sizeof(float)*(2*rad + 1));
+        if(!filter)
+        {
+          forms = g_list_next(forms);
+          pos++;
+          continue;
+        }
 
         if(rad > 0)
         {
@@ -365,33 +447,29 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         {
           filter[0] = 1.0f;
         }
-        for (int yy=posy ; yy<posy+fh; yy++)
-        {
-          //we test if we are inside roi_out
-          if (yy<roi_out->y || yy>=roi_out->y+roi_out->height) continue;
-          //we test if the source point is inside roi_in
-          if (yy-dy<roi_in->y || yy-dy>=roi_in->y+roi_in->height) continue;
-          for (int xx=posx ; xx<posx+fw; xx++)
-          {
-            //we test if we are inside roi_out
-            if (xx<roi_out->x || xx>=roi_out->x+roi_out->width) continue;
-            //we test if the source point is inside roi_in
-            if (xx-dx<roi_in->x || xx-dx>=roi_in->x+roi_in->width) continue;
-
-            const float f = filter[xx-posx+1]*filter[yy-posy+1];
-            for(int c=0; c<ch; c++)
-              out[4*((size_t)roi_out->width*(yy-roi_out->y) + xx-roi_out->x) + c] =
-                out[4*((size_t)roi_out->width*(yy-roi_out->y) + xx-roi_out->x) + c] * (1.0f-f) +
-                in[4*((size_t)roi_in->width*(yy-posy+posy_source-roi_in->y) + xx-posx+posx_source-roi_in->x) + c] * f;
-          }
-        }
+        clone->x0 = posx;
+        clone->y0 = posy;
+        clone->x1 = posx+fw;
+        clone->y1 = posy+fh;
+        clone->dx = posx-posx_source;
+        clone->dy = posy-posy_source;
+        clone->filter = filter;
+        clone->filter_x = posx-1;
+        clone->filter_y = posy-1;
+        to_free[num_clones++] = filter;
       }
       else
       {
         //we get the mask
-        float *mask;
         int posx,posy,width,height;
-        dt_masks_get_mask(self,piece,form,&mask,&width,&height,&posx,&posy);
+        float *mask_to_free;
+        const float *mask = _spots_get_mask(self,piece,form,pos,&width,&height,&posx,&posy,&mask_to_free);
+        if(!mask)
+        {
+          forms = g_list_next(forms);
+          pos++;
+          continue;
+        }
         int fts = posy*roi_in->scale, fhs = height*roi_in->scale, fls = posx*roi_in->scale, fws = width*roi_in->scale;
         //now we search the delta with the source
         int dx,dy;
@@ -416,35 +494,62 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         }
         if (dx!=0 || dy!=0)
         {
-          //now we do the pixel clone
-          for (int yy=fts+1 ; yy<fts+fhs-1; yy++)
-          {
-            //we test if we are inside roi_out
-            if (yy<roi_out->y || yy>=roi_out->y+roi_out->height) continue;
-            //we test if the source point is inside roi_in
-            if (yy-dy<roi_in->y || yy-dy>=roi_in->y+roi_in->height) continue;
-            for (int xx=fls+1 ; xx<fls+fws-1; xx++)
-            {
-              //we test if we are inside roi_out
-              if (xx<roi_out->x || xx>=roi_out->x+roi_out->width) continue;
-              //we test if the source point is inside roi_in
-              if (xx-dx<roi_in->x || xx-dx>=roi_in->x+roi_in->width) continue;
-
-              float f = mask[((int)((yy-fts)/roi_in->scale))*width + (int)((xx-fls)/roi_in->scale)];  //we can add the opacity here
-
-              for(int c=0; c<ch; c++)
-                out[4*((size_t)roi_out->width*(yy-roi_out->y) + xx-roi_out->x) + c] =
-                  out[4*((size_t)roi_out->width*(yy-roi_out->y) + xx-roi_out->x) + c] * (1.0f-f) +
-                  in[4*((size_t)roi_in->width*(yy-dy-roi_in->y) + xx-dx-roi_in->x) + c] * f;
-            }
-          }
+          clone->x0 = fls+1;
+          clone->y0 = fts+1;
+          clone->x1 = fls+fws-1;
+          clone->y1 = fts+fhs-1;
+          clone->dx = dx;
+          clone->dy = dy;
+          clone->mask = mask;
+          clone->mask_width = width;
+          clone->mask_x = fls;
+          clone->mask_y = fts;
+          to_free[num_clones++] = mask_to_free;
         }
-        free(mask);
+        else free(mask_to_free);
       }
       pos++;
       forms = g_list_next(forms);
     }
   }
+
+  // then go through the image row by row: copy what we don't modify and clone the spots onto it. every row gets
+  // the spots in the order of the group, so overlapping spots still stack up the same way, while the rows and
+  // with them the spots that don't overlap run in parallel.
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none) shared(out,in,roi_in,roi_out,clones,num_clones)
+#endif
+  for (int k=0; k<roi_out->height; k++)
+  {
+    float *outb = out + (size_t)ch*k*roi_out->width;
+    const float *inb =  in + (size_t)ch*roi_in->width*(k+roi_out->y-roi_in->y) + ch*(roi_out->x-roi_in->x);
+    memcpy(outb, inb, sizeof(float)*roi_out->width*ch);
+
+    const int yy = roi_out->y + k;
+    for(int s=0; s<num_clones; s++)
+    {
+      const dt_iop_spots_clone_t *clone = clones + s;
+      if (yy<clone->y0 || yy>=clone->y1) continue;
+      //we test if the source point is inside roi_in
+      if (yy-clone->dy<roi_in->y || yy-clone->dy>=roi_in->y+roi_in->height) continue;
+      //we stay inside roi_out, and the source inside roi_in
+      const int x0 = MAX(clone->x0, MAX(roi_out->x, roi_in->x+clone->dx));
+      const int x1 = MIN(clone->x1, MIN(roi_out->x+roi_out->width, roi_in->x+roi_in->width+clone->dx));
+      const float *src = in + 4*((size_t)roi_in->width*(yy-clone->dy-roi_in->y) - clone->dx - roi_in->x);
+      float *dst = out + 4*((size_t)roi_out->width*(yy-roi_out->y) - roi_out->x);
+      const float *mask = clone->mask ? clone->mask + ((int)((yy-clone->mask_y)/roi_in->scale))*clone->mask_width : NULL;
+      const float fy = clone->filter ? clone->filter[yy-clone->filter_y] : 0.0f;
+      for (int xx=x0; xx<x1; xx++)
+      {
+        //we can add the opacity here
+        const float f = mask ? mask[(int)((xx-clone->mask_x)/roi_in->scale)] : clone->filter[xx-clone->filter_x]*fy;
+        for(int c=0; c<ch; c++)
+          dst[4*xx + c] = dst[4*xx + c] * (1.0f-f) + src[4*xx + c] * f;
+      }
+    }
+  }
+
+  for(int s=0; s<num_clones; s++) free(to_free[s]);
 }
 
 /** init, cleanup, commit to pipeline */
@@ -501,17 +606,22 @@ void gui_focus (struct dt_iop_module_t *self, gboolean in)
 /** commit is the synch point between core and gui, so it copies params to pipe data. */
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *params, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  memcpy(piece->data, params, sizeof(dt_iop_spots_params_t));
+  dt_iop_spots_params_t *p = (dt_iop_spots_params_t *)params;
+  dt_iop_spots_data_t *d = (dt_iop_spots_data_t *)piece->data;
+  memcpy(d->clone_id, p->clone_id, sizeof(d->clone_id));
+  memcpy(d->clone_algo, p->clone_algo, sizeof(d->clone_algo));
 }
 
 void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
-  piece->data = malloc(sizeof(dt_iop_spots_data_t));
+  piece->data = calloc(1, sizeof(dt_iop_spots_data_t));
   self->commit_params(self, self->default_params, pipe, piece);
 }
 
 void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
 {
+  dt_iop_spots_data_t *d = (dt_iop_spots_data_t *)piece->data;
+  for(int k=0; k<64; k++) free(d->masks[k].mask);
   free(piece->data);
   piece->data = NULL;
 }
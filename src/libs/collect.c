@@ -27,6 +27,7 @@
 #include "dtgtk/button.h"
 #include "libs/lib.h"
 #include "common/metadata.h"
+#include "common/tags.h"
 #include "common/utility.h"
 #include "libs/collect.h"
 #include "views/view.h"
@@ -1060,7 +1061,6 @@ static void tags_view (dt_lib_collect_rule_t *dr)
 {
   // update related list
   dt_lib_collect_t *d = get_collect(dr);
-  sqlite3_stmt *stmt;
   GtkTreeIter uncategorized, temp;
   memset(&uncategorized,0,sizeof(GtkTreeIter));
 
@@ -1077,19 +1077,21 @@ static void tags_view (dt_lib_collect_rule_t *dr)
 
   set_properties (dr);
 
-  /* query construction */
-  char query[1024];
+  /* all tags come from the tag index, every one of them is inserted at the top, so go backwards */
   const gchar *text = NULL;
   text = gtk_entry_get_text(GTK_ENTRY(dr->text));
-  gchar *escaped_text = NULL;
-  escaped_text = dt_util_str_replace(text, "'", "''");
-  snprintf(query, sizeof(query), "SELECT distinct name, id, name LIKE '%%%s%%' FROM tags ORDER BY UPPER(name) DESC", escaped_text);
+  gchar *folded_text = g_utf8_casefold(text, -1);
+  GList *tags = NULL;
+  dt_tag_get_all(&tags);
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
-
-  while (sqlite3_step(stmt) == SQLITE_ROW)
+  for(GList *taglist = g_list_last(tags); taglist; taglist = g_list_previous(taglist))
   {
-    if(strchr((const char *)sqlite3_column_text(stmt, 0),'|')==0)
+    const gchar *name = ((dt_tag_t *)taglist->data)->tag;
+    gchar *folded = g_utf8_casefold(name, -1);
+    const gboolean visible = strstr(folded, folded_text) != NULL;
+    g_free(folded);
+
+    if(strchr(name,'|')==0)
     {
       /* add uncategorized root iter if not exists */
       if (!uncategorized.stamp)
@@ -1101,16 +1103,16 @@ static void tags_view (dt_lib_collect_rule_t *dr)
 
       /* adding an uncategorized tag */
       gtk_tree_store_insert(GTK_TREE_STORE(tagsmodel), &temp, &uncategorized,0);
-      gtk_tree_store_set(GTK_TREE_STORE(tagsmodel), &temp, DT_LIB_COLLECT_COL_TEXT, sqlite3_column_text(stmt, 0),
-                         DT_LIB_COLLECT_COL_PATH, sqlite3_column_text(stmt, 0),
-                         DT_LIB_COLLECT_COL_VISIBLE, sqlite3_column_int(stmt, 2), -1);
+      gtk_tree_store_set(GTK_TREE_STORE(tagsmodel), &temp, DT_LIB_COLLECT_COL_TEXT, name,
+                         DT_LIB_COLLECT_COL_PATH, name,
+                         DT_LIB_COLLECT_COL_VISIBLE, visible, -1);
     }
     else
     {
       int level = 0;
       char *value;
       GtkTreeIter current,iter;
-      char **pch = g_strsplit((char *)sqlite3_column_text(stmt, 0),"|", -1);
+      char **pch = g_strsplit(name,"|", -1);
 
       if (pch != NULL)
       {
@@ -1161,7 +1163,7 @@ static void tags_view (dt_lib_collect_rule_t *dr)
             gtk_tree_store_set(GTK_TREE_STORE(tagsmodel), &iter, DT_LIB_COLLECT_COL_TEXT, pch[j],
                               DT_LIB_COLLECT_COL_PATH, pth2,
                               DT_LIB_COLLECT_COL_COUNT, count,
-                              DT_LIB_COLLECT_COL_VISIBLE, sqlite3_column_int(stmt, 2), -1);
+                              DT_LIB_COLLECT_COL_VISIBLE, visible, -1);
             current = iter;
           }
 
@@ -1174,7 +1176,8 @@ static void tags_view (dt_lib_collect_rule_t *dr)
       }
     }
   }
-  sqlite3_finalize(stmt);
+  dt_tag_free_result(&tags);
+  g_free(folded_text);
 
   gtk_tree_view_set_tooltip_column(GTK_TREE_VIEW(view), DT_LIB_COLLECT_COL_TOOLTIP);
   gtk_tree_view_set_model(GTK_TREE_VIEW(view), tagsmodel);
@@ -47,6 +47,12 @@ int dt_lua_delete_image(lua_State *L)
   return 0;
 }
 
+static int flush_sidecars(lua_State *L)
+{
+  dt_image_flush_sidecar_files(-1);
+  return 0;
+}
+
 int dt_lua_move_image(lua_State*L) 
 {
   dt_lua_image_t imgid = -1;
@@ -200,6 +206,9 @@ int dt_lua_init_database(lua_State * L)
   lua_pushcfunction(L,dt_lua_copy_image);
   lua_pushcclosure(L,dt_lua_type_member_common,1);
   dt_lua_type_register_const_typeid(L,type_id,"copy_image");
+  lua_pushcfunction(L,flush_sidecars);
+  lua_pushcclosure(L,dt_lua_type_member_common,1);
+  dt_lua_type_register_const_typeid(L,type_id,"flush_sidecars");
 
   return 0;
 }
@@ -185,7 +185,7 @@ static gboolean shortcut_callback(GtkAccelGroup *accel_group,
     }
     else
     {
-      dt_control_job_set_params(job, t);
+      dt_control_job_set_params(job, t, NULL);
       t->name = strdup(p);
       dt_control_add_job(darktable.control, DT_JOB_QUEUE_USER_FG, job);
     }
@@ -435,7 +435,7 @@ static void on_view_changed(gpointer instance,
     }
     else
     {
-      dt_control_job_set_params(job, t);
+      dt_control_job_set_params(job, t, NULL);
       t->old_view = old_view;
       t->new_view = new_view;
       dt_control_add_job(darktable.control, DT_JOB_QUEUE_USER_FG, job);
@@ -135,7 +135,7 @@ static void lua_job_cancelled(dt_progress_t *progress, gpointer user_data)
 {
   dt_job_t *job = dt_control_job_create(&lua_job_canceled_job, "lua: on background cancel");
   if(!job) return;
-  dt_control_job_set_params(job, progress);
+  dt_control_job_set_params(job, progress, NULL);
   dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job);
 }
 
@@ -188,7 +188,7 @@ void dt_lua_init(lua_State*L,const char *lua_command)
 
 
   dt_job_t *job = dt_control_job_create(&run_early_script, "lua: run initial script");
-  dt_control_job_set_params(job, g_strdup(lua_command));
+  dt_control_job_set_params(job, g_strdup(lua_command), NULL);
   if(darktable.gui)
   {
     dt_control_add_job(darktable.control, DT_JOB_QUEUE_USER_BG, job);
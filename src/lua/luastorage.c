@@ -267,9 +267,10 @@ static void  free_params_wrapper  (struct dt_imageio_module_storage_t *self, dt_
     dt_control_job_dispose(job);
     return;
   }
-  dt_control_job_set_params(job, t);
+  dt_control_job_set_params(job, t, NULL);
   t->data = (lua_storage_t*)data;
-  dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, job);
+  // every one of these frees something else, so don't let them get merged or pushed out
+  dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job);
 }
 
 static int   set_params_wrapper   (struct dt_imageio_module_storage_t *self, const void *params, const int size)
@@ -0,0 +1,213 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark for the hot pixel detection of iop/hotpixels.c: runs the row kernels over a synthetic raw with a few
+// hot sites on one thread, checks them against the plain scalar loops and reports the cost per megapixel.
+// usage: ./hotpixels [width] [height] [runs]
+
+#include "iop/hotpixels.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double dt_get_wtime()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0/1000000.0)*time.tv_usec;
+}
+
+static const float threshold = 0.05f, multiplier = 0.125f;
+
+// the scalar loops, one site at a time
+static int reference_bayer(const float *const i, float *const o, const int width, const int height,
+                           const int min_neighbours, const int markfixed)
+{
+  const int widthx2 = 2*width;
+  int fixed = 0;
+  for (int row=2; row<height-2; row++)
+  {
+    const float *in = i + (size_t)width*row+2;
+    float *out = o + (size_t)width*row+2;
+    for (int col=2; col<width-1; col++, in++, out++)
+    {
+      float mid= *in * multiplier;
+      if (*in > threshold)
+      {
+        int count=0;
+        float maxin=0.0;
+        const int offsets[4] = { -2, -widthx2, 2, widthx2 };
+        for (int n=0; n<4; n++)
+        {
+          const float other = in[offsets[n]];
+          if (mid > other)
+          {
+            count++;
+            if (other > maxin) maxin = other;
+          }
+        }
+        if (count >= min_neighbours)
+        {
+          *out = maxin;
+          fixed++;
+          if (markfixed)
+          {
+            for (int i=-2; i>=-10 && i>=-col; i-=2)
+              out[i] = *in;
+            for (int i=2; i<=10 && i<width-col; i+=2)
+              out[i] = *in;
+          }
+        }
+      }
+    }
+  }
+  return fixed;
+}
+
+static int reference_xtrans(const float *const i, float *const o, const int width, const int height,
+                            int offsets[6][6][4][2], const int min_neighbours, const int markfixed)
+{
+  int fixed = 0;
+  for (int row=1; row<height-1; row++)
+  {
+    const float *in = i + (size_t)width*row+1;
+    float *out = o + (size_t)width*row+1;
+    for (int col=1; col<width-1; col++, in++, out++)
+    {
+      float mid= *in * multiplier;
+      if (*in > threshold)
+      {
+        int count=0;
+        float maxin=0.0;
+        for (int n=0; n < 4; ++n)
+        {
+          int xx = offsets[col%6][row%6][n][0];
+          int yy = offsets[col%6][row%6][n][1];
+          if ((xx < -col) || (xx >= (width-col)) ||
+              (yy < -row) || (yy >= (height-row)))
+            break;
+          float other = *(in + xx + yy*width);
+          if (mid > other)
+          {
+            count++;
+            if (other > maxin) maxin = other;
+          }
+        }
+        if (count >= min_neighbours)
+        {
+          *out = maxin;
+          fixed++;
+          if (markfixed)
+          {
+            for (int i=-2; i>=-10 && i>=-col; --i)
+              out[i] = *in;
+            for (int i=2; i<=10 && i<width-col; ++i)
+              out[i] = *in;
+          }
+        }
+      }
+    }
+  }
+  return fixed;
+}
+
+static int kernel_bayer(const float *const i, float *const o, const int width, const int height,
+                        const int min_neighbours, const int markfixed)
+{
+  int fixed = 0;
+  for (int row=2; row<height-2; row++)
+    fixed += dt_iop_hotpixels_bayer_row(i + (size_t)width*row, o + (size_t)width*row, width, threshold,
+                                        multiplier, min_neighbours, markfixed);
+  return fixed;
+}
+
+static int kernel_xtrans(const float *const i, float *const o, const int width, const int height,
+                         int offsets[6][6][4][2], const int min_neighbours, const int markfixed)
+{
+  int fixed = 0;
+  for (int row=1; row<height-1; row++)
+    fixed += dt_iop_hotpixels_xtrans_row(i + (size_t)width*row, o + (size_t)width*row, row, width, height,
+                                         offsets, threshold, multiplier, min_neighbours, markfixed);
+  return fixed;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 6000;
+  const int height = argc > 2 ? atoi(arg[2]) : 4000;
+  const int runs = argc > 3 ? atoi(arg[3]) : 10;
+  const size_t size = (size_t)width*height;
+  const double mpix = size * 1e-6;
+  const uint8_t xtrans[6][6] = { { 1, 1, 0, 1, 1, 2 }, { 1, 1, 2, 1, 1, 0 }, { 2, 0, 1, 0, 2, 1 },
+                                 { 1, 1, 2, 1, 1, 0 }, { 1, 1, 0, 1, 1, 2 }, { 0, 2, 1, 2, 0, 1 } };
+  int offsets[6][6][4][2];
+  dt_iop_hotpixels_xtrans_offsets(offsets, xtrans, 0, 0);
+
+  // a dark frame with some noise, about one hot site in 10000, some of them in pairs
+  float *in = (float *)malloc(sizeof(float)*size);
+  float *ref = (float *)malloc(sizeof(float)*size);
+  float *out = (float *)malloc(sizeof(float)*size);
+  srand(42);
+  for(size_t k=0; k<size; k++)
+  {
+    in[k] = 0.01f + 0.2f * rand() / (float)RAND_MAX;
+    if(rand() % 10000 == 0) in[k] = 0.5f + 0.5f * rand() / (float)RAND_MAX;
+    if(k > 0 && in[k-1] > 0.5f && rand() % 4 == 0) in[k] = in[k-1];
+  }
+
+  int failed = 0;
+  fprintf(stderr, "%dx%d, %d runs, single thread\n", width, height, runs);
+  for(int sensor=0; sensor<2; sensor++)
+    for(int mode=0; mode<3; mode++)
+    {
+      // strict, permissive, permissive and marking the fixed sites
+      const int min_neighbours = mode ? 3 : 4, markfixed = mode == 2;
+      double t_ref = 0.0, t_kernel = 0.0;
+      int fixed_ref = 0, fixed = 0;
+      for(int r=0; r<runs; r++)
+      {
+        memcpy(ref, in, sizeof(float)*size);
+        memcpy(out, in, sizeof(float)*size);
+        double start = dt_get_wtime();
+        fixed_ref = sensor ? reference_xtrans(in, ref, width, height, offsets, min_neighbours, markfixed)
+                           : reference_bayer(in, ref, width, height, min_neighbours, markfixed);
+        t_ref += dt_get_wtime() - start;
+        start = dt_get_wtime();
+        fixed = sensor ? kernel_xtrans(in, out, width, height, offsets, min_neighbours, markfixed)
+                       : kernel_bayer(in, out, width, height, min_neighbours, markfixed);
+        t_kernel += dt_get_wtime() - start;
+      }
+      const int same = fixed == fixed_ref && !memcmp(ref, out, sizeof(float)*size);
+      failed |= !same;
+      fprintf(stderr, "%-6s %-20s %6d fixed | scalar %7.3f ms/Mpix | vector %7.3f ms/Mpix | %5.2fx %s\n",
+              sensor ? "xtrans" : "bayer", mode == 0 ? "strict" : mode == 1 ? "permissive" : "permissive, marked",
+              fixed, 1e3 * t_ref / runs / mpix, 1e3 * t_kernel / runs / mpix, t_ref / t_kernel,
+              same ? "" : "MISMATCH");
+    }
+
+  free(in);
+  free(ref);
+  free(out);
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
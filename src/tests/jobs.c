@@ -0,0 +1,466 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark for the control job scheduler: push lots of small jobs (think thumbnail or xmp sized)
+// and report throughput and queueing latency, for the per-worker queues of control/jobs.c and for
+// the single locked queue they replaced. usage: ./jobs [worker threads] [jobs]
+
+#define DT_UNIT_TEST
+
+#include "common/dtpthread.h"
+#include "control/jobs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+// the bits of darktable the scheduler needs:
+#define DT_DEBUG_CONTROL 0
+
+typedef struct dt_control_t
+{
+  int32_t running;
+  dt_pthread_mutex_t queue_mutex, cond_mutex, run_mutex;
+  pthread_cond_t cond;
+  int32_t num_threads;
+  pthread_t *thread, kick_on_workers_thread;
+
+  struct dt_control_worker_t *workers;
+  uint32_t next_worker;
+  GHashTable *fg_jobs;
+  size_t fg_length;
+  uint64_t fg_seq;
+  dt_pthread_mutex_t deps_mutex;
+
+  dt_job_t *job_res[DT_CTL_WORKER_RESERVED];
+  uint8_t new_res[DT_CTL_WORKER_RESERVED];
+  pthread_t thread_res[DT_CTL_WORKER_RESERVED];
+}
+dt_control_t;
+
+static struct
+{
+  dt_control_t *control;
+  int num_openmp_threads;
+} darktable;
+
+static int num_workers = 4;
+
+static int dt_conf_get_int(const char *name)
+{
+  return num_workers;
+}
+
+static void dt_print(int type, const char *msg, ...)
+{
+}
+
+static double dt_get_wtime()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0/1000000.0)*time.tv_usec;
+}
+
+static int dt_control_running()
+{
+  dt_pthread_mutex_lock(&darktable.control->run_mutex);
+  const int running = darktable.control->running;
+  dt_pthread_mutex_unlock(&darktable.control->run_mutex);
+  return running;
+}
+
+#include "control/jobs.c"
+
+typedef struct bench_job_t
+{
+  double added;
+  int children;
+  // for jobs in a graph: shared with the other jobs of the graph, and how many of them have to be done before us
+  int *done;
+  int needs;
+  // don't return before this got set
+  int *hold;
+  // add a user foreground job, then keep the worker busy for that long
+  int busy_us;
+  int fg;
+}
+bench_job_t;
+
+static double *latencies, *fg_latencies;
+static int num_latencies, num_fg_latencies, num_done, num_discarded, num_out_of_order;
+static dt_control_t control;
+
+static int control_add_job(dt_job_queue_t queue_id, dt_job_t *job)
+{
+  return dt_control_add_job(&control, queue_id, job);
+}
+
+// the scheduler under test
+static int (*bench_add_job)(dt_job_queue_t queue_id, dt_job_t *job) = control_add_job;
+
+// the scheduler as it was before the per-worker queues: one set of queues behind one lock, and every
+// worker gets woken for every job.
+static struct
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  GList *queues[DT_JOB_QUEUE_MAX];
+  size_t length[DT_JOB_QUEUE_MAX];
+  int running;
+  pthread_t *threads;
+} single;
+
+static int single_add_job(dt_job_queue_t queue_id, dt_job_t *job)
+{
+  job->queue = queue_id;
+  dt_pthread_mutex_lock(&single.mutex);
+  GList **queue = &single.queues[queue_id];
+  if(queue_id == DT_JOB_QUEUE_SYSTEM_FG)
+  {
+    job->priority = DT_CONTROL_FG_PRIORITY;
+    for(GList *iter = *queue; iter; iter = g_list_next(iter))
+    {
+      _dt_job_t *other_job = (_dt_job_t *)iter->data;
+      if(dt_control_job_equal(job, other_job))
+      {
+        *queue = g_list_delete_link(*queue, iter);
+        single.length[queue_id]--;
+        dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
+        dt_control_job_dispose(job);
+        job = other_job;
+        break;
+      }
+    }
+    *queue = g_list_prepend(*queue, job);
+    if(++single.length[queue_id] > DT_CONTROL_MAX_JOBS)
+    {
+      GList *last = g_list_last(*queue);
+      _dt_job_t *last_job = (_dt_job_t *)last->data;
+      *queue = g_list_delete_link(*queue, last);
+      single.length[queue_id]--;
+      dt_control_job_set_state(last_job, DT_JOB_STATE_DISCARDED);
+      dt_control_job_dispose(last_job);
+    }
+  }
+  else
+  {
+    job->priority = (queue_id == DT_JOB_QUEUE_USER_BG || queue_id == DT_JOB_QUEUE_SYSTEM_BG) ? 0 : DT_CONTROL_FG_PRIORITY;
+    *queue = g_list_append(*queue, job);
+    single.length[queue_id]++;
+  }
+  dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
+  pthread_cond_broadcast(&single.cond);
+  dt_pthread_mutex_unlock(&single.mutex);
+  return 0;
+}
+
+static void *single_work(void *ptr)
+{
+  dt_pthread_mutex_lock(&single.mutex);
+  while(single.running)
+  {
+    _dt_job_t *job = NULL;
+    int winner_queue = DT_JOB_QUEUE_MAX, max_priority = -1;
+    for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+    {
+      if(!single.queues[i]) continue;
+      _dt_job_t *_job = (_dt_job_t *)single.queues[i]->data;
+      if(_job->priority > max_priority)
+      {
+        max_priority = _job->priority;
+        job = _job;
+        winner_queue = i;
+      }
+    }
+    if(!job)
+    {
+      dt_pthread_cond_wait(&single.cond, &single.mutex);
+      continue;
+    }
+    single.queues[winner_queue] = g_list_delete_link(single.queues[winner_queue], single.queues[winner_queue]);
+    single.length[winner_queue]--;
+    for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+      if(i != winner_queue && single.queues[i]) ((_dt_job_t *)single.queues[i]->data)->priority++;
+    dt_pthread_mutex_unlock(&single.mutex);
+
+    dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
+    job->result = job->execute(job);
+    dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
+    dt_control_job_dispose(job);
+
+    dt_pthread_mutex_lock(&single.mutex);
+  }
+  dt_pthread_mutex_unlock(&single.mutex);
+  return NULL;
+}
+
+static void bench_state(dt_job_t *job, dt_job_state_t state)
+{
+  // called with the state mutex of the job held, so don't use anything taking it
+  if(state == DT_JOB_STATE_DISCARDED) __sync_fetch_and_add(&num_discarded, 1);
+}
+
+static dt_job_t *bench_job_create(dt_job_execute_callback execute, int id, int children);
+
+static int32_t bench_execute(dt_job_t *job)
+{
+  bench_job_t *p = (bench_job_t *)dt_control_job_get_params(job);
+  const int slot = __sync_fetch_and_add(&num_latencies, 1);
+  latencies[slot] = dt_get_wtime() - p->added;
+
+  if(p->fg) fg_latencies[__sync_fetch_and_add(&num_fg_latencies, 1)] = latencies[slot];
+
+  if(p->hold)
+    while(!__sync_fetch_and_add(p->hold, 0)) usleep(100);
+
+  if(p->busy_us)
+  {
+    dt_job_t *fg = bench_job_create(bench_execute, 0, 0);
+    ((bench_job_t *)dt_control_job_get_params(fg))->fg = 1;
+    bench_add_job(DT_JOB_QUEUE_USER_FG, fg);
+    usleep(p->busy_us);
+  }
+
+  // a few microseconds of work, about what it takes to look at an xmp file that didn't change
+  volatile double x = 0.0;
+  for(int k = 0; k < 2000; k++) x += k * 0.5;
+
+  if(p->done && __sync_fetch_and_add(p->done, 1) < p->needs) __sync_fetch_and_add(&num_out_of_order, 1);
+
+  // fan out from inside a worker, these stay on its queues unless someone steals them
+  for(int k = 0; k < p->children; k++)
+    bench_add_job(DT_JOB_QUEUE_USER_BG, bench_job_create(bench_execute, k, 0));
+
+  __sync_fetch_and_add(&num_done, 1);
+  return 0;
+}
+
+static dt_job_t *bench_job_create(dt_job_execute_callback execute, int id, int children)
+{
+  dt_job_t *job = dt_control_job_create(execute, "bench %d", id);
+  bench_job_t *p = (bench_job_t *)malloc(sizeof(bench_job_t));
+  p->added = dt_get_wtime();
+  p->children = children;
+  p->done = NULL;
+  p->needs = 0;
+  p->hold = NULL;
+  p->busy_us = 0;
+  p->fg = 0;
+  dt_control_job_set_params(job, p, free);
+  dt_control_job_set_state_callback(job, bench_state);
+  return job;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  const double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static void report(const char *name, int expected, double start)
+{
+  while(__sync_fetch_and_add(&num_done, 0) + __sync_fetch_and_add(&num_discarded, 0) < expected)
+    usleep(1000);
+  const double elapsed = dt_get_wtime() - start;
+  qsort(latencies, num_latencies, sizeof(double), cmp_double);
+  fprintf(stderr, "%-22s %7d jobs %6d discarded %8.3fs %10.0f jobs/s | latency ms p50 %8.3f p99 %8.3f p99.9 %8.3f max %8.3f\n",
+          name, num_done, num_discarded, elapsed, num_done / elapsed,
+          1000.0 * latencies[num_latencies / 2], 1000.0 * latencies[(int)(num_latencies * 0.99)],
+          1000.0 * latencies[(int)(num_latencies * 0.999)], 1000.0 * latencies[num_latencies - 1]);
+  if(num_fg_latencies)
+  {
+    qsort(fg_latencies, num_fg_latencies, sizeof(double), cmp_double);
+    fprintf(stderr, "%-22s %7d user fg jobs                                | latency ms p50 %8.3f p99 %8.3f max %8.3f\n",
+            "", num_fg_latencies, 1000.0 * fg_latencies[num_fg_latencies / 2],
+            1000.0 * fg_latencies[(int)(num_fg_latencies * 0.99)], 1000.0 * fg_latencies[num_fg_latencies - 1]);
+  }
+  num_latencies = num_fg_latencies = num_done = num_discarded = 0;
+}
+
+/* the workloads both schedulers can run */
+static void run_benchmarks(const int num_jobs)
+{
+  // everything added from the gui thread, fifo
+  double start = dt_get_wtime();
+  for(int k = 0; k < num_jobs; k++)
+    bench_add_job(DT_JOB_QUEUE_USER_BG, bench_job_create(bench_execute, k, 0));
+  report("user bg from outside", num_jobs, start);
+
+  // a few jobs spawning the rest from inside the workers
+  start = dt_get_wtime();
+  const int parents = num_jobs / 100;
+  for(int k = 0; k < parents; k++)
+    bench_add_job(DT_JOB_QUEUE_USER_BG, bench_job_create(bench_execute, k, 99));
+  report("user bg fan out", parents * 100, start);
+
+  // thumbnail requests, the stack only keeps the newest ones. every job either runs or gets discarded.
+  start = dt_get_wtime();
+  for(int k = 0; k < num_jobs; k++)
+    bench_add_job(DT_JOB_QUEUE_SYSTEM_FG, bench_job_create(bench_execute, k, 0));
+  report("system fg", num_jobs, start);
+
+  // the same few thumbnails requested over and over
+  start = dt_get_wtime();
+  for(int k = 0; k < num_jobs; k++)
+    bench_add_job(DT_JOB_QUEUE_SYSTEM_FG, bench_job_create(bench_execute, k % 16, 0));
+  report("system fg duplicates", num_jobs, start);
+
+  // a gui action while all workers are busy with background work: user foreground jobs added by workers
+  // that are stuck in something slow right afterwards have to be picked up by the others.
+  start = dt_get_wtime();
+  const int busy = 64;
+  for(int k = 0; k < parents; k++)
+    bench_add_job(DT_JOB_QUEUE_USER_BG, bench_job_create(bench_execute, k, 99));
+  for(int k = 0; k < busy; k++)
+  {
+    dt_job_t *job = bench_job_create(bench_execute, k, 0);
+    ((bench_job_t *)dt_control_job_get_params(job))->busy_us = 2000;
+    bench_add_job(DT_JOB_QUEUE_USER_BG, job);
+  }
+  report("user fg while busy", parents * 100 + 2 * busy, start);
+}
+
+int main(int argc, char *arg[])
+{
+  if(argc > 1) num_workers = atoi(arg[1]);
+  const int num_jobs = argc > 2 ? atoi(arg[2]) : 100000;
+  // a few more for the jobs spawned on top of num_jobs
+  latencies = (double *)malloc(sizeof(double) * (num_jobs + 1024));
+  fg_latencies = (double *)malloc(sizeof(double) * (num_jobs + 1024));
+
+  darktable.control = &control;
+  darktable.num_openmp_threads = 1;
+  pthread_cond_init(&control.cond, NULL);
+  dt_pthread_mutex_init(&control.cond_mutex, NULL);
+  dt_pthread_mutex_init(&control.queue_mutex, NULL);
+  dt_pthread_mutex_init(&control.run_mutex, NULL);
+  dt_control_jobs_init(&control);
+  fprintf(stderr, "%d workers\n", control.num_threads);
+
+  fprintf(stderr, "per-worker queues:\n");
+  run_benchmarks(num_jobs);
+
+  // multi stage work: one job, ten depending on it and one joining those, all of it waited for as a group.
+  // every 8th graph gets cancelled before it's added, and another 8th while its jobs are waiting for the root,
+  // which has to take all of its jobs with it.
+  double start = dt_get_wtime();
+  const int graphs = num_jobs / 12;
+  int *done = (int *)calloc(graphs, sizeof(int));
+  dt_job_group_t *group = dt_control_job_group_create();
+  for(int k = 0; k < graphs; k++)
+  {
+    dt_job_t *root = bench_job_create(bench_execute, k, 0);
+    dt_job_t *join = bench_job_create(bench_execute, k, 0);
+    dt_job_t *stages[10];
+    ((bench_job_t *)dt_control_job_get_params(root))->done = done + k;
+    ((bench_job_t *)dt_control_job_get_params(join))->done = done + k;
+    ((bench_job_t *)dt_control_job_get_params(join))->needs = 11;
+    dt_control_job_group_add(group, root);
+    dt_control_job_group_add(group, join);
+    for(int i = 0; i < 10; i++)
+    {
+      stages[i] = bench_job_create(bench_execute, i, 0);
+      ((bench_job_t *)dt_control_job_get_params(stages[i]))->done = done + k;
+      ((bench_job_t *)dt_control_job_get_params(stages[i]))->needs = 1;
+      dt_control_job_group_add(group, stages[i]);
+      dt_control_job_add_dependency(stages[i], root);
+      dt_control_job_add_dependency(join, stages[i]);
+    }
+    if(k % 8 == 7) dt_control_job_cancel(root);
+    // added in the worst order on purpose
+    dt_control_add_job(&control, DT_JOB_QUEUE_USER_BG, join);
+    for(int i = 0; i < 10; i++) dt_control_add_job(&control, DT_JOB_QUEUE_USER_BG, stages[i]);
+    if(k % 8 == 3) dt_control_job_cancel(root);
+    dt_control_add_job(&control, DT_JOB_QUEUE_USER_BG, root);
+  }
+  const int failed = dt_control_job_group_wait(group);
+  dt_control_job_group_destroy(group);
+  free(done);
+  fprintf(stderr, "%d of %d graph jobs cancelled (expected %d), %d ran too early\n", failed, graphs * 12,
+          (graphs / 8 + (graphs + 4) / 8) * 12, num_out_of_order);
+  report("dependencies", 0, start);
+
+  // cancel a group while its root is running and the rest of it is parked waiting for the root. that disposes
+  // the parked jobs from within the cancel, and they have to leave the group on the way.
+  start = dt_get_wtime();
+  const int rounds = 100;
+  int wrong = 0;
+  for(int k = 0; k < rounds; k++)
+  {
+    int hold = 0;
+    group = dt_control_job_group_create();
+    dt_job_t *root = bench_job_create(bench_execute, k, 0);
+    ((bench_job_t *)dt_control_job_get_params(root))->hold = &hold;
+    dt_control_job_group_add(group, root);
+    for(int i = 0; i < 10; i++)
+    {
+      dt_job_t *stage = bench_job_create(bench_execute, i, 0);
+      dt_control_job_group_add(group, stage);
+      dt_control_job_add_dependency(stage, root);
+      dt_control_add_job(&control, DT_JOB_QUEUE_USER_BG, stage);
+    }
+    dt_control_add_job(&control, DT_JOB_QUEUE_USER_BG, root);
+    // the root can't go away before we let it
+    while(dt_control_job_get_state(root) != DT_JOB_STATE_RUNNING) usleep(100);
+    dt_control_job_group_cancel(group);
+    __sync_fetch_and_add(&hold, 1);
+    // the root finishes nevertheless, its stages don't
+    if(dt_control_job_group_wait(group) != 10) wrong++;
+    dt_control_job_group_destroy(group);
+  }
+  fprintf(stderr, "%d groups cancelled with parked jobs, %d with a wrong count of cancelled jobs\n", rounds, wrong);
+  report("group cancel", rounds, start);
+
+  dt_pthread_mutex_lock(&control.run_mutex);
+  control.running = 0;
+  dt_pthread_mutex_unlock(&control.run_mutex);
+  pthread_join(control.kick_on_workers_thread, NULL);
+  for(int k = 0; k < control.num_threads; k++) pthread_join(control.thread[k], NULL);
+  for(int k = 0; k < DT_CTL_WORKER_RESERVED; k++) pthread_join(control.thread_res[k], NULL);
+  dt_control_jobs_cleanup(&control);
+
+  // the same once more with the old scheduler
+  fprintf(stderr, "single queue:\n");
+  dt_pthread_mutex_init(&single.mutex, NULL);
+  pthread_cond_init(&single.cond, NULL);
+  single.running = 1;
+  single.threads = (pthread_t *)calloc(num_workers, sizeof(pthread_t));
+  for(int k = 0; k < num_workers; k++) pthread_create(&single.threads[k], NULL, single_work, NULL);
+  bench_add_job = single_add_job;
+  run_benchmarks(num_jobs);
+  dt_pthread_mutex_lock(&single.mutex);
+  single.running = 0;
+  pthread_cond_broadcast(&single.cond);
+  dt_pthread_mutex_unlock(&single.mutex);
+  for(int k = 0; k < num_workers; k++) pthread_join(single.threads[k], NULL);
+  free(single.threads);
+
+  free(latencies);
+  free(fg_latencies);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
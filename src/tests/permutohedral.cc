@@ -0,0 +1,236 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2014 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark for the permutohedral lattice of iop/Permutohedral.h: filters a synthetic image the way
+// iop/bilateral.cc and iop/tonemap.cc do, with the lattice and with the one it replaced, checks that the
+// results are the same and reports the time spent in each of the steps.
+// usage: ./permutohedral [width] [height] [runs]
+
+#include "iop/Permutohedral.h"
+#include "tests/Permutohedral_reference.h"
+
+#include <omp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double dt_get_wtime()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0/1000000.0)*time.tv_usec;
+}
+
+// time spent in splat, merge, blur and slice
+typedef struct timing_t
+{
+  double t[4];
+}
+timing_t;
+
+// bilateral.cc: x, y, r, g, b, blurring the colors
+template <class Lattice>
+static void bilateral(const float *const in, float *const out, const int width, const int height,
+                      const float *const sigma, timing_t *timing)
+{
+  double start = dt_get_wtime();
+  Lattice lattice((size_t)width*height, omp_get_max_threads());
+#ifdef _OPENMP
+  #pragma omp parallel for
+#endif
+  for(int j=0; j<height; j++)
+  {
+    const int thread = omp_get_thread_num();
+    size_t index = (size_t)j*width;
+    for(int i=0; i<width; i++, index++)
+    {
+      const float *pix = in + 4*index;
+      float pos[5] = {i*sigma[0], j*sigma[1], pix[0]*sigma[2], pix[1]*sigma[3], pix[2]*sigma[4]};
+      float val[4] = {pix[0], pix[1], pix[2], 1.0};
+      lattice.splat(pos, val, index, thread);
+    }
+  }
+  double end = dt_get_wtime();
+  timing->t[0] += end - start;
+  start = end;
+  lattice.merge_splat_threads();
+  end = dt_get_wtime();
+  timing->t[1] += end - start;
+  start = end;
+  lattice.blur();
+  end = dt_get_wtime();
+  timing->t[2] += end - start;
+  start = end;
+#ifdef _OPENMP
+  #pragma omp parallel for
+#endif
+  for(int j=0; j<height; j++)
+  {
+    size_t index = (size_t)j*width;
+    for(int i=0; i<width; i++, index++)
+    {
+      float val[4];
+      lattice.slice(val, index);
+      for(int k=0; k<3; k++) out[4*index+k] = val[k]/val[3];
+    }
+  }
+  timing->t[3] += dt_get_wtime() - start;
+}
+
+// tonemap.cc: x, y, log luminance, blurring the log luminance
+template <class Lattice>
+static void tonemap(const float *const in, float *const out, const int width, const int height,
+                    const float inv_sigma_s, const float inv_sigma_r, timing_t *timing)
+{
+  double start = dt_get_wtime();
+  Lattice lattice((size_t)width*height, omp_get_max_threads());
+#ifdef _OPENMP
+  #pragma omp parallel for
+#endif
+  for(int j=0; j<height; j++)
+  {
+    const int thread = omp_get_thread_num();
+    size_t index = (size_t)j*width;
+    for(int i=0; i<width; i++, index++)
+    {
+      const float *pix = in + 4*index;
+      float L = 0.2126*pix[0]+ 0.7152*pix[1] + 0.0722*pix[2];
+      if(L<=0.0) L=1e-6;
+      L = logf(L);
+      float pos[3] = {i*inv_sigma_s, j*inv_sigma_s, L*inv_sigma_r};
+      float val[2] = {L, 1.0};
+      lattice.splat(pos, val, index, thread);
+    }
+  }
+  double end = dt_get_wtime();
+  timing->t[0] += end - start;
+  start = end;
+  lattice.merge_splat_threads();
+  end = dt_get_wtime();
+  timing->t[1] += end - start;
+  start = end;
+  lattice.blur();
+  end = dt_get_wtime();
+  timing->t[2] += end - start;
+  start = end;
+#ifdef _OPENMP
+  #pragma omp parallel for
+#endif
+  for(int j=0; j<height; j++)
+  {
+    size_t index = (size_t)j*width;
+    for(int i=0; i<width; i++, index++)
+    {
+      float val[2];
+      lattice.slice(val, index);
+      out[4*index] = val[0]/val[1];
+    }
+  }
+  timing->t[3] += dt_get_wtime() - start;
+}
+
+static void report(const char *name, const timing_t *ref, const timing_t *fast, const int runs, const double mpix,
+                   const double maxdiff)
+{
+  static const char *steps[4] = { "splat", "merge", "blur", "slice" };
+  double tr = 0.0, tf = 0.0;
+  for(int k=0; k<4; k++)
+  {
+    fprintf(stderr, "%-9s %-5s | reference %8.3f ms/Mpix | lattice %8.3f ms/Mpix | %5.2fx\n", name, steps[k],
+            1e3 * ref->t[k] / runs / mpix, 1e3 * fast->t[k] / runs / mpix, ref->t[k] / fast->t[k]);
+    tr += ref->t[k];
+    tf += fast->t[k];
+  }
+  fprintf(stderr, "%-9s total | reference %8.3f ms/Mpix | lattice %8.3f ms/Mpix | %5.2fx | max difference %g%s\n",
+          name, 1e3 * tr / runs / mpix, 1e3 * tf / runs / mpix, tr / tf, maxdiff, maxdiff > 0.0 ? " MISMATCH" : "");
+}
+
+static double max_difference(const float *const a, const float *const b, const size_t n)
+{
+  double maxdiff = 0.0;
+  for(size_t k=0; k<n; k++)
+  {
+    const double d = fabs((double)a[k] - (double)b[k]);
+    if(!(d <= maxdiff)) maxdiff = d; // also catches nan
+  }
+  return maxdiff;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 2000;
+  const int height = argc > 2 ? atoi(arg[2]) : 1500;
+  const int runs = argc > 3 ? atoi(arg[3]) : 3;
+  const size_t size = (size_t)width*height;
+  const double mpix = size * 1e-6;
+
+  // smooth gradients with some edges and noise
+  float *in = (float *)malloc(sizeof(float)*4*size);
+  float *ref = (float *)malloc(sizeof(float)*4*size);
+  float *out = (float *)malloc(sizeof(float)*4*size);
+  srand(42);
+  for(int j=0; j<height; j++)
+    for(int i=0; i<width; i++)
+    {
+      float *pix = in + 4*((size_t)j*width+i);
+      const float edge = ((i / 200) + (j / 150)) % 2 ? 0.3f : 0.0f;
+      for(int c=0; c<3; c++)
+        pix[c] = 0.1f + 0.4f * (c == 0 ? i / (float)width : c == 1 ? j / (float)height : 0.5f) + edge
+                 + 0.02f * rand() / (float)RAND_MAX;
+      pix[3] = 0.0f;
+    }
+  memset(ref, 0, sizeof(float)*4*size);
+  memset(out, 0, sizeof(float)*4*size);
+
+  fprintf(stderr, "%dx%d, %d runs, %d threads\n", width, height, runs, omp_get_max_threads());
+  int failed = 0;
+
+  // the default parameters of the two modules
+  const float sigma[5] = { 1.0f/15.0f, 1.0f/15.0f, 1.0f/0.005f, 1.0f/0.005f, 1.0f/0.005f };
+  timing_t tr = {{0}}, tf = {{0}};
+  for(int r=0; r<runs; r++)
+  {
+    bilateral<ReferencePermutohedralLattice<5,4> >(in, ref, width, height, sigma, &tr);
+    bilateral<PermutohedralLattice<5,4> >(in, out, width, height, sigma, &tf);
+  }
+  double maxdiff = max_difference(ref, out, 4*size);
+  failed |= maxdiff > 0.0;
+  report("bilateral", &tr, &tf, runs, mpix, maxdiff);
+
+  memset(&tr, 0, sizeof(tr));
+  memset(&tf, 0, sizeof(tf));
+  const float inv_sigma_s = 1.0f/fmaxf(3.0f, 0.3f*fminf(width, height)), inv_sigma_r = 1.0f/0.4f;
+  for(int r=0; r<runs; r++)
+  {
+    tonemap<ReferencePermutohedralLattice<3,2> >(in, ref, width, height, inv_sigma_s, inv_sigma_r, &tr);
+    tonemap<PermutohedralLattice<3,2> >(in, out, width, height, inv_sigma_s, inv_sigma_r, &tf);
+  }
+  maxdiff = max_difference(ref, out, 4*size);
+  failed |= maxdiff > 0.0;
+  report("tonemap", &tr, &tf, runs, mpix, maxdiff);
+
+  free(in);
+  free(ref);
+  free(out);
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
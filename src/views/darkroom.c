@@ -541,6 +541,8 @@ dt_dev_change_image(dt_develop_t *dev, const uint32_t imgid)
   {
     dt_mipmap_cache_remove(darktable.mipmap_cache, dev->image_storage.id);
     dt_image_synch_xmp(dev->image_storage.id);
+    // don't leave the old image with a pending sidecar write behind
+    dt_image_flush_sidecar_files(dev->image_storage.id);
   }
 
   //cleanup visible masks
@@ -884,6 +886,12 @@ static void _darkroom_ui_pipe_finish_signal_callback(gpointer instance, gpointer
   dt_control_queue_redraw();
 }
 
+static void _darkroom_collection_changed_callback(gpointer instance, gpointer data)
+{
+  // the offsets of the old collection mean nothing in the new one
+  dt_view_filmstrip_prefetch_reset();
+}
+
 static void _darkroom_ui_favorite_presets_popupmenu(GtkWidget *w, gpointer user_data)
 {
   /* create favorites menu and popup */
@@ -1078,6 +1086,11 @@ void enter(dt_view_t *self)
                             DT_SIGNAL_DEVELOP_UI_PIPE_FINISHED,G_CALLBACK(_darkroom_ui_pipe_finish_signal_callback),
                             (gpointer)self);
 
+  /* start prefetching afresh, and again whenever the collection changes */
+  dt_view_filmstrip_prefetch_reset();
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED,
+                            G_CALLBACK(_darkroom_collection_changed_callback), (gpointer)self);
+
   dt_print(DT_DEBUG_CONTROL, "[run_job+] 11 %f in darkroom mode\n", dt_get_wtime());
   dt_develop_t *dev = (dt_develop_t *)self->data;
   if (!dev->form_gui)
@@ -1303,6 +1316,11 @@ void leave(dt_view_t *self)
                                G_CALLBACK(_darkroom_ui_pipe_finish_signal_callback),
                                (gpointer)self);
 
+  dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_darkroom_collection_changed_callback),
+                               (gpointer)self);
+  // nothing we looked ahead for is needed outside of the darkroom
+  dt_view_filmstrip_prefetch_reset();
+
   // store groups for next time:
   dt_conf_set_int("plugins/darkroom/groups", dt_dev_modulegroups_get(darktable.develop));
 
@@ -1328,6 +1346,8 @@ void leave(dt_view_t *self)
     dt_mipmap_cache_remove(darktable.mipmap_cache, dev->image_storage.id);
     // dump new xmp data
     dt_image_synch_xmp(dev->image_storage.id);
+    // and have it on disk when we're back in the lighttable, someone might copy or export the xmp right away
+    dt_image_flush_sidecar_files(dev->image_storage.id);
   }
 
   // clear gui.
@@ -206,7 +206,7 @@ static dt_job_t * process_job_create(dt_slideshow_t *d)
 {
   dt_job_t *job = dt_control_job_create(&process_job_run, "process slideshow image");
   if(!job) return NULL;
-  dt_control_job_set_params(job, d);
+  dt_control_job_set_params(job, d, NULL);
   return job;
 }
 
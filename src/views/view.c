@@ -1368,6 +1368,57 @@ void dt_view_filmstrip_set_active_image(dt_view_manager_t *vm,int iid)
   dt_view_filmstrip_scroll_to_image(vm, iid, TRUE);
 }
 
+// speculative loading of the neighbours of the selected image. a prefetch only runs if the generation it was
+// queued with is still current, bumping it drops all of them that didn't start yet.
+static int32_t _prefetch_generation = 0;
+static int _prefetch_offset = -1, _prefetch_direction = 0;
+
+typedef struct dt_view_prefetch_t
+{
+  int32_t imgid;
+  int32_t generation;
+}
+dt_view_prefetch_t;
+
+static int32_t _view_prefetch_job_run(dt_job_t *job)
+{
+  const dt_view_prefetch_t *p = (const dt_view_prefetch_t *)dt_control_job_get_params(job);
+  // the raw for the full pipe, and the downscaled float buffer for the preview pipe, which is made from it
+  const dt_mipmap_size_t mips[2] = { DT_MIPMAP_FULL, DT_MIPMAP_F };
+  for(int k = 0; k < 2; k++)
+  {
+    if(p->generation != __sync_fetch_and_add(&_prefetch_generation, 0)) break;
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, p->imgid, mips[k], DT_MIPMAP_BLOCKING);
+    if(buf.buf) dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+  }
+  return 0;
+}
+
+static void _view_prefetch_image(const int32_t imgid, const int32_t generation)
+{
+  dt_job_t *job = dt_control_job_create(&_view_prefetch_job_run, "prefetch image %d", imgid);
+  if(!job) return;
+  dt_view_prefetch_t *p = (dt_view_prefetch_t *)malloc(sizeof(dt_view_prefetch_t));
+  if(!p)
+  {
+    dt_control_job_dispose(job);
+    return;
+  }
+  p->imgid = imgid;
+  p->generation = generation;
+  dt_control_job_set_params(job, p, free);
+  // the low priority queue, which nothing pushes out: only idle workers get to it
+  dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job);
+}
+
+void dt_view_filmstrip_prefetch_reset()
+{
+  _prefetch_offset = -1;
+  _prefetch_direction = 0;
+  __sync_fetch_and_add(&_prefetch_generation, 1);
+}
+
 void dt_view_filmstrip_prefetch()
 {
   const gchar *qin = dt_collection_get_query (darktable.collection);
@@ -1386,18 +1437,48 @@ void dt_view_filmstrip_prefetch()
     offset = dt_collection_image_offset(imgid);
   }
 
+  // the same image again, everything is on its way already
+  if(offset == _prefetch_offset) return;
+  // 0 as long as we don't know where the user is going, then look ahead on both sides
+  const int direction = _prefetch_offset < 0 ? 0 : (offset > _prefetch_offset ? 1 : -1);
+  _prefetch_offset = offset;
+  if(direction != _prefetch_direction)
+  {
+    _prefetch_direction = direction;
+    __sync_fetch_and_add(&_prefetch_generation, 1);
+  }
+  const int32_t generation = __sync_fetch_and_add(&_prefetch_generation, 0);
+
+  // every prefetched image holds a full size buffer. leave room in that cache for the image being edited and
+  // for thumbnail generation, prefetches beyond that would only push each other (or worse, the current image) out.
+  const int room = MAX(0, (int)darktable.mipmap_cache->mip[DT_MIPMAP_FULL].cache.cost_quota - 2);
+  const int lookahead = MIN(dt_conf_get_int("plugins/darkroom/prefetch_images"), direction ? room : room / 2);
+  if(lookahead <= 0) return;
+
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
-  // only get one more image:
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, offset+1);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, offset+2);
-  if(sqlite3_step(stmt) == SQLITE_ROW)
+  if(direction >= 0)
   {
-    const uint32_t prefetchid = sqlite3_column_int(stmt, 0);
-    // dt_control_log("prefetching image %u", prefetchid);
-    dt_mipmap_cache_read_get(darktable.mipmap_cache, NULL, prefetchid, DT_MIPMAP_FULL, DT_MIPMAP_PREFETCH);
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, offset+1);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, lookahead);
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+      _view_prefetch_image(sqlite3_column_int(stmt, 0), generation);
+    sqlite3_finalize(stmt);
+  }
+  if(direction <= 0 && offset > 0)
+  {
+    const int first = MAX(0, offset - lookahead);
+    int32_t previous[8] = { 0 };
+    int num_previous = 0;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, first);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, MIN(offset - first, 8));
+    while(sqlite3_step(stmt) == SQLITE_ROW && num_previous < 8)
+      previous[num_previous++] = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    // closest first
+    for(int k = num_previous - 1; k >= 0; k--) _view_prefetch_image(previous[k], generation);
   }
-  sqlite3_finalize(stmt);
 }
 
 void dt_view_manager_view_toolbox_add(dt_view_manager_t *vm,GtkWidget *tool)
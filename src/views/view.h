@@ -333,10 +333,15 @@ uint32_t dt_view_lighttable_get_position(dt_view_manager_t *vm);
 
 /** set active image */
 void dt_view_filmstrip_set_active_image(dt_view_manager_t *vm,int iid);
-/** prefetch the next few images in film strip, from selected on.
+/** prefetch the next few images in film strip, from selected on, or the previous ones when the selection moved
+    backwards. as many as plugins/darkroom/prefetch_images says and the full size cache has room for.
+    prefetches that didn't start yet are dropped when the direction changes.
     TODO: move to control ?
 */
 void dt_view_filmstrip_prefetch();
+/** forget where the last prefetch was, so the next one looks ahead on both sides again. also drops the
+    prefetches that didn't start yet. */
+void dt_view_filmstrip_prefetch_reset();
 
 /*
  * Map View Proxy
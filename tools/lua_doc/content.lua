@@ -309,6 +309,10 @@ darktable.database.copy_image:add_parameter("image",tostring(types.dt_lua_image_
 darktable.database.copy_image:add_parameter("film",tostring(types.dt_lua_film_t),[[The film to copy to]])
 darktable.database.copy_image:add_return(tostring(types.dt_lua_image_t),[[The new image]])
 darktable.database.copy_image:set_main_parent(darktable.database)
+darktable.database.flush_sidecars:set_text([[Writes all XMP sidecar files that are still queued.]]..para()..
+[[Sidecar writes are delayed and done in the background, call this before reading XMP files from outside darktable.]])
+darktable.database.flush_sidecars:add_version_info("function added")
+darktable.database.flush_sidecars:set_main_parent(darktable.database)
 
 ------------------------
 --  DARKTABLE.MODULES --